@@ -0,0 +1,76 @@
+#include "main.h"
+#include "wallet.h"
+#include "init.h"
+
+using namespace std;
+
+CWallet* pwalletMain;
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+static int64 SumSelected(const vector<int64>& vValue, const vector<char>& vfBest)
+{
+    int64 nTotal = 0;
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        if (vfBest[i])
+            nTotal += vValue[i];
+    return nTotal;
+}
+
+// Synthetic wallets of many small coins, as seen on payout wallets.
+// Prints how long each strategy takes.
+static bool BenchCoinSelection(int nCoins)
+{
+    bool fOk = true;
+    vector<int64> vValue;
+    int64 nTotal = 0;
+    for (int i = 0; i < nCoins; i++)
+    {
+        int64 n = CENT / 10 + GetRand(10 * COIN);
+        vValue.push_back(n);
+        nTotal += n;
+    }
+    sort(vValue.rbegin(), vValue.rend());
+
+    int64 nTargets[] = { COIN / 3, 17 * COIN + 12345, nTotal / 3 };
+    for (int i = 0; i < ARRAYLEN(nTargets); i++)
+    {
+        // SelectCoinsMinConf only passes on coins below the target plus a cent
+        vector<int64> vCandidate;
+        BOOST_FOREACH(int64 n, vValue)
+            if (n < nTargets[i] + CENT)
+                vCandidate.push_back(n);
+
+        vector<char> vfBest;
+        int64 nBest = 0;
+        int64 nStart = GetTimeMillis();
+        bool fFound = SelectCoinsBranchAndBound(vCandidate, nTargets[i], vfBest, nBest);
+        int64 nBnBTime = GetTimeMillis() - nStart;
+        if (fFound && (nBest < nTargets[i] || nBest >= nTargets[i] + CENT || SumSelected(vCandidate, vfBest) != nBest))
+            fOk = error("BenchCoinSelection() : bnb selected %s for target %s", FormatMoney(nBest).c_str(), FormatMoney(nTargets[i]).c_str());
+
+        nStart = GetTimeMillis();
+        bool fKnapsack = SelectCoinsKnapsack(vCandidate, nTargets[i], vfBest, nBest);
+        int64 nKnapsackTime = GetTimeMillis() - nStart;
+        if (!fKnapsack || nBest < nTargets[i] || SumSelected(vCandidate, vfBest) != nBest)
+            fOk = error("BenchCoinSelection() : knapsack selected %s for target %s", FormatMoney(nBest).c_str(), FormatMoney(nTargets[i]).c_str());
+
+        printf("coinselection %d coins (%d candidates), target %s: bnb %s in %"PRI64d"ms, knapsack %"PRI64d"ms\n",
+               nCoins, (int)vCandidate.size(), FormatMoney(nTargets[i]).c_str(), fFound ? "matched" : "gave up", nBnBTime, nKnapsackTime);
+    }
+    return fOk;
+}
+
+int main(int argc, char* argv[])
+{
+    fPrintToConsole = true;
+    ParseParameters(argc, argv);
+
+    bool fOk = true;
+    fOk &= BenchCoinSelection(10000);
+    fOk &= BenchCoinSelection(100000);
+    return fOk ? 0 : 1;
+}
@@ -10,6 +10,7 @@
 #include "init.h"
 #undef printf
 #include <boost/asio.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/iostreams/concepts.hpp>
 #include <boost/iostreams/stream.hpp>
@@ -266,6 +267,33 @@ Value getconnectioncount(const Array& params, bool fHelp)
 }
 
 
+Value getnettotals(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getnettotals\n"
+            "Returns bytes received and bytes sent by traffic class, and how often\n"
+            "sends were held back by -maxuploadrate or -peeruploadrate.");
+
+    Object obj;
+    Object sent;
+    uint64 nTotalSent = 0;
+    CRITICAL_BLOCK(cs_sendScheduler)
+    {
+        for (int i = 0; i < SEND_PRIORITY_MAX; i++)
+        {
+            sent.push_back(Pair(GetSendPriorityName(i), (boost::int64_t)vnTotalBytesSent[i]));
+            nTotalSent += vnTotalBytesSent[i];
+        }
+        obj.push_back(Pair("totalbytesrecv", (boost::int64_t)nTotalBytesRecv));
+        obj.push_back(Pair("totalbytessent", (boost::int64_t)nTotalSent));
+        obj.push_back(Pair("bytessent",      sent));
+        obj.push_back(Pair("throttled",      (boost::int64_t)nSendThrottled));
+    }
+    return obj;
+}
+
+
 // Litecoin: Return average network hashes per second based on last number of blocks.
 int GetNetworkHashPS(int lookup) {
     if (pindexBest == NULL)
@@ -407,7 +435,9 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("generate",      GetBoolArg("-gen")));
     obj.push_back(Pair("genproclimit",  (int)GetArg("-genproclimit", -1)));
     obj.push_back(Pair("hashespersec",  gethashespersec(params, false)));
-    obj.push_back(Pair("pooledtx",      (uint64_t)nPooledTx));
+    obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
+    obj.push_back(Pair("pooledbytes",   (uint64_t)mempool.GetUsage()));
+    obj.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetRollingMinFee(1000))));
     obj.push_back(Pair("testnet",       fTestNet));
     return obj;
 }
@@ -427,9 +457,6 @@ Value getnewaddress(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     // Generate a new key that is added to wallet
     std::vector<unsigned char> newKey;
     if (!pwalletMain->GetKeyFromPool(newKey, false))
@@ -794,8 +821,10 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
 int64 GetAccountBalance(CWalletDB& walletdb, const string& strAccount, int nMinDepth)
 {
     int64 nBalance = 0;
+    if (pwalletMain->GetAccountBalance(strAccount, nMinDepth, nBalance))
+        return nBalance;
 
-    // Tally wallet transactions
+    // Deeper than the wallet's account tally goes, tally wallet transactions
     for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
     {
         const CWalletTx& wtx = (*it).second;
@@ -914,7 +943,10 @@ Value movecmd(const Array& params, bool fHelp)
     credit.strComment = strComment;
     walletdb.WriteAccountingEntry(credit);
 
-    walletdb.TxnCommit();
+    if (!walletdb.TxnCommit())
+        throw JSONRPCError(-4, "Error writing accounting entries to the wallet");
+    pwalletMain->AddAccountingEntry(debit);
+    pwalletMain->AddAccountingEntry(credit);
 
     return true;
 }
@@ -1034,6 +1066,91 @@ Value sendmany(const Array& params, bool fHelp)
     return wtx.GetHash().GetHex();
 }
 
+Value sendmanybatch(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 4)
+        throw runtime_error(
+            "sendmanybatch <fromaccount> {address:amount,...} [minconf=1] [comment]\n"
+            "amounts are double-precision floating point numbers\n"
+            "Like sendmany, but for any number of recipients: they are split over\n"
+            "transactions of at most " + strprintf("%u", BATCH_MAX_TX_OUTPUTS) + " outputs each.\n"
+            "Returns an array of the txids sent.  If a transaction fails to commit, the\n"
+            "error also holds the txids already sent and the addresses left unpaid."
+            + (pwalletMain->IsCrypted() ? "\nrequires wallet passphrase to be set with walletpassphrase first" : ""));
+
+    string strAccount = AccountFromValue(params[0]);
+    Object sendTo = params[1].get_obj();
+    int nMinDepth = 1;
+    if (params.size() > 2)
+        nMinDepth = params[2].get_int();
+
+    set<CBitcoinAddress> setAddress;
+    vector<pair<CScript, int64> > vecSend;
+    vector<string> vAddress;
+
+    int64 totalAmount = 0;
+    BOOST_FOREACH(const Pair& s, sendTo)
+    {
+        CBitcoinAddress address(s.name_);
+        if (!address.IsValid())
+            throw JSONRPCError(-5, string("Invalid litecoin address:")+s.name_);
+
+        if (setAddress.count(address))
+            throw JSONRPCError(-8, string("Invalid parameter, duplicated address: ")+s.name_);
+        setAddress.insert(address);
+
+        CScript scriptPubKey;
+        scriptPubKey.SetBitcoinAddress(address);
+        int64 nAmount = AmountFromValue(s.value_);
+        totalAmount += nAmount;
+
+        vecSend.push_back(make_pair(scriptPubKey, nAmount));
+        vAddress.push_back(s.name_);
+    }
+
+    if (pwalletMain->IsLocked())
+        throw JSONRPCError(-13, "Error: Please enter the wallet passphrase with walletpassphrase first.");
+
+    // Check funds
+    int64 nBalance = GetAccountBalance(strAccount, nMinDepth);
+    if (totalAmount > nBalance)
+        throw JSONRPCError(-6, "Account has insufficient funds");
+
+    // Send
+    CReserveKey keyChange(pwalletMain);
+    int64 nFeeRequired = 0;
+    vector<CWalletTx> vwtx;
+    bool fCreated = pwalletMain->CreateTransactions(vecSend, vwtx, keyChange, nFeeRequired);
+    if (!fCreated)
+    {
+        if (totalAmount + nFeeRequired > pwalletMain->GetBalance())
+            throw JSONRPCError(-6, "Insufficient funds");
+        throw JSONRPCError(-4, "Transaction creation failed");
+    }
+
+    Array ret;
+    BOOST_FOREACH(CWalletTx& wtx, vwtx)
+    {
+        wtx.strFromAccount = strAccount;
+        if (params.size() > 3 && params[3].type() != null_type && !params[3].get_str().empty())
+            wtx.mapValue["comment"] = params[3].get_str();
+        if (!pwalletMain->CommitTransaction(wtx, keyChange))
+        {
+            // The earlier transactions are already out, tell the caller
+            // exactly who still has to be paid
+            Object error = JSONRPCError(-4, strprintf("Transaction commit failed after %"PRIszu" of %"PRIszu" transactions", ret.size(), vwtx.size()));
+            Array unpaid;
+            for (unsigned int i = ret.size() * BATCH_MAX_TX_OUTPUTS; i < vAddress.size(); i++)
+                unpaid.push_back(vAddress[i]);
+            error.push_back(Pair("txids", ret));
+            error.push_back(Pair("unpaid", unpaid));
+            throw error;
+        }
+        ret.push_back(wtx.GetHash().GetHex());
+    }
+    return ret;
+}
+
 Value addmultisigaddress(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -1344,34 +1461,29 @@ Value listtransactions(const Array& params, bool fHelp)
         nFrom = params[2].get_int();
 
     Array ret;
-    CWalletDB walletdb(pwalletMain->strWalletFile);
-
-    // Firs: get all CWalletTx and CAccountingEntry into a sorted-by-time multimap:
-    typedef pair<CWalletTx*, CAccountingEntry*> TxPair;
-    typedef multimap<int64, TxPair > TxItems;
-    TxItems txByTime;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-    {
-        CWalletTx* wtx = &((*it).second);
-        txByTime.insert(make_pair(wtx->GetTxTime(), TxPair(wtx, (CAccountingEntry*)0)));
-    }
-    list<CAccountingEntry> acentries;
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+    // Walk the wallet's time ordered transactions and accounting entries
+    // back from the newest until we have nCount items to return.  Only
+    // the selected account's accounting entries count towards [from].
+    const CWallet::TxItems& txOrdered = pwalletMain->vOrderedTxItems;
+    bool fAllAccounts = (strAccount == string("*"));
+    CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin();
+    if (fAllAccounts)
+        it += min((size_t)max(nFrom, 0), txOrdered.size());
+    for (int nSkip = (fAllAccounts ? 0 : nFrom); it != txOrdered.rend(); ++it)
     {
-        txByTime.insert(make_pair(entry.nTime, TxPair((CWalletTx*)0, &entry)));
-    }
+        CAccountingEntry *const pacentry = (*it).second.second;
+        if (pacentry != 0 && !fAllAccounts && pacentry->strAccount != strAccount)
+            continue;
+        if (nSkip > 0)
+        {
+            nSkip--;
+            continue;
+        }
 
-    // Now: iterate backwards until we have nCount items to return:
-    TxItems::reverse_iterator it = txByTime.rbegin();
-    if (txByTime.size() > nFrom) std::advance(it, nFrom);
-    for (; it != txByTime.rend(); ++it)
-    {
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
             ListTransactions(*pwtx, strAccount, 0, true, ret);
-        CAccountingEntry *const pacentry = (*it).second.second;
         if (pacentry != 0)
             AcentryToJSON(*pacentry, strAccount, ret);
 
@@ -1408,32 +1520,36 @@ Value listaccounts(const Array& params, bool fHelp)
             mapAccountBalances[entry.second] = 0;
     }
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    if (!pwalletMain->GetAccountBalances(nMinDepth, mapAccountBalances))
     {
-        const CWalletTx& wtx = (*it).second;
-        int64 nGeneratedImmature, nGeneratedMature, nFee;
-        string strSentAccount;
-        list<pair<CBitcoinAddress, int64> > listReceived;
-        list<pair<CBitcoinAddress, int64> > listSent;
-        wtx.GetAmounts(nGeneratedImmature, nGeneratedMature, listReceived, listSent, nFee, strSentAccount);
-        mapAccountBalances[strSentAccount] -= nFee;
-        BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, int64)& s, listSent)
-            mapAccountBalances[strSentAccount] -= s.second;
-        if (wtx.GetDepthInMainChain() >= nMinDepth)
+        // Deeper than the wallet's account tally goes
+        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
         {
-            mapAccountBalances[""] += nGeneratedMature;
-            BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, int64)& r, listReceived)
-                if (pwalletMain->mapAddressBook.count(r.first))
-                    mapAccountBalances[pwalletMain->mapAddressBook[r.first]] += r.second;
-                else
-                    mapAccountBalances[""] += r.second;
+            const CWalletTx& wtx = (*it).second;
+            int64 nGeneratedImmature, nGeneratedMature, nFee;
+            string strSentAccount;
+            list<pair<CBitcoinAddress, int64> > listReceived;
+            list<pair<CBitcoinAddress, int64> > listSent;
+            wtx.GetAmounts(nGeneratedImmature, nGeneratedMature, listReceived, listSent, nFee, strSentAccount);
+            mapAccountBalances[strSentAccount] -= nFee;
+            BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, int64)& s, listSent)
+                mapAccountBalances[strSentAccount] -= s.second;
+            if (wtx.GetDepthInMainChain() >= nMinDepth)
+            {
+                mapAccountBalances[""] += nGeneratedMature;
+                BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, int64)& r, listReceived)
+                    if (pwalletMain->mapAddressBook.count(r.first))
+                        mapAccountBalances[pwalletMain->mapAddressBook[r.first]] += r.second;
+                    else
+                        mapAccountBalances[""] += r.second;
+            }
         }
-    }
 
-    list<CAccountingEntry> acentries;
-    CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
-    BOOST_FOREACH(const CAccountingEntry& entry, acentries)
-        mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
+        list<CAccountingEntry> acentries;
+        CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
+        BOOST_FOREACH(const CAccountingEntry& entry, acentries)
+            mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
+    }
 
     Object ret;
     BOOST_FOREACH(const PAIRTYPE(string, int64)& accountBalance, mapAccountBalances) {
@@ -1468,17 +1584,13 @@ Value listsinceblock(const Array& params, bool fHelp)
             throw JSONRPCError(-8, "Invalid parameter");
     }
 
-    int depth = pindex ? (1 + nBestHeight - pindex->nHeight) : -1;
-
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
-    {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions);
-    }
+    // Everything above the block, from the wallet's height index
+    vector<const CWalletTx*> vwtx;
+    pwalletMain->GetTransactionsSince(pindex ? pindex->nHeight : -1, vwtx);
+    BOOST_FOREACH(const CWalletTx* pwtx, vwtx)
+        ListTransactions(*pwtx, "*", 0, true, transactions);
 
     uint256 lastblock;
 
@@ -1577,11 +1689,6 @@ Value keypoolrefill(const Array& params, bool fHelp)
 }
 
 
-void ThreadTopUpKeyPool(void* parg)
-{
-    pwalletMain->TopUpKeyPool();
-}
-
 void ThreadCleanWalletPassphrase(void* parg)
 {
     int64 nMyWakeTime = GetTimeMillis() + *((int64*)parg) * 1000;
@@ -1654,7 +1761,7 @@ Value walletpassphrase(const Array& params, bool fHelp)
             "walletpassphrase <passphrase> <timeout>\n"
             "Stores the wallet decryption key in memory for <timeout> seconds.");
 
-    CreateThread(ThreadTopUpKeyPool, NULL);
+    pwalletMain->TopUpKeyPoolInBackground();
     int64* pnSleepTime = new int64(params[1].get_int64());
     CreateThread(ThreadCleanWalletPassphrase, pnSleepTime);
 
@@ -1832,14 +1939,17 @@ Value getworkex(const Array& params, bool fHelp)
     if (params.size() == 0)
     {
         // Update block
-        static unsigned int nTransactionsUpdatedLast;
+        static boost::shared_ptr<const CBlockTemplate> ptemplateLast;
         static CBlockIndex* pindexPrev;
         static int64 nStart;
         static CBlock* pblock;
-        if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+        boost::shared_ptr<const CBlockTemplate> ptemplate = GetBlockTemplate();
+        if (!ptemplate)
+            throw JSONRPCError(-7, "Out of memory");
+        if (pindexPrev != ptemplate->pindexPrev ||
+            (ptemplate != ptemplateLast && GetTime() - nStart > 60))
         {
-            if (pindexPrev != pindexBest)
+            if (pindexPrev != ptemplate->pindexPrev)
             {
                 // Deallocate old blocks since they're obsolete now
                 mapNewBlock.clear();
@@ -1847,14 +1957,13 @@ Value getworkex(const Array& params, bool fHelp)
                     delete pblock;
                 vNewBlock.clear();
             }
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            pindexPrev = pindexBest;
+            ptemplateLast = ptemplate;
+            pindexPrev = ptemplate->pindexPrev;
             nStart = GetTime();
 
-            // Create new block
-            pblock = CreateNewBlock(reservekey);
-            if (!pblock)
-                throw JSONRPCError(-7, "Out of memory");
+            // Copy the shared template and pay the coinbase to our key
+            pblock = new CBlock(ptemplate->block);
+            pblock->vtx[0].vout[0].scriptPubKey << reservekey.GetReservedKey() << OP_CHECKSIG;
             vNewBlock.push_back(pblock);
         }
 
@@ -1964,14 +2073,17 @@ Value getwork(const Array& params, bool fHelp)
     if (params.size() == 0)
     {
         // Update block
-        static unsigned int nTransactionsUpdatedLast;
+        static boost::shared_ptr<const CBlockTemplate> ptemplateLast;
         static CBlockIndex* pindexPrev;
         static int64 nStart;
         static CBlock* pblock;
-        if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+        boost::shared_ptr<const CBlockTemplate> ptemplate = GetBlockTemplate();
+        if (!ptemplate)
+            throw JSONRPCError(-7, "Out of memory");
+        if (pindexPrev != ptemplate->pindexPrev ||
+            (ptemplate != ptemplateLast && GetTime() - nStart > 60))
         {
-            if (pindexPrev != pindexBest)
+            if (pindexPrev != ptemplate->pindexPrev)
             {
                 // Deallocate old blocks since they're obsolete now
                 mapNewBlock.clear();
@@ -1979,14 +2091,13 @@ Value getwork(const Array& params, bool fHelp)
                     delete pblock;
                 vNewBlock.clear();
             }
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            pindexPrev = pindexBest;
+            ptemplateLast = ptemplate;
+            pindexPrev = ptemplate->pindexPrev;
             nStart = GetTime();
 
-            // Create new block
-            pblock = CreateNewBlock(reservekey);
-            if (!pblock)
-                throw JSONRPCError(-7, "Out of memory");
+            // Copy the shared template and pay the coinbase to our key
+            pblock = new CBlock(ptemplate->block);
+            pblock->vtx[0].vout[0].scriptPubKey << reservekey.GetReservedKey() << OP_CHECKSIG;
             vNewBlock.push_back(pblock);
         }
 
@@ -2068,26 +2179,25 @@ Value getmemorypool(const Array& params, bool fHelp)
         if (IsInitialBlockDownload())
             throw JSONRPCError(-10, "Litecoin is downloading blocks...");
 
-        static CReserveKey reservekey(pwalletMain);
-
         // Update block
-        static unsigned int nTransactionsUpdatedLast;
+        static boost::shared_ptr<const CBlockTemplate> ptemplateLast;
         static CBlockIndex* pindexPrev;
         static int64 nStart;
         static CBlock* pblock;
-        if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+        boost::shared_ptr<const CBlockTemplate> ptemplate = GetBlockTemplate();
+        if (!ptemplate)
+            throw JSONRPCError(-7, "Out of memory");
+        if (pindexPrev != ptemplate->pindexPrev ||
+            (ptemplate != ptemplateLast && GetTime() - nStart > 5))
         {
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            pindexPrev = pindexBest;
+            ptemplateLast = ptemplate;
+            pindexPrev = ptemplate->pindexPrev;
             nStart = GetTime();
 
-            // Create new block
+            // Copy the shared template
             if(pblock)
                 delete pblock;
-            pblock = CreateNewBlock(reservekey);
-            if (!pblock)
-                throw JSONRPCError(-7, "Out of memory");
+            pblock = new CBlock(ptemplate->block);
         }
 
         // Update nTime
@@ -2136,12 +2246,13 @@ Value getblockhash(const Array& params, bool fHelp)
             "getblockhash <index>\n"
             "Returns hash of block in best-block-chain at <index>.");
 
+    // Runs without cs_main, so walk back from one snapshot of the best
+    // chain instead of looking it up in mapBlockIndex
     int nHeight = params[0].get_int();
-    if (nHeight < 0 || nHeight > nBestHeight)
+    CBlockIndex* pblockindex = pindexBest;
+    if (nHeight < 0 || pblockindex == NULL || nHeight > pblockindex->nHeight)
         throw runtime_error("Block number out of range.");
 
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
     while (pblockindex->nHeight > nHeight)
         pblockindex = pblockindex->pprev;
     return pblockindex->phashBlock->GetHex();
@@ -2181,59 +2292,89 @@ Value getblock(const Array& params, bool fHelp)
 // Call Table
 //
 
-pair<string, rpcfn_type> pCallTable[] =
-{
-    make_pair("help",                   &help),
-    make_pair("stop",                   &stop),
-    make_pair("getblockcount",          &getblockcount),
-    make_pair("getblocknumber",         &getblocknumber),
-    make_pair("getconnectioncount",     &getconnectioncount),
-    make_pair("getdifficulty",          &getdifficulty),
-    make_pair("getnetworkhashps",       &getnetworkhashps),
-    make_pair("getgenerate",            &getgenerate),
-    make_pair("setgenerate",            &setgenerate),
-    make_pair("gethashespersec",        &gethashespersec),
-    make_pair("getinfo",                &getinfo),
-    make_pair("getmininginfo",          &getmininginfo),
-    make_pair("getnewaddress",          &getnewaddress),
-    make_pair("getaccountaddress",      &getaccountaddress),
-    make_pair("setaccount",             &setaccount),
-    make_pair("getaccount",             &getaccount),
-    make_pair("getaddressesbyaccount",  &getaddressesbyaccount),
-    make_pair("sendtoaddress",          &sendtoaddress),
-    make_pair("getreceivedbyaddress",   &getreceivedbyaddress),
-    make_pair("getreceivedbyaccount",   &getreceivedbyaccount),
-    make_pair("listreceivedbyaddress",  &listreceivedbyaddress),
-    make_pair("listreceivedbyaccount",  &listreceivedbyaccount),
-    make_pair("backupwallet",           &backupwallet),
-    make_pair("keypoolrefill",          &keypoolrefill),
-    make_pair("walletpassphrase",       &walletpassphrase),
-    make_pair("walletpassphrasechange", &walletpassphrasechange),
-    make_pair("walletlock",             &walletlock),
-    make_pair("encryptwallet",          &encryptwallet),
-    make_pair("validateaddress",        &validateaddress),
-    make_pair("getbalance",             &getbalance),
-    make_pair("move",                   &movecmd),
-    make_pair("sendfrom",               &sendfrom),
-    make_pair("sendmany",               &sendmany),
-    make_pair("addmultisigaddress",     &addmultisigaddress),
-    make_pair("getblock",               &getblock),
-    make_pair("getblockhash",           &getblockhash),
-    make_pair("gettransaction",         &gettransaction),
-    make_pair("listtransactions",       &listtransactions),
-    make_pair("signmessage",            &signmessage),
-    make_pair("verifymessage",          &verifymessage),
-    make_pair("getwork",                &getwork),
-    make_pair("getworkex",                &getworkex),
-    make_pair("listaccounts",           &listaccounts),
-    make_pair("settxfee",               &settxfee),
-    make_pair("setmininput",            &setmininput),
-    make_pair("getmemorypool",          &getmemorypool),
-    make_pair("listsinceblock",         &listsinceblock),
-    make_pair("dumpprivkey",            &dumpprivkey),
-    make_pair("importprivkey",          &importprivkey)
+// The locks each call needs held while it runs.  Calls not taking cs_main
+// and cs_wallet run concurrently with everything else, so they must only
+// read what is safe to read without them or take their own locks.
+static const int RPC_LOCK_NONE = 0;
+static const int RPC_LOCK_MAIN = (1 << 0);
+static const int RPC_LOCK_WALLET = (1 << 1);
+static const int RPC_LOCK_GETWORK = (1 << 2); // cs_getwork, guarding getwork's saved blocks
+static const int RPC_LOCK_ALL = RPC_LOCK_MAIN | RPC_LOCK_WALLET;
+
+struct CRPCCommand
+{
+    string strName;
+    rpcfn_type actor;
+    int nLocks;
 };
-map<string, rpcfn_type> mapCallTable(pCallTable, pCallTable + sizeof(pCallTable)/sizeof(pCallTable[0]));
+
+static const CRPCCommand pCallTable[] =
+{
+    { "help",                   &help,                   RPC_LOCK_ALL },
+    { "stop",                   &stop,                   RPC_LOCK_NONE },
+    { "getblockcount",          &getblockcount,          RPC_LOCK_NONE },
+    { "getblocknumber",         &getblocknumber,         RPC_LOCK_NONE },
+    { "getconnectioncount",     &getconnectioncount,     RPC_LOCK_NONE },
+    { "getnettotals",           &getnettotals,           RPC_LOCK_NONE },
+    { "getdifficulty",          &getdifficulty,          RPC_LOCK_NONE },
+    { "getnetworkhashps",       &getnetworkhashps,       RPC_LOCK_MAIN },
+    { "getgenerate",            &getgenerate,            RPC_LOCK_NONE },
+    { "setgenerate",            &setgenerate,            RPC_LOCK_ALL },
+    { "gethashespersec",        &gethashespersec,        RPC_LOCK_NONE },
+    { "getinfo",                &getinfo,                RPC_LOCK_ALL },
+    { "getmininginfo",          &getmininginfo,          RPC_LOCK_ALL },
+    { "getnewaddress",          &getnewaddress,          RPC_LOCK_ALL },
+    { "getaccountaddress",      &getaccountaddress,      RPC_LOCK_ALL },
+    { "setaccount",             &setaccount,             RPC_LOCK_ALL },
+    { "getaccount",             &getaccount,             RPC_LOCK_ALL },
+    { "getaddressesbyaccount",  &getaddressesbyaccount,  RPC_LOCK_ALL },
+    { "sendtoaddress",          &sendtoaddress,          RPC_LOCK_ALL },
+    { "getreceivedbyaddress",   &getreceivedbyaddress,   RPC_LOCK_ALL },
+    { "getreceivedbyaccount",   &getreceivedbyaccount,   RPC_LOCK_ALL },
+    { "listreceivedbyaddress",  &listreceivedbyaddress,  RPC_LOCK_ALL },
+    { "listreceivedbyaccount",  &listreceivedbyaccount,  RPC_LOCK_ALL },
+    { "backupwallet",           &backupwallet,           RPC_LOCK_ALL },
+    { "keypoolrefill",          &keypoolrefill,          RPC_LOCK_ALL },
+    { "walletpassphrase",       &walletpassphrase,       RPC_LOCK_ALL },
+    { "walletpassphrasechange", &walletpassphrasechange, RPC_LOCK_ALL },
+    { "walletlock",             &walletlock,             RPC_LOCK_ALL },
+    { "encryptwallet",          &encryptwallet,          RPC_LOCK_ALL },
+    { "validateaddress",        &validateaddress,        RPC_LOCK_ALL },
+    { "getbalance",             &getbalance,             RPC_LOCK_ALL },
+    { "move",                   &movecmd,                RPC_LOCK_ALL },
+    { "sendfrom",               &sendfrom,               RPC_LOCK_ALL },
+    { "sendmany",               &sendmany,               RPC_LOCK_ALL },
+    { "sendmanybatch",          &sendmanybatch,          RPC_LOCK_ALL },
+    { "addmultisigaddress",     &addmultisigaddress,     RPC_LOCK_ALL },
+    { "getblock",               &getblock,               RPC_LOCK_MAIN },
+    { "getblockhash",           &getblockhash,           RPC_LOCK_NONE },
+    { "gettransaction",         &gettransaction,         RPC_LOCK_ALL },
+    { "listtransactions",       &listtransactions,       RPC_LOCK_ALL },
+    { "signmessage",            &signmessage,            RPC_LOCK_ALL },
+    { "verifymessage",          &verifymessage,          RPC_LOCK_NONE },
+    { "getwork",                &getwork,                RPC_LOCK_GETWORK },
+    { "getworkex",              &getworkex,              RPC_LOCK_GETWORK },
+    { "listaccounts",           &listaccounts,           RPC_LOCK_ALL },
+    { "settxfee",               &settxfee,               RPC_LOCK_ALL },
+    { "setmininput",            &setmininput,            RPC_LOCK_ALL },
+    { "getmemorypool",          &getmemorypool,          RPC_LOCK_ALL },
+    { "listsinceblock",         &listsinceblock,         RPC_LOCK_ALL },
+    { "dumpprivkey",            &dumpprivkey,            RPC_LOCK_ALL },
+    { "importprivkey",          &importprivkey,          RPC_LOCK_ALL }
+};
+map<string, rpcfn_type> mapCallTable;
+map<string, int> mapCallLocks;
+
+static bool InitCallTable()
+{
+    for (unsigned int i = 0; i < ARRAYLEN(pCallTable); i++)
+    {
+        mapCallTable[pCallTable[i].strName] = pCallTable[i].actor;
+        mapCallLocks[pCallTable[i].strName] = pCallTable[i].nLocks;
+    }
+    return true;
+}
+static bool fCallTableInit = InitCallTable();
 
 string pAllowInSafeMode[] =
 {
@@ -2242,6 +2383,7 @@ string pAllowInSafeMode[] =
     "getblockcount",
     "getblocknumber",  // deprecated
     "getconnectioncount",
+    "getnettotals",
     "getdifficulty",
     "getnetworkhashps",
     "getgenerate",
@@ -2524,135 +2666,203 @@ private:
 };
 #endif
 
-void ThreadRPCServer(void* parg)
+static CCriticalSection cs_getwork;
+static CCriticalSection cs_rpcThreadsRunning;
+
+// Take the locks a call declared in the call table, in lock order, and run it
+Value static ExecuteRPC(rpcfn_type pfn, const Array& params, int nLocks)
 {
-    IMPLEMENT_RANDOMIZE_STACK(ThreadRPCServer(parg));
-    try
-    {
-        vnThreadsRunning[THREAD_RPCSERVER]++;
-        ThreadRPCServer2(parg);
-        vnThreadsRunning[THREAD_RPCSERVER]--;
-    }
-    catch (std::exception& e) {
-        vnThreadsRunning[THREAD_RPCSERVER]--;
-        PrintException(&e, "ThreadRPCServer()");
-    } catch (...) {
-        vnThreadsRunning[THREAD_RPCSERVER]--;
-        PrintException(NULL, "ThreadRPCServer()");
-    }
-    printf("ThreadRPCServer exiting\n");
+    if (nLocks & RPC_LOCK_GETWORK)
+        CRITICAL_BLOCK(cs_getwork)
+            return ExecuteRPC(pfn, params, nLocks & ~RPC_LOCK_GETWORK);
+    if (nLocks & RPC_LOCK_MAIN)
+        CRITICAL_BLOCK(cs_main)
+            return ExecuteRPC(pfn, params, nLocks & ~RPC_LOCK_MAIN);
+    if (nLocks & RPC_LOCK_WALLET)
+        CRITICAL_BLOCK(pwalletMain->cs_wallet)
+            return ExecuteRPC(pfn, params, nLocks & ~RPC_LOCK_WALLET);
+    return (*pfn)(params, false);
 }
 
-void ThreadRPCServer2(void* parg)
+class CRPCServer;
+
+//
+// One JSON-RPC connection.  The request is read and the reply written
+// asynchronously, so slow clients don't tie up a worker; the call runs on
+// whichever worker thread completed the read.  Handlers of a connection go
+// through its strand so they never run at the same time, and the timeout
+// covers reading and writing but not the call itself.
+//
+class CRPCConnection : public boost::enable_shared_from_this<CRPCConnection>
 {
-    printf("ThreadRPCServer started\n");
+public:
+#ifdef USE_SSL
+    SSLStream stream;
+#else
+    ip::tcp::socket stream;
+#endif
+    bool fUseSSL;
+    io_service::strand strand;
+    deadline_timer timer;
+    asio::streambuf buf;
+    ip::tcp::endpoint peer;
+    map<string, string> mapHeaders;
+    int nLen;
+    string strReply;
 
-    strRPCUserColonPass = mapArgs["-rpcuser"] + ":" + mapArgs["-rpcpassword"];
-    if (mapArgs["-rpcpassword"] == "")
+    CRPCConnection(CRPCServer& server);
+
+    ip::tcp::socket& socket()
     {
-        unsigned char rand_pwd[32];
-        RAND_bytes(rand_pwd, 32);
-        string strWhatAmI = "To use litecoind";
-        if (mapArgs.count("-server"))
-            strWhatAmI = strprintf(_("To use the %s option"), "\"-server\"");
-        else if (mapArgs.count("-daemon"))
-            strWhatAmI = strprintf(_("To use the %s option"), "\"-daemon\"");
-        ::error(
-            _("%s, you must set a rpcpassword in the configuration file:\n %s\n"
-              "It is recommended you use the following random password:\n"
-              "rpcuser=bitcoinrpc\n"
-              "rpcpassword=%s\n"
-              "(you do not need to remember this password)\n"
-              "If the file does not exist, create it with owner-readable-only file permissions.\n"),
-                strWhatAmI.c_str(),
-                GetConfigFile().c_str(),
-                EncodeBase58(&rand_pwd[0],&rand_pwd[0]+32).c_str());
-#ifndef QT_GUI
-        CreateThread(Shutdown, NULL);
+#ifdef USE_SSL
+        return stream.next_layer();
+#else
+        return stream;
 #endif
-        return;
     }
 
-    bool fUseSSL = GetBoolArg("-rpcssl");
-    asio::ip::address bindAddress = mapArgs.count("-rpcallowip") ? asio::ip::address_v4::any() : asio::ip::address_v4::loopback();
-
-    asio::io_service io_service;
-    ip::tcp::endpoint endpoint(bindAddress, GetArg("-rpcport", 9332));
-    ip::tcp::acceptor acceptor(io_service, endpoint);
+    void Start()
+    {
+        StartTimer();
+#ifdef USE_SSL
+        if (fUseSSL)
+        {
+            stream.async_handshake(ssl::stream_base::server, strand.wrap(boost::bind(&CRPCConnection::HandleHandshake, shared_from_this(), asio::placeholders::error)));
+            return;
+        }
+#endif
+        ReadHeader();
+    }
 
-    acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+    void Close()
+    {
+        boost::system::error_code error;
+        timer.cancel(error);
+        socket().close(error);
+    }
 
-#ifdef USE_SSL
-    ssl::context context(io_service, ssl::context::sslv23);
-    if (fUseSSL)
+    // Send the reply and close the connection once it's out
+    void Write(const string& str)
     {
-        context.set_options(ssl::context::no_sslv2);
-        filesystem::path certfile = GetArg("-rpcsslcertificatechainfile", "server.cert");
-        if (!certfile.is_complete()) certfile = filesystem::path(GetDataDir()) / certfile;
-        if (filesystem::exists(certfile)) context.use_certificate_chain_file(certfile.string().c_str());
-        else printf("ThreadRPCServer ERROR: missing server certificate file %s\n", certfile.string().c_str());
-        filesystem::path pkfile = GetArg("-rpcsslprivatekeyfile", "server.pem");
-        if (!pkfile.is_complete()) pkfile = filesystem::path(GetDataDir()) / pkfile;
-        if (filesystem::exists(pkfile)) context.use_private_key_file(pkfile.string().c_str(), ssl::context::pem);
-        else printf("ThreadRPCServer ERROR: missing server private key file %s\n", pkfile.string().c_str());
+        strReply = str;
+        StartTimer();
+#ifdef USE_SSL
+        if (fUseSSL)
+        {
+            async_write(stream, asio::buffer(strReply), strand.wrap(boost::bind(&CRPCConnection::HandleWrite, shared_from_this(), asio::placeholders::error)));
+            return;
+        }
+#endif
+        async_write(socket(), asio::buffer(strReply), strand.wrap(boost::bind(&CRPCConnection::HandleWrite, shared_from_this(), asio::placeholders::error)));
+    }
 
-        string ciphers = GetArg("-rpcsslciphers",
-                                         "TLSv1+HIGH:!SSLv2:!aNULL:!eNULL:!AH:!3DES:@STRENGTH");
-        SSL_CTX_set_cipher_list(context.impl(), ciphers.c_str());
+private:
+    void StartTimer()
+    {
+        timer.expires_from_now(posix_time::seconds(GetArg("-rpctimeout", 30)));
+        timer.async_wait(strand.wrap(boost::bind(&CRPCConnection::HandleTimeout, shared_from_this(), asio::placeholders::error)));
     }
-#else
-    if (fUseSSL)
-        throw runtime_error("-rpcssl=1, but litecoin compiled without full openssl libraries.");
-#endif
 
-    loop
+    void ReadHeader()
     {
-        // Accept connection
 #ifdef USE_SSL
-        SSLStream sslStream(io_service, context);
-        SSLIOStreamDevice d(sslStream, fUseSSL);
-        iostreams::stream<SSLIOStreamDevice> stream(d);
-#else
-        ip::tcp::iostream stream;
+        if (fUseSSL)
+        {
+            async_read_until(stream, buf, "\r\n\r\n", strand.wrap(boost::bind(&CRPCConnection::HandleHeader, shared_from_this(), asio::placeholders::error)));
+            return;
+        }
 #endif
+        async_read_until(socket(), buf, "\r\n\r\n", strand.wrap(boost::bind(&CRPCConnection::HandleHeader, shared_from_this(), asio::placeholders::error)));
+    }
 
-        ip::tcp::endpoint peer;
-        vnThreadsRunning[THREAD_RPCSERVER]--;
+    void ReadBody(unsigned int nBytes)
+    {
 #ifdef USE_SSL
-        acceptor.accept(sslStream.lowest_layer(), peer);
-#else
-        acceptor.accept(*stream.rdbuf(), peer);
+        if (fUseSSL)
+        {
+            async_read(stream, buf, asio::transfer_at_least(nBytes), strand.wrap(boost::bind(&CRPCConnection::HandleBody, shared_from_this(), asio::placeholders::error)));
+            return;
+        }
 #endif
-        vnThreadsRunning[4]++;
-        if (fShutdown)
+        async_read(socket(), buf, asio::transfer_at_least(nBytes), strand.wrap(boost::bind(&CRPCConnection::HandleBody, shared_from_this(), asio::placeholders::error)));
+    }
+
+    void HandleTimeout(const boost::system::error_code& error)
+    {
+        if (error == asio::error::operation_aborted || !socket().is_open())
             return;
+        printf("ThreadRPCServer connection timeout\n");
+        Close();
+    }
 
-        // Restrict callers by IP
-        if (!ClientAllowed(peer.address().to_string()))
+    void HandleWrite(const boost::system::error_code& error)
+    {
+        Close();
+    }
+
+    void HandleHandshake(const boost::system::error_code& error)
+    {
+        if (error)
         {
-            // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
-            if (!fUseSSL)
-                stream << HTTPReply(403, "") << std::flush;
-            continue;
+            Close();
+            return;
         }
+        ReadHeader();
+    }
 
-        map<string, string> mapHeaders;
-        string strRequest;
+    void HandleHeader(const boost::system::error_code& error)
+    {
+        if (error)
+        {
+            Close();
+            return;
+        }
+        std::istream is(&buf);
+        ReadHTTPStatus(is);
+        nLen = ReadHTTPHeader(is, mapHeaders);
+        if (nLen < 0 || nLen > MAX_SIZE)
+        {
+            Close();
+            return;
+        }
+        if (buf.size() < (unsigned int)nLen)
+            ReadBody(nLen - buf.size());
+        else
+            HandleBody(boost::system::error_code());
+    }
 
-        boost::thread api_caller(ReadHTTP, boost::ref(stream), boost::ref(mapHeaders), boost::ref(strRequest));
-        if (!api_caller.timed_join(boost::posix_time::seconds(GetArg("-rpctimeout", 30))))
-        {   // Timed out:
-            acceptor.cancel();
-            printf("ThreadRPCServer ReadHTTP timeout\n");
-            continue;
+    void HandleBody(const boost::system::error_code& error)
+    {
+        if (error)
+        {
+            Close();
+            return;
         }
+        boost::system::error_code ignored;
+        timer.cancel(ignored);
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
+        string strRequest;
+        if (nLen > 0)
         {
-            stream << HTTPReply(401, "") << std::flush;
-            continue;
+            vector<char> vch(nLen);
+            std::istream is(&buf);
+            is.read(&vch[0], nLen);
+            strRequest = string(vch.begin(), vch.end());
         }
+
+        CRITICAL_BLOCK(cs_rpcThreadsRunning)
+            vnThreadsRunning[THREAD_RPCSERVER]++;
+        string strResult = HandleRequest(strRequest);
+        CRITICAL_BLOCK(cs_rpcThreadsRunning)
+            vnThreadsRunning[THREAD_RPCSERVER]--;
+        Write(strResult);
+    }
+
+    string HandleRequest(const string& strRequest)
+    {
+        // Check authorization
+        if (mapHeaders.count("authorization") == 0)
+            return HTTPReply(401, "");
         if (!HTTPAuthorized(mapHeaders))
         {
             printf("ThreadRPCServer incorrect password attempt from %s\n",peer.address().to_string().c_str());
@@ -2662,10 +2872,10 @@ void ThreadRPCServer2(void* parg)
             if (mapArgs["-rpcpassword"].size() < 20)
                 Sleep(250);
 
-            stream << HTTPReply(401, "") << std::flush;
-            continue;
+            return HTTPReply(401, "");
         }
 
+        std::ostringstream ssReply;
         Value id = Value::null;
         try
         {
@@ -2711,29 +2921,206 @@ void ThreadRPCServer2(void* parg)
             try
             {
                 // Execute
-                Value result;
-                CRITICAL_BLOCK(cs_main)
-                CRITICAL_BLOCK(pwalletMain->cs_wallet)
-                    result = (*(*mi).second)(params, false);
+                Value result = ExecuteRPC((*mi).second, params, mapCallLocks[strMethod]);
 
                 // Send reply
                 string strReply = JSONRPCReply(result, Value::null, id);
-                stream << HTTPReply(200, strReply) << std::flush;
+                ssReply << HTTPReply(200, strReply);
             }
             catch (std::exception& e)
             {
-                ErrorReply(stream, JSONRPCError(-1, e.what()), id);
+                ErrorReply(ssReply, JSONRPCError(-1, e.what()), id);
             }
         }
         catch (Object& objError)
         {
-            ErrorReply(stream, objError, id);
+            ErrorReply(ssReply, objError, id);
         }
         catch (std::exception& e)
         {
-            ErrorReply(stream, JSONRPCError(-32700, e.what()), id);
+            ErrorReply(ssReply, JSONRPCError(-32700, e.what()), id);
+        }
+        return ssReply.str();
+    }
+};
+
+//
+// Accepts connections on the RPC port and hands them to the worker pool
+//
+class CRPCServer
+{
+public:
+    asio::io_service& io_service;
+    ip::tcp::acceptor& acceptor;
+#ifdef USE_SSL
+    ssl::context& context;
+#endif
+    bool fUseSSL;
+
+#ifdef USE_SSL
+    CRPCServer(asio::io_service& io_serviceIn, ip::tcp::acceptor& acceptorIn, ssl::context& contextIn, bool fUseSSLIn) :
+        io_service(io_serviceIn), acceptor(acceptorIn), context(contextIn), fUseSSL(fUseSSLIn) { }
+#else
+    CRPCServer(asio::io_service& io_serviceIn, ip::tcp::acceptor& acceptorIn, bool fUseSSLIn) :
+        io_service(io_serviceIn), acceptor(acceptorIn), fUseSSL(fUseSSLIn) { }
+#endif
+
+    void Accept()
+    {
+        boost::shared_ptr<CRPCConnection> conn(new CRPCConnection(*this));
+        acceptor.async_accept(conn->socket(), conn->peer, boost::bind(&CRPCServer::HandleAccept, this, conn, asio::placeholders::error));
+    }
+
+    void HandleAccept(boost::shared_ptr<CRPCConnection> conn, const boost::system::error_code& error)
+    {
+        // Stop accepting once we're shutting down, the workers return when
+        // the connections in flight are done
+        if (fShutdown)
+            return;
+        Accept();
+        if (error)
+            return;
+
+        // Restrict callers by IP
+        if (!ClientAllowed(conn->peer.address().to_string()))
+        {
+            // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
+            if (!fUseSSL)
+                conn->Write(HTTPReply(403, ""));
+            else
+                conn->Close();
+            return;
         }
+        conn->Start();
     }
+};
+
+#ifdef USE_SSL
+CRPCConnection::CRPCConnection(CRPCServer& server) : stream(server.io_service, server.context), strand(server.io_service), timer(server.io_service), buf(MAX_SIZE)
+#else
+CRPCConnection::CRPCConnection(CRPCServer& server) : stream(server.io_service), strand(server.io_service), timer(server.io_service), buf(MAX_SIZE)
+#endif
+{
+    fUseSSL = server.fUseSSL;
+    nLen = 0;
+}
+
+void static ThreadRPCWorker(asio::io_service* pio_service)
+{
+    loop
+    {
+        try
+        {
+            pio_service->run();
+            break;
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadRPCWorker()");
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ThreadRPCWorker()");
+        }
+    }
+}
+
+void ThreadRPCServer(void* parg)
+{
+    IMPLEMENT_RANDOMIZE_STACK(ThreadRPCServer(parg));
+    try
+    {
+        vnThreadsRunning[THREAD_RPCSERVER]++;
+        ThreadRPCServer2(parg);
+        vnThreadsRunning[THREAD_RPCSERVER]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_RPCSERVER]--;
+        PrintException(&e, "ThreadRPCServer()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_RPCSERVER]--;
+        PrintException(NULL, "ThreadRPCServer()");
+    }
+    printf("ThreadRPCServer exiting\n");
+}
+
+void ThreadRPCServer2(void* parg)
+{
+    printf("ThreadRPCServer started\n");
+
+    strRPCUserColonPass = mapArgs["-rpcuser"] + ":" + mapArgs["-rpcpassword"];
+    if (mapArgs["-rpcpassword"] == "")
+    {
+        unsigned char rand_pwd[32];
+        RAND_bytes(rand_pwd, 32);
+        string strWhatAmI = "To use litecoind";
+        if (mapArgs.count("-server"))
+            strWhatAmI = strprintf(_("To use the %s option"), "\"-server\"");
+        else if (mapArgs.count("-daemon"))
+            strWhatAmI = strprintf(_("To use the %s option"), "\"-daemon\"");
+        ::error(
+            _("%s, you must set a rpcpassword in the configuration file:\n %s\n"
+              "It is recommended you use the following random password:\n"
+              "rpcuser=bitcoinrpc\n"
+              "rpcpassword=%s\n"
+              "(you do not need to remember this password)\n"
+              "If the file does not exist, create it with owner-readable-only file permissions.\n"),
+                strWhatAmI.c_str(),
+                GetConfigFile().c_str(),
+                EncodeBase58(&rand_pwd[0],&rand_pwd[0]+32).c_str());
+#ifndef QT_GUI
+        CreateThread(Shutdown, NULL);
+#endif
+        return;
+    }
+
+    bool fUseSSL = GetBoolArg("-rpcssl");
+    asio::ip::address bindAddress = mapArgs.count("-rpcallowip") ? asio::ip::address_v4::any() : asio::ip::address_v4::loopback();
+
+    asio::io_service io_service;
+    ip::tcp::endpoint endpoint(bindAddress, GetArg("-rpcport", 9332));
+    ip::tcp::acceptor acceptor(io_service, endpoint);
+
+    acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+
+#ifdef USE_SSL
+    ssl::context context(io_service, ssl::context::sslv23);
+    if (fUseSSL)
+    {
+        context.set_options(ssl::context::no_sslv2);
+        filesystem::path certfile = GetArg("-rpcsslcertificatechainfile", "server.cert");
+        if (!certfile.is_complete()) certfile = filesystem::path(GetDataDir()) / certfile;
+        if (filesystem::exists(certfile)) context.use_certificate_chain_file(certfile.string().c_str());
+        else printf("ThreadRPCServer ERROR: missing server certificate file %s\n", certfile.string().c_str());
+        filesystem::path pkfile = GetArg("-rpcsslprivatekeyfile", "server.pem");
+        if (!pkfile.is_complete()) pkfile = filesystem::path(GetDataDir()) / pkfile;
+        if (filesystem::exists(pkfile)) context.use_private_key_file(pkfile.string().c_str(), ssl::context::pem);
+        else printf("ThreadRPCServer ERROR: missing server private key file %s\n", pkfile.string().c_str());
+
+        string ciphers = GetArg("-rpcsslciphers",
+                                         "TLSv1+HIGH:!SSLv2:!aNULL:!eNULL:!AH:!3DES:@STRENGTH");
+        SSL_CTX_set_cipher_list(context.impl(), ciphers.c_str());
+    }
+#else
+    if (fUseSSL)
+        throw runtime_error("-rpcssl=1, but litecoin compiled without full openssl libraries.");
+#endif
+
+    // Requests are read asynchronously and run on a pool of worker threads,
+    // each call only taking the locks the call table says it needs
+#ifdef USE_SSL
+    CRPCServer server(io_service, acceptor, context, fUseSSL);
+#else
+    CRPCServer server(io_service, acceptor, fUseSSL);
+#endif
+    server.Accept();
+
+    int nThreads = max((int)GetArg("-rpcthreads", 4), 1);
+    CRITICAL_BLOCK(cs_rpcThreadsRunning)
+        vnThreadsRunning[THREAD_RPCSERVER]--;
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&ThreadRPCWorker, &io_service));
+    threads.join_all();
+    CRITICAL_BLOCK(cs_rpcThreadsRunning)
+        vnThreadsRunning[THREAD_RPCSERVER]++;
 }
 
 
@@ -2870,6 +3257,7 @@ int CommandLineRPC(int argc, char *argv[])
         if (strMethod == "listaccounts"           && n > 0) ConvertTo<boost::int64_t>(params[0]);
         if (strMethod == "walletpassphrase"       && n > 1) ConvertTo<boost::int64_t>(params[1]);
         if (strMethod == "listsinceblock"         && n > 1) ConvertTo<boost::int64_t>(params[1]);
+        if (strMethod == "importprivkey"          && n > 2) ConvertTo<boost::int64_t>(params[2]);
         if (strMethod == "sendmany"               && n > 1)
         {
             string s = params[1].get_str();
@@ -2879,6 +3267,15 @@ int CommandLineRPC(int argc, char *argv[])
             params[1] = v.get_obj();
         }
         if (strMethod == "sendmany"                && n > 2) ConvertTo<boost::int64_t>(params[2]);
+        if (strMethod == "sendmanybatch"          && n > 1)
+        {
+            string s = params[1].get_str();
+            Value v;
+            if (!read_string(s, v) || v.type() != obj_type)
+                throw runtime_error("type mismatch");
+            params[1] = v.get_obj();
+        }
+        if (strMethod == "sendmanybatch"          && n > 2) ConvertTo<boost::int64_t>(params[2]);
         if (strMethod == "addmultisigaddress"      && n > 0) ConvertTo<boost::int64_t>(params[0]);
         if (strMethod == "addmultisigaddress"      && n > 1)
         {
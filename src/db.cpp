@@ -795,11 +795,126 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 }
 
 
+enum
+{
+    TXRECORD_OK,
+    TXRECORD_UPGRADE,
+    TXRECORD_CORRUPT,
+};
+
+// Wallet transactions are decoded WALLET_LOAD_BATCH records at a time, so
+// only one batch of raw records is held next to the decoded wallet
+static const unsigned int WALLET_LOAD_BATCH = 1000;
+
+// Supporting transactions loaded so far, by hash.  Records often carry the
+// same few supporting transactions, so identical copies share one object.
+class CSupportingTxPool
+{
+public:
+    CCriticalSection cs;
+    std::map<uint256, boost::shared_ptr<const CMerkleTx> > mapTx;
+
+    void Share(std::vector<boost::shared_ptr<const CMerkleTx> >& vtx)
+    {
+        BOOST_FOREACH(boost::shared_ptr<const CMerkleTx>& ptx, vtx)
+        {
+            uint256 hash = ptx->GetHash();
+            CRITICAL_BLOCK(cs)
+            {
+                boost::shared_ptr<const CMerkleTx>& ptxShared = mapTx[hash];
+                if (!ptxShared)
+                    ptxShared = ptx;
+                else if (ptxShared->hashBlock == ptx->hashBlock && ptxShared->nIndex == ptx->nIndex &&
+                         ptxShared->vMerkleBranch == ptx->vMerkleBranch)
+                    ptx = ptxShared;
+            }
+        }
+    }
+};
+
+void static LoadWalletTxRecords(vector<pair<uint256, CDataStream> >* pvRecords, const vector<CWalletTx*>* pvpwtx, vector<char>* pvfStatus, CSupportingTxPool* ppool, unsigned int nBegin, unsigned int nStep)
+{
+    for (unsigned int i = nBegin; i < pvRecords->size(); i += nStep)
+    {
+        const uint256& hash = (*pvRecords)[i].first;
+        CDataStream& ssValue = (*pvRecords)[i].second;
+        CWalletTx& wtx = *(*pvpwtx)[i];
+        try
+        {
+            ssValue >> wtx;
+        }
+        catch (std::exception& e)
+        {
+            (*pvfStatus)[i] = TXRECORD_CORRUPT;
+            continue;
+        }
+
+        if (wtx.GetHash() != hash)
+            printf("Error in wallet.dat, hash mismatch\n");
+        ppool->Share(wtx.vtxPrev);
+
+        // Undo serialize changes in 31600
+        if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+        {
+            if (!ssValue.empty())
+            {
+                char fTmp;
+                char fUnused;
+                ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+                printf("LoadWallet() upgrading tx ver=%d %d '%s' %s\n", wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
+                wtx.fTimeReceivedIsTxTime = fTmp;
+            }
+            else
+            {
+                printf("LoadWallet() repairing tx ver=%d %s\n", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
+                wtx.fTimeReceivedIsTxTime = 0;
+            }
+            (*pvfStatus)[i] = TXRECORD_UPGRADE;
+        }
+    }
+}
+
+// Decode a batch of wallet transaction records on several threads
+bool static LoadWalletTxBatch(CWallet* pwallet, vector<pair<uint256, CDataStream> >& vTxRecords, CSupportingTxPool& pool, vector<uint256>& vWalletUpgrade)
+{
+    vector<CWalletTx*> vpwtx;
+    vpwtx.reserve(vTxRecords.size());
+    for (unsigned int i = 0; i < vTxRecords.size(); i++)
+        vpwtx.push_back(&pwallet->mapWallet[vTxRecords[i].first]);
+    vector<char> vfStatus(vTxRecords.size(), TXRECORD_OK);
+    int nThreads = boost::thread::hardware_concurrency();
+    if (nThreads < 1)
+        nThreads = 1;
+    if (nThreads > 8)
+        nThreads = 8;
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads && i < vTxRecords.size(); i++)
+        threads.create_thread(boost::bind(&LoadWalletTxRecords, &vTxRecords, &vpwtx, &vfStatus, &pool, i, nThreads));
+    threads.join_all();
+
+    for (unsigned int i = 0; i < vTxRecords.size(); i++)
+    {
+        const uint256& hash = vTxRecords[i].first;
+        if (vfStatus[i] == TXRECORD_CORRUPT)
+        {
+            printf("Error reading wallet database: tx %s unreadable\n", hash.ToString().c_str());
+            return false;
+        }
+        vpwtx[i]->BindWallet(pwallet);
+        if (vfStatus[i] == TXRECORD_UPGRADE)
+            vWalletUpgrade.push_back(hash);
+    }
+    vTxRecords.clear();
+    return true;
+}
+
 int CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey.clear();
     int nFileVersion = 0;
     vector<uint256> vWalletUpgrade;
+    vector<pair<uint256, CDataStream> > vTxRecords;
+    CSupportingTxPool poolSupportingTx;
     bool fIsEncrypted = false;
 
     //// todo: shouldn't we catch exceptions and try to recover and continue?
@@ -842,39 +957,9 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
             {
                 uint256 hash;
                 ssKey >> hash;
-                CWalletTx& wtx = pwallet->mapWallet[hash];
-                ssValue >> wtx;
-                wtx.BindWallet(pwallet);
-
-                if (wtx.GetHash() != hash)
-                    printf("Error in wallet.dat, hash mismatch\n");
-
-                // Undo serialize changes in 31600
-                if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-                {
-                    if (!ssValue.empty())
-                    {
-                        char fTmp;
-                        char fUnused;
-                        ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                        printf("LoadWallet() upgrading tx ver=%d %d '%s' %s\n", wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
-                        wtx.fTimeReceivedIsTxTime = fTmp;
-                    }
-                    else
-                    {
-                        printf("LoadWallet() repairing tx ver=%d %s\n", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
-                        wtx.fTimeReceivedIsTxTime = 0;
-                    }
-                    vWalletUpgrade.push_back(hash);
-                }
-
-                //// debug print
-                //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
-                //printf(" %12I64d  %s  %s  %s\n",
-                //    wtx.vout[0].nValue,
-                //    DateTimeStrFormat("%x %H:%M:%S", wtx.GetBlockTime()).c_str(),
-                //    wtx.hashBlock.ToString().substr(0,20).c_str(),
-                //    wtx.mapValue["message"].c_str());
+                vTxRecords.push_back(make_pair(hash, ssValue));
+                if (vTxRecords.size() >= WALLET_LOAD_BATCH && !LoadWalletTxBatch(pwallet, vTxRecords, poolSupportingTx, vWalletUpgrade))
+                    return DB_CORRUPT;
             }
             else if (strType == "acentry")
             {
@@ -884,6 +969,13 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
                 ssKey >> nNumber;
                 if (nNumber > nAccountingEntryNumber)
                     nAccountingEntryNumber = nNumber;
+
+                // Keep them in memory, with a running total for balances
+                CAccountingEntry acentry;
+                ssValue >> acentry;
+                acentry.strAccount = strAccount;
+                pwallet->laccentries.push_back(acentry);
+                pwallet->mapAccountCreditDebit[strAccount] += acentry.nCreditDebit;
             }
             else if (strType == "key" || strType == "wkey")
             {
@@ -988,6 +1080,9 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
             }
         }
         pcursor->close();
+
+        if (!LoadWalletTxBatch(pwallet, vTxRecords, poolSupportingTx, vWalletUpgrade))
+            return DB_CORRUPT;
     }
 
     BOOST_FOREACH(uint256 hash, vWalletUpgrade)
@@ -1011,6 +1106,13 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
     return DB_LOAD_OK;
 }
 
+// The database log is the wallet's write-ahead log: every change is
+// committed to it first, and checkpoints carry the changes into wallet.dat
+// so the log can be trimmed.  Checkpointing works with wallet.dat open, so
+// this thread never makes other database users wait; making wallet.dat
+// self contained for copying is left to BackupWallet and shutdown.
+// With -walletsync wallet commits only hand the log to the OS (see
+// CWalletDB::Write), and this thread forces it to disk at least that often.
 void ThreadFlushWalletDB(void* parg)
 {
     const string& strFile = ((const string*)parg)[0];
@@ -1018,7 +1120,9 @@ void ThreadFlushWalletDB(void* parg)
     if (fOneThread)
         return;
     fOneThread = true;
-    if (!GetBoolArg("-flushwallet", true))
+    bool fFlushWallet = GetBoolArg("-flushwallet", true);
+    int64 nSyncInterval = GetArg("-walletsync", 0);
+    if (!fFlushWallet && nSyncInterval <= 0)
         return;
 
     unsigned int nLastSeen = nWalletDBUpdated;
@@ -1026,7 +1130,13 @@ void ThreadFlushWalletDB(void* parg)
     int64 nLastWalletUpdate = GetTime();
     while (!fShutdown)
     {
-        Sleep(500);
+        Sleep(nSyncInterval > 0 ? min(nSyncInterval, (int64)500) : 500);
+
+        // Shutdown closes the environment under cs_db without waiting for us
+        if (nSyncInterval > 0)
+            TRY_CRITICAL_BLOCK(cs_db)
+                if (!fShutdown && fDbEnvInit)
+                    dbenv.log_flush(NULL);
 
         if (nLastSeen != nWalletDBUpdated)
         {
@@ -1034,37 +1144,16 @@ void ThreadFlushWalletDB(void* parg)
             nLastWalletUpdate = GetTime();
         }
 
-        if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
+        if (fFlushWallet && nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
         {
             TRY_CRITICAL_BLOCK(cs_db)
             {
-                // Don't do this if any databases are in use
-                int nRefCount = 0;
-                map<string, int>::iterator mi = mapFileUseCount.begin();
-                while (mi != mapFileUseCount.end())
+                if (!fShutdown && fDbEnvInit)
                 {
-                    nRefCount += (*mi).second;
-                    mi++;
-                }
-
-                if (nRefCount == 0 && !fShutdown)
-                {
-                    map<string, int>::iterator mi = mapFileUseCount.find(strFile);
-                    if (mi != mapFileUseCount.end())
-                    {
-                        printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
-                        printf("Flushing wallet.dat\n");
-                        nLastFlushed = nWalletDBUpdated;
-                        int64 nStart = GetTimeMillis();
-
-                        // Flush wallet.dat so it's self contained
-                        CloseDb(strFile);
-                        dbenv.txn_checkpoint(0, 0, 0);
-                        dbenv.lsn_reset(strFile.c_str(), 0);
-
-                        mapFileUseCount.erase(mi++);
-                        printf("Flushed wallet.dat %"PRI64d"ms\n", GetTimeMillis() - nStart);
-                    }
+                    nLastFlushed = nWalletDBUpdated;
+                    int64 nStart = GetTimeMillis();
+                    dbenv.txn_checkpoint(0, 0, 0);
+                    printf("Flushed %s %"PRI64d"ms\n", strFile.c_str(), GetTimeMillis() - nStart);
                 }
             }
         }
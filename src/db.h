@@ -212,12 +212,12 @@ protected:
     }
 
 public:
-    bool TxnBegin()
+    bool TxnBegin(u_int32_t nFlags=DB_TXN_NOSYNC)
     {
         if (!pdb)
             return false;
         DbTxn* ptxn = NULL;
-        int ret = dbenv.txn_begin(GetTxn(), &ptxn, DB_TXN_NOSYNC);
+        int ret = dbenv.txn_begin(GetTxn(), &ptxn, nFlags);
         if (!ptxn || ret != 0)
             return false;
         vTxn.push_back(ptxn);
@@ -360,10 +360,42 @@ class CWalletDB : public CDB
 public:
     CWalletDB(std::string strFilename, const char* pszMode="r+") : CDB(strFilename.c_str(), pszMode)
     {
+        fNoSync = (GetArg("-walletsync", 0) > 0);
     }
 private:
     CWalletDB(const CWalletDB&);
     void operator=(const CWalletDB&);
+
+    // With -walletsync, writes outside an explicit transaction only hand
+    // the log to the OS, and ThreadFlushWalletDB syncs it.  The block
+    // databases keep syncing each commit.
+    bool fNoSync;
+
+    template<typename K, typename T>
+    bool Write(const K& key, const T& value, bool fOverwrite=true)
+    {
+        if (!fNoSync || GetTxn() || !TxnBegin(DB_TXN_WRITE_NOSYNC))
+            return CDB::Write(key, value, fOverwrite);
+        if (!CDB::Write(key, value, fOverwrite))
+        {
+            TxnAbort();
+            return false;
+        }
+        return TxnCommit();
+    }
+
+    template<typename K>
+    bool Erase(const K& key)
+    {
+        if (!fNoSync || GetTxn() || !TxnBegin(DB_TXN_WRITE_NOSYNC))
+            return CDB::Erase(key);
+        if (!CDB::Erase(key))
+        {
+            TxnAbort();
+            return false;
+        }
+        return TxnCommit();
+    }
 public:
     bool ReadName(const std::string& strAddress, std::string& strName)
     {
@@ -60,6 +60,8 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         DBFlush(false);
         StopNode();
+        if (GetBoolArg("-persistmempool", true))
+            DumpMempool();
         DBFlush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -123,6 +125,28 @@ bool AppInit(int argc, char* argv[])
     return fRet;
 }
 
+void static ThreadLoadMemoryPool(void* parg)
+{
+    // Counted as running by AppInit2 before the thread is started, so that
+    // an early shutdown still waits for it
+    try
+    {
+        // Add wallet transactions that aren't already in a block to the memory pool
+        CRITICAL_BLOCK(cs_main)
+            pwalletMain->ReacceptWalletTransactions();
+
+        // Bring back the memory pool from the last run
+        if (GetBoolArg("-persistmempool", true))
+            LoadMempool();
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadLoadMemoryPool()");
+    } catch (...) {
+        PrintException(NULL, "ThreadLoadMemoryPool()");
+    }
+    vnThreadsRunning[THREAD_LOADMEMPOOL]--;
+}
+
 bool AppInit2(int argc, char* argv[])
 {
 #ifdef _MSC_VER
@@ -180,6 +204,15 @@ bool AppInit2(int argc, char* argv[])
             "  -datadir=<dir>   \t\t  " + _("Specify data directory") + "\n" +
             "  -dbcache=<n>     \t\t  " + _("Set database cache size in megabytes (default: 25)") + "\n" +
 			"  -dblogsize=<n>   \t\t  " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+            "  -walletsync=<n>  \t  "   + _("Let wallet changes reach the disk up to <n> milliseconds late instead of syncing each one (default: 0)") + "\n" +
+            "  -compressblocks  \t  "   + _("Store new blocks compressed on disk (default: 0)") + "\n" +
+            "  -convertblockfiles\t  "  + _("Rewrite existing block files in the format selected by -compressblocks") + "\n" +
+            "  -maxorphanblocks=<n>\t  " + _("Keep at most <n> MB of orphan blocks in memory (default: 32)") + "\n" +
+            "  -orphanblockdisk=<n>\t  " + _("Move orphan blocks over the memory limit to disk, up to <n> MB (default: 0)") + "\n" +
+            "  -persistmempool  \t  "   + _("Save the memory pool at shutdown and reload it at startup (default: 1)") + "\n" +
+            "  -maxmempool=<n>  \t  "   + _("Keep the transaction memory pool below <n> MB, evicting the lowest fee rates (default: 300)") + "\n" +
+            "  -maxsigcachesize=<n>\t  " + _("Keep at most <n> verified signatures cached (default: 50000)") + "\n" +
+            "  -headersfirst    \t  "   + _("When far behind, sync headers first and download blocks from several peers at once (default: 1)") + "\n" +
             "  -timeout=<n>     \t  "   + _("Specify connection timeout (in milliseconds)") + "\n" +
             "  -proxy=<ip:port> \t  "   + _("Connect through socks4 proxy") + "\n" +
             "  -dns             \t  "   + _("Allow DNS lookups for addnode and connect") + "\n" +
@@ -197,6 +230,9 @@ bool AppInit2(int argc, char* argv[])
             "  -bantime=<n>     \t  "   + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
             "  -maxreceivebuffer=<n>\t  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 10000)") + "\n" +
             "  -maxsendbuffer=<n>\t  "   + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 10000)") + "\n" +
+            "  -maxuploadrate=<n>\t  " + _("Limit total upload to <n> KB/s, new blocks are exempt (default: 0 = unlimited)") + "\n" +
+            "  -peeruploadrate=<n>\t  " + _("Limit upload to each peer to <n> KB/s, new blocks are exempt (default: 0 = unlimited)") + "\n" +
+            "  -msghandlerthreads=<n>\t  " + _("Number of threads processing peer messages (default: 2)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
             "  -upnp            \t  "   + _("Use Universal Plug and Play to map the listening port (default: 1)") + "\n" +
@@ -206,6 +242,8 @@ bool AppInit2(int argc, char* argv[])
 #endif
             "  -paytxfee=<amt>  \t  "   + _("Fee per KB to add to transactions you send") + "\n" +
             "  -mininput=<amt>  \t  "   + _("When creating transactions, ignore inputs with value less than this (default: 0.0001)") + "\n" +
+            "  -coinselection=<s>\t  " + _("Coin selection strategy to try first, bnb or knapsack (default: bnb)") + "\n" +
+            "  -blockprioritysize=<n>\t  " + _("Bytes of each new block to fill by priority before filling by fee (default: 27000)") + "\n" +
 #ifdef QT_GUI
             "  -server          \t\t  " + _("Accept command line and JSON-RPC commands") + "\n" +
 #endif
@@ -223,6 +261,7 @@ bool AppInit2(int argc, char* argv[])
             "  -rpcpassword=<pw>\t  "   + _("Password for JSON-RPC connections") + "\n" +
             "  -rpcport=<port>  \t\t  " + _("Listen for JSON-RPC connections on <port> (default: 9332)") + "\n" +
             "  -rpcallowip=<ip> \t\t  " + _("Allow JSON-RPC connections from specified IP address") + "\n" +
+            "  -rpcthreads=<n>  \t\t  " + _("Number of threads answering JSON-RPC calls (default: 4)") + "\n" +
             "  -rpcconnect=<ip> \t  "   + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
             "  -blocknotify=<cmd> "     + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
             "  -keypool=<n>     \t  "   + _("Set key pool size to <n> (default: 100)") + "\n" +
@@ -338,6 +377,16 @@ bool AppInit2(int argc, char* argv[])
         return false;
     }
 
+    if (mapArgs.count("-coinselection"))
+    {
+        pfnCoinSelection = GetCoinSelection(mapArgs["-coinselection"]);
+        if (!pfnCoinSelection)
+        {
+            wxMessageBox(_("Invalid strategy for -coinselection=<s>"), "Litecoin");
+            return false;
+        }
+    }
+
     std::ostringstream strErrors;
     //
     // Load data files
@@ -353,13 +402,27 @@ bool AppInit2(int argc, char* argv[])
         strErrors << _("Error loading addr.dat") << "\n";
     printf(" addresses   %15"PRI64d"ms\n", GetTimeMillis() - nStart);
 
+    fCompressBlocks = GetBoolArg("-compressblocks");
+    fHeadersFirst = GetBoolArg("-headersfirst", true);
+
     InitMessage(_("Loading block index..."));
     printf("Loading block index...\n");
     nStart = GetTimeMillis();
-    if (!LoadBlockIndex())
+    bool fLoadedBlockIndex = LoadBlockIndex();
+    if (!fLoadedBlockIndex)
         strErrors << _("Error loading blkindex.dat") << "\n";
     printf(" block index %15"PRI64d"ms\n", GetTimeMillis() - nStart);
 
+    if (fLoadedBlockIndex && GetBoolArg("-convertblockfiles"))
+    {
+        InitMessage(_("Converting block files..."));
+        printf("Converting block files...\n");
+        nStart = GetTimeMillis();
+        if (!ConvertBlockFiles())
+            strErrors << _("Error converting block files") << "\n";
+        printf(" convert     %15"PRI64d"ms\n", GetTimeMillis() - nStart);
+    }
+
     InitMessage(_("Loading wallet..."));
     printf("Loading wallet...\n");
     nStart = GetTimeMillis();
@@ -422,8 +485,14 @@ bool AppInit2(int argc, char* argv[])
         return false;
     }
 
-    // Add wallet transactions that aren't already in a block to mapTransactions
-    pwalletMain->ReacceptWalletTransactions();
+    // Re-adding wallet transactions and the saved memory pool goes through
+    // the txdb for every transaction, do it in the background
+    vnThreadsRunning[THREAD_LOADMEMPOOL]++;
+    if (!CreateThread(ThreadLoadMemoryPool, NULL))
+    {
+        printf("Error: CreateThread(ThreadLoadMemoryPool) failed\n");
+        vnThreadsRunning[THREAD_LOADMEMPOOL]--;
+    }
 
     // Note: Bitcoin-QT stores several settings in the wallet, so we want
     // to load the wallet BEFORE parsing command-line arguments, so
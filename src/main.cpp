@@ -11,6 +11,7 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <zlib.h>
 
 using namespace std;
 using namespace boost;
@@ -29,12 +30,13 @@ set<CWallet*> setpwalletRegistered;
 
 CCriticalSection cs_main;
 
-static map<uint256, CTransaction> mapTransactions;
-CCriticalSection cs_mapTransactions;
+CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
-map<COutPoint, CInPoint> mapNextTx;
 
 map<uint256, CBlockIndex*> mapBlockIndex;
+// Block index entries by where the block is stored, so the block a CTxIndex
+// points into can be found without reading its header
+static map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockIndexByPos;
 uint256 hashGenesisBlock("0x12a765e31ffd4059bada1e25190f6e98c99d9714d334efa41a195a7e7e04bfe2");
 static CBigNum bnProofOfWorkLimit(~uint256(0) >> 20); // Litecoin: starting difficulty is 1 / 2^12
 CBlockIndex* pindexGenesisBlock = NULL;
@@ -47,11 +49,35 @@ int64 nTimeBestReceived = 0;
 
 CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes claim to have
 
-map<uint256, CBlock*> mapOrphanBlocks;
-multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
-
-map<uint256, CDataStream*> mapOrphanTransactions;
-multimap<uint256, CDataStream*> mapOrphanTransactionsByPrev;
+// Orphan blocks, held until their parent arrives, see AddOrphanBlock()
+struct COrphanBlock
+{
+    CBlock* pblock;         // NULL while spilled to disk
+    uint256 hashPrev;
+    unsigned int nSize;
+    long nDiskPos;
+    CNode* pfrom;           // NULL once the peer is gone
+    list<uint256>::iterator itLRU;
+};
+static map<uint256, COrphanBlock> mapOrphanBlocks;
+static multimap<uint256, uint256> mapOrphanBlocksByPrev;
+static list<uint256> lruOrphanBlocks;
+static uint64 nOrphanBlockBytes = 0;
+static uint64 nOrphanBlockDiskBytes = 0;
+static int nOrphanBlocksSpilled = 0;
+static FILE* fileOrphanBlocks = NULL;
+
+// Headers-first sync and block download state, see SendBlockRequests()
+static map<uint256, CBlockIndex*> mapHeaderIndex;
+static vector<CBlockIndex*> vHeaderChain;
+static int nHeaderChainHave = -1;
+static map<uint256, pair<CNode*, int64> > mapBlocksInFlight;
+static CNode* pnodeHeadersSync = NULL;
+static int64 nHeadersSyncTime = 0;
+
+map<uint256, COrphanTx> mapOrphanTransactions;
+multimap<uint256, boost::shared_ptr<CTransaction> > mapOrphanTransactionsByPrev;
+uint64 nOrphanTxBytes = 0;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -66,6 +92,8 @@ int64 nTransactionFee = 0;
 int64 nMinimumInputValue = CENT / 100;
 int fMinimizeToTray = true;
 int fMinimizeOnClose = true;
+bool fCompressBlocks = false;
+bool fHeadersFirst = true;
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -170,51 +198,90 @@ void static ResendWalletTransactions()
 // mapOrphanTransactions
 //
 
-void AddOrphanTx(const CDataStream& vMsg)
-{
-    CTransaction tx;
-    CDataStream(vMsg) >> tx;
-    uint256 hash = tx.GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return;
-
-    CDataStream* pvMsg = mapOrphanTransactions[hash] = new CDataStream(vMsg);
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev.insert(make_pair(txin.prevout.hash, pvMsg));
-}
-
 void static EraseOrphanTx(uint256 hash)
 {
-    if (!mapOrphanTransactions.count(hash))
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+    if (it == mapOrphanTransactions.end())
         return;
-    const CDataStream* pvMsg = mapOrphanTransactions[hash];
-    CTransaction tx;
-    CDataStream(*pvMsg) >> tx;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    const COrphanTx& orphan = (*it).second;
+    BOOST_FOREACH(const CTxIn& txin, orphan.ptx->vin)
     {
-        for (multimap<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(txin.prevout.hash);
+        for (multimap<uint256, boost::shared_ptr<CTransaction> >::iterator mi = mapOrphanTransactionsByPrev.lower_bound(txin.prevout.hash);
              mi != mapOrphanTransactionsByPrev.upper_bound(txin.prevout.hash);)
         {
-            if ((*mi).second == pvMsg)
+            if ((*mi).second == orphan.ptx)
                 mapOrphanTransactionsByPrev.erase(mi++);
             else
                 mi++;
         }
     }
-    delete pvMsg;
-    mapOrphanTransactions.erase(hash);
+    nOrphanTxBytes -= orphan.nSize;
+    if (orphan.pfrom)
+        orphan.pfrom->nOrphanTxBytes -= orphan.nSize;
+    mapOrphanTransactions.erase(it);
 }
 
-int LimitOrphanTxSize(int nMaxOrphans)
+// Drops orphans whose parents haven't shown up in ORPHAN_TX_EXPIRE_TIME
+int static ExpireOrphanTx()
 {
-    int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    static int64 nNextSweep;
+    int64 nNow = GetTime();
+    if (nNow < nNextSweep)
+        return 0;
+    nNextSweep = nNow + 60;
+
+    vector<uint256> vExpired;
+    BOOST_FOREACH(const PAIRTYPE(const uint256, COrphanTx)& item, mapOrphanTransactions)
+        if (item.second.nTimeExpire <= nNow)
+            vExpired.push_back(item.first);
+    BOOST_FOREACH(const uint256& hash, vExpired)
+        EraseOrphanTx(hash);
+    return vExpired.size();
+}
+
+bool AddOrphanTx(const CTransaction& tx, CNode* pfrom)
+{
+    uint256 hash = tx.GetHash();
+    if (mapOrphanTransactions.count(hash))
+        return false;
+
+    // Ignore big transactions, to avoid a send-big-orphans memory exhaustion
+    // attack, and don't let a single peer take more than its share of the pool
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK);
+    if (nSize > MAX_ORPHAN_TX_SIZE)
+    {
+        printf("ignoring large orphan tx (size: %u, hash: %s)\n", nSize, hash.ToString().substr(0,10).c_str());
+        return false;
+    }
+    if (pfrom && pfrom->nOrphanTxBytes + nSize > MAX_ORPHAN_TX_BYTES / 4)
+    {
+        printf("ignoring orphan tx %s, peer %s is over its limit\n", hash.ToString().substr(0,10).c_str(), pfrom->addr.ToString().c_str());
+        return false;
+    }
+
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.ptx.reset(new CTransaction(tx));
+    orphan.nSize = nSize;
+    orphan.pfrom = pfrom;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        mapOrphanTransactionsByPrev.insert(make_pair(txin.prevout.hash, orphan.ptx));
+    nOrphanTxBytes += nSize;
+    if (pfrom)
+        pfrom->nOrphanTxBytes += nSize;
+    return true;
+}
+
+int LimitOrphanTxSize(unsigned int nMaxOrphans, uint64 nMaxBytes)
+{
+    int nEvicted = ExpireOrphanTx();
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTxBytes > nMaxBytes)
     {
         // Evict a random orphan:
         std::vector<unsigned char> randbytes(32);
         RAND_bytes(&randbytes[0], 32);
         uint256 randomhash(randbytes);
-        map<uint256, CDataStream*>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
+        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
         if (it == mapOrphanTransactions.end())
             it = mapOrphanTransactions.begin();
         EraseOrphanTx(it->first);
@@ -223,6 +290,13 @@ int LimitOrphanTxSize(int nMaxOrphans)
     return nEvicted;
 }
 
+void static ForgetOrphanTxPeer(CNode* pnode)
+{
+    BOOST_FOREACH(PAIRTYPE(const uint256, COrphanTx)& item, mapOrphanTransactions)
+        if (item.second.pfrom == pnode)
+            item.second.pfrom = NULL;
+}
+
 
 
 
@@ -459,7 +533,83 @@ bool CTransaction::CheckTransaction() const
     return true;
 }
 
-bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMissingInputs)
+uint64 static GetMaxMemPoolUsage()
+{
+    return (uint64)GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+}
+
+// Height of the main chain block holding a transaction, -1 if it's in
+// the memory pool or not on the main chain
+int static GetTxIndexHeight(const CTxIndex& txindex)
+{
+    if (txindex.pos.IsNull() || txindex.pos == CDiskTxPos(1,1,1))
+        return -1;
+    map<pair<unsigned int, unsigned int>, CBlockIndex*>::iterator mi = mapBlockIndexByPos.find(make_pair(txindex.pos.nFile, txindex.pos.nBlockPos));
+    if (mi == mapBlockIndexByPos.end() || !(*mi).second->IsInMainChain())
+        return -1;
+    return (*mi).second->nHeight;
+}
+
+// Caches what block templates need to know about a transaction's inputs,
+// so they can be built without reading them back from disk
+void static FillMemPoolEntry(CTxMemPoolEntry& entry, const MapPrevTx& mapInputs)
+{
+    const CTransaction& tx = entry.tx;
+    entry.nTxSize = ::GetSerializeSize(tx, SER_NETWORK);
+    entry.nSigOps = tx.GetLegacySigOpCount();
+    entry.nTime = GetTime();
+    if (mapInputs.empty())
+        return;
+
+    entry.nFee = tx.GetValueIn(mapInputs) - tx.GetValueOut();
+    entry.nSigOps += tx.GetP2SHSigOpCount(mapInputs);
+    map<uint256, int> mapHeight;
+    entry.vInputs.clear();
+    entry.nCoinbaseHeight = -1;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        const pair<CTxIndex, CTransaction>& prev = (*mapInputs.find(txin.prevout.hash)).second;
+        if (!mapHeight.count(txin.prevout.hash))
+            mapHeight[txin.prevout.hash] = GetTxIndexHeight(prev.first);
+        int nHeight = mapHeight[txin.prevout.hash];
+        entry.vInputs.push_back(make_pair(prev.second.vout[txin.prevout.n].nValue, nHeight));
+        if (prev.second.IsCoinBase())
+            entry.nCoinbaseHeight = max(entry.nCoinbaseHeight, nHeight);
+    }
+}
+
+// Fills in an entry added without its inputs, once they can all be found
+// in the chain or the pool.  Inputs already spent in the chain or paying
+// out less than the outputs leave the entry unfilled, so block templates
+// never pick it.
+void static FetchMemPoolEntryInputs(CTxDB& txdb, const uint256& hash)
+{
+    CTransaction tx;
+    CRITICAL_BLOCK(mempool.cs)
+    {
+        map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.find(hash);
+        if (mi == mempool.mapTx.end() || (*mi).second.nFee >= 0)
+            return;
+        tx = (*mi).second.tx;
+    }
+
+    map<uint256, CTxIndex> mapUnused;
+    MapPrevTx mapInputs;
+    bool fInvalid = false;
+    if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+        return;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        const CTxIndex& txindex = mapInputs[txin.prevout.hash].first;
+        if (txindex.pos != CDiskTxPos(1,1,1) && !txindex.vSpent[txin.prevout.n].IsNull())
+            return;
+    }
+    if (tx.GetValueIn(mapInputs) < tx.GetValueOut())
+        return;
+    mempool.FillInputs(hash, mapInputs);
+}
+
+bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMissingInputs, bool fLimitFree)
 {
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -481,15 +631,15 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
 
     // Do we already have it?
     uint256 hash = GetHash();
-    CRITICAL_BLOCK(cs_mapTransactions)
-        if (mapTransactions.count(hash))
-            return false;
+    if (mempool.exists(hash))
+        return false;
     if (fCheckInputs)
         if (txdb.ContainsTx(hash))
             return false;
 
     // Check for conflicts with in-memory transactions
     CTransaction* ptxOld = NULL;
+    map<COutPoint, CInPoint>& mapNextTx = mempool.mapNextTx;
     for (int i = 0; i < vin.size(); i++)
     {
         COutPoint outpoint = vin[i].prevout;
@@ -516,9 +666,9 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
         }
     }
 
+    MapPrevTx mapInputs;
     if (fCheckInputs)
     {
-        MapPrevTx mapInputs;
         map<uint256, CTxIndex> mapUnused;
         bool fInvalid = false;
         if (!FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
@@ -545,10 +695,16 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
         if (nFees < GetMinFee(1000, true, GMF_RELAY))
             return error("AcceptToMemoryPool() : not enough fees");
 
+        // While the pool is full, or recently was, it takes more than the
+        // fee rate of what was last evicted
+        int64 nRollingFee = mempool.GetRollingMinFee(nSize);
+        if (nFees < nRollingFee)
+            return error("AcceptToMemoryPool() : mempool full, fee %s below %s", FormatMoney(nFees).c_str(), FormatMoney(nRollingFee).c_str());
+
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make other's transactions take longer to confirm.
-        if (nFees < MIN_RELAY_TX_FEE)
+        if (fLimitFree && nFees < MIN_RELAY_TX_FEE)
         {
             static CCriticalSection cs;
             static double dFreeCount;
@@ -578,21 +734,48 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
         }
     }
 
+    // Without fCheckInputs (transactions coming back from disconnected
+    // blocks, wallet reaccepts) the inputs aren't checked; the entry's fee
+    // and priority data is filled in below once they can be found, so block
+    // templates can be built from the pool alone
+    CTxMemPoolEntry entry;
+    entry.tx = *this;
+    FillMemPoolEntry(entry, mapInputs);
+
     // Store transaction in memory
-    CRITICAL_BLOCK(cs_mapTransactions)
+    uint256 hashOld = 0;
+    CRITICAL_BLOCK(mempool.cs)
     {
         if (ptxOld)
         {
-            printf("AcceptToMemoryPool() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
-            ptxOld->RemoveFromMemoryPool();
+            hashOld = ptxOld->GetHash();
+            printf("AcceptToMemoryPool() : replacing tx %s with new version\n", hashOld.ToString().c_str());
+            mempool.remove(*ptxOld);
+        }
+        mempool.addUnchecked(hash, entry);
+        if (fCheckInputs)
+        {
+            mempool.TrimToSize(GetMaxMemPoolUsage());
+            if (!mempool.exists(hash))
+                return error("AcceptToMemoryPool() : mempool full");
         }
-        AddToMemoryPoolUnchecked();
+    }
+    if (!fCheckInputs)
+    {
+        // Spenders that came back before this one were waiting on it
+        set<uint256> setChildren;
+        CRITICAL_BLOCK(mempool.cs)
+            if (mempool.mapTx.count(hash))
+                setChildren = mempool.mapTx[hash].setChildren;
+        FetchMemPoolEntryInputs(txdb, hash);
+        BOOST_FOREACH(const uint256& hashChild, setChildren)
+            FetchMemPoolEntryInputs(txdb, hashChild);
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
     // If updated, erase old tx from wallet
-    if (ptxOld)
-        EraseFromWallets(ptxOld->GetHash());
+    if (hashOld != 0)
+        EraseFromWallets(hashOld);
 
     printf("AcceptToMemoryPool(): accepted %s\n", hash.ToString().substr(0,10).c_str());
     return true;
@@ -604,44 +787,509 @@ bool CTransaction::AcceptToMemoryPool(bool fCheckInputs, bool* pfMissingInputs)
     return AcceptToMemoryPool(txdb, fCheckInputs, pfMissingInputs);
 }
 
-uint64 nPooledTx = 0;
+// Rough memory footprint of a pool entry: the transaction itself, its
+// outpoint map records and the index and map nodes that hold it
+unsigned int static GetMemPoolEntryUsage(const CTxMemPoolEntry& entry)
+{
+    const CTransaction& tx = entry.tx;
+    unsigned int nUsage = sizeof(CTxMemPoolEntry) + 4 * 64;
+    nUsage += tx.vin.size() * (sizeof(CTxIn) + sizeof(pair<int64, int>) + 64 + sizeof(COutPoint) + sizeof(CInPoint));
+    nUsage += tx.vout.size() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += txin.scriptSig.size();
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += txout.scriptPubKey.size();
+    return nUsage;
+}
 
-bool CTransaction::AddToMemoryPoolUnchecked()
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entryIn)
 {
-    printf("AcceptToMemoryPoolUnchecked(): size %lu\n",  mapTransactions.size());
     // Add to memory pool without checking anything.  Don't call this directly,
     // call AcceptToMemoryPool to properly check the transaction first.
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(cs)
     {
-        uint256 hash = GetHash();
-        mapTransactions[hash] = *this;
-        for (int i = 0; i < vin.size(); i++)
-            mapNextTx[vin[i].prevout] = CInPoint(&mapTransactions[hash], i);
+        CTxMemPoolEntry& entry = mapTx[hash];
+        entry = entryIn;
+        const CTransaction& tx = entry.tx;
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        {
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&entry.tx, i);
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(tx.vin[i].prevout.hash);
+            if (mi != mapTx.end())
+            {
+                entry.setParents.insert((*mi).first);
+                (*mi).second.setChildren.insert(hash);
+                if (i < entry.vInputs.size())
+                    entry.vInputs[i].second = -1;
+            }
+        }
+
+        // A transaction coming back from a disconnected block may already
+        // have spenders in the pool
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it == mapNextTx.end())
+                continue;
+            uint256 hashChild = (*it).second.ptx->GetHash();
+            map<uint256, CTxMemPoolEntry>::iterator mic = mapTx.find(hashChild);
+            if (mic == mapTx.end())
+                continue;
+            CTxMemPoolEntry& child = (*mic).second;
+            child.setParents.insert(hash);
+            entry.setChildren.insert(hashChild);
+            if ((*it).second.n < child.vInputs.size())
+                child.vInputs[(*it).second.n].second = -1;
+            UpdatePriority(child, hashChild);
+        }
+
+        entry.dPriorityKey = entry.GetPriority(nPriorityHeight);
+        setByPriority.insert(make_pair(entry.dPriorityKey, hash));
+        setByFeeRate.insert(make_pair(entry.GetFeeRate(), hash));
+        entry.nUsage = GetMemPoolEntryUsage(entry);
+        nPoolUsage += entry.nUsage;
+        if (fTrackChanges)
+            vTxAdded.push_back(hash);
         nTransactionsUpdated++;
-        ++nPooledTx;
+        printf("CTxMemPool::addUnchecked(): size %lu\n", mapTx.size());
     }
     return true;
 }
 
 
-bool CTransaction::RemoveFromMemoryPool()
+bool CTxMemPool::remove(const CTransaction& tx, bool fRecursive)
 {
     // Remove transaction from memory pool
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(cs)
     {
-        uint256 hash = GetHash();
-        if (mapTransactions.count(hash))
+        uint256 hash = tx.GetHash();
+        if (fRecursive)
+        {
+            for (unsigned int i = 0; i < tx.vout.size(); i++)
+            {
+                map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+                if (it != mapNextTx.end())
+                    remove(*(*it).second.ptx, true);
+            }
+        }
+        map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hash);
+        if (mi != mapTx.end())
         {
-            BOOST_FOREACH(const CTxIn& txin, vin)
+            CTxMemPoolEntry& entry = (*mi).second;
+            BOOST_FOREACH(const CTxIn& txin, entry.tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTransactions.erase(hash);
+            BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+            {
+                map<uint256, CTxMemPoolEntry>::iterator mip = mapTx.find(hashParent);
+                if (mip != mapTx.end())
+                    (*mip).second.setChildren.erase(hash);
+            }
+            BOOST_FOREACH(const uint256& hashChild, entry.setChildren)
+            {
+                map<uint256, CTxMemPoolEntry>::iterator mic = mapTx.find(hashChild);
+                if (mic != mapTx.end())
+                    (*mic).second.setParents.erase(hash);
+            }
+            setByFeeRate.erase(make_pair(entry.GetFeeRate(), hash));
+            setByPriority.erase(make_pair(entry.dPriorityKey, hash));
+            nPoolUsage -= entry.nUsage;
+            mapTx.erase(mi);
+            if (fTrackChanges)
+                vTxRemoved.push_back(hash);
             nTransactionsUpdated++;
-            --nPooledTx;
         }
     }
     return true;
 }
 
+void CTxMemPool::removeConflicts(const CTransaction& tx)
+{
+    // Remove transactions which spend the same inputs as tx, and everything
+    // that depends on them
+    CRITICAL_BLOCK(cs)
+    {
+        uint256 hash = tx.GetHash();
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
+            if (it == mapNextTx.end())
+                continue;
+            const CTransaction& txConflict = *(*it).second.ptx;
+            if (txConflict.GetHash() != hash)
+                remove(txConflict, true);
+        }
+    }
+}
+
+void CTxMemPool::removeConfirmed(const CTransaction& tx, int nHeight)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        // Spenders of its outputs now have a confirmed input
+        uint256 hash = tx.GetHash();
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it == mapNextTx.end())
+                continue;
+            const CInPoint& inpoint = (*it).second;
+            uint256 hashChild = inpoint.ptx->GetHash();
+            map<uint256, CTxMemPoolEntry>::iterator mic = mapTx.find(hashChild);
+            if (mic == mapTx.end())
+                continue;
+            CTxMemPoolEntry& child = (*mic).second;
+            if (inpoint.n < child.vInputs.size())
+            {
+                child.vInputs[inpoint.n] = make_pair(tx.vout[i].nValue, nHeight);
+                UpdatePriority(child, hashChild);
+            }
+        }
+
+        remove(tx);
+        removeConflicts(tx);
+    }
+}
+
+void CTxMemPool::UpdatePriority(CTxMemPoolEntry& entry, const uint256& hash)
+{
+    setByPriority.erase(make_pair(entry.dPriorityKey, hash));
+    entry.dPriorityKey = entry.GetPriority(nPriorityHeight);
+    setByPriority.insert(make_pair(entry.dPriorityKey, hash));
+}
+
+void CTxMemPool::FillInputs(const uint256& hash, const MapPrevTx& mapInputs)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hash);
+        if (mi == mapTx.end() || (*mi).second.nFee >= 0)
+            return;
+        CTxMemPoolEntry& entry = (*mi).second;
+        setByFeeRate.erase(make_pair(entry.GetFeeRate(), hash));
+        int64 nTime = entry.nTime;
+        FillMemPoolEntry(entry, mapInputs);
+        entry.nTime = nTime;
+        for (unsigned int i = 0; i < entry.vInputs.size(); i++)
+            if (mapTx.count(entry.tx.vin[i].prevout.hash))
+                entry.vInputs[i].second = -1;
+        setByFeeRate.insert(make_pair(entry.GetFeeRate(), hash));
+        UpdatePriority(entry, hash);
+    }
+}
+
+void CTxMemPool::UpdatePriorities(int nHeight)
+{
+    // Priorities grow with every block, re-file them all once per height
+    CRITICAL_BLOCK(cs)
+    {
+        if (nHeight == nPriorityHeight)
+            return;
+        nPriorityHeight = nHeight;
+        setByPriority.clear();
+        for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        {
+            CTxMemPoolEntry& entry = (*mi).second;
+            entry.dPriorityKey = entry.GetPriority(nHeight);
+            setByPriority.insert(make_pair(entry.dPriorityKey, (*mi).first));
+        }
+    }
+}
+
+int CTxMemPool::TrimToSize(uint64 nMaxUsage)
+{
+    // Evict the lowest fee rate transactions, along with everything that
+    // spends them, until the pool fits.  New transactions then have to pay
+    // more than what was evicted.
+    //
+    // Entries added without their inputs (transactions put back from a
+    // disconnected block, wallet reaccepts) have no fee yet and sort as
+    // zero, so they are skipped rather than ranked; they only go along with
+    // an evicted parent.
+    int nEvicted = 0;
+    CRITICAL_BLOCK(cs)
+    {
+        nMaxPoolUsage = nMaxUsage;
+        double dEvictedFeeRate = -1;
+        set<pair<double, uint256> >::iterator it = setByFeeRate.begin();
+        while (nPoolUsage > nMaxUsage && it != setByFeeRate.end())
+        {
+            const pair<double, uint256> lowest = *it;
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(lowest.second);
+            if (mi == mapTx.end())
+            {
+                setByFeeRate.erase(it++);
+                continue;
+            }
+            if ((*mi).second.nFee < 0)
+            {
+                ++it;
+                continue;
+            }
+            dEvictedFeeRate = max(dEvictedFeeRate, lowest.first);
+            unsigned long nSizeBefore = mapTx.size();
+            remove((*mi).second.tx, true);
+            nEvicted += nSizeBefore - mapTx.size();
+            it = setByFeeRate.upper_bound(lowest);
+        }
+        if (dEvictedFeeRate >= 0)
+        {
+            GetRollingMinFee(0);
+            dRollingMinFeeRate = max(dRollingMinFeeRate, dEvictedFeeRate + MIN_RELAY_TX_FEE);
+            printf("CTxMemPool::TrimToSize() : evicted %d tx, min fee now %s/kB\n", nEvicted, FormatMoney((int64)dRollingMinFeeRate).c_str());
+        }
+    }
+    return nEvicted;
+}
+
+int64 CTxMemPool::GetRollingMinFee(unsigned int nBytes)
+{
+    int64 nFee = 0;
+    CRITICAL_BLOCK(cs)
+    {
+        // Decay faster once the pool has room again
+        int64 nNow = GetTime();
+        if (dRollingMinFeeRate > 0 && nNow > nLastRollingFeeUpdate)
+        {
+            double dHalfLife = ROLLING_FEE_HALFLIFE;
+            if (nPoolUsage < nMaxPoolUsage / 4)
+                dHalfLife /= 4;
+            else if (nPoolUsage < nMaxPoolUsage / 2)
+                dHalfLife /= 2;
+            dRollingMinFeeRate /= pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalfLife);
+            if (dRollingMinFeeRate < MIN_RELAY_TX_FEE / 2)
+                dRollingMinFeeRate = 0;
+        }
+        nLastRollingFeeUpdate = nNow;
+        nFee = (int64)(dRollingMinFeeRate * nBytes / 1000);
+    }
+    return nFee;
+}
+
+void CTxMemPool::clear()
+{
+    CRITICAL_BLOCK(cs)
+    {
+        if (fTrackChanges)
+            for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+                vTxRemoved.push_back((*mi).first);
+        mapTx.clear();
+        mapNextTx.clear();
+        setByFeeRate.clear();
+        setByPriority.clear();
+        nPoolUsage = 0;
+        ++nTransactionsUpdated;
+    }
+}
+
+void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
+{
+    vtxid.clear();
+
+    CRITICAL_BLOCK(cs)
+    {
+        vtxid.reserve(mapTx.size());
+        for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+            vtxid.push_back((*mi).first);
+    }
+}
+
+
+
+
+//
+// mempool.dat holds the memory pool across restarts: the transactions,
+// parents before children, with the time each entered the pool
+//
+
+static const int MEMPOOL_DUMP_VERSION = 1;
+static const int64 MEMPOOL_EXPIRY = 14 * 24 * 60 * 60;
+static const unsigned int MEMPOOL_LOAD_BATCH = 100;
+
+// Appends the transaction after whatever it spends from the pool.  Chains
+// of unconfirmed transactions can be long, so the walk keeps its own stack:
+// an entry goes back on with its entry filled in once its parents are
+// pushed above it, and is appended when it comes up again.
+void static AppendMempoolTx(const uint256& hash, set<uint256>& setDone, vector<pair<CTransaction, int64> >& vtx)
+{
+    vector<pair<uint256, const CTxMemPoolEntry*> > vStack;
+    vStack.push_back(make_pair(hash, (const CTxMemPoolEntry*)NULL));
+    while (!vStack.empty())
+    {
+        const CTxMemPoolEntry* pentry = vStack.back().second;
+        if (pentry)
+        {
+            vtx.push_back(make_pair(pentry->tx, pentry->nTime));
+            vStack.pop_back();
+            continue;
+        }
+        uint256 hashTx = vStack.back().first;
+        vStack.pop_back();
+        if (!setDone.insert(hashTx).second)
+            continue;
+        map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.find(hashTx);
+        if (mi == mempool.mapTx.end())
+            continue;
+        vStack.push_back(make_pair(hashTx, &(*mi).second));
+        BOOST_FOREACH(const uint256& hashParent, (*mi).second.setParents)
+            if (!setDone.count(hashParent))
+                vStack.push_back(make_pair(hashParent, (const CTxMemPoolEntry*)NULL));
+    }
+}
+
+// Set once LoadMempool has gone through the whole dump, until then the
+// pool only holds part of it and must not be written over the file
+static bool fMempoolLoaded = false;
+
+// The periodic dumper and Shutdown can both get here, and share the file
+static CCriticalSection cs_mempoolDump;
+
+bool DumpMempool()
+{
+    if (!fMempoolLoaded)
+        return false;
+    int64 nStart = GetTimeMillis();
+    vector<pair<CTransaction, int64> > vtx;
+    CRITICAL_BLOCK(mempool.cs)
+    {
+        set<uint256> setDone;
+        vtx.reserve(mempool.mapTx.size());
+        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            AppendMempoolTx((*mi).first, setDone, vtx);
+    }
+
+    // Write to a temporary file and move it into place, so a crash midway
+    // leaves the previous dump intact
+    string strFile = GetDataDir() + "/mempool.dat";
+    string strTmp = strFile + ".new";
+    CRITICAL_BLOCK(cs_mempoolDump)
+    {
+        try
+        {
+            CAutoFile fileout = CAutoFile(fopen(strTmp.c_str(), "wb"), SER_DISK);
+            if (!fileout)
+                return error("DumpMempool() : open failed");
+            fileout << MEMPOOL_DUMP_VERSION << vtx;
+            fflush(fileout);
+        }
+        catch (std::exception& e)
+        {
+            return error("DumpMempool() : %s", e.what());
+        }
+        boost::filesystem::remove(strFile);
+        boost::filesystem::rename(strTmp, strFile);
+    }
+    printf("Dumped %"PRIszu" mempool transactions %"PRI64d"ms\n", vtx.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+// Checks the signatures of every nStep'th loaded transaction whose inputs
+// are all in the chain, which leaves them in the signature cache
+void static PreverifyMempoolTx(vector<pair<CTransaction, int64> >* pvtx, unsigned int nBegin, unsigned int nStep)
+{
+    try
+    {
+        CTxDB txdb("r");
+        for (unsigned int i = nBegin; i < pvtx->size() && !fShutdown; i += nStep)
+        {
+            CTransaction& tx = (*pvtx)[i].first;
+            bool fInChain = true;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                if (!txdb.ContainsTx(txin.prevout.hash))
+                    fInChain = false;
+            if (!fInChain)
+                continue;
+
+            MapPrevTx mapInputs;
+            map<uint256, CTxIndex> mapUnused;
+            bool fInvalid = false;
+            if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+                continue;
+            for (unsigned int n = 0; n < tx.vin.size(); n++)
+                if (!VerifySignature(mapInputs[tx.vin[n].prevout.hash].second, tx, n, true, 0))
+                    break;
+        }
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "PreverifyMempoolTx()");
+    }
+}
+
+bool LoadMempool()
+{
+    int64 nStart = GetTimeMillis();
+    string strFile = GetDataDir() + "/mempool.dat";
+    vector<pair<CTransaction, int64> > vtx;
+    try
+    {
+        CAutoFile filein = CAutoFile(fopen(strFile.c_str(), "rb"), SER_DISK);
+        if (!filein)
+        {
+            fMempoolLoaded = true;
+            return true;
+        }
+        int nVersion;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+        {
+            fMempoolLoaded = true;
+            return error("LoadMempool() : unknown version %d", nVersion);
+        }
+        filein >> vtx;
+    }
+    catch (std::exception& e)
+    {
+        fMempoolLoaded = true;
+        return error("LoadMempool() : %s", e.what());
+    }
+
+    // Signature checks are what takes time, do them in parallel first
+    int nThreads = boost::thread::hardware_concurrency();
+    if (nThreads < 1)
+        nThreads = 1;
+    if (nThreads > 8)
+        nThreads = 8;
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&PreverifyMempoolTx, &vtx, i, nThreads));
+    threads.join_all();
+
+    // Then re-accept them against the current best chain, in order so
+    // parents are back before their children.  cs_main is taken a batch
+    // at a time so blocks arriving meanwhile aren't held up for the whole
+    // file.
+    int nAccepted = 0;
+    int64 nNow = GetTime();
+    unsigned int i = 0;
+    while (i < vtx.size() && !fShutdown)
+    {
+        CRITICAL_BLOCK(cs_main)
+        {
+            CTxDB txdb("r");
+            unsigned int nEnd = min(i + MEMPOOL_LOAD_BATCH, (unsigned int)vtx.size());
+            for (; i < nEnd && !fShutdown; i++)
+            {
+                CTransaction& tx = vtx[i].first;
+                if (vtx[i].second < nNow - MEMPOOL_EXPIRY)
+                    continue;
+                if (!tx.AcceptToMemoryPool(txdb, true, NULL, false))
+                    continue;
+                CRITICAL_BLOCK(mempool.cs)
+                {
+                    map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.find(tx.GetHash());
+                    if (mi != mempool.mapTx.end())
+                        (*mi).second.nTime = vtx[i].second;
+                }
+                nAccepted++;
+            }
+        }
+    }
+    printf("Loaded %d of %"PRIszu" mempool transactions %"PRI64d"ms\n", nAccepted, vtx.size(), GetTimeMillis() - nStart);
+    if (fShutdown)
+        return false;
+    fMempoolLoaded = true;
+    return true;
+}
+
 
 
 
@@ -705,16 +1353,19 @@ bool CMerkleTx::AcceptToMemoryPool()
 
 bool CWalletTx::AcceptWalletTransaction(CTxDB& txdb, bool fCheckInputs)
 {
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(mempool.cs)
     {
         // Add previous supporting transactions first
-        BOOST_FOREACH(CMerkleTx& tx, vtxPrev)
+        BOOST_FOREACH(const boost::shared_ptr<const CMerkleTx>& ptx, vtxPrev)
         {
-            if (!tx.IsCoinBase())
+            if (!ptx->IsCoinBase())
             {
-                uint256 hash = tx.GetHash();
-                if (!mapTransactions.count(hash) && !txdb.ContainsTx(hash))
+                uint256 hash = ptx->GetHash();
+                if (!mempool.exists(hash) && !txdb.ContainsTx(hash))
+                {
+                    CMerkleTx tx(*ptx);
                     tx.AcceptToMemoryPool(txdb, fCheckInputs);
+                }
             }
         }
         return AcceptToMemoryPool(txdb, fCheckInputs);
@@ -772,12 +1423,178 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
     return true;
 }
 
-uint256 static GetOrphanRoot(const CBlock* pblock)
+//
+// The orphan block pool is bounded by -maxorphanblocks megabytes.  When it is
+// full the least recently used orphans are dropped, or, if -orphanblockdisk
+// allows, written out to orphanblocks.dat and read back when their parent
+// shows up.  A single peer may fill at most a quarter of the pool, except
+// with blocks on the headers-first chain that we asked for ourselves.
+//
+
+uint64 static GetMaxOrphanBlockBytes()
 {
-    // Work back to the first block in the orphan chain
-    while (mapOrphanBlocks.count(pblock->hashPrevBlock))
-        pblock = mapOrphanBlocks[pblock->hashPrevBlock];
-    return pblock->GetHash();
+    return (uint64)GetArg("-maxorphanblocks", 32) * 1000000;
+}
+
+uint64 static GetMaxOrphanBlockDiskBytes()
+{
+    return (uint64)GetArg("-orphanblockdisk", 0) * 1000000;
+}
+
+bool static SpillOrphanBlock(COrphanBlock& orphan)
+{
+    if (nOrphanBlockDiskBytes + orphan.nSize > GetMaxOrphanBlockDiskBytes())
+        return false;
+    if (fileOrphanBlocks == NULL)
+    {
+        fileOrphanBlocks = fopen((GetDataDir() + "/orphanblocks.dat").c_str(), "w+b");
+        if (fileOrphanBlocks == NULL)
+            return error("SpillOrphanBlock() : open failed");
+    }
+
+    CDataStream ssBlock(SER_DISK);
+    ssBlock.reserve(orphan.nSize);
+    ssBlock << *orphan.pblock;
+    if (fseek(fileOrphanBlocks, 0, SEEK_END) != 0)
+        return error("SpillOrphanBlock() : fseek failed");
+    long nPos = ftell(fileOrphanBlocks);
+    if (nPos < 0 || fwrite(&ssBlock[0], 1, ssBlock.size(), fileOrphanBlocks) != ssBlock.size())
+        return error("SpillOrphanBlock() : write failed");
+
+    orphan.nDiskPos = nPos;
+    nOrphanBlockBytes -= orphan.nSize;
+    nOrphanBlockDiskBytes += orphan.nSize;
+    nOrphanBlocksSpilled++;
+    delete orphan.pblock;
+    orphan.pblock = NULL;
+    return true;
+}
+
+static CBlock* ReadSpilledOrphanBlock(const COrphanBlock& orphan)
+{
+    CBlock* pblock = new CBlock();
+    try
+    {
+        vector<char> vch(orphan.nSize);
+        if (fseek(fileOrphanBlocks, orphan.nDiskPos, SEEK_SET) != 0 ||
+            fread(&vch[0], 1, vch.size(), fileOrphanBlocks) != vch.size())
+            throw runtime_error("read failed");
+        CDataStream ssBlock(vch, SER_DISK);
+        ssBlock >> *pblock;
+    }
+    catch (std::exception &e) {
+        error("ReadSpilledOrphanBlock() : %s", e.what());
+        delete pblock;
+        return NULL;
+    }
+    return pblock;
+}
+
+// Removes an orphan from the pool.  With fTake its block is handed to the
+// caller (read back from disk if need be), otherwise it is freed.
+static CBlock* EraseOrphanBlock(map<uint256, COrphanBlock>::iterator mi, bool fTake=false)
+{
+    COrphanBlock& orphan = (*mi).second;
+    for (multimap<uint256, uint256>::iterator it = mapOrphanBlocksByPrev.lower_bound(orphan.hashPrev);
+         it != mapOrphanBlocksByPrev.upper_bound(orphan.hashPrev); ++it)
+    {
+        if ((*it).second == (*mi).first)
+        {
+            mapOrphanBlocksByPrev.erase(it);
+            break;
+        }
+    }
+    lruOrphanBlocks.erase(orphan.itLRU);
+    if (orphan.pfrom)
+        orphan.pfrom->nOrphanBlockBytes -= orphan.nSize;
+
+    CBlock* pblock = orphan.pblock;
+    if (pblock)
+        nOrphanBlockBytes -= orphan.nSize;
+    else
+    {
+        if (fTake)
+            pblock = ReadSpilledOrphanBlock(orphan);
+        if (--nOrphanBlocksSpilled == 0)
+        {
+            // Nothing left on disk, start the file over next time
+            fclose(fileOrphanBlocks);
+            fileOrphanBlocks = NULL;
+            nOrphanBlockDiskBytes = 0;
+        }
+    }
+    mapOrphanBlocks.erase(mi);
+
+    if (!fTake)
+    {
+        delete pblock;
+        return NULL;
+    }
+    return pblock;
+}
+
+void static AddOrphanBlock(CNode* pfrom, const CBlock& block, const uint256& hash)
+{
+    unsigned int nSize = ::GetSerializeSize(block, SER_NETWORK);
+    uint64 nMaxBytes = GetMaxOrphanBlockBytes();
+
+    // Make room within this peer's share by dropping its oldest orphans
+    if (pfrom && !mapHeaderIndex.count(hash))
+    {
+        list<uint256>::iterator it = lruOrphanBlocks.begin();
+        while (pfrom->nOrphanBlockBytes + nSize > nMaxBytes / 4 && it != lruOrphanBlocks.end())
+        {
+            map<uint256, COrphanBlock>::iterator mi = mapOrphanBlocks.find(*it++);
+            if ((*mi).second.pfrom == pfrom)
+                EraseOrphanBlock(mi);
+        }
+        if (pfrom->nOrphanBlockBytes + nSize > nMaxBytes / 4)
+        {
+            printf("AddOrphanBlock() : peer %s over its orphan limit, ignoring %s\n", pfrom->addr.ToString().c_str(), hash.ToString().substr(0,20).c_str());
+            return;
+        }
+    }
+
+    COrphanBlock orphan;
+    orphan.pblock = new CBlock(block);
+    orphan.hashPrev = block.hashPrevBlock;
+    orphan.nSize = nSize;
+    orphan.nDiskPos = -1;
+    orphan.pfrom = pfrom;
+    orphan.itLRU = lruOrphanBlocks.insert(lruOrphanBlocks.end(), hash);
+    mapOrphanBlocks.insert(make_pair(hash, orphan));
+    mapOrphanBlocksByPrev.insert(make_pair(block.hashPrevBlock, hash));
+    nOrphanBlockBytes += nSize;
+    if (pfrom)
+        pfrom->nOrphanBlockBytes += nSize;
+
+    // Spill or evict the least recently used orphans until we are under the limit
+    list<uint256>::iterator it = lruOrphanBlocks.begin();
+    while (nOrphanBlockBytes > nMaxBytes && it != lruOrphanBlocks.end())
+    {
+        map<uint256, COrphanBlock>::iterator mi = mapOrphanBlocks.find(*it++);
+        COrphanBlock& orphanOld = (*mi).second;
+        if (orphanOld.pblock == NULL)
+            continue;
+        if (!SpillOrphanBlock(orphanOld))
+            EraseOrphanBlock(mi);
+    }
+}
+
+void static TouchOrphanBlock(const uint256& hash)
+{
+    map<uint256, COrphanBlock>::iterator mi = mapOrphanBlocks.find(hash);
+    if (mi != mapOrphanBlocks.end())
+        lruOrphanBlocks.splice(lruOrphanBlocks.end(), lruOrphanBlocks, (*mi).second.itLRU);
+}
+
+uint256 static GetOrphanRoot(uint256 hash)
+{
+    // Work back to the first block in the orphan chain
+    map<uint256, COrphanBlock>::iterator mi;
+    while ((mi = mapOrphanBlocks.find(hash)) != mapOrphanBlocks.end() && mapOrphanBlocks.count((*mi).second.hashPrev))
+        hash = (*mi).second.hashPrev;
+    return hash;
 }
 
 int64 static GetBlockValue(int nHeight, int64 nFees)
@@ -1033,12 +1850,8 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         if (!fFound || txindex.pos == CDiskTxPos(1,1,1))
         {
             // Get prev tx from single transactions in memory
-            CRITICAL_BLOCK(cs_mapTransactions)
-            {
-                if (!mapTransactions.count(prevout.hash))
-                    return error("FetchInputs() : %s mapTransactions prev not found %s", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
-                txPrev = mapTransactions[prevout.hash];
-            }
+            if (!mempool.lookup(prevout.hash, txPrev))
+                return error("FetchInputs() : %s mempool prev not found %s", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
             if (!fFound)
                 txindex.vSpent.resize(txPrev.vout.size());
         }
@@ -1199,16 +2012,17 @@ bool CTransaction::ClientConnectInputs()
         return false;
 
     // Take over previous transactions' spent pointers
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(mempool.cs)
     {
         int64 nValueIn = 0;
         for (int i = 0; i < vin.size(); i++)
         {
             // Get prev tx from single transactions in memory
             COutPoint prevout = vin[i].prevout;
-            if (!mapTransactions.count(prevout.hash))
+            map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.find(prevout.hash);
+            if (mi == mempool.mapTx.end())
                 return false;
-            CTransaction& txPrev = mapTransactions[prevout.hash];
+            CTransaction& txPrev = (*mi).second.tx;
 
             if (prevout.n >= txPrev.vout.size())
                 return false;
@@ -1392,7 +2206,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     reverse(vConnect.begin(), vConnect.end());
 
     // Disconnect shorter branch
-    vector<CTransaction> vResurrect;
+    vector<vector<CTransaction> > vResurrect;
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
     {
         CBlock block;
@@ -1402,13 +2216,11 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
             return error("Reorganize() : DisconnectBlock failed");
 
         // Queue memory transactions to resurrect
-        BOOST_FOREACH(const CTransaction& tx, block.vtx)
-            if (!tx.IsCoinBase())
-                vResurrect.push_back(tx);
+        vResurrect.push_back(block.vtx);
     }
 
     // Connect longer branch
-    vector<CTransaction> vDelete;
+    vector<pair<CTransaction, int> > vDelete;
     for (int i = 0; i < vConnect.size(); i++)
     {
         CBlockIndex* pindex = vConnect[i];
@@ -1424,7 +2236,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 
         // Queue memory transactions to delete
         BOOST_FOREACH(const CTransaction& tx, block.vtx)
-            vDelete.push_back(tx);
+            vDelete.push_back(make_pair(tx, pindex->nHeight));
     }
     if (!txdb.WriteHashBestChain(pindexNew->GetBlockHash()))
         return error("Reorganize() : WriteHashBestChain failed");
@@ -1443,13 +2255,21 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
 
-    // Resurrect memory transactions that were in the disconnected branch
-    BOOST_FOREACH(CTransaction& tx, vResurrect)
-        tx.AcceptToMemoryPool(txdb, false);
+    // Resurrect memory transactions that were in the disconnected branch,
+    // oldest block first so parents are back before their spenders.  Once
+    // they all are, anything spending one that couldn't come back has lost
+    // its input.
+    vector<CTransaction> vLost;
+    for (vector<vector<CTransaction> >::reverse_iterator rit = vResurrect.rbegin(); rit != vResurrect.rend(); ++rit)
+        BOOST_FOREACH(CTransaction& tx, *rit)
+            if (tx.IsCoinBase() || !tx.AcceptToMemoryPool(txdb, false))
+                vLost.push_back(tx);
+    BOOST_FOREACH(CTransaction& tx, vLost)
+        mempool.remove(tx, true);
 
     // Delete redundant memory transactions that are in the connected branch
-    BOOST_FOREACH(CTransaction& tx, vDelete)
-        tx.RemoveFromMemoryPool();
+    for (int i = 0; i < vDelete.size(); i++)
+        mempool.removeConfirmed(vDelete[i].first, vDelete[i].second);
 
     printf("REORGANIZE: Disconnected %i blocks; %s..%s\n", vDisconnect.size(), pfork->GetBlockHash().ToString().substr(0,20).c_str(), pindexBest->GetBlockHash().ToString().substr(0,20).c_str());
     printf("REORGANIZE: Connected %i blocks; %s..%s\n", vConnect.size(), pfork->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->GetBlockHash().ToString().substr(0,20).c_str());
@@ -1486,7 +2306,7 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
-        tx.RemoveFromMemoryPool();
+        mempool.removeConfirmed(tx, pindexNew->nHeight);
 
     return true;
 }
@@ -1593,6 +2413,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : new CBlockIndex failed");
     map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
+    mapBlockIndexByPos[make_pair(nFile, nBlockPos)] = pindexNew;
     map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
@@ -1768,13 +2589,12 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     if (!mapBlockIndex.count(pblock->hashPrevBlock))
     {
         printf("ProcessBlock: ORPHAN BLOCK, prev=%s\n", pblock->hashPrevBlock.ToString().substr(0,20).c_str());
-        CBlock* pblock2 = new CBlock(*pblock);
-        mapOrphanBlocks.insert(make_pair(hash, pblock2));
-        mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
+        AddOrphanBlock(pfrom, *pblock, hash);
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+        // Ask this guy to fill in what we're missing, unless the block is
+        // part of the header chain and its parents are already on their way
+        if (pfrom && !mapHeaderIndex.count(hash))
+            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(hash));
         return true;
     }
 
@@ -1788,17 +2608,22 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     for (int i = 0; i < vWorkQueue.size(); i++)
     {
         uint256 hashPrev = vWorkQueue[i];
-        for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
+        vector<uint256> vChildren;
+        for (multimap<uint256, uint256>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
              mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
              ++mi)
+            vChildren.push_back((*mi).second);
+
+        BOOST_FOREACH(const uint256& hashOrphan, vChildren)
         {
-            CBlock* pblockOrphan = (*mi).second;
-            if (pblockOrphan->AcceptBlock())
-                vWorkQueue.push_back(pblockOrphan->GetHash());
-            mapOrphanBlocks.erase(pblockOrphan->GetHash());
+            map<uint256, COrphanBlock>::iterator mi = mapOrphanBlocks.find(hashOrphan);
+            if (mi == mapOrphanBlocks.end())
+                continue;
+            CBlock* pblockOrphan = EraseOrphanBlock(mi, true);
+            if (pblockOrphan && pblockOrphan->AcceptBlock())
+                vWorkQueue.push_back(hashOrphan);
             delete pblockOrphan;
         }
-        mapOrphanBlocksByPrev.erase(hashPrev);
     }
 
     printf("ProcessBlock: ACCEPTED\n");
@@ -1871,6 +2696,376 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
     }
 }
 
+//
+// Each block in a block file is preceded by pchMessageStart and a size word.
+// If BLOCK_COMPRESSED_FLAG is set in the size word, the payload is the
+// uncompressed size of the block followed by a zlib stream, otherwise it is
+// the serialized block.  nBlockPos always points at the payload, so blocks
+// of either kind can be read at random from the index.
+//
+
+FILE* OpenBlockFrame(unsigned int nFile, unsigned int nBlockPos, unsigned int& nFrameSizeRet, const char* pszMode)
+{
+    nFrameSizeRet = 0;
+    if (nBlockPos < sizeof(nFrameSizeRet))
+        return NULL;
+    CAutoFile file = OpenBlockFile(nFile, nBlockPos - sizeof(nFrameSizeRet), pszMode);
+    if (!file)
+        return NULL;
+    if (fread(&nFrameSizeRet, sizeof(nFrameSizeRet), 1, file) != 1)
+        return NULL;
+    return file.release();
+}
+
+bool CompressBlock(const CBlock& block, vector<unsigned char>& vchRet)
+{
+    CDataStream ssBlock(SER_DISK);
+    ssBlock << block;
+    unsigned int nRawSize = ssBlock.size();
+
+    uLongf nCompressedSize = compressBound(nRawSize);
+    vchRet.resize(sizeof(nRawSize) + nCompressedSize);
+    memcpy(&vchRet[0], &nRawSize, sizeof(nRawSize));
+    if (compress2(&vchRet[sizeof(nRawSize)], &nCompressedSize, (const Bytef*)&ssBlock[0], nRawSize, Z_BEST_COMPRESSION) != Z_OK)
+        return error("CompressBlock() : compress2 failed");
+    vchRet.resize(sizeof(nRawSize) + nCompressedSize);
+    return true;
+}
+
+bool DecompressBlock(const unsigned char* pbegin, const unsigned char* pend, CDataStream& ssBlockRet)
+{
+    unsigned int nRawSize;
+    if (pend - pbegin < (int)sizeof(nRawSize))
+        return error("DecompressBlock() : truncated payload");
+    memcpy(&nRawSize, pbegin, sizeof(nRawSize));
+    if (nRawSize > MAX_SIZE)
+        return error("DecompressBlock() : uncompressed size %u too large", nRawSize);
+
+    ssBlockRet.clear();
+    ssBlockRet.resize(nRawSize);
+    uLongf nDecompressedSize = nRawSize;
+    if (uncompress((Bytef*)&ssBlockRet[0], &nDecompressedSize, pbegin + sizeof(nRawSize), pend - pbegin - sizeof(nRawSize)) != Z_OK ||
+        nDecompressedSize != nRawSize)
+        return error("DecompressBlock() : uncompress failed");
+    return true;
+}
+
+// Transactions are read from disk one at a time when connecting blocks, so
+// keep the most recently used decompressed blocks around, already
+// deserialized, instead of inflating and parsing the whole block again for
+// every input.  Entries are shared and never modified; readers copy out the
+// block, or just the transaction at the offset they were given.
+class CDecompressedBlock
+{
+public:
+    CBlock block;
+    vector<unsigned int> vTxOffset; // from the start of the block, as in CDiskTxPos
+};
+
+static const unsigned int MAX_DECOMPRESSED_BLOCK_CACHE = 16;
+static CCriticalSection cs_mapDecompressedBlocks;
+static list<pair<unsigned int, unsigned int> > lDecompressedBlocksUsed; // most recent first
+static map<pair<unsigned int, unsigned int>, pair<boost::shared_ptr<const CDecompressedBlock>, list<pair<unsigned int, unsigned int> >::iterator> > mapDecompressedBlocks;
+
+static bool GetDecompressedBlock(FILE* file, unsigned int nFrameSize, unsigned int nFile, unsigned int nBlockPos, boost::shared_ptr<const CDecompressedBlock>& pblockRet)
+{
+    pair<unsigned int, unsigned int> key(nFile, nBlockPos);
+    CRITICAL_BLOCK(cs_mapDecompressedBlocks)
+    {
+        map<pair<unsigned int, unsigned int>, pair<boost::shared_ptr<const CDecompressedBlock>, list<pair<unsigned int, unsigned int> >::iterator> >::iterator mi = mapDecompressedBlocks.find(key);
+        if (mi != mapDecompressedBlocks.end())
+        {
+            lDecompressedBlocksUsed.splice(lDecompressedBlocksUsed.begin(), lDecompressedBlocksUsed, (*mi).second.second);
+            pblockRet = (*mi).second.first;
+            return true;
+        }
+    }
+
+    unsigned int nPayloadSize = nFrameSize & ~BLOCK_COMPRESSED_FLAG;
+    if (nPayloadSize > MAX_SIZE)
+        return error("GetDecompressedBlock() : payload size %u too large", nPayloadSize);
+    vector<unsigned char> vchPayload(nPayloadSize);
+    if (nPayloadSize == 0 || fread(&vchPayload[0], 1, nPayloadSize, file) != nPayloadSize)
+        return error("GetDecompressedBlock() : fread failed");
+    CDataStream ssBlock(SER_DISK);
+    if (!DecompressBlock(&vchPayload[0], &vchPayload[0] + nPayloadSize, ssBlock))
+        return false;
+    if (ssBlock.empty())
+        return error("GetDecompressedBlock() : empty block");
+
+    boost::shared_ptr<CDecompressedBlock> pblock(new CDecompressedBlock());
+    try {
+        ssBlock >> pblock->block;
+    }
+    catch (std::exception& e) {
+        return error("GetDecompressedBlock() : deserialize failed");
+    }
+    const vector<CTransaction>& vtx = pblock->block.vtx;
+    unsigned int nTxOffset = ::GetSerializeSize(CBlock(), SER_DISK) - 1 + GetSizeOfCompactSize(vtx.size());
+    pblock->vTxOffset.reserve(vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        pblock->vTxOffset.push_back(nTxOffset);
+        nTxOffset += ::GetSerializeSize(tx, SER_DISK);
+    }
+    pblockRet = pblock;
+
+    CRITICAL_BLOCK(cs_mapDecompressedBlocks)
+    {
+        if (!mapDecompressedBlocks.count(key))
+        {
+            lDecompressedBlocksUsed.push_front(key);
+            mapDecompressedBlocks[key] = make_pair(pblockRet, lDecompressedBlocksUsed.begin());
+        }
+        while (lDecompressedBlocksUsed.size() > MAX_DECOMPRESSED_BLOCK_CACHE)
+        {
+            mapDecompressedBlocks.erase(lDecompressedBlocksUsed.back());
+            lDecompressedBlocksUsed.pop_back();
+        }
+    }
+    return true;
+}
+
+bool ReadCompressedBlock(FILE* file, unsigned int nFrameSize, unsigned int nFile, unsigned int nBlockPos, CBlock& blockRet)
+{
+    boost::shared_ptr<const CDecompressedBlock> pblock;
+    if (!GetDecompressedBlock(file, nFrameSize, nFile, nBlockPos, pblock))
+        return false;
+    blockRet = pblock->block;
+    return true;
+}
+
+bool ReadCompressedTx(FILE* file, unsigned int nFrameSize, unsigned int nFile, unsigned int nBlockPos, unsigned int nTxOffset, CTransaction& txRet)
+{
+    boost::shared_ptr<const CDecompressedBlock> pblock;
+    if (!GetDecompressedBlock(file, nFrameSize, nFile, nBlockPos, pblock))
+        return false;
+    const vector<unsigned int>& vTxOffset = pblock->vTxOffset;
+    vector<unsigned int>::const_iterator it = lower_bound(vTxOffset.begin(), vTxOffset.end(), nTxOffset);
+    if (it == vTxOffset.end() || *it != nTxOffset)
+        return error("ReadCompressedTx() : no transaction at offset %u", nTxOffset);
+    txRet = pblock->block.vtx[it - vTxOffset.begin()];
+    return true;
+}
+
+void ForgetDecompressedBlock(unsigned int nFile, unsigned int nBlockPos)
+{
+    CRITICAL_BLOCK(cs_mapDecompressedBlocks)
+    {
+        map<pair<unsigned int, unsigned int>, pair<boost::shared_ptr<const CDecompressedBlock>, list<pair<unsigned int, unsigned int> >::iterator> >::iterator mi = mapDecompressedBlocks.find(make_pair(nFile, nBlockPos));
+        if (mi != mapDecompressedBlocks.end())
+        {
+            lDecompressedBlocksUsed.erase((*mi).second.second);
+            mapDecompressedBlocks.erase(mi);
+        }
+    }
+}
+
+// Inflates just the first nHeaderSize bytes of a compressed block, for
+// callers that only want the header
+bool ReadCompressedBlockHeader(FILE* file, unsigned int nFrameSize, unsigned int nFile, unsigned int nBlockPos, unsigned int nHeaderSize, CDataStream& ssHeaderRet)
+{
+    ssHeaderRet.clear();
+    CRITICAL_BLOCK(cs_mapDecompressedBlocks)
+    {
+        map<pair<unsigned int, unsigned int>, pair<boost::shared_ptr<const CDecompressedBlock>, list<pair<unsigned int, unsigned int> >::iterator> >::iterator mi = mapDecompressedBlocks.find(make_pair(nFile, nBlockPos));
+        if (mi != mapDecompressedBlocks.end())
+        {
+            // The stream's type has SER_BLOCKHEADERONLY set
+            ssHeaderRet << (*mi).second.first->block;
+            return true;
+        }
+    }
+
+    unsigned int nPayloadSize = nFrameSize & ~BLOCK_COMPRESSED_FLAG;
+    unsigned int nRawSize;
+    if (nPayloadSize < sizeof(nRawSize) || fread(&nRawSize, sizeof(nRawSize), 1, file) != 1)
+        return error("ReadCompressedBlockHeader() : fread failed");
+    if (nRawSize < nHeaderSize)
+        return error("ReadCompressedBlockHeader() : block shorter than its header");
+    ssHeaderRet.resize(nHeaderSize);
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK)
+        return error("ReadCompressedBlockHeader() : inflateInit failed");
+    zs.next_out = (Bytef*)&ssHeaderRet[0];
+    zs.avail_out = nHeaderSize;
+    unsigned int nLeft = nPayloadSize - sizeof(nRawSize);
+    unsigned char pchBuf[1024];
+    int ret = Z_OK;
+    while (zs.avail_out > 0 && ret == Z_OK && nLeft > 0)
+    {
+        unsigned int nRead = min(nLeft, (unsigned int)sizeof(pchBuf));
+        if (fread(pchBuf, 1, nRead, file) != nRead)
+            break;
+        nLeft -= nRead;
+        zs.next_in = pchBuf;
+        zs.avail_in = nRead;
+        ret = inflate(&zs, Z_NO_FLUSH);
+    }
+    bool fComplete = (zs.avail_out == 0);
+    inflateEnd(&zs);
+    if (!fComplete)
+        return error("ReadCompressedBlockHeader() : inflate failed");
+    return true;
+}
+
+static bool CommitBlockFile(unsigned int nFile)
+{
+    FILE* file = OpenBlockFile(nFile, 0, "ab");
+    if (!file)
+        return false;
+    fflush(file);
+#ifdef WIN32
+    _commit(_fileno(file));
+#else
+    fsync(fileno(file));
+#endif
+    fclose(file);
+    return true;
+}
+
+// Point the block index, and the transaction index entries that refer to
+// the block at its old position, at the copy of the block at nFile/nBlockPos
+static bool RelocateBlock(CTxDB& txdb, CBlockIndex* pindex, const CBlock& block, unsigned int nFile, unsigned int nBlockPos)
+{
+    unsigned int nOldFile = pindex->nFile;
+    unsigned int nOldBlockPos = pindex->nBlockPos;
+
+    if (!txdb.TxnBegin())
+        return error("RelocateBlock() : TxnBegin failed");
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        uint256 hashTx = tx.GetHash();
+        CTxIndex txindex;
+        if (txdb.ReadTxIndex(hashTx, txindex) && txindex.pos.nFile == nOldFile && txindex.pos.nBlockPos == nOldBlockPos)
+        {
+            txindex.pos = CDiskTxPos(nFile, nBlockPos, nBlockPos + (txindex.pos.nTxPos - nOldBlockPos));
+            if (!txdb.UpdateTxIndex(hashTx, txindex))
+            {
+                txdb.TxnAbort();
+                return error("RelocateBlock() : UpdateTxIndex failed");
+            }
+        }
+
+        if (tx.IsCoinBase())
+            continue;
+
+        // The transactions this one spends record where it is in vSpent
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            CTxIndex txindexPrev;
+            if (!txdb.ReadTxIndex(txin.prevout.hash, txindexPrev) || txin.prevout.n >= txindexPrev.vSpent.size())
+                continue;
+            CDiskTxPos& posSpent = txindexPrev.vSpent[txin.prevout.n];
+            if (posSpent.nFile != nOldFile || posSpent.nBlockPos != nOldBlockPos)
+                continue;
+            posSpent = CDiskTxPos(nFile, nBlockPos, nBlockPos + (posSpent.nTxPos - nOldBlockPos));
+            if (!txdb.UpdateTxIndex(txin.prevout.hash, txindexPrev))
+            {
+                txdb.TxnAbort();
+                return error("RelocateBlock() : UpdateTxIndex failed");
+            }
+        }
+    }
+
+    pindex->nFile = nFile;
+    pindex->nBlockPos = nBlockPos;
+    if (!txdb.WriteBlockIndex(CDiskBlockIndex(pindex)))
+    {
+        pindex->nFile = nOldFile;
+        pindex->nBlockPos = nOldBlockPos;
+        txdb.TxnAbort();
+        return error("RelocateBlock() : WriteBlockIndex failed");
+    }
+    if (!txdb.TxnCommit())
+        return error("RelocateBlock() : TxnCommit failed");
+    mapBlockIndexByPos.erase(make_pair(nOldFile, nOldBlockPos));
+    mapBlockIndexByPos[make_pair(nFile, nBlockPos)] = pindex;
+    return true;
+}
+
+// Rewrite every indexed block into new block files in the format selected
+// by fCompressBlocks.  The copies are appended after the existing files,
+// and the old files are only removed once every block has been moved, so
+// an interrupted conversion can simply be run again.
+bool ConvertBlockFiles()
+{
+    vector<pair<pair<unsigned int, unsigned int>, CBlockIndex*> > vSortedByPos;
+    vSortedByPos.reserve(mapBlockIndex.size());
+    unsigned int nLastOldFile = 0;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    {
+        CBlockIndex* pindex = item.second;
+        vSortedByPos.push_back(make_pair(make_pair(pindex->nFile, pindex->nBlockPos), pindex));
+        nLastOldFile = max(nLastOldFile, pindex->nFile);
+    }
+    sort(vSortedByPos.begin(), vSortedByPos.end());
+    if (vSortedByPos.empty())
+        return true;
+
+    // An interrupted conversion leaves copies past the last file the index
+    // refers to.  Nothing points into them, so start over from scratch.
+    for (unsigned int nFile = nLastOldFile + 1; ; nFile++)
+    {
+        string strFile = strprintf("%s/blk%04d.dat", GetDataDir().c_str(), nFile);
+        if (!filesystem::exists(strFile))
+            break;
+        printf("ConvertBlockFiles() : removing partial output %s\n", strFile.c_str());
+        if (remove(strFile.c_str()) != 0)
+            return error("ConvertBlockFiles() : failed to remove %s", strFile.c_str());
+    }
+
+    printf("ConvertBlockFiles() : converting %"PRIszu" blocks in %u files to %s format\n", vSortedByPos.size(), nLastOldFile, fCompressBlocks ? "compressed" : "uncompressed");
+    nCurrentBlockFile = nLastOldFile + 1;
+
+    CTxDB txdb;
+    vector<CBlock> vBatch;
+    vector<pair<unsigned int, unsigned int> > vBatchPos;
+    for (unsigned int i = 0; i < vSortedByPos.size(); i++)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(vSortedByPos[i].second))
+            return error("ConvertBlockFiles() : ReadFromDisk failed at height %d", vSortedByPos[i].second->nHeight);
+        unsigned int nFile, nBlockPos;
+        if (!block.WriteToDisk(nFile, nBlockPos, false))
+            return error("ConvertBlockFiles() : WriteToDisk failed");
+        vBatch.push_back(block);
+        vBatchPos.push_back(make_pair(nFile, nBlockPos));
+
+        // Commit the new copies to disk before the index refers to them
+        if (vBatch.size() < 500 && i + 1 < vSortedByPos.size())
+            continue;
+        for (unsigned int nFileCommit = vBatchPos.front().first; nFileCommit <= vBatchPos.back().first; nFileCommit++)
+            if (!CommitBlockFile(nFileCommit))
+                return error("ConvertBlockFiles() : CommitBlockFile failed");
+        for (unsigned int j = 0; j < vBatch.size(); j++)
+            if (!RelocateBlock(txdb, vSortedByPos[i + 1 - vBatch.size() + j].second, vBatch[j], vBatchPos[j].first, vBatchPos[j].second))
+                return false;
+        vBatch.clear();
+        vBatchPos.clear();
+        printf("ConvertBlockFiles() : %u/%"PRIszu" blocks\n", i + 1, vSortedByPos.size());
+    }
+    txdb.Close();
+    dbenv.txn_checkpoint(0, 0, 0);
+
+    CRITICAL_BLOCK(cs_mapDecompressedBlocks)
+    {
+        mapDecompressedBlocks.clear();
+        lDecompressedBlocksUsed.clear();
+    }
+    // The conversion is done either way, a leftover file only wastes space
+    for (unsigned int nFile = 1; nFile <= nLastOldFile; nFile++)
+    {
+        string strFile = strprintf("%s/blk%04d.dat", GetDataDir().c_str(), nFile);
+        if (remove(strFile.c_str()) != 0 && filesystem::exists(strFile))
+            printf("ConvertBlockFiles() : failed to remove %s\n", strFile.c_str());
+    }
+    return true;
+}
+
 bool LoadBlockIndex(bool fAllowNew)
 {
     if (fTestNet)
@@ -1891,6 +3086,8 @@ bool LoadBlockIndex(bool fAllowNew)
     if (!txdb.LoadBlockIndex())
         return false;
     txdb.Close();
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        mapBlockIndexByPos[make_pair(item.second->nFile, item.second->nBlockPos)] = item.second;
 
     //
     // Init with genesis block
@@ -2174,61 +3371,441 @@ bool CAlert::ProcessAlert()
 
 //////////////////////////////////////////////////////////////////////////////
 //
-// Messages
+// Headers-first sync
+//
+// While we are far behind, headers are fetched from one peer at a time with
+// getheaders and checked (proof of work, difficulty, timestamp and
+// checkpoints) into a header tree that is kept apart from mapBlockIndex.
+// Block bodies along the best header chain are then requested from all peers
+// at once, up to HEADERS_DOWNLOAD_WINDOW blocks past the last one we have.
+// Blocks that arrive ahead of their parent wait in mapOrphanBlocks, which the
+// window keeps small.
 //
 
+static const int HEADERS_DOWNLOAD_WINDOW = 1024;
+static const int MAX_BLOCKS_IN_FLIGHT = 16;
+static const int64 HEADERS_SYNC_TIMEOUT = 2 * 60;
+static const int HEADERS_SYNC_VERSION = 31800;
 
-bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
+bool static IsHeadersSyncWanted()
 {
-    switch (inv.type)
-    {
-    case MSG_TX:    return mapTransactions.count(inv.hash) || mapOrphanTransactions.count(inv.hash) || txdb.ContainsTx(inv.hash);
-    case MSG_BLOCK: return mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash);
-    }
-    // Don't know what it is, just say we already got one
-    return true;
+    if (!fHeadersFirst)
+        return false;
+    return (pindexBest == NULL || nBestHeight < Checkpoints::GetTotalBlocksEstimate() ||
+            pindexBest->GetBlockTime() < GetTime() - 24 * 60 * 60);
 }
 
+bool static IsHeadersSyncActive()
+{
+    return (pnodeHeadersSync != NULL || !vHeaderChain.empty());
+}
 
+static CBlockIndex* GetBestHeader()
+{
+    return (vHeaderChain.empty() ? pindexBest : vHeaderChain.back());
+}
 
+void static SetBestHeaderChain(CBlockIndex* pindexNew)
+{
+    vHeaderChain.resize(pindexNew->nHeight + 1, NULL);
+    CBlockIndex* pindex = pindexNew;
+    for (; pindex && vHeaderChain[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vHeaderChain[pindex->nHeight] = pindex;
+
+    // Blocks past the fork have to be checked again
+    int nFork = (pindex ? pindex->nHeight : -1);
+    nHeaderChainHave = min(nHeaderChainHave, nFork);
+}
 
-// The message start string is designed to be unlikely to occur in normal data.
-// The characters are rarely used upper ascii, not valid as UTF-8, and produce
-// a large 4-byte int at any alignment.
-unsigned char pchMessageStart[4] = { 0xfb, 0xc0, 0xb6, 0xdb }; // Litecoin: increase each by adding 2 to bitcoin's value.
-
+void static ClearHeaderChain()
+{
+    BOOST_FOREACH(PAIRTYPE(const uint256, CBlockIndex*)& item, mapHeaderIndex)
+        delete item.second;
+    mapHeaderIndex.clear();
+    vHeaderChain.clear();
+    nHeaderChainHave = -1;
+}
 
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+bool static AcceptBlockHeader(CBlock& header, CBlockIndex*& pindexRet)
 {
-    static map<CService, vector<unsigned char> > mapReuseKey;
-    RandAddSeedPerfmon();
-    if (fDebug) {
-        printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
-        printf("received: %s (%d bytes)\n", strCommand.c_str(), vRecv.size());
+    // Check for duplicate
+    uint256 hash = header.GetHash();
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+    {
+        pindexRet = (*mi).second;
+        return true;
     }
-    if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
+    mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
     {
-        printf("dropmessagestest DROPPING RECV MESSAGE\n");
+        pindexRet = (*mi).second;
         return true;
     }
 
+    // Get prev header, which may be a block we already have
+    CBlockIndex* pindexPrev = NULL;
+    mi = mapHeaderIndex.find(header.hashPrevBlock);
+    if (mi != mapHeaderIndex.end())
+        pindexPrev = (*mi).second;
+    else if ((mi = mapBlockIndex.find(header.hashPrevBlock)) != mapBlockIndex.end())
+        pindexPrev = (*mi).second;
+    else
+        return header.DoS(10, error("AcceptBlockHeader() : prev header not found"));
+    int nHeight = pindexPrev->nHeight+1;
 
+    // Same checks as CheckBlock and AcceptBlock, minus the transactions
+    if (!CheckProofOfWork(header.GetPoWHash(), header.nBits))
+        return header.DoS(50, error("AcceptBlockHeader() : proof of work failed"));
+    if (header.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return error("AcceptBlockHeader() : block timestamp too far in the future");
+    if (header.nBits != GetNextWorkRequired(pindexPrev, &header))
+        return header.DoS(100, error("AcceptBlockHeader() : incorrect proof of work"));
+    if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return error("AcceptBlockHeader() : block's timestamp is too early");
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+        return header.DoS(100, error("AcceptBlockHeader() : rejected by checkpoint lockin at %d", nHeight));
 
+    CBlockIndex* pindexNew = new CBlockIndex(0, 0, header);
+    mi = mapHeaderIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    pindexNew->pprev = pindexPrev;
+    pindexNew->nHeight = nHeight;
+    pindexNew->bnChainWork = pindexPrev->bnChainWork + pindexNew->GetBlockWork();
 
+    // New best header
+    if (pindexNew->bnChainWork > GetBestHeader()->bnChainWork)
+        SetBestHeaderChain(pindexNew);
 
-    if (strCommand == "version")
+    pindexRet = pindexNew;
+    return true;
+}
+
+void static SendHeadersSyncRequest(CNode* pto)
+{
+    if (pto->fClient || pto->nVersion < HEADERS_SYNC_VERSION)
+        return;
+
+    // Fetch headers from one peer at a time, moving on if it stalls
+    int64 nNow = GetTime();
+    if (pnodeHeadersSync == NULL || pnodeHeadersSync->fDisconnect ||
+        (pnodeHeadersSync != pto && nNow - nHeadersSyncTime > HEADERS_SYNC_TIMEOUT))
     {
-        // Each connection can only send one version message
-        if (pfrom->nVersion != 0)
+        CBlockIndex* pindexBestHeader = GetBestHeader();
+        if (IsHeadersSyncWanted() && pindexBestHeader && pto->nStartingHeight > pindexBestHeader->nHeight)
         {
-            pfrom->Misbehaving(1);
-            return false;
+            printf("requesting headers from %s after height %d\n", pto->addr.ToString().c_str(), pindexBestHeader->nHeight);
+            pnodeHeadersSync = pto;
+            nHeadersSyncTime = nNow;
+            pto->PushMessage("getheaders", CBlockLocator(pindexBestHeader), uint256(0));
         }
+        else if (pnodeHeadersSync != NULL && pnodeHeadersSync->fDisconnect)
+            pnodeHeadersSync = NULL;
+    }
+}
 
-        int64 nTime;
-        CAddress addrMe;
-        CAddress addrFrom;
-        uint64 nNonce = 1;
+
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Block download
+//
+// Every getdata for a block goes through here so that we know which peer each
+// block is in flight from.  Candidates are the blocks in the headers-first
+// window, which any peer that claims to be far enough along can serve, and
+// the blocks a peer has announced to us with inv.  Each peer's response time
+// is tracked; slow peers get fewer requests at a time, and a request that
+// takes well over its peer's usual time is given up and handed to the next
+// peer that can serve it.  The block holding up the window is re-requested
+// from a faster peer as soon as it is clearly late.
+//
+
+static const unsigned int MAX_BLOCKS_TO_DOWNLOAD = 50000;
+static const int64 BLOCK_STALL_TIMEOUT_MIN = 10 * 1000;
+static const int64 BLOCK_STALL_TIMEOUT_MAX = 2 * 60 * 1000;
+static int64 nAvgBlockLatency = 0;
+
+// Milliseconds we wait on a block from this peer before asking someone else
+int64 static GetBlockStallTimeout(const CNode* pnode)
+{
+    if (pnode->nBlockLatency == 0)
+        return BLOCK_STALL_TIMEOUT_MAX / 2;
+    return max(BLOCK_STALL_TIMEOUT_MIN, min(BLOCK_STALL_TIMEOUT_MAX, 4 * pnode->nBlockLatency));
+}
+
+// Peers much slower than average only get a couple of blocks at a time
+int static GetMaxBlocksInFlight(const CNode* pnode)
+{
+    if (pnode->nBlockLatency == 0 || nAvgBlockLatency == 0 || pnode->nBlockLatency <= 2 * nAvgBlockLatency)
+        return MAX_BLOCKS_IN_FLIGHT;
+    return 2;
+}
+
+void static AddBlockToDownload(CNode* pfrom, const uint256& hash)
+{
+    if (pfrom->vBlocksToDownload.size() < MAX_BLOCKS_TO_DOWNLOAD)
+        pfrom->vBlocksToDownload.push_back(hash);
+}
+
+void static MarkBlockReceived(CNode* pfrom, const uint256& hash)
+{
+    // Announced blocks stay queued until the peer delivers them, so a stalled
+    // request gets retried; once delivered there's no point asking again
+    deque<uint256>::iterator it = std::find(pfrom->vBlocksToDownload.begin(), pfrom->vBlocksToDownload.end(), hash);
+    if (it != pfrom->vBlocksToDownload.end())
+        pfrom->vBlocksToDownload.erase(it);
+
+    map<uint256, pair<CNode*, int64> >::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi == mapBlocksInFlight.end())
+        return;
+    CNode* pnode = (*mi).second.first;
+    if (pnode == pfrom)
+    {
+        int64 nLatency = max((int64)1, GetTimeMillis() - (*mi).second.second);
+        pnode->nBlockLatency = (pnode->nBlockLatency == 0 ? nLatency : (3 * pnode->nBlockLatency + nLatency) / 4);
+        nAvgBlockLatency = (nAvgBlockLatency == 0 ? nLatency : (7 * nAvgBlockLatency + nLatency) / 8);
+    }
+    pnode->nBlocksInFlight--;
+    mapBlocksInFlight.erase(mi);
+}
+
+bool static RequestBlock(CNode* pto, const uint256& hash, vector<CInv>& vGetData)
+{
+    if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+        return false;
+
+    map<uint256, pair<CNode*, int64> >::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi != mapBlocksInFlight.end())
+        return false;
+
+    vGetData.push_back(CInv(MSG_BLOCK, hash));
+    mapBlocksInFlight[hash] = make_pair(pto, GetTimeMillis());
+    pto->nBlocksInFlight++;
+    return true;
+}
+
+void static SendBlockRequests(CNode* pto)
+{
+    int64 nNow = GetTimeMillis();
+
+    // Give up on requests that stalled or whose peer has gone away
+    for (map<uint256, pair<CNode*, int64> >::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end();)
+    {
+        CNode* pnode = (*mi).second.first;
+        int64 nTimeout = GetBlockStallTimeout(pnode);
+        if (pnode->fDisconnect || nNow - (*mi).second.second > nTimeout)
+        {
+            if (!pnode->fDisconnect)
+            {
+                printf("block download stalled: %s from %s\n", (*mi).first.ToString().substr(0,20).c_str(), pnode->addr.ToString().c_str());
+                pnode->nBlockLatency = max(pnode->nBlockLatency, nTimeout);
+            }
+            pnode->nBlocksInFlight--;
+            mapBlocksInFlight.erase(mi++);
+        }
+        else
+            mi++;
+    }
+
+    if (pto->fClient || pto->fDisconnect)
+        return;
+    int nMaxInFlight = GetMaxBlocksInFlight(pto);
+    vector<CInv> vGetData;
+
+    // Blocks in the headers-first window
+    if (!vHeaderChain.empty())
+    {
+        while (nHeaderChainHave + 1 < vHeaderChain.size() && mapBlockIndex.count(vHeaderChain[nHeaderChainHave + 1]->GetBlockHash()))
+            nHeaderChainHave++;
+        if (nHeaderChainHave + 1 >= vHeaderChain.size())
+        {
+            // Every block on the header chain is in, go back to normal relay
+            if (pnodeHeadersSync == NULL)
+            {
+                printf("headers-first sync done at height %d\n", nHeaderChainHave);
+                ClearHeaderChain();
+            }
+        }
+        else if (nHeaderChainHave + 1 <= pto->nStartingHeight)
+        {
+            // If the block holding up the window is late from a slower peer,
+            // ask this one for it too
+            uint256 hashNext = vHeaderChain[nHeaderChainHave + 1]->GetBlockHash();
+            map<uint256, pair<CNode*, int64> >::iterator mi = mapBlocksInFlight.find(hashNext);
+            if (mi != mapBlocksInFlight.end() && (*mi).second.first != pto && pto->nBlockLatency != 0 &&
+                pto->nBlocksInFlight < nMaxInFlight && !mapOrphanBlocks.count(hashNext))
+            {
+                CNode* pnodeSlow = (*mi).second.first;
+                if (pnodeSlow->nBlockLatency > 2 * pto->nBlockLatency && nNow - (*mi).second.second > 2 * pto->nBlockLatency)
+                {
+                    printf("re-requesting block %s from faster peer %s\n", hashNext.ToString().substr(0,20).c_str(), pto->addr.ToString().c_str());
+                    pnodeSlow->nBlocksInFlight--;
+                    mapBlocksInFlight.erase(mi);
+                    RequestBlock(pto, hashNext, vGetData);
+                }
+            }
+
+            int nWindowEnd = min((int)vHeaderChain.size() - 1, nHeaderChainHave + HEADERS_DOWNLOAD_WINDOW);
+            for (int nHeight = nHeaderChainHave + 1; nHeight <= nWindowEnd && pto->nBlocksInFlight < nMaxInFlight; nHeight++)
+            {
+                if (nHeight > pto->nStartingHeight)
+                    break;
+                RequestBlock(pto, vHeaderChain[nHeight]->GetBlockHash(), vGetData);
+            }
+        }
+    }
+
+    // Blocks this peer has announced.  They stay queued while in flight, from
+    // this peer or another, so they are asked for again if that request stalls.
+    for (deque<uint256>::iterator it = pto->vBlocksToDownload.begin(); it != pto->vBlocksToDownload.end() && pto->nBlocksInFlight < nMaxInFlight;)
+    {
+        if (mapBlockIndex.count(*it) || mapOrphanBlocks.count(*it))
+        {
+            it = pto->vBlocksToDownload.erase(it);
+            continue;
+        }
+        if (RequestBlock(pto, *it, vGetData))
+            printf("sending getdata: %s\n", CInv(MSG_BLOCK, *it).ToString().c_str());
+        it++;
+    }
+
+    if (!vGetData.empty())
+        pto->PushMessage("getdata", vGetData);
+}
+
+void FinalizeNode(CNode* pnode)
+{
+    for (map<uint256, pair<CNode*, int64> >::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end();)
+    {
+        if ((*mi).second.first == pnode)
+            mapBlocksInFlight.erase(mi++);
+        else
+            mi++;
+    }
+    if (pnodeHeadersSync == pnode)
+        pnodeHeadersSync = NULL;
+    BOOST_FOREACH(PAIRTYPE(const uint256, COrphanBlock)& item, mapOrphanBlocks)
+        if (item.second.pfrom == pnode)
+            item.second.pfrom = NULL;
+    ForgetOrphanTxPeer(pnode);
+}
+
+
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Messages
+//
+
+// Salts for the deterministic choice of addr relay peers and of which tx invs
+// skip the trickle.  Set once by InitMessageSalts before the message handler
+// threads start, since several of them read these at once.
+static uint256 hashAddrRelaySalt;
+static uint256 hashInvTrickleSalt;
+
+void InitMessageSalts()
+{
+    RAND_bytes((unsigned char*)&hashAddrRelaySalt, sizeof(hashAddrRelaySalt));
+    RAND_bytes((unsigned char*)&hashInvTrickleSalt, sizeof(hashInvTrickleSalt));
+}
+
+
+bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
+{
+    switch (inv.type)
+    {
+    case MSG_TX:    return mempool.exists(inv.hash) || mapOrphanTransactions.count(inv.hash) || txdb.ContainsTx(inv.hash);
+    case MSG_BLOCK: return mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash);
+    }
+    // Don't know what it is, just say we already got one
+    return true;
+}
+
+
+
+
+// The message start string is designed to be unlikely to occur in normal data.
+// The characters are rarely used upper ascii, not valid as UTF-8, and produce
+// a large 4-byte int at any alignment.
+unsigned char pchMessageStart[4] = { 0xfb, 0xc0, 0xb6, 0xdb }; // Litecoin: increase each by adding 2 to bitcoin's value.
+
+
+// A new block is usually requested by most of our peers within a few
+// seconds, so keep the last few block messages we served and share them
+// instead of reading and serializing the block again for each peer.
+static const unsigned int MAX_BLOCK_MESSAGE_CACHE = 8;
+static CCriticalSection cs_mapBlockMessages;
+static map<uint256, CMessageBuffer> mapBlockMessages;
+static deque<uint256> vBlockMessagesOrder;
+
+CMessageBuffer static GetBlockMessage(CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    CRITICAL_BLOCK(cs_mapBlockMessages)
+    {
+        map<uint256, CMessageBuffer>::iterator mi = mapBlockMessages.find(hash);
+        if (mi != mapBlockMessages.end())
+            return (*mi).second;
+    }
+
+    CBlock block;
+    if (!block.ReadFromDisk(pindex))
+        return CMessageBuffer();
+    CDataStream ssBlock(SER_NETWORK);
+    ssBlock.reserve(block.GetSerializeSize(SER_NETWORK));
+    ssBlock << block;
+    CMessageBuffer msg = BuildMessage("block", ssBlock);
+
+    CRITICAL_BLOCK(cs_mapBlockMessages)
+    {
+        if (mapBlockMessages.insert(make_pair(hash, msg)).second)
+            vBlockMessagesOrder.push_back(hash);
+        while (vBlockMessagesOrder.size() > MAX_BLOCK_MESSAGE_CACHE)
+        {
+            mapBlockMessages.erase(vBlockMessagesOrder.front());
+            vBlockMessagesOrder.pop_front();
+        }
+    }
+    return msg;
+}
+
+bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+{
+    static map<CService, vector<unsigned char> > mapReuseKey;
+    RandAddSeedPerfmon();
+    if (fDebug) {
+        printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
+        printf("received: %s (%d bytes)\n", strCommand.c_str(), vRecv.size());
+    }
+    if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
+    {
+        printf("dropmessagestest DROPPING RECV MESSAGE\n");
+        return true;
+    }
+
+
+
+
+
+    if (strCommand == "version")
+    {
+        // Each connection can only send one version message
+        if (pfrom->nVersion != 0)
+        {
+            pfrom->Misbehaving(1);
+            return false;
+        }
+
+        int64 nTime;
+        CAddress addrMe;
+        CAddress addrFrom;
+        uint64 nNonce = 1;
         vRecv >> pfrom->nVersion >> pfrom->nServices >> nTime >> addrMe;
         if (pfrom->nVersion < 209)
         {
@@ -2295,8 +3872,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
 
         // Ask the first connected node for block updates
+        // (while headers-first sync is wanted SendMessages takes care of it)
         static int nAskedForBlocks = 0;
-        if (!pfrom->fClient &&
+        if (!pfrom->fClient && !(pfrom->nVersion >= HEADERS_SYNC_VERSION && IsHeadersSyncWanted()) &&
             (pfrom->nVersion < 32000 || pfrom->nVersion >= 32400) &&
              (nAskedForBlocks < 1 || vNodes.size() <= 1))
         {
@@ -2327,7 +3905,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        // The socket thread reads nRecvVersion as it frames new messages
+        CRITICAL_BLOCK(pfrom->cs_vRecv)
+            pfrom->nRecvVersion = min(pfrom->nVersion, PROTOCOL_VERSION);
     }
 
 
@@ -2372,11 +3952,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 {
                     // Use deterministic randomness to send to the same nodes for 24 hours
                     // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        RAND_bytes((unsigned char*)&hashSalt, sizeof(hashSalt));
                     int64 hashAddr = addr.GetHash();
-                    uint256 hashRand = hashSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
+                    uint256 hashRand = hashAddrRelaySalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     multimap<uint256, CNode*> mapMix;
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -2424,13 +4001,25 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (fDebug)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
+            // Blocks come in along the header chain while that is being synced
+            if (inv.type == MSG_BLOCK && IsHeadersSyncActive())
+            {
+                Inventory(inv.hash);
+                continue;
+            }
+
             // Always request the last block in an inv bundle (even if we already have it), as it is the
             // trigger for the other side to send further invs. If we are stuck on a (very long) side chain,
             // this is necessary to connect earlier received orphan blocks to the chain again.
-            if (!fAlreadyHave || (inv.type == MSG_BLOCK && nInv==vInv.size()-1))
+            if (inv.type == MSG_BLOCK && !fAlreadyHave)
+                AddBlockToDownload(pfrom, inv.hash);
+            else if (!fAlreadyHave || (inv.type == MSG_BLOCK && nInv==vInv.size()-1))
                 pfrom->AskFor(inv);
             if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash))
-                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
+            {
+                TouchOrphanBlock(inv.hash);
+                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(inv.hash));
+            }
 
             // Track requests for our stuff
             Inventory(inv.hash);
@@ -2460,9 +4049,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    // Blocks more than a few deep are only wanted by peers that
+                    // are catching up, so they yield to fresh relay traffic
+                    CBlockIndex* pindex = (*mi).second;
+                    int nPriority = (pindex->nHeight + 6 > nBestHeight ? SEND_PRIORITY_BLOCK : SEND_PRIORITY_HISTORIC);
+                    CMessageBuffer msg = GetBlockMessage(pindex);
+                    if (msg)
+                        pfrom->PushMessageBuffer(msg, nPriority);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -2472,7 +4065,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                         // wait for other stuff first.
                         vector<CInv> vInv;
                         vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
-                        pfrom->PushMessage("inv", vInv);
+                        CDataStream ssInv(SER_NETWORK);
+                        ssInv << vInv;
+                        pfrom->PushMessageBuffer(BuildMessage("inv", ssInv), nPriority);
                         pfrom->hashContinue = 0;
                     }
                 }
@@ -2482,9 +4077,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 // Send stream from relay memory
                 CRITICAL_BLOCK(cs_mapRelay)
                 {
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CMessageBuffer>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end())
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushMessageBuffer((*mi).second, inv.type == MSG_TX ? SEND_PRIORITY_TX : SEND_PRIORITY_BLOCK);
                 }
             }
 
@@ -2568,6 +4163,41 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > 2000)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %d", vHeaders.size());
+        }
+
+        // Only the peer we are syncing from gets to extend the header tree
+        if (pfrom != pnodeHeadersSync)
+            return true;
+
+        CBlockIndex* pindexLast = NULL;
+        BOOST_FOREACH(CBlock& header, vHeaders)
+        {
+            if (!AcceptBlockHeader(header, pindexLast))
+            {
+                pnodeHeadersSync = NULL;
+                if (header.nDoS) pfrom->Misbehaving(header.nDoS);
+                return error("message headers : AcceptBlockHeader FAILED");
+            }
+        }
+        printf("received %d headers, best header now at height %d\n", vHeaders.size(), GetBestHeader() ? GetBestHeader()->nHeight : -1);
+
+        // A full batch means there are more to come
+        nHeadersSyncTime = GetTime();
+        if (vHeaders.size() == 2000)
+            pfrom->PushMessage("getheaders", CBlockLocator(pindexLast), uint256(0));
+        else
+            pnodeHeadersSync = NULL;
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -2587,39 +4217,47 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             vWorkQueue.push_back(inv.hash);
 
             // Recursively process any orphan transactions that depended on this one
+            vector<uint256> vEraseQueue;
             for (int i = 0; i < vWorkQueue.size(); i++)
             {
                 uint256 hashPrev = vWorkQueue[i];
-                for (multimap<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(hashPrev);
+                vector<boost::shared_ptr<CTransaction> > vOrphans;
+                for (multimap<uint256, boost::shared_ptr<CTransaction> >::iterator mi = mapOrphanTransactionsByPrev.lower_bound(hashPrev);
                      mi != mapOrphanTransactionsByPrev.upper_bound(hashPrev);
                      ++mi)
-                {
-                    const CDataStream& vMsg = *((*mi).second);
-                    CTransaction tx;
-                    CDataStream(vMsg) >> tx;
-                    CInv inv(MSG_TX, tx.GetHash());
+                    vOrphans.push_back((*mi).second);
 
-                    if (tx.AcceptToMemoryPool(true))
+                BOOST_FOREACH(boost::shared_ptr<CTransaction>& ptxOrphan, vOrphans)
+                {
+                    CInv inv(MSG_TX, ptxOrphan->GetHash());
+                    bool fMissingInputs2 = false;
+                    if (ptxOrphan->AcceptToMemoryPool(true, &fMissingInputs2))
                     {
                         printf("   accepted orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-                        SyncWithWallets(tx, NULL, true);
-                        RelayMessage(inv, vMsg);
+                        SyncWithWallets(*ptxOrphan, NULL, true);
+                        RelayMessage(inv, *ptxOrphan);
                         mapAlreadyAskedFor.erase(inv);
                         vWorkQueue.push_back(inv.hash);
+                        vEraseQueue.push_back(inv.hash);
+                    }
+                    else if (!fMissingInputs2)
+                    {
+                        // Has its inputs but was rejected, it won't get any better
+                        vEraseQueue.push_back(inv.hash);
                     }
                 }
             }
 
-            BOOST_FOREACH(uint256 hash, vWorkQueue)
+            BOOST_FOREACH(uint256 hash, vEraseQueue)
                 EraseOrphanTx(hash);
         }
         else if (fMissingInputs)
         {
             printf("storing orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-            AddOrphanTx(vMsg);
+            AddOrphanTx(tx, pfrom);
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+            int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, MAX_ORPHAN_TX_BYTES);
             if (nEvicted > 0)
                 printf("mapOrphan overflow, removed %d tx\n", nEvicted);
         }
@@ -2637,6 +4275,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
+        MarkBlockReceived(pfrom, inv.hash);
 
         if (ProcessBlock(pfrom, &block))
             mapAlreadyAskedFor.erase(inv);
@@ -2646,7 +4285,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        CRITICAL_BLOCK(pfrom->cs_vAddrToSend)
+            pfrom->vAddrToSend.clear();
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -2716,7 +4356,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             pfrom->setKnown.insert(alert.GetHash());
             CRITICAL_BLOCK(cs_vNodes)
                 BOOST_FOREACH(CNode* pnode, vNodes)
-                    alert.RelayTo(pnode);
+                    pnode->PushAlert(alert.GetHash());
         }
     }
 
@@ -2736,14 +4376,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
-bool ProcessMessages(CNode* pfrom)
+// Messages that only touch the peer, the address manager and the adjusted
+// time are handled without cs_main so they don't queue up behind block
+// validation.  Each of those has its own lock.
+bool static MessageNeedsChainLock(const string& strCommand)
 {
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty())
-        return true;
-    //if (fDebug)
-    //    printf("ProcessMessages(%u bytes)\n", vRecv.size());
+    return !(strCommand == "verack" || strCommand == "addr" || strCommand == "getaddr" || strCommand == "ping");
+}
 
+bool ProcessMessages(CNode* pfrom)
+{
     //
     // Message format
     //  (4) message start
@@ -2752,70 +4394,55 @@ bool ProcessMessages(CNode* pfrom)
     //  (4) checksum
     //  (x) data
     //
+    // Messages are framed and checksummed by the socket thread as the bytes
+    // arrive (see CNode::ReceiveMsgBytes); complete ones queue up on vRecvMsg.
+    //
 
     loop
     {
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-        if (vRecv.end() - pstart < nHeaderSize)
-        {
-            if (vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
+        // Stop processing if the peer has been dropped
+        if (pfrom->fDisconnect)
             break;
-        }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %d BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
-
-        // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-        CMessageHeader hdr;
-        vRecv >> hdr;
-        if (!hdr.IsValid())
-        {
-            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
-            continue;
-        }
-        string strCommand = hdr.GetCommand();
 
-        // Message size
-        unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > MAX_SIZE)
-        {
-            printf("ProcessMessage(%s, %u bytes) : nMessageSize > MAX_SIZE\n", strCommand.c_str(), nMessageSize);
-            continue;
-        }
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
+        // The socket thread only ever appends to the back of the queue, so a
+        // complete message at the front can be processed without holding cs_vRecv
+        CNetMessage* pmsg = NULL;
+        CRITICAL_BLOCK(pfrom->cs_vRecv)
+            if (!pfrom->vRecvMsg.empty() && pfrom->vRecvMsg.front().IsComplete())
+                pmsg = &pfrom->vRecvMsg.front();
+        if (pmsg == NULL)
             break;
-        }
+        CNetMessage& msg = *pmsg;
+        string strCommand = msg.hdr.GetCommand();
+        unsigned int nMessageSize = msg.hdr.nMessageSize;
 
         // Checksum
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
         unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum)
+        if (!msg.CheckChecksum(nChecksum))
         {
             printf("ProcessMessage(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
-               strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
+               strCommand.c_str(), nMessageSize, nChecksum, msg.hdr.nChecksum);
+            CRITICAL_BLOCK(pfrom->cs_vRecv)
+            {
+                pfrom->nRecvSize -= CNetMessage::HEADER_SIZE + nMessageSize;
+                pfrom->vRecvMsg.pop_front();
+            }
             continue;
         }
 
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
+        CDataStream& vMsg = msg.vRecv;
+        vMsg.SetVersion(pfrom->nRecvVersion);
 
         // Process message
         bool fRet = false;
         try
         {
-            CRITICAL_BLOCK(cs_main)
+            if (MessageNeedsChainLock(strCommand))
+            {
+                CRITICAL_BLOCK(cs_main)
+                    fRet = ProcessMessage(pfrom, strCommand, vMsg);
+            }
+            else
                 fRet = ProcessMessage(pfrom, strCommand, vMsg);
             if (fShutdown)
                 return true;
@@ -2845,31 +4472,49 @@ bool ProcessMessages(CNode* pfrom)
 
         if (!fRet)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+
+        CRITICAL_BLOCK(pfrom->cs_vRecv)
+        {
+            pfrom->nRecvSize -= CNetMessage::HEADER_SIZE + nMessageSize;
+            pfrom->vRecvMsg.pop_front();
+        }
     }
 
-    vRecv.Compact();
     return true;
 }
 
 
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
-    CRITICAL_BLOCK(cs_main)
-    {
-        // Don't send anything until we get their version message
-        if (pto->nVersion == 0)
-            return true;
+    // cs_main is only taken for the parts below that look at chain state, so
+    // that peers keep being serviced while a block is being connected.
+
+    // Don't send anything until we get their version message
+    if (pto->nVersion == 0)
+        return true;
 
-        // Keep-alive ping
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty())
-            pto->PushMessage("ping");
+    // Keep-alive ping
+    if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->nSendSize == 0)
+        pto->PushMessage("ping");
 
-        // Resend wallet transactions that haven't gotten in a block yet
+    // Resend wallet transactions that haven't gotten in a block yet.
+    // If cs_main is busy this is simply retried on the next pass.
+    TRY_CRITICAL_BLOCK(cs_main)
         ResendWalletTransactions();
 
-        // Address refresh broadcast
-        static int64 nLastRebroadcast;
-        if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60))
+    // Address refresh broadcast
+    static int64 nLastRebroadcast;
+    static CCriticalSection cs_nLastRebroadcast;
+    bool fRebroadcast = false;
+    TRY_CRITICAL_BLOCK(cs_nLastRebroadcast)
+    {
+        // Retried on the next pass if cs_main is busy
+        if (GetTime() - nLastRebroadcast > 24 * 60 * 60)
+        {
+            TRY_CRITICAL_BLOCK(cs_main)
+                fRebroadcast = !IsInitialBlockDownload();
+        }
+        if (fRebroadcast)
         {
             CRITICAL_BLOCK(cs_vNodes)
             {
@@ -2877,7 +4522,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
-                        pnode->setAddrKnown.clear();
+                        CRITICAL_BLOCK(pnode->cs_vAddrToSend)
+                            pnode->setAddrKnown.clear();
 
                     // Rebroadcast our address
                     if (!fNoListen && !fUseProxy && addrLocalHost.IsRoutable())
@@ -2890,118 +4536,178 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             nLastRebroadcast = GetTime();
         }
+    }
 
-        //
-        // Message: addr
-        //
-        if (fSendTrickle)
+    //
+    // Message: alert
+    //
+    vector<uint256> vAlertHash;
+    CRITICAL_BLOCK(pto->cs_inventory)
+        vAlertHash.swap(pto->vAlertToSend);
+    if (!vAlertHash.empty())
+    {
+        vector<CAlert> vAlert;
+        CRITICAL_BLOCK(cs_mapAlerts)
+        {
+            BOOST_FOREACH(const uint256& hash, vAlertHash)
+            {
+                map<uint256, CAlert>::iterator mi = mapAlerts.find(hash);
+                if (mi != mapAlerts.end())
+                    vAlert.push_back((*mi).second);
+            }
+        }
+        BOOST_FOREACH(const CAlert& alert, vAlert)
+            alert.RelayTo(pto);
+    }
+
+    //
+    // Message: addr
+    //
+    if (fSendTrickle)
+    {
+        vector<CAddress> vAddr;
+        CRITICAL_BLOCK(pto->cs_vAddrToSend)
         {
-            vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
                 // returns true if wasn't already contained in the set
                 if (pto->setAddrKnown.insert(addr).second)
-                {
                     vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
-                }
             }
             pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
         }
+        // receiver rejects addr messages larger than 1000
+        for (unsigned int i = 0; i < vAddr.size(); i += 1000)
+            pto->PushMessage("addr", vector<CAddress>(vAddr.begin() + i, vAddr.begin() + min((unsigned int)vAddr.size(), i + 1000)));
+    }
 
 
-        //
-        // Message: inventory
-        //
-        vector<CInv> vInv;
-        vector<CInv> vInvWait;
+    //
+    // Message: inventory
+    //
+    // Which of the queued tx invs are our own is looked up before taking
+    // cs_inventory: the wallet lookup takes cs_wallet, and the wallet takes
+    // cs_inventory while holding cs_wallet when it relays its transactions.
+    vector<uint256> vCheckFromMe;
+    if (!fSendTrickle)
+    {
         CRITICAL_BLOCK(pto->cs_inventory)
         {
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (inv.type != MSG_TX || pto->setInventoryKnown.count(inv))
                     continue;
+                uint256 hashRand = inv.hash ^ hashInvTrickleSalt;
+                hashRand = Hash(BEGIN(hashRand), END(hashRand));
+                if ((hashRand & 3) == 0)
+                    vCheckFromMe.push_back(inv.hash);
+            }
+        }
+    }
+    set<uint256> setNotFromMe;
+    if (!vCheckFromMe.empty())
+    {
+        CRITICAL_BLOCK(cs_setpwalletRegistered)
+        {
+            BOOST_FOREACH(const uint256& hash, vCheckFromMe)
+            {
+                CWalletTx wtx;
+                if (!GetTransaction(hash, wtx) || !wtx.fFromMe)
+                    setNotFromMe.insert(hash);
+            }
+        }
+    }
 
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        RAND_bytes((unsigned char*)&hashSalt, sizeof(hashSalt));
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    // always trickle our own transactions
-                    if (!fTrickleWait)
-                    {
-                        CWalletTx wtx;
-                        if (GetTransaction(inv.hash, wtx))
-                            if (wtx.fFromMe)
-                                fTrickleWait = true;
-                    }
+    vector<CInv> vInv;
+    vector<CInv> vInvWait;
+    CRITICAL_BLOCK(pto->cs_inventory)
+    {
+        vInv.reserve(pto->vInventoryToSend.size());
+        vInvWait.reserve(pto->vInventoryToSend.size());
+        BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
+        {
+            if (pto->setInventoryKnown.count(inv))
+                continue;
 
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
+            // trickle out tx inv to protect privacy
+            if (inv.type == MSG_TX && !fSendTrickle)
+            {
+                // 1/4 of tx invs blast to all immediately, but always
+                // trickle our own transactions (and anything queued since
+                // the lookup above, which gets checked on the next pass)
+                if (!setNotFromMe.count(inv.hash))
+                {
+                    vInvWait.push_back(inv);
+                    continue;
                 }
+            }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+            // returns true if wasn't already contained in the set
+            if (pto->setInventoryKnown.insert(inv).second)
+            {
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
-            pto->vInventoryToSend = vInvWait;
         }
-        if (!vInv.empty())
-            pto->PushMessage("inv", vInv);
+        pto->vInventoryToSend = vInvWait;
+    }
+    if (!vInv.empty())
+        pto->PushMessage("inv", vInv);
 
 
-        //
-        // Message: getdata
-        //
-        vector<CInv> vGetData;
-        int64 nNow = GetTime() * 1000000;
-        CTxDB txdb("r");
-        while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
+    //
+    // Message: getheaders, getdata (blocks)
+    //
+    // Skipped when cs_main is busy, the next pass will catch up.
+    TRY_CRITICAL_BLOCK(cs_main)
+    {
+        if (fHeadersFirst)
+            SendHeadersSyncRequest(pto);
+        SendBlockRequests(pto);
+    }
+
+
+    //
+    // Message: getdata
+    //
+    // mapAskFor is only filled in by this node's own "inv" messages, which
+    // are never processed concurrently with this, so it can be checked
+    // before deciding whether cs_main is needed at all.  cs_vSend is held
+    // here, so cs_main is only tried; due requests stay queued for the next
+    // pass if it is busy.
+    vector<CInv> vGetData;
+    int64 nNow = GetTime() * 1000000;
+    if (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
+    {
+        TRY_CRITICAL_BLOCK(cs_main)
         {
-            const CInv& inv = (*pto->mapAskFor.begin()).second;
-            if (!AlreadyHave(txdb, inv))
+            CTxDB txdb("r");
+            while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
             {
-                printf("sending getdata: %s\n", inv.ToString().c_str());
-                vGetData.push_back(inv);
-                if (vGetData.size() >= 1000)
+                const CInv& inv = (*pto->mapAskFor.begin()).second;
+                if (!AlreadyHave(txdb, inv))
                 {
-                    pto->PushMessage("getdata", vGetData);
-                    vGetData.clear();
+                    printf("sending getdata: %s\n", inv.ToString().c_str());
+                    vGetData.push_back(inv);
+                    if (vGetData.size() >= 1000)
+                    {
+                        pto->PushMessage("getdata", vGetData);
+                        vGetData.clear();
+                    }
                 }
+                mapAlreadyAskedFor[inv] = nNow;
+                pto->mapAskFor.erase(pto->mapAskFor.begin());
             }
-            mapAlreadyAskedFor[inv] = nNow;
-            pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
-        if (!vGetData.empty())
-            pto->PushMessage("getdata", vGetData);
-
     }
+    if (!vGetData.empty())
+        pto->PushMessage("getdata", vGetData);
+
     return true;
 }
 
@@ -3092,33 +4798,15 @@ unsigned int static ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1
     }
 }
 
-// Some explaining would be appreciated
-class COrphan
-{
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = 0;
-    }
-
-    void print() const
-    {
-        printf("COrphan(hash=%s, dPriority=%.1f)\n", ptx->GetHash().ToString().substr(0,10).c_str(), dPriority);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().substr(0,10).c_str());
-    }
-};
-
-
 uint64 nLastBlockTx = 0;
 uint64 nLastBlockSize = 0;
 
 CBlock* CreateNewBlock(CReserveKey& reservekey)
+{
+    return CreateNewBlock(CScript() << reservekey.GetReservedKey() << OP_CHECKSIG);
+}
+
+CBlock* CreateNewBlock(const CScript& scriptPubKey)
 {
     CBlockIndex* pindexPrev = pindexBest;
 
@@ -3132,144 +4820,133 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
     txNew.vin.resize(1);
     txNew.vin[0].prevout.SetNull();
     txNew.vout.resize(1);
-    txNew.vout[0].scriptPubKey << reservekey.GetReservedKey() << OP_CHECKSIG;
+    txNew.vout[0].scriptPubKey = scriptPubKey;
 
     // Add our coinbase tx as first transaction
     pblock->vtx.push_back(txNew);
 
-    // Collect memory pool transactions into the block
+    // How much of the block is filled in priority order before the rest
+    // is filled by fee rate
+    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(MAX_BLOCK_SIZE_GEN, nBlockPrioritySize);
+
+    // Collect memory pool transactions into the block.  Everything comes
+    // from the data cached in the pool entries, nothing is read from disk:
+    // the pool only holds transactions whose inputs were checked when they
+    // came in, and is kept in step with the chain as blocks are connected
+    // and disconnected.
     int64 nFees = 0;
     CRITICAL_BLOCK(cs_main)
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(mempool.cs)
     {
-        CTxDB txdb("r");
+        mempool.UpdatePriorities(pindexPrev->nHeight);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        multimap<double, CTransaction*> mapPriority;
-        for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi)
-        {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || !tx.IsFinal())
-                continue;
+        // A transaction is ready once all its in-pool parents are in the
+        // block.  Candidates come off the current index, or off mapReady
+        // for children whose last parent just got in, whichever is better.
+        set<uint256> setInBlock;
+        multimap<double, uint256> mapReady;
+        bool fSortedByFee = (nBlockPrioritySize == 0);
+        const set<pair<double, uint256> >* psetIndex = fSortedByFee ? &mempool.setByFeeRate : &mempool.setByPriority;
+        set<pair<double, uint256> >::const_reverse_iterator it = psetIndex->rbegin();
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        uint64 nBlockSize = 1000;
+        uint64 nBlockTx = 0;
+        int nBlockSigOps = 100;
+        for (;;)
+        {
+            // Priority area is full, go on by fee rate
+            if (!fSortedByFee && nBlockSize >= nBlockPrioritySize)
             {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+                fSortedByFee = true;
+                multimap<double, uint256> mapReadyByFee;
+                for (multimap<double, uint256>::iterator mi = mapReady.begin(); mi != mapReady.end(); ++mi)
                 {
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    continue;
+                    map<uint256, CTxMemPoolEntry>::iterator mit = mempool.mapTx.find((*mi).second);
+                    if (mit != mempool.mapTx.end())
+                        mapReadyByFee.insert(make_pair((*mit).second.GetFeeRate(), (*mi).second));
                 }
-                int64 nValueIn = txPrev.vout[txin.prevout.n].nValue;
-
-                // Read block header
-                int nConf = txindex.GetDepthInMainChain();
-
-                dPriority += (double)nValueIn * nConf;
-
-                if (fDebug && GetBoolArg("-printpriority"))
-                    printf("priority     nValueIn=%-12I64d nConf=%-5d dPriority=%-20.1f\n", nValueIn, nConf, dPriority);
+                mapReady.swap(mapReadyByFee);
+                psetIndex = &mempool.setByFeeRate;
+                it = psetIndex->rbegin();
             }
 
-            // Priority is sum(valuein * age) / txsize
-            dPriority /= ::GetSerializeSize(tx, SER_NETWORK);
-
-            if (porphan)
-                porphan->dPriority = dPriority;
-            else
-                mapPriority.insert(make_pair(-dPriority, &(*mi).second));
-
-            if (fDebug && GetBoolArg("-printpriority"))
+            uint256 hash;
+            if (!mapReady.empty() && (it == psetIndex->rend() || (*mapReady.rbegin()).first >= (*it).first))
             {
-                printf("priority %-20.1f %s\n%s", dPriority, tx.GetHash().ToString().substr(0,10).c_str(), tx.ToString().c_str());
-                if (porphan)
-                    porphan->print();
-                printf("\n");
+                hash = (*mapReady.rbegin()).second;
+                mapReady.erase(--mapReady.end());
             }
-        }
-
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64 nBlockSize = 1000;
-        uint64 nBlockTx = 0;
-        int nBlockSigOps = 100;
-        while (!mapPriority.empty())
-        {
-            // Take highest priority transaction off priority queue
-            double dPriority = -(*mapPriority.begin()).first;
-            CTransaction& tx = *(*mapPriority.begin()).second;
-            mapPriority.erase(mapPriority.begin());
+            else if (it != psetIndex->rend())
+                hash = (*it++).second;
+            else
+                break;
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK);
-            if (nBlockSize + nTxSize >= MAX_BLOCK_SIZE_GEN)
+            if (setInBlock.count(hash))
                 continue;
-
-            // Legacy limits on sigOps:
-            int nTxSigOps = tx.GetLegacySigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            map<uint256, CTxMemPoolEntry>::iterator mit = mempool.mapTx.find(hash);
+            if (mit == mempool.mapTx.end())
+                continue;
+            CTxMemPoolEntry& entry = (*mit).second;
+            CTransaction& tx = entry.tx;
+
+            // Has to wait for dependencies, comes back through mapReady
+            bool fReady = true;
+            BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+                if (!setInBlock.count(hashParent))
+                    fReady = false;
+            if (!fReady)
                 continue;
 
-            // Transaction fee required depends on block size
-            // Litecoind: Reduce the exempted free transactions to 500 bytes (from Bitcoin's 3000 bytes)
-            bool fAllowFree = (nBlockSize + nTxSize < 1500 || CTransaction::AllowFree(dPriority));
-            int64 nMinFee = tx.GetMinFee(nBlockSize, fAllowFree, GMF_BLOCK);
+            if (tx.IsCoinBase() || !tx.IsFinal())
+                continue;
 
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+            // Inputs not known yet, or an immature coinbase
+            if (!entry.IsSpendableAt(pindexPrev->nHeight + 1))
                 continue;
 
-            int64 nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-            if (nTxFees < nMinFee)
+            // Size limits
+            if (nBlockSize + entry.nTxSize >= MAX_BLOCK_SIZE_GEN)
                 continue;
 
-            nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            // Legacy and P2SH limits on sigOps:
+            if (nBlockSigOps + entry.nSigOps >= MAX_BLOCK_SIGOPS)
                 continue;
+            int64 nTxFees = entry.nFee;
+            int nTxSigOps = entry.nSigOps;
 
-            if (!tx.ConnectInputs(mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true))
+            // Transaction fee required depends on block size
+            // Litecoind: Reduce the exempted free transactions to 500 bytes (from Bitcoin's 3000 bytes)
+            double dPriority = entry.dPriorityKey;
+            bool fAllowFree = (nBlockSize + entry.nTxSize < 1500 || CTransaction::AllowFree(dPriority));
+            int64 nMinFee = tx.GetMinFee(nBlockSize, fAllowFree, GMF_BLOCK);
+            if (nTxFees < nMinFee)
                 continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
 
             // Added
             pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
+            setInBlock.insert(hash);
+            nBlockSize += entry.nTxSize;
             ++nBlockTx;
             nBlockSigOps += nTxSigOps;
             nFees += nTxFees;
 
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
+            if (fDebug && GetBoolArg("-printpriority"))
+                printf("priority %.1f feerate %.1f txid %s\n", dPriority, entry.GetFeeRate(), hash.ToString().substr(0,10).c_str());
+
+            // Queue up transactions that were only waiting for this one
+            BOOST_FOREACH(const uint256& hashChild, entry.setChildren)
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                            mapPriority.insert(make_pair(-porphan->dPriority, porphan->ptx));
-                    }
-                }
+                map<uint256, CTxMemPoolEntry>::iterator mic = mempool.mapTx.find(hashChild);
+                if (mic == mempool.mapTx.end())
+                    continue;
+                const CTxMemPoolEntry& child = (*mic).second;
+                bool fChildReady = true;
+                BOOST_FOREACH(const uint256& hashParent, child.setParents)
+                    if (!setInBlock.count(hashParent))
+                        fChildReady = false;
+                if (fChildReady)
+                    mapReady.insert(make_pair(fSortedByFee ? child.GetFeeRate() : child.dPriorityKey, hashChild));
             }
         }
 
@@ -3291,6 +4968,318 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
 }
 
 
+//
+// Block template builder.  Keeps a candidate block for getwork and
+// getmemorypool up to date in the background: rebuilt from scratch when the
+// best block changes, otherwise patched as transactions enter and leave the
+// memory pool, with a periodic full rebuild to restore fee/priority order.
+//
+
+static const int64 TEMPLATE_REBUILD_INTERVAL = 60;
+static const int64 TEMPLATE_IDLE_TIMEOUT = 10 * 60;
+
+class CTemplateTx
+{
+public:
+    int64 nFee;
+    unsigned int nTxSize;
+    int nSigOps;
+};
+
+class CTemplateBuilder
+{
+public:
+    CBlock block;
+    CBlockIndex* pindexPrev;
+    map<uint256, CTemplateTx> mapTx;
+    set<COutPoint> setSpent;
+    uint64 nBlockSize;
+    int nBlockSigOps;
+    int64 nFees;
+    unsigned int nTransactionsUpdatedLast;
+    int64 nTimeRebuilt;
+
+    CTemplateBuilder()
+    {
+        pindexPrev = NULL;
+        nTransactionsUpdatedLast = 0;
+        nTimeRebuilt = 0;
+    }
+
+    bool Rebuild();
+    bool Update();
+    void Publish();
+};
+
+static CCriticalSection cs_blockTemplate;
+static boost::shared_ptr<const CBlockTemplate> ptemplateCurrent;
+static bool fTemplateBuilderRunning = false;
+static int64 nTemplateLastRequest = 0;
+
+static CCriticalSection cs_templateBuilder;
+static CTemplateBuilder templateBuilder;
+
+bool CTemplateBuilder::Rebuild()
+{
+    // Caller holds cs_main
+    CRITICAL_BLOCK(mempool.cs)
+    {
+        mempool.fTrackChanges = true;
+        mempool.vTxAdded.clear();
+        mempool.vTxRemoved.clear();
+
+        auto_ptr<CBlock> pblock(CreateNewBlock(CScript()));
+        if (!pblock.get())
+            return false;
+        block = *pblock;
+        pindexPrev = pindexBest;
+        nTransactionsUpdatedLast = nTransactionsUpdated;
+        nTimeRebuilt = GetTime();
+
+        mapTx.clear();
+        setSpent.clear();
+        nBlockSize = 1000;
+        nBlockSigOps = 100;
+        nFees = 0;
+        for (int i = 1; i < block.vtx.size(); i++)
+        {
+            const CTransaction& tx = block.vtx[i];
+            map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.find(tx.GetHash());
+            if (mi == mempool.mapTx.end())
+                return error("CTemplateBuilder::Rebuild() : %s not in the memory pool", tx.GetHash().ToString().substr(0,10).c_str());
+            const CTxMemPoolEntry& entry = (*mi).second;
+            CTemplateTx& txinfo = mapTx[tx.GetHash()];
+            txinfo.nFee = entry.nFee;
+            txinfo.nTxSize = entry.nTxSize;
+            txinfo.nSigOps = entry.nSigOps;
+            nBlockSize += entry.nTxSize;
+            nBlockSigOps += entry.nSigOps;
+            nFees += entry.nFee;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                setSpent.insert(txin.prevout);
+        }
+    }
+    return true;
+}
+
+bool CTemplateBuilder::Update()
+{
+    // Caller holds cs_main
+    bool fChanged = false;
+    CRITICAL_BLOCK(mempool.cs)
+    {
+        vector<uint256> vAdded, vRemoved;
+        vAdded.swap(mempool.vTxAdded);
+        vRemoved.swap(mempool.vTxRemoved);
+        nTransactionsUpdatedLast = nTransactionsUpdated;
+
+        // Drop transactions that left the pool, and whatever in the block
+        // spends them.  Children always come after their parents.
+        set<uint256> setGone;
+        BOOST_FOREACH(const uint256& hash, vRemoved)
+            if (mapTx.count(hash))
+                setGone.insert(hash);
+        if (!setGone.empty())
+        {
+            vector<CTransaction> vtxKeep;
+            vtxKeep.push_back(block.vtx[0]);
+            for (int i = 1; i < block.vtx.size(); i++)
+            {
+                const CTransaction& tx = block.vtx[i];
+                uint256 hash = tx.GetHash();
+                bool fDrop = setGone.count(hash);
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    if (setGone.count(txin.prevout.hash))
+                        fDrop = true;
+                if (!fDrop)
+                {
+                    vtxKeep.push_back(tx);
+                    continue;
+                }
+                setGone.insert(hash);
+                map<uint256, CTemplateTx>::iterator mi = mapTx.find(hash);
+                if (mi != mapTx.end())
+                {
+                    const CTemplateTx& txinfo = (*mi).second;
+                    nBlockSize -= txinfo.nTxSize;
+                    nBlockSigOps -= txinfo.nSigOps;
+                    nFees -= txinfo.nFee;
+                    mapTx.erase(mi);
+                }
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    setSpent.erase(txin.prevout);
+            }
+            block.vtx.swap(vtxKeep);
+            fChanged = true;
+        }
+
+        // Append new arrivals that fit, the same rules as CreateNewBlock
+        BOOST_FOREACH(const uint256& hash, vAdded)
+        {
+            if (mapTx.count(hash))
+                continue;
+            map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.find(hash);
+            if (mi == mempool.mapTx.end())
+                continue;
+            CTxMemPoolEntry& entry = (*mi).second;
+            CTransaction& tx = entry.tx;
+
+            bool fReady = true;
+            BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+                if (!mapTx.count(hashParent))
+                    fReady = false;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                if (setSpent.count(txin.prevout))
+                    fReady = false;
+            if (!fReady || !tx.IsFinal() || !entry.IsSpendableAt(pindexPrev->nHeight + 1))
+                continue;
+            if (nBlockSize + entry.nTxSize >= MAX_BLOCK_SIZE_GEN)
+                continue;
+            if (nBlockSigOps + entry.nSigOps >= MAX_BLOCK_SIGOPS)
+                continue;
+            bool fAllowFree = (nBlockSize + entry.nTxSize < 1500 || CTransaction::AllowFree(entry.GetPriority(pindexPrev->nHeight)));
+            if (entry.nFee < tx.GetMinFee(nBlockSize, fAllowFree, GMF_BLOCK))
+                continue;
+
+            block.vtx.push_back(tx);
+            CTemplateTx& txinfo = mapTx[hash];
+            txinfo.nFee = entry.nFee;
+            txinfo.nTxSize = entry.nTxSize;
+            txinfo.nSigOps = entry.nSigOps;
+            nBlockSize += entry.nTxSize;
+            nBlockSigOps += entry.nSigOps;
+            nFees += entry.nFee;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                setSpent.insert(txin.prevout);
+            fChanged = true;
+        }
+    }
+    return fChanged;
+}
+
+void CTemplateBuilder::Publish()
+{
+    boost::shared_ptr<CBlockTemplate> ptemplate(new CBlockTemplate());
+    CBlock& blockNew = ptemplate->block;
+    blockNew = block;
+    blockNew.vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
+    blockNew.hashPrevBlock  = pindexPrev->GetBlockHash();
+    blockNew.hashMerkleRoot = blockNew.BuildMerkleTree();
+    blockNew.UpdateTime(pindexPrev);
+    blockNew.nBits          = GetNextWorkRequired(pindexPrev, &blockNew);
+    blockNew.nNonce         = 0;
+    ptemplate->pindexPrev = pindexPrev;
+    ptemplate->nFees = nFees;
+    ptemplate->nTimeCreated = GetTime();
+
+    CRITICAL_BLOCK(cs_blockTemplate)
+        ptemplateCurrent = ptemplate;
+}
+
+// Brings the template up to date, caller holds cs_main and cs_templateBuilder
+bool static RefreshBlockTemplate()
+{
+    CTemplateBuilder& builder = templateBuilder;
+    if (builder.pindexPrev != pindexBest ||
+        (nTransactionsUpdated != builder.nTransactionsUpdatedLast && GetTime() - builder.nTimeRebuilt > TEMPLATE_REBUILD_INTERVAL))
+    {
+        if (!builder.Rebuild())
+            return false;
+        builder.Publish();
+    }
+    else if (nTransactionsUpdated != builder.nTransactionsUpdatedLast && builder.Update())
+    {
+        builder.Publish();
+    }
+    return true;
+}
+
+void static ThreadBlockTemplate(void* parg)
+{
+    printf("ThreadBlockTemplate started\n");
+    vnThreadsRunning[THREAD_TEMPLATE]++;
+    try
+    {
+        while (!fShutdown)
+        {
+            // Stop when nobody has asked for work in a while
+            bool fIdle = false;
+            CRITICAL_BLOCK(cs_blockTemplate)
+                fIdle = (GetTime() - nTemplateLastRequest > TEMPLATE_IDLE_TIMEOUT);
+            if (fIdle)
+                break;
+
+            // Only a hint, RefreshBlockTemplate checks again under cs_main
+            bool fStale = false;
+            CRITICAL_BLOCK(cs_templateBuilder)
+                fStale = (templateBuilder.pindexPrev != pindexBest || nTransactionsUpdated != templateBuilder.nTransactionsUpdatedLast);
+            if (fStale)
+            {
+                CRITICAL_BLOCK(cs_main)
+                CRITICAL_BLOCK(cs_templateBuilder)
+                    RefreshBlockTemplate();
+            }
+            Sleep(250);
+        }
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadBlockTemplate()");
+    } catch (...) {
+        PrintException(NULL, "ThreadBlockTemplate()");
+    }
+
+    // Stop tracking before letting another builder start, or it could
+    // Rebuild and then have tracking switched off under it.  Without the
+    // change lists the builder can't Update, so the next refresh rebuilds.
+    CRITICAL_BLOCK(cs_templateBuilder)
+    {
+        CRITICAL_BLOCK(mempool.cs)
+        {
+            mempool.fTrackChanges = false;
+            mempool.vTxAdded.clear();
+            mempool.vTxRemoved.clear();
+        }
+        templateBuilder.pindexPrev = NULL;
+    }
+    CRITICAL_BLOCK(cs_blockTemplate)
+        fTemplateBuilderRunning = false;
+    vnThreadsRunning[THREAD_TEMPLATE]--;
+    printf("ThreadBlockTemplate exiting\n");
+}
+
+// The current block template, shared and immutable.  Normally this only
+// copies a pointer; the template is built here directly if the builder
+// hasn't caught up with the best block yet.
+boost::shared_ptr<const CBlockTemplate> GetBlockTemplate()
+{
+    boost::shared_ptr<const CBlockTemplate> ptemplate;
+    bool fStart = false;
+    CRITICAL_BLOCK(cs_blockTemplate)
+    {
+        nTemplateLastRequest = GetTime();
+        ptemplate = ptemplateCurrent;
+        if (!fTemplateBuilderRunning)
+            fTemplateBuilderRunning = fStart = true;
+    }
+    if (fStart && !CreateThread(ThreadBlockTemplate, NULL))
+    {
+        printf("Error: CreateThread(ThreadBlockTemplate) failed\n");
+        CRITICAL_BLOCK(cs_blockTemplate)
+            fTemplateBuilderRunning = false;
+    }
+
+    if (!ptemplate || ptemplate->pindexPrev != pindexBest)
+    {
+        CRITICAL_BLOCK(cs_main)
+        CRITICAL_BLOCK(cs_templateBuilder)
+            RefreshBlockTemplate();
+        CRITICAL_BLOCK(cs_blockTemplate)
+            ptemplate = ptemplateCurrent;
+    }
+    return ptemplate;
+}
+
+
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
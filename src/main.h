@@ -17,6 +17,7 @@
 
 class CBlock;
 class CBlockIndex;
+class CBlockTemplate;
 class CWalletTx;
 class CWallet;
 class CKeyItem;
@@ -35,7 +36,13 @@ extern const std::string CLIENT_NAME;
 static const unsigned int MAX_BLOCK_SIZE = 1000000;
 static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE/2;
 static const int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
+static const unsigned int DEFAULT_BLOCK_PRIORITY_SIZE = 27000;
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+static const int64 ROLLING_FEE_HALFLIFE = 12 * 60 * 60;
 static const int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+static const unsigned int MAX_ORPHAN_TX_BYTES = 5 * MAX_BLOCK_SIZE;
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+static const int64 ORPHAN_TX_EXPIRE_TIME = 20 * 60;
 static const int64 COIN = 100000000;
 static const int64 CENT = 1000000;
 static const int64 MIN_TX_FEE = 10000000; // Litecoin: minimum transaction fee of 0.1 LTC
@@ -45,6 +52,8 @@ inline bool MoneyRange(int64 nValue) { return (nValue >= 0 && nValue <= MAX_MONE
 static const int COINBASE_MATURITY = 100;
 // Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp.
 static const int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
+// Set in the size word that frames a block in blk*.dat when the block is stored compressed.
+static const unsigned int BLOCK_COMPRESSED_FLAG = 0x80000000;
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
 #else
@@ -68,7 +77,6 @@ extern CBigNum bnBestChainWork;
 extern CBigNum bnBestInvalidWork;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
-extern uint64 nPooledTx;
 extern unsigned int nTransactionsUpdated;
 extern uint64 nLastBlockTx;
 extern uint64 nLastBlockSize;
@@ -84,6 +92,8 @@ extern int64 nTransactionFee;
 extern int64 nMinimumInputValue;
 extern int fMinimizeToTray;
 extern int fMinimizeOnClose;
+extern bool fCompressBlocks;
+extern bool fHeadersFirst;
 
 
 
@@ -99,12 +109,26 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64 nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
+FILE* OpenBlockFrame(unsigned int nFile, unsigned int nBlockPos, unsigned int& nFrameSizeRet, const char* pszMode="rb");
+bool ReadCompressedBlock(FILE* file, unsigned int nFrameSize, unsigned int nFile, unsigned int nBlockPos, CBlock& blockRet);
+bool ReadCompressedTx(FILE* file, unsigned int nFrameSize, unsigned int nFile, unsigned int nBlockPos, unsigned int nTxOffset, CTransaction& txRet);
+void ForgetDecompressedBlock(unsigned int nFile, unsigned int nBlockPos);
+bool ReadCompressedBlockHeader(FILE* file, unsigned int nFrameSize, unsigned int nFile, unsigned int nBlockPos, unsigned int nHeaderSize, CDataStream& ssHeaderRet);
+bool CompressBlock(const CBlock& block, std::vector<unsigned char>& vchRet);
+bool DecompressBlock(const unsigned char* pbegin, const unsigned char* pend, CDataStream& ssBlockRet);
+bool ConvertBlockFiles();
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
+void InitMessageSalts();
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
+void FinalizeNode(CNode* pnode);
+bool DumpMempool();
+bool LoadMempool();
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 CBlock* CreateNewBlock(CReserveKey& reservekey);
+CBlock* CreateNewBlock(const CScript& scriptPubKey);
+boost::shared_ptr<const CBlockTemplate> GetBlockTemplate();
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
@@ -599,9 +623,21 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
-        CAutoFile filein = OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb");
+        unsigned int nFrameSize;
+        CAutoFile filein = OpenBlockFrame(pos.nFile, pos.nBlockPos, nFrameSize, pfileRet ? "rb+" : "rb");
         if (!filein)
-            return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
+            return error("CTransaction::ReadFromDisk() : OpenBlockFrame failed");
+
+        // Compressed blocks have no file offset for the transaction,
+        // nTxPos is relative to the start of the uncompressed block
+        if (nFrameSize & BLOCK_COMPRESSED_FLAG)
+        {
+            if (pfileRet)
+                return error("CTransaction::ReadFromDisk() : file pointer requested for compressed block");
+            if (!ReadCompressedTx(filein, nFrameSize, pos.nFile, pos.nBlockPos, pos.nTxPos - pos.nBlockPos, *this))
+                return error("CTransaction::ReadFromDisk() : ReadCompressedTx failed");
+            return true;
+        }
 
         // Read transaction
         if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
@@ -689,14 +725,11 @@ public:
                        const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
-    bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
+    bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL, bool fLimitFree=true);
     bool AcceptToMemoryPool(bool fCheckInputs=true, bool* pfMissingInputs=NULL);
 
 protected:
     const CTxOut& GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const;
-    bool AddToMemoryPoolUnchecked();
-public:
-    bool RemoveFromMemoryPool();
 };
 
 
@@ -757,6 +790,23 @@ public:
 
 
 
+//
+// A transaction waiting for its inputs.  The parsed transaction is shared
+// between the orphan pool and its by-prev index, so resolving orphans never
+// has to deserialize or copy it.
+//
+class COrphanTx
+{
+public:
+    boost::shared_ptr<CTransaction> ptx;
+    unsigned int nSize;
+    CNode* pfrom;           // peer that sent it, NULL once it is gone
+    int64 nTimeExpire;
+};
+
+
+
+
 //
 // A txdb record that contains the disk location of a transaction and the
 // locations of transactions that spend its outputs.  vSpent is really only
@@ -959,7 +1009,7 @@ public:
     }
 
 
-    bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet)
+    bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet, bool fCommit=true)
     {
         // Open history file to append
         CAutoFile fileout = AppendBlockFile(nFileRet);
@@ -967,19 +1017,31 @@ public:
             return error("CBlock::WriteToDisk() : AppendBlockFile failed");
 
         // Write index header
-        unsigned int nSize = fileout.GetSerializeSize(*this);
+        std::vector<unsigned char> vchCompressed;
+        unsigned int nSize;
+        if (fCompressBlocks)
+        {
+            if (!CompressBlock(*this, vchCompressed))
+                return error("CBlock::WriteToDisk() : CompressBlock failed");
+            nSize = vchCompressed.size() | BLOCK_COMPRESSED_FLAG;
+        }
+        else
+            nSize = fileout.GetSerializeSize(*this);
         fileout << FLATDATA(pchMessageStart) << nSize;
 
         // Write block
         long fileOutPos = ftell(fileout);
         if (fileOutPos < 0)
             return error("CBlock::WriteToDisk() : ftell failed");
-        fileout << *this;
+        if (fCompressBlocks)
+            fileout.write((char*)&vchCompressed[0], vchCompressed.size());
+        else
+            fileout << *this;
         nBlockPosRet = fileOutPos;
 
         // Flush stdio buffers and commit to disk before returning
         fflush(fileout);
-        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
+        if (fCommit && (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0))
         {
 #ifdef WIN32
             _commit(_fileno(fileout));
@@ -996,14 +1058,31 @@ public:
         SetNull();
 
         // Open history file to read
-        CAutoFile filein = OpenBlockFile(nFile, nBlockPos, "rb");
+        unsigned int nFrameSize;
+        CAutoFile filein = OpenBlockFrame(nFile, nBlockPos, nFrameSize);
         if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
+            return error("CBlock::ReadFromDisk() : OpenBlockFrame failed");
 
         // Read block
-        filein >> *this;
+        if ((nFrameSize & BLOCK_COMPRESSED_FLAG) && !fReadTransactions)
+        {
+            // Only inflate as far as the header
+            CDataStream ssHeader(SER_DISK | SER_BLOCKHEADERONLY);
+            if (!ReadCompressedBlockHeader(filein, nFrameSize, nFile, nBlockPos, ::GetSerializeSize(*this, ssHeader.nType), ssHeader))
+                return error("CBlock::ReadFromDisk() : ReadCompressedBlockHeader failed");
+            ssHeader >> *this;
+        }
+        else if (nFrameSize & BLOCK_COMPRESSED_FLAG)
+        {
+            if (!ReadCompressedBlock(filein, nFrameSize, nFile, nBlockPos, *this))
+                return error("CBlock::ReadFromDisk() : ReadCompressedBlock failed");
+        }
+        else
+        {
+            if (!fReadTransactions)
+                filein.nType |= SER_BLOCKHEADERONLY;
+            filein >> *this;
+        }
 
         // Check the header
         if (!CheckProofOfWork(GetPoWHash(), nBits))
@@ -1159,14 +1238,28 @@ public:
     bool EraseBlockFromDisk()
     {
         // Open history file
-        CAutoFile fileout = OpenBlockFile(nFile, nBlockPos, "rb+");
+        unsigned int nFrameSize;
+        CAutoFile fileout = OpenBlockFrame(nFile, nBlockPos, nFrameSize, "rb+");
         if (!fileout)
             return false;
+        if (fseek(fileout, nBlockPos, SEEK_SET) != 0)
+            return false;
 
-        // Overwrite with empty null block
+        // Overwrite with empty null block, compressed if the frame is.  It
+        // is smaller than what it replaces, and the frame keeps its size so
+        // the blocks after it stay where they are.
         CBlock block;
         block.SetNull();
-        fileout << block;
+        if (nFrameSize & BLOCK_COMPRESSED_FLAG)
+        {
+            std::vector<unsigned char> vchCompressed;
+            if (!CompressBlock(block, vchCompressed) || vchCompressed.size() > (nFrameSize & ~BLOCK_COMPRESSED_FLAG))
+                return false;
+            fileout.write((char*)&vchCompressed[0], vchCompressed.size());
+            ForgetDecompressedBlock(nFile, nBlockPos);
+        }
+        else
+            fileout << block;
 
         return true;
     }
@@ -1630,4 +1723,183 @@ public:
     bool ProcessAlert();
 };
 
+
+
+
+//
+// A transaction in the memory pool, with the data block templates need
+// cached when it is accepted so they can be built without touching disk
+//
+class CTxMemPoolEntry
+{
+public:
+    CTransaction tx;
+    int64 nFee;             // -1 if the inputs couldn't be fetched
+    unsigned int nTxSize;
+    int nSigOps;
+    int64 nTime;
+
+    // Value and block height of each input, height -1 while the input
+    // is still in the memory pool
+    std::vector<std::pair<int64, int> > vInputs;
+
+    // Height of the newest coinbase this spends, -1 if it spends none
+    int nCoinbaseHeight;
+
+    // In-pool transactions this one spends, and those that spend it
+    std::set<uint256> setParents;
+    std::set<uint256> setChildren;
+
+    // Priority key this entry is filed under in CTxMemPool::setByPriority
+    double dPriorityKey;
+
+    // Estimated memory taken by the entry, set when it enters the pool
+    unsigned int nUsage;
+
+    CTxMemPoolEntry()
+    {
+        nFee = -1;
+        nTxSize = 0;
+        nSigOps = 0;
+        nTime = 0;
+        nCoinbaseHeight = -1;
+        dPriorityKey = 0;
+        nUsage = 0;
+    }
+
+    // Priority is sum(valuein * age) / txsize, age counted at nHeight
+    double GetPriority(int nHeight) const
+    {
+        double dPriority = 0;
+        for (unsigned int i = 0; i < vInputs.size(); i++)
+            if (vInputs[i].second >= 0 && vInputs[i].second <= nHeight)
+                dPriority += (double)vInputs[i].first * (nHeight - vInputs[i].second + 1);
+        return dPriority / nTxSize;
+    }
+
+    // Whether the cached inputs can be spent in a block at nHeight: they
+    // have been filled in, and any coinbase spent has matured by then
+    bool IsSpendableAt(int nHeight) const
+    {
+        if (nFee < 0)
+            return false;
+        return nCoinbaseHeight < 0 || nHeight - nCoinbaseHeight > COINBASE_MATURITY;
+    }
+
+    // Fee per 1000 bytes
+    double GetFeeRate() const
+    {
+        return (double)std::max(nFee, (int64)0) * 1000 / nTxSize;
+    }
+};
+
+//
+// The memory pool of unconfirmed transactions.  Besides the transactions
+// themselves it keeps the spent-outpoint map, the in-pool dependency graph
+// and indexes ordered by fee rate and by priority.
+//
+class CTxMemPool
+{
+public:
+    mutable CCriticalSection cs;
+    std::map<uint256, CTxMemPoolEntry> mapTx;
+    std::map<COutPoint, CInPoint> mapNextTx;
+    std::set<std::pair<double, uint256> > setByFeeRate;
+    std::set<std::pair<double, uint256> > setByPriority;
+    int nPriorityHeight;
+
+    // Transactions added and removed since the block template builder last
+    // looked, only recorded while fTrackChanges is set
+    bool fTrackChanges;
+    std::vector<uint256> vTxAdded;
+    std::vector<uint256> vTxRemoved;
+
+    // Estimated memory used by all entries, and the minimum fee rate per
+    // 1000 bytes for new transactions, raised when the pool has to evict
+    // and decaying back to zero afterwards
+    uint64 nPoolUsage;
+    uint64 nMaxPoolUsage;
+    double dRollingMinFeeRate;
+    int64 nLastRollingFeeUpdate;
+
+    CTxMemPool()
+    {
+        nPriorityHeight = -1;
+        fTrackChanges = false;
+        nPoolUsage = 0;
+        nMaxPoolUsage = 0;
+        dRollingMinFeeRate = 0;
+        nLastRollingFeeUpdate = 0;
+    }
+
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entryIn);
+    bool remove(const CTransaction& tx, bool fRecursive=false);
+    void removeConflicts(const CTransaction& tx);
+    void removeConfirmed(const CTransaction& tx, int nHeight);
+    void UpdatePriorities(int nHeight);
+    // Fills in the fee and input data of an entry added without them
+    void FillInputs(const uint256& hash, const MapPrevTx& mapInputs);
+    int TrimToSize(uint64 nMaxUsage);
+    int64 GetRollingMinFee(unsigned int nBytes);
+    void clear();
+    void queryHashes(std::vector<uint256>& vtxid);
+
+    unsigned long size()
+    {
+        unsigned long nSize = 0;
+        CRITICAL_BLOCK(cs)
+            nSize = mapTx.size();
+        return nSize;
+    }
+
+    uint64 GetUsage()
+    {
+        uint64 nUsage = 0;
+        CRITICAL_BLOCK(cs)
+            nUsage = nPoolUsage;
+        return nUsage;
+    }
+
+    bool exists(const uint256& hash)
+    {
+        bool fExists = false;
+        CRITICAL_BLOCK(cs)
+            fExists = (mapTx.count(hash) != 0);
+        return fExists;
+    }
+
+    bool lookup(const uint256& hash, CTransaction& result)
+    {
+        CRITICAL_BLOCK(cs)
+        {
+            std::map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hash);
+            if (mi != mapTx.end())
+            {
+                result = (*mi).second.tx;
+                return true;
+            }
+        }
+        return false;
+    }
+
+protected:
+    void UpdatePriority(CTxMemPoolEntry& entry, const uint256& hash);
+};
+
+extern CTxMemPool mempool;
+
+//
+// A block ready for mining, published by the template builder and never
+// modified afterwards.  The coinbase pays to an empty script, callers copy
+// the block and fill in their own.
+//
+class CBlockTemplate
+{
+public:
+    CBlock block;
+    CBlockIndex* pindexPrev;
+    int64 nFees;
+    int64 nTimeCreated;
+};
+
 #endif
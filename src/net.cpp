@@ -16,6 +16,10 @@
 #include <string.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
 #include <miniupnpc/miniupnpc.h>
@@ -29,6 +33,7 @@ using namespace boost;
 static const int MAX_OUTBOUND_CONNECTIONS = 8;
 
 void ThreadMessageHandler2(void* parg);
+void ThreadMessageWorker2(void* parg);
 void ThreadSocketHandler2(void* parg);
 void ThreadOpenConnections2(void* parg);
 void ThreadOpenAddedConnections2(void* parg);
@@ -37,6 +42,7 @@ void ThreadMapPort2(void* parg);
 #endif
 void ThreadDNSAddressSeed2(void* parg);
 bool OpenNetworkConnection(const CAddress& addrConnect);
+static void RegisterNodeSocket(CNode* pnode);
 
 
 
@@ -56,7 +62,7 @@ CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CMessageBuffer> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64> mapAlreadyAskedFor;
@@ -67,6 +73,137 @@ CCriticalSection cs_setservAddNodeAddresses;
 
 
 
+// Upload rate limits in bytes per second, 0 for unlimited
+static int64 nMaxUploadRate = 0;
+static int64 nPeerUploadRate = 0;
+
+// Only this many bytes are committed to the wire ahead of the socket, so a new
+// block never waits behind more than this much lower priority traffic
+static const unsigned int SEND_WINDOW = 64 * 1024;
+
+CCriticalSection cs_sendScheduler;
+static int64 nGlobalSendTokens = 0;
+static int64 nGlobalSendTokensTime = 0;
+uint64 vnTotalBytesSent[SEND_PRIORITY_MAX];
+uint64 nTotalBytesRecv = 0;
+uint64 nSendThrottled = 0;
+
+
+CMessageBuffer BuildMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+    CMessageHeader hdr(pszCommand, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CDataStream ssHeader(SER_NETWORK);
+    ssHeader << hdr;
+    vector<char>* pvch = new vector<char>(ssHeader.begin(), ssHeader.end());
+    pvch->insert(pvch->end(), ssPayload.begin(), ssPayload.end());
+    return CMessageBuffer(pvch);
+}
+
+int CNetMessage::ReadHeader(const char* pch, unsigned int nBytes)
+{
+    // copy as much of the header as we have into the parsing buffer
+    unsigned int nCopy = min((unsigned int)HEADER_SIZE - nHdrPos, nBytes);
+    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    nHdrPos += nCopy;
+    if (nHdrPos < HEADER_SIZE)
+        return nCopy;
+
+    try
+    {
+        hdrbuf >> hdr;
+    }
+    catch (std::exception &e)
+    {
+        return -1;
+    }
+
+    // bad message start, command or size: the stream cannot be resynced
+    if (!hdr.IsValid())
+        return -1;
+
+    fInData = true;
+    return nCopy;
+}
+
+int CNetMessage::ReadData(const char* pch, unsigned int nBytes)
+{
+    unsigned int nCopy = min(hdr.nMessageSize - nDataPos, nBytes);
+    vRecv.write(pch, nCopy);
+    SHA256_Update(&ctxChecksum, pch, nCopy);
+    nDataPos += nCopy;
+    return nCopy;
+}
+
+bool CNetMessage::CheckChecksum(unsigned int& nChecksumRet) const
+{
+    // finish the double-SHA256 on a copy so the message stays untouched
+    SHA256_CTX ctx = ctxChecksum;
+    uint256 hash1;
+    SHA256_Final((unsigned char*)&hash1, &ctx);
+    uint256 hash2;
+    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    nChecksumRet = 0;
+    memcpy(&nChecksumRet, &hash2, sizeof(nChecksumRet));
+    return nChecksumRet == hdr.nChecksum;
+}
+
+// Split received bytes into messages on vRecvMsg.  Caller must hold cs_vRecv.
+// Returns false if the peer sent something that is not a valid message stream.
+bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
+{
+    bool fComplete = false;
+    while (nBytes > 0)
+    {
+        // continue the last incomplete message, or start a new one
+        if (vRecvMsg.empty() || vRecvMsg.back().IsComplete())
+            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+        CNetMessage& msg = vRecvMsg.back();
+
+        int nCopied;
+        if (!msg.fInData)
+            nCopied = msg.ReadHeader(pch, nBytes);
+        else
+            nCopied = msg.ReadData(pch, nBytes);
+        if (nCopied < 0)
+            return false;
+
+        pch += nCopied;
+        nBytes -= nCopied;
+        nRecvSize += nCopied;
+        if (msg.IsComplete())
+            fComplete = true;
+    }
+
+    if (fComplete)
+        SignalMessageHandler(this);
+    return true;
+}
+
+int GetSendPriority(const char* pszCommand)
+{
+    // Blocks default to the top class, getdata serves old ones as historic
+    if (strcmp(pszCommand, "tx") == 0)
+        return SEND_PRIORITY_TX;
+    if (strcmp(pszCommand, "addr") == 0)
+        return SEND_PRIORITY_ADDR;
+    return SEND_PRIORITY_BLOCK;
+}
+
+const char* GetSendPriorityName(int nPriority)
+{
+    switch (nPriority)
+    {
+    case SEND_PRIORITY_BLOCK:    return "block";
+    case SEND_PRIORITY_TX:       return "tx";
+    case SEND_PRIORITY_HISTORIC: return "historicblock";
+    case SEND_PRIORITY_ADDR:     return "addr";
+    }
+    return "unknown";
+}
+
 unsigned short GetListenPort()
 {
     return (unsigned short)(GetArg("-port", GetDefaultPort()));
@@ -460,7 +597,10 @@ CNode* ConnectNode(CAddress addrConnect, int64 nTimeout)
         else
             pnode->AddRef();
         CRITICAL_BLOCK(cs_vNodes)
+        {
+            RegisterNodeSocket(pnode);
             vNodes.push_back(pnode);
+        }
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -481,7 +621,6 @@ void CNode::CloseSocketDisconnect()
         printf("disconnecting node %s\n", addr.ToString().c_str());
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
-        vRecv.clear();
     }
 }
 
@@ -577,62 +716,436 @@ void ThreadSocketHandler(void* parg)
     printf("ThreadSocketHandler exiting\n");
 }
 
-void ThreadSocketHandler2(void* parg)
+#ifdef USE_EPOLL
+//
+// Socket readiness is tracked with an edge-triggered epoll set.  Each node
+// remembers whether its socket was last seen readable or writable, and
+// nodes with work outstanding are kept in setNodesReady, so a wakeup only
+// touches the nodes that need it.  EndMessage wakes the loop through a pipe
+// when it queues data for a node.
+//
+static int hEpoll = -1;
+static int hWakeupPipe[2] = { -1, -1 };
+static CCriticalSection cs_setNodesSendPending;
+static set<CNode*> setNodesSendPending;
+static set<CNode*> setNodesReady;
+
+static void CloseSocketEvents()
 {
-    printf("ThreadSocketHandler started\n");
-    list<CNode*> vNodesDisconnected;
-    int nPrevNodeCount = 0;
+    if (hEpoll != -1)
+        close(hEpoll);
+    hEpoll = -1;
+    for (int i = 0; i < 2; i++)
+    {
+        if (hWakeupPipe[i] != -1)
+            close(hWakeupPipe[i]);
+        hWakeupPipe[i] = -1;
+    }
+}
 
-    loop
+// Called with cs_vNodes held, so that every node is registered either
+// here or by RegisterNodeSocket when it is added to vNodes
+static bool InitSocketEvents()
+{
+    hEpoll = epoll_create(1024);
+    if (hEpoll == -1)
+        return error("InitSocketEvents() : epoll_create failed, error %d", errno);
+    if (pipe(hWakeupPipe) != 0)
+        return error("InitSocketEvents() : pipe failed, error %d", errno);
+    fcntl(hWakeupPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(hWakeupPipe[1], F_SETFL, O_NONBLOCK);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hWakeupPipe[0], &event) != 0)
+        return error("InitSocketEvents() : epoll_ctl wakeup pipe failed, error %d", errno);
+    if (hListenSocket != INVALID_SOCKET)
     {
-        //
-        // Disconnect nodes
-        //
-        CRITICAL_BLOCK(cs_vNodes)
+        event.events = EPOLLIN;
+        event.data.ptr = &hListenSocket;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) != 0)
+            return error("InitSocketEvents() : epoll_ctl listen socket failed, error %d", errno);
+    }
+    return true;
+}
+
+// Called with cs_vNodes held.  Nodes added before the socket thread has
+// set up epoll are registered by it instead.
+static void RegisterNodeSocket(CNode* pnode)
+{
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0)
+        printf("RegisterNodeSocket() : epoll_ctl failed, error %d\n", errno);
+}
+
+static void UnregisterNode(CNode* pnode)
+{
+    CRITICAL_BLOCK(cs_setNodesSendPending)
+        setNodesSendPending.erase(pnode);
+    setNodesReady.erase(pnode);
+}
+
+void WakeSocketHandler(CNode* pnode)
+{
+    CRITICAL_BLOCK(cs_setNodesSendPending)
+        if (!setNodesSendPending.insert(pnode).second)
+            return;
+    if (hWakeupPipe[1] != -1)
+    {
+        char c = 0;
+        if (write(hWakeupPipe[1], &c, 1) < 0 && errno != EAGAIN)
+            printf("WakeSocketHandler() : write failed, error %d\n", errno);
+    }
+}
+#else
+static void RegisterNodeSocket(CNode* pnode)
+{
+}
+
+static void UnregisterNode(CNode* pnode)
+{
+}
+
+void WakeSocketHandler(CNode* pnode)
+{
+}
+#endif
+
+static void DisconnectNodes(list<CNode*>& vNodesDisconnected)
+{
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0))
+            {
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+                pnode->Cleanup();
+
+                // hold in disconnected pool until all refs are released
+                pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
+            }
+        }
+
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+        {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                bool fDelete = false;
+                TRY_CRITICAL_BLOCK(pnode->cs_vSend)
+                 TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
+                  TRY_CRITICAL_BLOCK(pnode->cs_mapRequests)
+                   TRY_CRITICAL_BLOCK(pnode->cs_inventory)
+                    TRY_CRITICAL_BLOCK(cs_main)
+                    {
+                        FinalizeNode(pnode);
+                        fDelete = true;
+                    }
+                if (fDelete)
                 {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                    vNodesDisconnected.remove(pnode);
+                    UnregisterNode(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+}
 
-                    // close socket and cleanup
+static void AcceptConnection()
+{
+    struct sockaddr_in sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        addr = CAddress(sockaddr);
+
+    CRITICAL_BLOCK(cs_vNodes)
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        if (pnode->fInbound)
+            nInbound++;
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        if (WSAGetLastError() != WSAEWOULDBLOCK)
+            printf("socket error accept failed: %d\n", WSAGetLastError());
+    }
+    else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+    {
+        CRITICAL_BLOCK(cs_setservAddNodeAddresses)
+            if (!setservAddNodeAddresses.count(addr))
+                closesocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+        closesocket(hSocket);
+    }
+    else
+    {
+        printf("accepted connection %s\n", addr.ToString().c_str());
+        CNode* pnode = new CNode(hSocket, addr, true);
+        pnode->AddRef();
+        CRITICAL_BLOCK(cs_vNodes)
+        {
+            RegisterNodeSocket(pnode);
+            vNodes.push_back(pnode);
+        }
+    }
+}
+
+// Frame what the socket has into vRecvMsg.  Returns false if vRecvMsg was in use by
+// another thread.  fDrainedRet is set once the socket has nothing more to read.
+static bool SocketRecvData(CNode* pnode, bool& fDrainedRet)
+{
+    fDrainedRet = true;
+    TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
+    {
+        if (pnode->nRecvSize > ReceiveBufferSize()) {
+            if (!pnode->fDisconnect)
+                printf("socket recv flood control disconnect (%u bytes)\n", pnode->nRecvSize);
+            pnode->CloseSocketDisconnect();
+        }
+        else {
+            // typical socket buffer is 8K-64K
+            char pchBuf[0x10000];
+            int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+            if (nBytes > 0)
+            {
+                if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                {
+                    printf("socket invalid message header, disconnecting\n");
                     pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
+                }
+                pnode->nLastRecv = GetTime();
+                nTotalBytesRecv += nBytes;
+                fDrainedRet = (nBytes < sizeof(pchBuf));
+            }
+            else if (nBytes == 0)
+            {
+                // socket closed gracefully
+                if (!pnode->fDisconnect)
+                    printf("socket closed\n");
+                pnode->CloseSocketDisconnect();
+            }
+            else if (nBytes < 0)
+            {
+                // error
+                int nErr = WSAGetLastError();
+                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                {
+                    if (!pnode->fDisconnect)
+                        printf("socket recv error %d\n", nErr);
+                    pnode->CloseSocketDisconnect();
+                }
+            }
+        }
+        return true;
+    }
+    return false;
+}
 
-                    // hold in disconnected pool until all refs are released
-                    pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
+// Token bucket: credit accrues at nRate bytes per second up to one second's
+// worth, and may go negative when a large message is let through.
+static void RefillSendTokens(int64& nTokens, int64& nTokensTime, int64 nRate, int64 nNow)
+{
+    if (nTokensTime != 0)
+        nTokens = min(nRate, nTokens + nRate * (nNow - nTokensTime) / 1000);
+    nTokensTime = nNow;
+}
+
+// Move queued messages onto the wire queue, highest class first.  Caller
+// must hold pnode->cs_vSend.
+static void ScheduleSendData(CNode* pnode)
+{
+    int64 nNow = GetTimeMillis();
+    if (nPeerUploadRate > 0)
+        RefillSendTokens(pnode->nSendTokens, pnode->nSendTokensTime, nPeerUploadRate, nNow);
+
+    for (int nPriority = 0; nPriority < SEND_PRIORITY_MAX; nPriority++)
+    {
+        deque<CMessageBuffer>& vQueue = pnode->vSendQueue[nPriority];
+        while (!vQueue.empty() && pnode->nSendCommitted < SEND_WINDOW)
+        {
+            unsigned int nSize = vQueue.front()->size();
+            bool fThrottled = false;
+            CRITICAL_BLOCK(cs_sendScheduler)
+            {
+                if (nMaxUploadRate > 0)
+                    RefillSendTokens(nGlobalSendTokens, nGlobalSendTokensTime, nMaxUploadRate, nNow);
+
+                // New blocks are never held back, but still use up the
+                // budget so the other classes slow down to make room
+                if (nPriority != SEND_PRIORITY_BLOCK &&
+                    ((nPeerUploadRate > 0 && pnode->nSendTokens < 0) ||
+                     (nMaxUploadRate > 0 && nGlobalSendTokens < 0)))
+                {
+                    nSendThrottled++;
+                    fThrottled = true;
+                }
+                else
+                {
+                    if (nMaxUploadRate > 0)
+                        nGlobalSendTokens -= nSize;
+                    vnTotalBytesSent[nPriority] += nSize;
                 }
             }
+            if (fThrottled)
+                return;
+
+            if (nPeerUploadRate > 0)
+                pnode->nSendTokens -= nSize;
+            pnode->vnBytesSent[nPriority] += nSize;
+            pnode->vSendMsg.push_back(vQueue.front());
+            pnode->nSendCommitted += nSize;
+            vQueue.pop_front();
+        }
+
+        // Lower classes wait until this one has drained
+        if (!vQueue.empty())
+            return;
+    }
+}
+
+// Write as much of the send queue as the socket will take.  Returns false if
+// the queue was in use by another thread.  fBlockedRet is set if the socket
+// could not take everything that was queued.
+static bool SocketSendData(CNode* pnode, bool& fBlockedRet)
+{
+    fBlockedRet = false;
+    TRY_CRITICAL_BLOCK(pnode->cs_vSend)
+    {
+        loop
+        {
+            ScheduleSendData(pnode);
+            if (pnode->vSendMsg.empty() || fBlockedRet)
+                break;
 
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // Gather the queued buffers into a single write
+#ifdef WIN32
+            const vector<char>& vch = *pnode->vSendMsg.front();
+            unsigned int nRequested = vch.size() - pnode->nSendOffset;
+            int nBytes = send(pnode->hSocket, &vch[pnode->nSendOffset], nRequested, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+            struct iovec iov[64];
+            int nIov = 0;
+            unsigned int nRequested = 0;
+            for (deque<CMessageBuffer>::iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nIov < ARRAYLEN(iov); ++it, ++nIov)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                unsigned int nOffset = (nIov == 0 ? pnode->nSendOffset : 0);
+                iov[nIov].iov_base = (void*)(&(**it)[0] + nOffset);
+                iov[nIov].iov_len = (*it)->size() - nOffset;
+                nRequested += iov[nIov].iov_len;
+            }
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = nIov;
+            int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+            if (nBytes > 0)
+            {
+                fBlockedRet = (nBytes < nRequested);
+                pnode->nLastSend = GetTime();
+                pnode->nSendSize -= nBytes;
+                pnode->nSendCommitted -= nBytes;
+
+                // Drop the buffers that have been written in full
+                unsigned int nSent = nBytes;
+                while (nSent > 0)
                 {
-                    bool fDelete = false;
-                    TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                     TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
-                      TRY_CRITICAL_BLOCK(pnode->cs_mapRequests)
-                       TRY_CRITICAL_BLOCK(pnode->cs_inventory)
-                        fDelete = true;
-                    if (fDelete)
+                    unsigned int nRemaining = pnode->vSendMsg.front()->size() - pnode->nSendOffset;
+                    if (nSent < nRemaining)
+                    {
+                        pnode->nSendOffset += nSent;
+                        break;
+                    }
+                    nSent -= nRemaining;
+                    pnode->nSendOffset = 0;
+                    pnode->vSendMsg.pop_front();
+                }
+            }
+            else
+            {
+                fBlockedRet = true;
+                if (nBytes < 0)
+                {
+                    // error
+                    int nErr = WSAGetLastError();
+                    if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                     {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        printf("socket send error %d\n", nErr);
+                        pnode->CloseSocketDisconnect();
                     }
                 }
             }
         }
+        if (pnode->nSendSize > SendBufferSize()) {
+            if (!pnode->fDisconnect)
+                printf("socket send flood control disconnect (%"PRI64u" bytes)\n", pnode->nSendSize);
+            pnode->CloseSocketDisconnect();
+        }
+        return true;
+    }
+    return false;
+}
+
+static void CheckInactivity(CNode* pnode)
+{
+    if (pnode->nSendSize == 0)
+        pnode->nLastSendEmpty = GetTime();
+    if (GetTime() - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
+        {
+            printf("socket not sending\n");
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastRecv > 90*60)
+        {
+            printf("socket inactivity timeout\n");
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+void static SocketHandlerSelect()
+{
+    list<CNode*> vNodesDisconnected;
+    int nPrevNodeCount = 0;
+
+    loop
+    {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(vNodesDisconnected);
         if (vNodes.size() != nPrevNodeCount)
         {
             nPrevNodeCount = vNodes.size();
@@ -645,7 +1158,7 @@ void ThreadSocketHandler2(void* parg)
         //
         struct timeval timeout;
         timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+        timeout.tv_usec = 50000; // frequency to poll pnode->vSendMsg
 
         fd_set fdsetRecv;
         fd_set fdsetSend;
@@ -668,8 +1181,11 @@ void ThreadSocketHandler2(void* parg)
                 FD_SET(pnode->hSocket, &fdsetError);
                 hSocketMax = max(hSocketMax, pnode->hSocket);
                 TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                    if (!pnode->vSend.empty())
+                {
+                    ScheduleSendData(pnode);
+                    if (!pnode->vSendMsg.empty())
                         FD_SET(pnode->hSocket, &fdsetSend);
+                }
             }
         }
 
@@ -697,46 +1213,7 @@ void ThreadSocketHandler2(void* parg)
         // Accept new connections
         //
         if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-            struct sockaddr_in sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                addr = CAddress(sockaddr);
-
-            CRITICAL_BLOCK(cs_vNodes)
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                if (pnode->fInbound)
-                    nInbound++;
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                if (WSAGetLastError() != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", WSAGetLastError());
-            }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-            {
-                CRITICAL_BLOCK(cs_setservAddNodeAddresses)
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                closesocket(hSocket);
-            }
-            else
-            {
-                printf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, true);
-                pnode->AddRef();
-                CRITICAL_BLOCK(cs_vNodes)
-                    vNodes.push_back(pnode);
-            }
-        }
+            AcceptConnection();
 
 
         //
@@ -761,46 +1238,8 @@ void ThreadSocketHandler2(void* parg)
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
             {
-                TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
-                {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
-
-                    if (nPos > ReceiveBufferSize()) {
-                        if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%d bytes)\n", vRecv.size());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vRecv.resize(nPos + nBytes);
-                            memcpy(&vRecv[nPos], pchBuf, nBytes);
-                            pnode->nLastRecv = GetTime();
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                printf("socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    printf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                bool fDrained;
+                SocketRecvData(pnode, fDrained);
             }
 
             //
@@ -810,69 +1249,185 @@ void ThreadSocketHandler2(void* parg)
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetSend))
             {
-                TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
-                    {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                            pnode->nLastSend = GetTime();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                printf("socket send error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                        if (vSend.size() > SendBufferSize()) {
-                            if (!pnode->fDisconnect)
-                                printf("socket send flood control disconnect (%d bytes)\n", vSend.size());
-                            pnode->CloseSocketDisconnect();
-                        }
-                    }
-                }
+                bool fBlocked;
+                SocketSendData(pnode, fBlocked);
             }
 
             //
             // Inactivity checking
             //
-            if (pnode->vSend.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
+            CheckInactivity(pnode);
+        }
+        CRITICAL_BLOCK(cs_vNodes)
+        {
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+
+        Sleep(10);
+    }
+}
+
+#ifdef USE_EPOLL
+void ThreadSocketHandler2(void* parg)
+{
+    bool fSocketEvents = false;
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        fSocketEvents = InitSocketEvents();
+        if (fSocketEvents)
+        {
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                RegisterNodeSocket(pnode);
+        }
+        else
+            CloseSocketEvents();
+    }
+    if (!fSocketEvents)
+    {
+        printf("ThreadSocketHandler started (epoll unavailable, using select)\n");
+        SocketHandlerSelect();
+        return;
+    }
+
+    printf("ThreadSocketHandler started (epoll)\n");
+    list<CNode*> vNodesDisconnected;
+    int nPrevNodeCount = 0;
+    int64 nLastHousekeeping = 0;
+    bool fProgress = true;
+
+    loop
+    {
+        //
+        // Disconnect nodes and check for inactivity, a few times a second
+        // rather than on every wakeup
+        //
+        if (GetTimeMillis() - nLastHousekeeping >= 100)
+        {
+            nLastHousekeeping = GetTimeMillis();
+            DisconnectNodes(vNodesDisconnected);
+            CRITICAL_BLOCK(cs_vNodes)
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
+                BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    printf("socket not sending\n");
-                    pnode->fDisconnect = true;
+                    CheckInactivity(pnode);
+
+                    // Retry sends held back by the upload rate limits
+                    if (pnode->nSendSize > pnode->nSendCommitted)
+                        setNodesReady.insert(pnode);
                 }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
+                if (vNodes.size() != nPrevNodeCount)
                 {
-                    printf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
+                    nPrevNodeCount = vNodes.size();
+                    MainFrameRepaint();
                 }
             }
         }
-        CRITICAL_BLOCK(cs_vNodes)
+
+        //
+        // Wait for socket events or queued sends
+        //
+        int nTimeout = 100;
+        if (!setNodesReady.empty())
+            nTimeout = fProgress ? 0 : 10;
+        struct epoll_event events[256];
+
+        vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+        int nEvents = epoll_wait(hEpoll, events, ARRAYLEN(events), nTimeout);
+        vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+        if (fShutdown)
+            return;
+        if (nEvents < 0)
         {
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            if (errno != EINTR)
+            {
+                printf("socket epoll_wait error %d\n", errno);
+                Sleep(10);
+            }
+            nEvents = 0;
         }
 
-        Sleep(10);
+        for (int i = 0; i < nEvents; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                char pchBuf[256];
+                while (read(hWakeupPipe[0], pchBuf, sizeof(pchBuf)) > 0)
+                    ;
+                continue;
+            }
+            if (events[i].data.ptr == &hListenSocket)
+            {
+                AcceptConnection();
+                continue;
+            }
+            CNode* pnode = (CNode*)events[i].data.ptr;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                pnode->fSocketReadable = true;
+            if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                pnode->fSocketWritable = true;
+            setNodesReady.insert(pnode);
+        }
+        CRITICAL_BLOCK(cs_setNodesSendPending)
+        {
+            setNodesReady.insert(setNodesSendPending.begin(), setNodesSendPending.end());
+            setNodesSendPending.clear();
+        }
+
+        //
+        // Service the sockets that are ready, keeping the ones that still
+        // have work for the next pass
+        //
+        vector<CNode*> vNodesReady(setNodesReady.begin(), setNodesReady.end());
+        setNodesReady.clear();
+        fProgress = false;
+        BOOST_FOREACH(CNode* pnode, vNodesReady)
+        {
+            if (fShutdown)
+                return;
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+
+            bool fRetry = false;
+            if (pnode->fSocketReadable)
+            {
+                bool fDrained;
+                if (SocketRecvData(pnode, fDrained))
+                {
+                    fProgress = true;
+                    if (fDrained)
+                        pnode->fSocketReadable = false;
+                }
+                fRetry |= pnode->fSocketReadable;
+            }
+
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (pnode->fSocketWritable)
+            {
+                bool fBlocked;
+                if (SocketSendData(pnode, fBlocked))
+                {
+                    fProgress = true;
+                    if (fBlocked)
+                        pnode->fSocketWritable = false;
+                }
+                else
+                    fRetry = true;
+            }
+
+            if (fRetry)
+                setNodesReady.insert(pnode);
+        }
     }
 }
+#else
+void ThreadSocketHandler2(void* parg)
+{
+    printf("ThreadSocketHandler started\n");
+    SocketHandlerSelect();
+}
+#endif
 
 #ifdef USE_UPNP
 void ThreadMapPort(void* parg)
@@ -1112,9 +1667,18 @@ void DumpAddresses()
 void ThreadDumpAddress2(void* parg)
 {
     vnThreadsRunning[THREAD_DUMPADDRESS]++;
+    int64 nLastMempoolDump = GetTime();
     while (!fShutdown)
     {
         DumpAddresses();
+
+        // The memory pool is saved at shutdown too, this just limits what
+        // a crash loses
+        if (GetTime() - nLastMempoolDump > 15 * 60 && GetBoolArg("-persistmempool", true))
+        {
+            DumpMempool();
+            nLastMempoolDump = GetTime();
+        }
         vnThreadsRunning[THREAD_DUMPADDRESS]--;
         Sleep(100000);
         vnThreadsRunning[THREAD_DUMPADDRESS]++;
@@ -1376,74 +1940,172 @@ bool OpenNetworkConnection(const CAddress& addrConnect)
 
 
 
+// The coordinator and every worker count themselves in
+// vnThreadsRunning[THREAD_MESSAGEHANDLER], so updates to it go through here
+static CCriticalSection cs_messageHandlerRunning;
+
+void static AddMessageHandlerRunning(int n)
+{
+    CRITICAL_BLOCK(cs_messageHandlerRunning)
+        vnThreadsRunning[THREAD_MESSAGEHANDLER] += n;
+}
+
 void ThreadMessageHandler(void* parg)
 {
     IMPLEMENT_RANDOMIZE_STACK(ThreadMessageHandler(parg));
     try
     {
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
+        AddMessageHandlerRunning(1);
         ThreadMessageHandler2(parg);
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
+        AddMessageHandlerRunning(-1);
     }
     catch (std::exception& e) {
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
+        AddMessageHandlerRunning(-1);
         PrintException(&e, "ThreadMessageHandler()");
     } catch (...) {
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
+        AddMessageHandlerRunning(-1);
         PrintException(NULL, "ThreadMessageHandler()");
     }
     printf("ThreadMessageHandler exiting\n");
 }
 
+//
+// Message handling is event driven: the socket thread signals a node as soon
+// as a complete message has been framed, and PushInventory signals it when
+// there is something new to announce.  Signalled nodes go on a ready queue
+// served by a pool of worker threads.  A node is only ever handled by one
+// worker at a time, so messages from each peer are still processed in order;
+// a node signalled while busy is requeued once its worker is done with it.
+//
+static boost::mutex mutexMessageHandler;
+static boost::condition_variable condMessageHandler;
+static deque<CNode*> vNodesHandlerQueue;
+
+void SignalMessageHandler(CNode* pnode)
+{
+    boost::mutex::scoped_lock lock(mutexMessageHandler);
+    if (pnode->fHandlerQueued)
+        return;
+    pnode->fHandlerQueued = true;
+    if (!pnode->fHandlerBusy)
+    {
+        pnode->AddRef();
+        vNodesHandlerQueue.push_back(pnode);
+        condMessageHandler.notify_one();
+    }
+}
+
 void ThreadMessageHandler2(void* parg)
 {
     printf("ThreadMessageHandler started\n");
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (!fShutdown)
     {
-        vector<CNode*> vNodesCopy;
+        // Periodically give every node a turn so that time based work in
+        // SendMessages (trickled inventory, addr relay, getdata requests,
+        // keepalive pings) still happens when nothing was signalled.
         CRITICAL_BLOCK(cs_vNodes)
         {
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
-
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
-        {
-            // Receive messages
-            TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
-                ProcessMessages(pnode);
-            if (fShutdown)
-                return;
-
-            // Send messages
-            TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                SendMessages(pnode, pnode == pnodeTrickle);
-            if (fShutdown)
-                return;
-        }
-
-        CRITICAL_BLOCK(cs_vNodes)
-        {
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            if (!vNodes.empty())
+            {
+                CNode* pnodeTrickle = vNodes[GetRand(vNodes.size())];
+                boost::mutex::scoped_lock lock(mutexMessageHandler);
+                pnodeTrickle->fTrickleDue = true;
+            }
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                SignalMessageHandler(pnode);
         }
 
-        // Wait and allow messages to bunch up.
         // Reduce vnThreadsRunning so StopNode has permission to exit while
         // we're sleeping, but we must always check fShutdown after doing this.
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
+        AddMessageHandlerRunning(-1);
         Sleep(100);
         if (fRequestShutdown)
             Shutdown(NULL);
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
+        AddMessageHandlerRunning(1);
+    }
+
+    // Wake up the workers so they see fShutdown
+    boost::mutex::scoped_lock lock(mutexMessageHandler);
+    condMessageHandler.notify_all();
+}
+
+void ThreadMessageWorker(void* parg)
+{
+    IMPLEMENT_RANDOMIZE_STACK(ThreadMessageWorker(parg));
+    try
+    {
+        AddMessageHandlerRunning(1);
+        ThreadMessageWorker2(parg);
+        AddMessageHandlerRunning(-1);
+    }
+    catch (std::exception& e) {
+        AddMessageHandlerRunning(-1);
+        PrintException(&e, "ThreadMessageWorker()");
+    } catch (...) {
+        AddMessageHandlerRunning(-1);
+        PrintException(NULL, "ThreadMessageWorker()");
+    }
+    printf("ThreadMessageWorker exiting\n");
+}
+
+void ThreadMessageWorker2(void* parg)
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (!fShutdown)
+    {
+        // Wait for a node to be signalled
+        CNode* pnode = NULL;
+        bool fSendTrickle = false;
+        {
+            boost::mutex::scoped_lock lock(mutexMessageHandler);
+            if (vNodesHandlerQueue.empty())
+            {
+                AddMessageHandlerRunning(-1);
+                condMessageHandler.timed_wait(lock, boost::posix_time::milliseconds(100));
+                AddMessageHandlerRunning(1);
+                continue;
+            }
+            pnode = vNodesHandlerQueue.front();
+            vNodesHandlerQueue.pop_front();
+            pnode->fHandlerQueued = false;
+            pnode->fHandlerBusy = true;
+            fSendTrickle = pnode->fTrickleDue;
+            pnode->fTrickleDue = false;
+        }
+
+        // Receive messages
+        ProcessMessages(pnode);
         if (fShutdown)
             return;
+
+        // Send messages
+        bool fSent = false;
+        TRY_CRITICAL_BLOCK(pnode->cs_vSend)
+        {
+            SendMessages(pnode, fSendTrickle);
+            fSent = true;
+        }
+        if (fShutdown)
+            return;
+
+        bool fRequeue = false;
+        {
+            boost::mutex::scoped_lock lock(mutexMessageHandler);
+            pnode->fHandlerBusy = false;
+            if (!fSent && fSendTrickle)
+                pnode->fTrickleDue = true;
+            if (pnode->fHandlerQueued)
+            {
+                // Signalled again while we were busy, keep our reference
+                vNodesHandlerQueue.push_back(pnode);
+                condMessageHandler.notify_one();
+                fRequeue = true;
+            }
+        }
+        if (!fRequeue)
+            CRITICAL_BLOCK(cs_vNodes)
+                pnode->Release();
     }
 }
 
@@ -1542,6 +2204,9 @@ void StartNode(void* parg)
 #endif
 #endif
 
+    nMaxUploadRate = 1000 * GetArg("-maxuploadrate", 0);
+    nPeerUploadRate = 1000 * GetArg("-peeruploadrate", 0);
+
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
@@ -1639,8 +2304,14 @@ void StartNode(void* parg)
         printf("Error: CreateThread(ThreadOpenConnections) failed\n");
 
     // Process messages
+    InitMessageSalts();
     if (!CreateThread(ThreadMessageHandler, NULL))
         printf("Error: CreateThread(ThreadMessageHandler) failed\n");
+    int nMessageWorkers = GetArg("-msghandlerthreads", 2);
+    nMessageWorkers = max(1, min(nMessageWorkers, 16));
+    for (int i = 0; i < nMessageWorkers; i++)
+        if (!CreateThread(ThreadMessageWorker, NULL))
+            printf("Error: CreateThread(ThreadMessageWorker) failed\n");
 
     // Dump network addresses
     if (!CreateThread(ThreadDumpAddress, NULL))
@@ -1676,7 +2347,13 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_DNSSEED] > 0) printf("ThreadDNSAddressSeed still running\n");
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
-    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCSERVER] > 0)
+    if (vnThreadsRunning[THREAD_TEMPLATE] > 0) printf("ThreadBlockTemplate still running\n");
+    if (vnThreadsRunning[THREAD_LOADMEMPOOL] > 0) printf("ThreadLoadMemoryPool still running\n");
+    if (vnThreadsRunning[THREAD_KEYPOOL] > 0) printf("ThreadTopUpKeyPool still running\n");
+    // The memory pool loader and the keypool refill use the wallet, which
+    // is deleted after this
+    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCSERVER] > 0 ||
+           vnThreadsRunning[THREAD_LOADMEMPOOL] > 0 || vnThreadsRunning[THREAD_KEYPOOL] > 0)
         Sleep(20);
     Sleep(50);
     DumpAddresses();
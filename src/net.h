@@ -8,7 +8,9 @@
 
 #include <deque>
 #include <boost/array.hpp>
+#include <boost/detail/atomic_count.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
@@ -32,6 +34,27 @@ inline unsigned int ReceiveBufferSize() { return 1000*GetArg("-maxreceivebuffer"
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 10*1000); }
 static const unsigned int PUBLISH_HOPS = 5;
 
+/** A complete message, header and payload, ready to be written to a socket.
+ *  Buffers are not modified once built, so the same one can be queued to
+ *  every peer a block or transaction is relayed to. */
+typedef boost::shared_ptr<const std::vector<char> > CMessageBuffer;
+
+CMessageBuffer BuildMessage(const char* pszCommand, const CDataStream& ssPayload);
+
+/** Outbound traffic classes, highest priority first.  Queued messages are
+ *  handed to the socket in this order, and everything below
+ *  SEND_PRIORITY_BLOCK is subject to -maxuploadrate and -peeruploadrate. */
+enum
+{
+    SEND_PRIORITY_BLOCK = 0,    // new blocks, and small control messages
+    SEND_PRIORITY_TX,
+    SEND_PRIORITY_HISTORIC,     // old blocks served to peers that are syncing
+    SEND_PRIORITY_ADDR,
+    SEND_PRIORITY_MAX
+};
+
+int GetSendPriority(const char* pszCommand);
+const char* GetSendPriorityName(int nPriority);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 bool GetMyExternalIP(CNetAddr& ipRet);
 void AddressCurrentlyConnected(const CService& addr);
@@ -44,6 +67,8 @@ void MapPort(bool fMapPort);
 bool BindListenPort(std::string& strError=REF(std::string()));
 void StartNode(void* parg);
 bool StopNode();
+void WakeSocketHandler(CNode* pnode);
+void SignalMessageHandler(CNode* pnode);
 
 enum
 {
@@ -82,6 +107,9 @@ enum threadId
     THREAD_DNSSEED,
     THREAD_ADDEDCONNECTIONS,
     THREAD_DUMPADDRESS,
+    THREAD_TEMPLATE,
+    THREAD_LOADMEMPOOL,
+    THREAD_KEYPOOL,
 
     THREAD_MAX
 };
@@ -96,12 +124,62 @@ extern CAddrMan addrman;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CMessageBuffer> mapRelay;
 extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64> mapAlreadyAskedFor;
 
+extern CCriticalSection cs_sendScheduler;
+extern uint64 vnTotalBytesSent[SEND_PRIORITY_MAX];
+extern uint64 nTotalBytesRecv;
+extern uint64 nSendThrottled;
+
+
+
+
+
+
+
+/** A single network message as it is framed off the wire.  The header is
+ * parsed as soon as its 24 bytes are in, after which the payload is appended
+ * to vRecv and fed to the checksum as it arrives, so a message is ready to be
+ * verified the moment its last byte is read.
+ */
+class CNetMessage
+{
+public:
+    bool fInData;
+
+    // parsing header (fInData == false)
+    CDataStream hdrbuf;
+    CMessageHeader hdr;
+    unsigned int nHdrPos;
+
+    // parsing payload (fInData == true)
+    CDataStream vRecv;
+    unsigned int nDataPos;
+    SHA256_CTX ctxChecksum;
+
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    {
+        hdrbuf.resize(HEADER_SIZE);
+        fInData = false;
+        nHdrPos = 0;
+        nDataPos = 0;
+        SHA256_Init(&ctxChecksum);
+    }
+
+    enum { HEADER_SIZE = sizeof(::pchMessageStart) + CMessageHeader::COMMAND_SIZE + 2 * sizeof(unsigned int) };
+
+    bool IsComplete() const
+    {
+        return fInData && nDataPos == hdr.nMessageSize;
+    }
 
+    int ReadHeader(const char* pch, unsigned int nBytes);
+    int ReadData(const char* pch, unsigned int nBytes);
+    bool CheckChecksum(unsigned int& nChecksumRet) const;
+};
 
 
 
@@ -114,7 +192,18 @@ public:
     uint64 nServices;
     SOCKET hSocket;
     CDataStream vSend;
-    CDataStream vRecv;
+    std::deque<CMessageBuffer> vSendMsg;
+    std::deque<CMessageBuffer> vSendQueue[SEND_PRIORITY_MAX];
+    int nSendPriority;
+    unsigned int nSendOffset;
+    uint64 nSendSize;
+    uint64 nSendCommitted;
+    int64 nSendTokens;
+    int64 nSendTokensTime;
+    uint64 vnBytesSent[SEND_PRIORITY_MAX];
+    std::deque<CNetMessage> vRecvMsg;
+    unsigned int nRecvSize;
+    int nRecvVersion;
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
     int64 nLastSend;
@@ -131,8 +220,15 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    bool fSocketReadable;
+    bool fSocketWritable;
+    bool fHandlerQueued;
+    bool fHandlerBusy;
+    bool fTrickleDue;
 protected:
-    int nRefCount;
+    // Taken by the socket thread and the message handler workers as well as
+    // under cs_vNodes, so it has to be updated atomically
+    boost::detail::atomic_count nRefCount;
 
     // Denial-of-service detection/prevention
     // Key is ip address, value is banned-until-time
@@ -148,12 +244,19 @@ public:
     CBlockIndex* pindexLastGetBlocksBegin;
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
+    int nBlocksInFlight;
+    int64 nBlockLatency;
+    uint64 nOrphanBlockBytes;
+    uint64 nOrphanTxBytes;
+    std::deque<uint256> vBlocksToDownload;
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
+    CCriticalSection cs_vAddrToSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
+    std::vector<uint256> vAlertToSend;
 
     // inventory based relay
     mruset<CInv> setInventoryKnown;
@@ -164,14 +267,22 @@ public:
     // publish and subscription
     std::vector<char> vfSubscribe;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, bool fInboundIn=false)
+    CNode(SOCKET hSocketIn, CAddress addrIn, bool fInboundIn=false) : nRefCount(0)
     {
         nServices = 0;
         hSocket = hSocketIn;
         vSend.SetType(SER_NETWORK);
-        vRecv.SetType(SER_NETWORK);
         vSend.SetVersion(209);
-        vRecv.SetVersion(209);
+        nRecvSize = 0;
+        nRecvVersion = 209;
+        nSendPriority = SEND_PRIORITY_BLOCK;
+        nSendOffset = 0;
+        nSendSize = 0;
+        nSendCommitted = 0;
+        nSendTokens = 0;
+        nSendTokensTime = 0;
+        for (int i = 0; i < SEND_PRIORITY_MAX; i++)
+            vnBytesSent[i] = 0;
         nLastSend = 0;
         nLastRecv = 0;
         nLastSendEmpty = GetTime();
@@ -186,12 +297,20 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
-        nRefCount = 0;
+        fSocketReadable = false;
+        fSocketWritable = false;
+        fHandlerQueued = false;
+        fHandlerBusy = false;
+        fTrickleDue = false;
         nReleaseTime = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
+        nBlocksInFlight = 0;
+        nBlockLatency = 0;
+        nOrphanBlockBytes = 0;
+        nOrphanTxBytes = 0;
         fGetAddr = false;
         vfSubscribe.assign(256, false);
         nMisbehavior = 0;
@@ -219,7 +338,7 @@ public:
 
     int GetRefCount()
     {
-        return std::max(nRefCount, 0) + (GetTime() < nReleaseTime ? 1 : 0);
+        return std::max((long)nRefCount, 0L) + (GetTime() < nReleaseTime ? 1 : 0);
     }
 
     CNode* AddRef(int64 nTimeout=0)
@@ -227,20 +346,21 @@ public:
         if (nTimeout != 0)
             nReleaseTime = std::max(nReleaseTime, GetTime() + nTimeout);
         else
-            nRefCount++;
+            ++nRefCount;
         return this;
     }
 
     void Release()
     {
-        nRefCount--;
+        --nRefCount;
     }
 
 
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        CRITICAL_BLOCK(cs_vAddrToSend)
+            setAddrKnown.insert(addr);
     }
 
     void PushAddress(const CAddress& addr)
@@ -248,8 +368,9 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr))
-            vAddrToSend.push_back(addr);
+        CRITICAL_BLOCK(cs_vAddrToSend)
+            if (addr.IsValid() && !setAddrKnown.count(addr))
+                vAddrToSend.push_back(addr);
     }
 
 
@@ -261,9 +382,24 @@ public:
 
     void PushInventory(const CInv& inv)
     {
+        bool fNew = false;
         CRITICAL_BLOCK(cs_inventory)
             if (!setInventoryKnown.count(inv))
+            {
                 vInventoryToSend.push_back(inv);
+                fNew = true;
+            }
+        if (fNew)
+            SignalMessageHandler(this);
+    }
+
+    // Alerts are relayed by the peer's own message worker, which is the only
+    // thread that touches setKnown or pushes into this node's send buffer
+    void PushAlert(const uint256& hash)
+    {
+        CRITICAL_BLOCK(cs_inventory)
+            vAlertToSend.push_back(hash);
+        SignalMessageHandler(this);
     }
 
     void AskFor(const CInv& inv)
@@ -293,6 +429,7 @@ public:
         if (nHeaderStart != -1)
             AbortMessage();
         nHeaderStart = vSend.size();
+        nSendPriority = GetSendPriority(pszCommand);
         vSend << CMessageHeader(pszCommand, 0);
         nMessageStart = vSend.size();
         if (fDebug) {
@@ -341,11 +478,32 @@ public:
             printf("(%d bytes)\n", nSize);
         }
 
+        // Hand the finished message to the send queue for its class
+        CMessageBuffer msg(new std::vector<char>(vSend.begin() + nHeaderStart, vSend.end()));
+        vSend.resize(nHeaderStart);
+        vSendQueue[nSendPriority].push_back(msg);
+        nSendSize += msg->size();
+
         nHeaderStart = -1;
         nMessageStart = -1;
+        WakeSocketHandler(this);
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
+    void PushMessageBuffer(const CMessageBuffer& msg, int nPriority)
+    {
+        CRITICAL_BLOCK(cs_vSend)
+        {
+            if (fDebug) {
+                printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
+                printf("sending: shared message (%"PRIszu" bytes)\n", msg->size());
+            }
+            vSendQueue[nPriority].push_back(msg);
+            nSendSize += msg->size();
+            WakeSocketHandler(this);
+        }
+    }
+
     void EndMessageAbortIfEmpty()
     {
         if (nHeaderStart == -1)
@@ -565,6 +723,7 @@ public:
     bool IsSubscribed(unsigned int nChannel);
     void Subscribe(unsigned int nChannel, unsigned int nHops=0);
     void CancelSubscribe(unsigned int nChannel);
+    bool ReceiveMsgBytes(const char* pch, unsigned int nBytes);
     void CloseSocketDisconnect();
     void Cleanup();
 
@@ -626,8 +785,9 @@ inline void RelayMessage<>(const CInv& inv, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay[inv] = ss;
+        // Save original serialized message so newer versions are preserved,
+        // built once as a complete message to be shared by every peer that asks
+        mapRelay[inv] = BuildMessage(inv.GetCommand(), ss);
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
@@ -46,17 +46,42 @@ public:
     }
 };
 
+// First block a key created at nBirth (a height, or a unix time as for
+// nLockTime) could have been used in.  Block times can be off by a couple
+// of hours, so start that much earlier.
+CBlockIndex* GetRescanStart(int64 nBirth)
+{
+    if (nBirth < LOCKTIME_THRESHOLD)
+    {
+        CBlockIndex* pindex = pindexBest;
+        while (pindex && pindex->pprev && pindex->nHeight > nBirth)
+            pindex = pindex->pprev;
+        return pindex;
+    }
+    CBlockIndex* pindex = pindexBest;
+    while (pindex && pindex->pprev && pindex->GetBlockTime() >= nBirth - 2 * 60 * 60)
+        pindex = pindex->pprev;
+    return pindex;
+}
+
 Value importprivkey(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() < 1 || params.size() > 2)
+    if (fHelp || params.size() < 1 || params.size() > 3)
         throw runtime_error(
-            "importprivkey <bitcoinprivkey> [label]\n"
-            "Adds a private key (as returned by dumpprivkey) to your wallet.");
+            "importprivkey <bitcoinprivkey> [label] [birth]\n"
+            "Adds a private key (as returned by dumpprivkey) to your wallet.\n"
+            "[birth] is the block height, or unix time, the key was created at;\n"
+            "the rescan for its transactions starts there instead of at genesis.");
 
     string strSecret = params[0].get_str();
     string strLabel = "";
     if (params.size() > 1)
         strLabel = params[1].get_str();
+    int64 nBirth = 0;
+    if (params.size() > 2)
+        nBirth = params[2].get_int64();
+    if (nBirth < 0)
+        throw JSONRPCError(-8, "Invalid birth height or time");
     CBitcoinSecret vchSecret;
     bool fGood = vchSecret.SetString(strSecret);
 
@@ -77,7 +102,7 @@ Value importprivkey(const Array& params, bool fHelp)
         if (!pwalletMain->AddKey(key))
             throw JSONRPCError(-4,"Error adding key to wallet");
 
-        pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
+        pwalletMain->ScanForWalletTransactions(GetRescanStart(nBirth), true);
         pwalletMain->ReacceptWalletTransactions();
     }
 
@@ -5,6 +5,9 @@
 // file license.txt or http://www.opensource.org/licenses/mit-license.php.
 #include "headers.h"
 
+#include <boost/tuple/tuple.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
+
 using namespace std;
 using namespace boost;
 
@@ -1094,13 +1097,55 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 }
 
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+// Valid signatures are remembered, so a transaction checked when it entered
+// the memory pool (or checked ahead of time on another thread) isn't
+// verified again when it shows up in a block
+class CSignatureCache
 {
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
+private:
+    // sighash, signature, public key
+    typedef boost::tuple<uint256, valtype, valtype> sigdata_type;
+    set<sigdata_type> setValid;
+    CCriticalSection cs_sigcache;
+
+public:
+    bool Get(const uint256& hash, const valtype& vchSig, const valtype& vchPubKey)
+    {
+        CRITICAL_BLOCK(cs_sigcache)
+            return setValid.count(sigdata_type(hash, vchSig, vchPubKey)) != 0;
         return false;
+    }
+
+    void Set(const uint256& hash, const valtype& vchSig, const valtype& vchPubKey)
+    {
+        unsigned int nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
+        if (nMaxCacheSize == 0)
+            return;
+
+        CRITICAL_BLOCK(cs_sigcache)
+        {
+            while (setValid.size() >= nMaxCacheSize)
+            {
+                // Evict a random entry, random because that helps
+                // foil would-be DoS attackers who might try to pre-generate
+                // and re-use a set of valid signatures just-slightly-greater
+                // than our cache size.
+                std::vector<unsigned char> randbytes(32);
+                RAND_bytes(&randbytes[0], 32);
+                set<sigdata_type>::iterator it = setValid.lower_bound(sigdata_type(uint256(randbytes), valtype(), valtype()));
+                if (it == setValid.end())
+                    it = setValid.begin();
+                setValid.erase(it);
+            }
+            setValid.insert(sigdata_type(hash, vchSig, vchPubKey));
+        }
+    }
+};
+static CSignatureCache signatureCache;
 
+bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
         return false;
@@ -1110,7 +1155,18 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         return false;
     vchSig.pop_back();
 
-    return key.Verify(SignatureHash(scriptCode, txTo, nIn, nHashType), vchSig);
+    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    if (signatureCache.Get(sighash, vchSig, vchPubKey))
+        return true;
+
+    CKey key;
+    if (!key.SetPubKey(vchPubKey))
+        return false;
+    if (!key.Verify(sighash, vchSig))
+        return false;
+
+    signatureCache.Set(sighash, vchSig, vchPubKey);
+    return true;
 }
 
 
@@ -19,6 +19,7 @@
 #include <boost/tuple/tuple.hpp>
 #include <boost/tuple/tuple_comparison.hpp>
 #include <boost/tuple/tuple_io.hpp>
+#include <boost/shared_ptr.hpp>
 
 typedef long long  int64;
 typedef unsigned long long  uint64;
@@ -395,6 +396,11 @@ template<typename K, typename Pred, typename A> unsigned int GetSerializeSize(co
 template<typename Stream, typename K, typename Pred, typename A> void Serialize(Stream& os, const std::set<K, Pred, A>& m, int nType, int nVersion=PROTOCOL_VERSION);
 template<typename Stream, typename K, typename Pred, typename A> void Unserialize(Stream& is, std::set<K, Pred, A>& m, int nType, int nVersion=PROTOCOL_VERSION);
 
+// shared immutable object
+template<typename T> unsigned int GetSerializeSize(const boost::shared_ptr<const T>& p, int nType, int nVersion=PROTOCOL_VERSION);
+template<typename Stream, typename T> void Serialize(Stream& os, const boost::shared_ptr<const T>& p, int nType, int nVersion=PROTOCOL_VERSION);
+template<typename Stream, typename T> void Unserialize(Stream& is, boost::shared_ptr<const T>& p, int nType, int nVersion=PROTOCOL_VERSION);
+
 
 
 
@@ -738,6 +744,31 @@ void Unserialize(Stream& is, std::set<K, Pred, A>& m, int nType, int nVersion)
 
 
 
+//
+// shared immutable object, serialized as the object itself
+//
+template<typename T>
+unsigned int GetSerializeSize(const boost::shared_ptr<const T>& p, int nType, int nVersion)
+{
+    return GetSerializeSize(*p, nType, nVersion);
+}
+
+template<typename Stream, typename T>
+void Serialize(Stream& os, const boost::shared_ptr<const T>& p, int nType, int nVersion)
+{
+    Serialize(os, *p, nType, nVersion);
+}
+
+template<typename Stream, typename T>
+void Unserialize(Stream& is, boost::shared_ptr<const T>& p, int nType, int nVersion)
+{
+    T* pobj = new T();
+    p.reset(pobj);
+    Unserialize(is, *pobj, nType, nVersion);
+}
+
+
+
 //
 // Support for IMPLEMENT_SERIALIZE and READWRITE macro
 //
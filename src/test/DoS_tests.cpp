@@ -13,10 +13,11 @@
 #include <stdint.h>
 
 // Tests this internal-to-main.cpp method:
-extern void AddOrphanTx(const CDataStream& vMsg);
-extern int LimitOrphanTxSize(int nMaxOrphans);
-extern std::map<uint256, CDataStream*> mapOrphanTransactions;
-extern std::multimap<uint256, CDataStream*> mapOrphanTransactionsByPrev;
+extern bool AddOrphanTx(const CTransaction& tx, CNode* pfrom);
+extern int LimitOrphanTxSize(unsigned int nMaxOrphans, uint64 nMaxBytes);
+extern std::map<uint256, COrphanTx> mapOrphanTransactions;
+extern std::multimap<uint256, boost::shared_ptr<CTransaction> > mapOrphanTransactionsByPrev;
+extern uint64 nOrphanTxBytes;
 
 CService ip(uint32_t i)
 {
@@ -139,14 +140,11 @@ static uint256 RandomHash()
 
 CTransaction RandomOrphan()
 {
-    std::map<uint256, CDataStream*>::iterator it;
+    std::map<uint256, COrphanTx>::iterator it;
     it = mapOrphanTransactions.lower_bound(RandomHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    const CDataStream* pvMsg = it->second;
-    CTransaction tx;
-    CDataStream(*pvMsg) >> tx;
-    return tx;
+    return *it->second.ptx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -168,9 +166,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetBitcoinAddress(key.GetPubKey());
 
-        CDataStream ds;
-        ds << tx;
-        AddOrphanTx(ds);
+        AddOrphanTx(tx, NULL);
     }
 
     // ... and 50 that depend on other orphans:
@@ -187,19 +183,45 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey.SetBitcoinAddress(key.GetPubKey());
         SignSignature(keystore, txPrev, tx, 0);
 
-        CDataStream ds;
-        ds << tx;
-        AddOrphanTx(ds);
+        AddOrphanTx(tx, NULL);
+    }
+
+    // This really-big orphan should be ignored:
+    for (int i = 0; i < 10; i++)
+    {
+        CTransaction txPrev = RandomOrphan();
+
+        CTransaction tx;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1*CENT;
+        tx.vout[0].scriptPubKey.SetBitcoinAddress(key.GetPubKey());
+        tx.vin.resize(500);
+        for (int j = 0; j < tx.vin.size(); j++)
+        {
+            tx.vin[j].prevout.n = j;
+            tx.vin[j].prevout.hash = txPrev.GetHash();
+        }
+        SignSignature(keystore, txPrev, tx, 0);
+        // Re-use same signature for other inputs
+        // (they don't have to be valid for this test)
+        for (int j = 1; j < tx.vin.size(); j++)
+            tx.vin[j].scriptSig = tx.vin[0].scriptSig;
+
+        BOOST_CHECK(!AddOrphanTx(tx, NULL));
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, MAX_ORPHAN_TX_BYTES);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, MAX_ORPHAN_TX_BYTES);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    uint64 nBytes = nOrphanTxBytes;
+    LimitOrphanTxSize(10, nBytes / 2);
+    BOOST_CHECK(nOrphanTxBytes <= nBytes / 2);
+    LimitOrphanTxSize(0, MAX_ORPHAN_TX_BYTES);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(nOrphanTxBytes == 0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
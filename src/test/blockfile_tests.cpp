@@ -0,0 +1,199 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "wallet.h"
+
+#include <zlib.h>
+
+BOOST_AUTO_TEST_SUITE(blockfile_tests)
+
+static CBlock MakeBlock()
+{
+    CBlock block;
+    block.nVersion = 1;
+    block.nTime = 1317972665;
+    block.nBits = 0x1e0ffff0;
+    block.nNonce = 2084524493;
+
+    CTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vin[0].scriptSig = CScript() << 486604799 << CBigNum(4);
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].nValue = 50 * COIN;
+    txCoinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    block.vtx.push_back(txCoinbase);
+
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(txCoinbase.GetHash(), 0);
+    tx.vin[0].scriptSig = CScript() << OP_TRUE;
+    tx.vout.resize(2);
+    tx.vout[0].nValue = 20 * COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    tx.vout[1].nValue = 30 * COIN;
+    tx.vout[1].scriptPubKey = CScript() << OP_FALSE;
+    block.vtx.push_back(tx);
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+// A file holding just the payload of a block frame, positioned at its start
+static FILE* WritePayload(const std::vector<unsigned char>& vch)
+{
+    FILE* file = tmpfile();
+    if (!vch.empty())
+        fwrite(&vch[0], 1, vch.size(), file);
+    rewind(file);
+    return file;
+}
+
+BOOST_AUTO_TEST_CASE(compress_roundtrip)
+{
+    CBlock block = MakeBlock();
+    std::vector<unsigned char> vch;
+    BOOST_CHECK(CompressBlock(block, vch));
+
+    CDataStream ssBlock(SER_DISK);
+    BOOST_CHECK(DecompressBlock(&vch[0], &vch[0] + vch.size(), ssBlock));
+    BOOST_CHECK_EQUAL(ssBlock.size(), ::GetSerializeSize(block, SER_DISK));
+    CBlock blockOut;
+    ssBlock >> blockOut;
+    BOOST_CHECK(blockOut.GetHash() == block.GetHash());
+    BOOST_CHECK(blockOut.BuildMerkleTree() == block.hashMerkleRoot);
+
+    // truncated before the size, and partway through the zlib stream
+    BOOST_CHECK(!DecompressBlock(&vch[0], &vch[0] + 3, ssBlock));
+    BOOST_CHECK(!DecompressBlock(&vch[0], &vch[0] + vch.size() / 2, ssBlock));
+
+    // a stated size that doesn't match what inflates
+    std::vector<unsigned char> vchBadSize(vch);
+    vchBadSize[0] ^= 1;
+    BOOST_CHECK(!DecompressBlock(&vchBadSize[0], &vchBadSize[0] + vchBadSize.size(), ssBlock));
+
+    // corrupt compressed data
+    std::vector<unsigned char> vchCorrupt(vch);
+    vchCorrupt[vchCorrupt.size() / 2] ^= 0xff;
+    BOOST_CHECK(!DecompressBlock(&vchCorrupt[0], &vchCorrupt[0] + vchCorrupt.size(), ssBlock));
+}
+
+BOOST_AUTO_TEST_CASE(read_compressed_block)
+{
+    // block file numbers well clear of anything else using the cache
+    const unsigned int nFile = 0x7fff0000;
+    const unsigned int nBlockPos = 8;
+    CBlock block = MakeBlock();
+    std::vector<unsigned char> vch;
+    BOOST_CHECK(CompressBlock(block, vch));
+    unsigned int nFrameSize = vch.size() | BLOCK_COMPRESSED_FLAG;
+
+    FILE* file = WritePayload(vch);
+    CBlock blockOut;
+    BOOST_CHECK(ReadCompressedBlock(file, nFrameSize, nFile, nBlockPos, blockOut));
+    BOOST_CHECK(blockOut.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(blockOut.vtx.size(), 2);
+    fclose(file);
+
+    // now cached, a later read doesn't look at the file at all
+    std::vector<unsigned char> vchGarbage(vch.size(), 0xab);
+    file = WritePayload(vchGarbage);
+    CBlock blockCached;
+    BOOST_CHECK(ReadCompressedBlock(file, nFrameSize, nFile, nBlockPos, blockCached));
+    BOOST_CHECK(blockCached.GetHash() == block.GetHash());
+
+    // transactions are found by their offset in the uncompressed block,
+    // the same offsets ConnectBlock puts in CDiskTxPos
+    unsigned int nTxOffset = ::GetSerializeSize(CBlock(), SER_DISK) - 1 + GetSizeOfCompactSize(block.vtx.size());
+    CTransaction tx;
+    BOOST_CHECK(ReadCompressedTx(file, nFrameSize, nFile, nBlockPos, nTxOffset, tx));
+    BOOST_CHECK(tx.GetHash() == block.vtx[0].GetHash());
+    nTxOffset += ::GetSerializeSize(block.vtx[0], SER_DISK);
+    BOOST_CHECK(ReadCompressedTx(file, nFrameSize, nFile, nBlockPos, nTxOffset, tx));
+    BOOST_CHECK(tx.GetHash() == block.vtx[1].GetHash());
+    BOOST_CHECK(!ReadCompressedTx(file, nFrameSize, nFile, nBlockPos, nTxOffset + 1, tx));
+
+    // the header comes out of the cache too
+    CDataStream ssHeader(SER_DISK | SER_BLOCKHEADERONLY);
+    BOOST_CHECK(ReadCompressedBlockHeader(file, nFrameSize, nFile, nBlockPos, ::GetSerializeSize(block, ssHeader.nType), ssHeader));
+    CBlock header;
+    ssHeader >> header;
+    BOOST_CHECK(header.GetHash() == block.GetHash());
+
+    // once forgotten the garbage is read, and rejected
+    ForgetDecompressedBlock(nFile, nBlockPos);
+    rewind(file);
+    BOOST_CHECK(!ReadCompressedBlock(file, nFrameSize, nFile, nBlockPos, blockOut));
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_CASE(read_compressed_header)
+{
+    const unsigned int nFile = 0x7fff0001;
+    const unsigned int nBlockPos = 8;
+    CBlock block = MakeBlock();
+    std::vector<unsigned char> vch;
+    BOOST_CHECK(CompressBlock(block, vch));
+    unsigned int nFrameSize = vch.size() | BLOCK_COMPRESSED_FLAG;
+
+    // not cached, only the header is inflated
+    FILE* file = WritePayload(vch);
+    CDataStream ssHeader(SER_DISK | SER_BLOCKHEADERONLY);
+    BOOST_CHECK(ReadCompressedBlockHeader(file, nFrameSize, nFile, nBlockPos, ::GetSerializeSize(block, ssHeader.nType), ssHeader));
+    CBlock header;
+    ssHeader >> header;
+    BOOST_CHECK(header.GetHash() == block.GetHash());
+    BOOST_CHECK(header.vtx.empty());
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_CASE(read_compressed_bad_frame)
+{
+    const unsigned int nFile = 0x7fff0002;
+    CBlock block = MakeBlock();
+    std::vector<unsigned char> vch;
+    BOOST_CHECK(CompressBlock(block, vch));
+    CBlock blockOut;
+    CTransaction tx;
+
+    // frame says more than the file holds
+    std::vector<unsigned char> vchTruncated(vch.begin(), vch.begin() + vch.size() / 2);
+    FILE* file = WritePayload(vchTruncated);
+    BOOST_CHECK(!ReadCompressedBlock(file, vch.size() | BLOCK_COMPRESSED_FLAG, nFile, 8, blockOut));
+    fclose(file);
+
+    // frame only covers part of the zlib stream
+    file = WritePayload(vch);
+    BOOST_CHECK(!ReadCompressedBlock(file, vchTruncated.size() | BLOCK_COMPRESSED_FLAG, nFile, 16, blockOut));
+    fclose(file);
+
+    // corrupt payload
+    std::vector<unsigned char> vchCorrupt(vch);
+    vchCorrupt[vchCorrupt.size() / 2] ^= 0xff;
+    file = WritePayload(vchCorrupt);
+    BOOST_CHECK(!ReadCompressedTx(file, vchCorrupt.size() | BLOCK_COMPRESSED_FLAG, nFile, 24, 81, tx));
+    fclose(file);
+
+    // inflates fine but isn't a block
+    CTransaction txNotBlock;
+    txNotBlock.vout.resize(1);
+    CDataStream ssNotBlock(SER_DISK);
+    ssNotBlock << txNotBlock;
+    std::vector<unsigned char> vchNotBlock(sizeof(unsigned int) + compressBound(ssNotBlock.size()));
+    unsigned int nRawSize = ssNotBlock.size();
+    memcpy(&vchNotBlock[0], &nRawSize, sizeof(nRawSize));
+    uLongf nCompressedSize = vchNotBlock.size() - sizeof(nRawSize);
+    BOOST_CHECK(compress2(&vchNotBlock[sizeof(nRawSize)], &nCompressedSize, (const Bytef*)&ssNotBlock[0], nRawSize, Z_BEST_COMPRESSION) == Z_OK);
+    vchNotBlock.resize(sizeof(nRawSize) + nCompressedSize);
+    file = WritePayload(vchNotBlock);
+    BOOST_CHECK(!ReadCompressedBlock(file, vchNotBlock.size() | BLOCK_COMPRESSED_FLAG, nFile, 32, blockOut));
+    fclose(file);
+
+    // none of the failures were cached
+    file = WritePayload(vch);
+    BOOST_CHECK(ReadCompressedBlock(file, vch.size() | BLOCK_COMPRESSED_FLAG, nFile, 8, blockOut));
+    BOOST_CHECK(blockOut.GetHash() == block.GetHash());
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,108 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "wallet.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(coinselection_tests)
+
+static int64 SumSelected(const vector<int64>& vValue, const vector<char>& vfBest)
+{
+    int64 nTotal = 0;
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        if (vfBest[i])
+            nTotal += vValue[i];
+    return nTotal;
+}
+
+BOOST_AUTO_TEST_CASE(coinselection_bnb)
+{
+    vector<int64> vValue;
+    for (int i = 5; i >= 1; i--)
+        vValue.push_back(i * COIN);
+
+    vector<char> vfBest;
+    int64 nBest = 0;
+    BOOST_CHECK(SelectCoinsBranchAndBound(vValue, 6 * COIN, vfBest, nBest));
+    BOOST_CHECK_EQUAL(nBest, 6 * COIN);
+    BOOST_CHECK_EQUAL(SumSelected(vValue, vfBest), nBest);
+
+    // less than a cent over is still a match, the closest one wins
+    vValue.push_back(COIN / 2);
+    BOOST_CHECK(SelectCoinsBranchAndBound(vValue, 6 * COIN - CENT / 2, vfBest, nBest));
+    BOOST_CHECK_EQUAL(nBest, 6 * COIN);
+
+    // anything that would need change is left to the fallback
+    BOOST_CHECK(!SelectCoinsBranchAndBound(vValue, COIN / 4, vfBest, nBest));
+    BOOST_CHECK(!SelectCoinsBranchAndBound(vValue, 100 * COIN, vfBest, nBest));
+
+    // lots of identical coins with no match must not blow up
+    vValue.assign(10000, COIN);
+    BOOST_CHECK(!SelectCoinsBranchAndBound(vValue, 5000 * COIN + COIN / 2, vfBest, nBest));
+}
+
+BOOST_AUTO_TEST_CASE(coinselection_knapsack)
+{
+    vector<int64> vValue;
+    vValue.push_back(3 * COIN);
+    vValue.push_back(2 * COIN);
+    vValue.push_back(COIN);
+
+    // aims for a cent of change when there's enough
+    vector<char> vfBest;
+    int64 nBest = 0;
+    BOOST_CHECK(SelectCoinsKnapsack(vValue, 4 * COIN, vfBest, nBest));
+    BOOST_CHECK_EQUAL(nBest, 5 * COIN);
+    BOOST_CHECK_EQUAL(SumSelected(vValue, vfBest), nBest);
+
+    BOOST_CHECK(SelectCoinsKnapsack(vValue, 6 * COIN, vfBest, nBest));
+    BOOST_CHECK_EQUAL(nBest, 6 * COIN);
+
+    BOOST_CHECK(!SelectCoinsKnapsack(vValue, 7 * COIN, vfBest, nBest));
+
+    BOOST_CHECK(GetCoinSelection("bnb") == &SelectCoinsBranchAndBound);
+    BOOST_CHECK(GetCoinSelection("knapsack") == &SelectCoinsKnapsack);
+    BOOST_CHECK(GetCoinSelection("foo") == NULL);
+}
+
+// Many small coins, as seen on payout wallets, from a fixed seed so every
+// run checks the same wallet.  bench/bench_coinselection.cpp times this.
+BOOST_AUTO_TEST_CASE(coinselection_many_coins)
+{
+    vector<int64> vValue;
+    uint64 nSeed = 42;
+    int64 nTotal = 0;
+    for (int i = 0; i < 2000; i++)
+    {
+        nSeed = nSeed * 6364136223846793005ULL + 1442695040888963407ULL;
+        int64 n = CENT / 10 + (nSeed >> 33) % (10 * COIN);
+        vValue.push_back(n);
+        nTotal += n;
+    }
+    sort(vValue.rbegin(), vValue.rend());
+
+    int64 nTargets[] = { COIN / 3, 17 * COIN + 12345, nTotal / 3 };
+    for (int i = 0; i < ARRAYLEN(nTargets); i++)
+    {
+        // SelectCoinsMinConf only passes on coins below the target plus a cent
+        vector<int64> vCandidate;
+        BOOST_FOREACH(int64 n, vValue)
+            if (n < nTargets[i] + CENT)
+                vCandidate.push_back(n);
+
+        vector<char> vfBest;
+        int64 nBest = 0;
+        if (SelectCoinsBranchAndBound(vCandidate, nTargets[i], vfBest, nBest))
+        {
+            BOOST_CHECK(nBest >= nTargets[i] && nBest < nTargets[i] + CENT);
+            BOOST_CHECK_EQUAL(SumSelected(vCandidate, vfBest), nBest);
+        }
+
+        BOOST_CHECK(SelectCoinsKnapsack(vCandidate, nTargets[i], vfBest, nBest));
+        BOOST_CHECK(nBest >= nTargets[i]);
+        BOOST_CHECK_EQUAL(SumSelected(vCandidate, vfBest), nBest);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,200 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "wallet.h"
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+static CTxMemPoolEntry MakeEntry(const uint256& hashPrev, int64 nValue, int nHeight)
+{
+    CTxMemPoolEntry entry;
+    entry.tx.vin.resize(1);
+    entry.tx.vin[0].prevout = COutPoint(hashPrev, 0);
+    entry.tx.vout.resize(1);
+    entry.tx.vout[0].nValue = nValue;
+    entry.nTxSize = 100;
+    entry.nFee = 10000;
+    entry.vInputs.push_back(std::make_pair(nValue, nHeight));
+    return entry;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_graph)
+{
+    CTxMemPool pool;
+    pool.UpdatePriorities(100);
+
+    // parent spends a confirmed output, child and grandchild chain off it
+    CTxMemPoolEntry parent = MakeEntry(uint256(1), 1*COIN, 91);
+    uint256 hashParent = parent.tx.GetHash();
+    CTxMemPoolEntry child = MakeEntry(hashParent, 1*COIN, 95);
+    uint256 hashChild = child.tx.GetHash();
+    CTxMemPoolEntry grandchild = MakeEntry(hashChild, 1*COIN, 95);
+    uint256 hashGrandchild = grandchild.tx.GetHash();
+
+    pool.addUnchecked(hashParent, parent);
+    pool.addUnchecked(hashChild, child);
+    pool.addUnchecked(hashGrandchild, grandchild);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK(pool.mapTx[hashChild].setParents.count(hashParent));
+    BOOST_CHECK(pool.mapTx[hashParent].setChildren.count(hashChild));
+    BOOST_CHECK(pool.setByFeeRate.size() == 3);
+    BOOST_CHECK(pool.setByPriority.size() == 3);
+
+    // inputs from the pool don't count towards priority
+    BOOST_CHECK(pool.mapTx[hashParent].dPriorityKey == (double)COIN * 10 / 100);
+    BOOST_CHECK(pool.mapTx[hashChild].dPriorityKey == 0);
+
+    // once the parent confirms the child's input ages with the chain
+    pool.removeConfirmed(parent.tx, 101);
+    pool.UpdatePriorities(105);
+    BOOST_CHECK(!pool.exists(hashParent));
+    BOOST_CHECK(pool.mapTx[hashChild].setParents.empty());
+    BOOST_CHECK(pool.mapTx[hashChild].dPriorityKey == (double)COIN * 5 / 100);
+
+    // a conflicting spend takes the whole chain with it
+    CTxMemPoolEntry conflict = MakeEntry(hashParent, 2*COIN, 101);
+    pool.removeConflicts(conflict.tx);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK(pool.mapNextTx.empty());
+    BOOST_CHECK(pool.setByFeeRate.empty());
+    BOOST_CHECK(pool.setByPriority.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim)
+{
+    CTxMemPool pool;
+
+    // a cheap parent with an expensive child, and a medium fee loner
+    CTxMemPoolEntry parent = MakeEntry(uint256(1), 1*COIN, 10);
+    parent.nFee = 1000;
+    uint256 hashParent = parent.tx.GetHash();
+    CTxMemPoolEntry child = MakeEntry(hashParent, 1*COIN, 10);
+    child.nFee = 100000;
+    uint256 hashChild = child.tx.GetHash();
+    CTxMemPoolEntry loner = MakeEntry(uint256(2), 1*COIN, 10);
+    loner.nFee = 50000;
+    uint256 hashLoner = loner.tx.GetHash();
+
+    pool.addUnchecked(hashParent, parent);
+    pool.addUnchecked(hashChild, child);
+    pool.addUnchecked(hashLoner, loner);
+    BOOST_CHECK(pool.GetUsage() > 0);
+    BOOST_CHECK_EQUAL(pool.GetRollingMinFee(1000), 0);
+
+    // nothing to do while it fits
+    BOOST_CHECK_EQUAL(pool.TrimToSize(pool.GetUsage()), 0);
+
+    // the lowest fee rate goes first, taking its descendants along
+    BOOST_CHECK_EQUAL(pool.TrimToSize(pool.GetUsage() - 1), 2);
+    BOOST_CHECK(!pool.exists(hashParent));
+    BOOST_CHECK(!pool.exists(hashChild));
+    BOOST_CHECK(pool.exists(hashLoner));
+    BOOST_CHECK_EQUAL(pool.GetUsage(), pool.mapTx[hashLoner].nUsage);
+
+    // and new transactions have to outbid it
+    BOOST_CHECK(pool.GetRollingMinFee(1000) >= 10000 + MIN_RELAY_TX_FEE);
+
+    BOOST_CHECK_EQUAL(pool.TrimToSize(0), 1);
+    BOOST_CHECK_EQUAL(pool.GetUsage(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim_unknown_fee)
+{
+    CTxMemPool pool;
+
+    // put back from a disconnected block, its fee not known yet
+    CTxMemPoolEntry unknown = MakeEntry(uint256(1), 1*COIN, 10);
+    unknown.nFee = -1;
+    unknown.vInputs.clear();
+    uint256 hashUnknown = unknown.tx.GetHash();
+    CTxMemPoolEntry cheap = MakeEntry(uint256(2), 1*COIN, 10);
+    cheap.nFee = 1000;
+    uint256 hashCheap = cheap.tx.GetHash();
+    CTxMemPoolEntry rich = MakeEntry(uint256(3), 1*COIN, 10);
+    rich.nFee = 100000;
+    uint256 hashRich = rich.tx.GetHash();
+
+    pool.addUnchecked(hashUnknown, unknown);
+    pool.addUnchecked(hashCheap, cheap);
+    pool.addUnchecked(hashRich, rich);
+    BOOST_CHECK(*pool.setByFeeRate.begin() == std::make_pair(0.0, hashUnknown));
+
+    // the lowest known fee rate goes, not the entry sorted below it
+    BOOST_CHECK_EQUAL(pool.TrimToSize(pool.GetUsage() - 1), 1);
+    BOOST_CHECK(pool.exists(hashUnknown));
+    BOOST_CHECK(!pool.exists(hashCheap));
+    BOOST_CHECK(pool.exists(hashRich));
+    BOOST_CHECK(pool.GetRollingMinFee(1000) > MIN_RELAY_TX_FEE);
+    BOOST_CHECK(pool.GetRollingMinFee(1000) <= 10000 + MIN_RELAY_TX_FEE);
+
+    // it is never evicted on its own, even if the pool can't fit
+    BOOST_CHECK_EQUAL(pool.TrimToSize(0), 1);
+    BOOST_CHECK(pool.exists(hashUnknown));
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+
+    // but it goes along with an evicted parent
+    CTxMemPoolEntry child = MakeEntry(uint256(4), 1*COIN, 10);
+    child.nFee = -1;
+    child.vInputs.clear();
+    CTxMemPoolEntry parent = MakeEntry(uint256(5), 1*COIN, 10);
+    parent.nFee = 1000;
+    uint256 hashParent = parent.tx.GetHash();
+    child.tx.vin[0].prevout = COutPoint(hashParent, 0);
+    uint256 hashChild = child.tx.GetHash();
+    pool.addUnchecked(hashParent, parent);
+    pool.addUnchecked(hashChild, child);
+    BOOST_CHECK_EQUAL(pool.TrimToSize(0), 2);
+    BOOST_CHECK(!pool.exists(hashChild));
+    BOOST_CHECK(pool.exists(hashUnknown));
+}
+
+BOOST_AUTO_TEST_CASE(mempool_fill_inputs)
+{
+    CTxMemPool pool;
+    pool.UpdatePriorities(100);
+
+    // added without its inputs, as when coming back from a disconnected block
+    CTxMemPoolEntry entry = MakeEntry(uint256(1), 1*COIN, 50);
+    entry.nFee = -1;
+    entry.vInputs.clear();
+    uint256 hash = entry.tx.GetHash();
+    pool.addUnchecked(hash, entry);
+    BOOST_CHECK(pool.setByFeeRate.count(std::make_pair(0.0, hash)));
+
+    // the inputs turned up, as they do on the accept path
+    CTransaction txPrev;
+    txPrev.vout.resize(1);
+    txPrev.vout[0].nValue = 1*COIN + 20000;
+    MapPrevTx mapInputs;
+    mapInputs[uint256(1)] = std::make_pair(CTxIndex(), txPrev);
+    pool.FillInputs(hash, mapInputs);
+    const CTxMemPoolEntry& filled = pool.mapTx[hash];
+    BOOST_CHECK_EQUAL(filled.nFee, 20000);
+    BOOST_CHECK_EQUAL(filled.vInputs.size(), 1);
+    BOOST_CHECK_EQUAL(pool.setByFeeRate.size(), 1);
+    BOOST_CHECK(pool.setByFeeRate.count(std::make_pair(filled.GetFeeRate(), hash)));
+
+    // entries that already have their data are left alone
+    txPrev.vout[0].nValue = 2*COIN;
+    mapInputs[uint256(1)] = std::make_pair(CTxIndex(), txPrev);
+    pool.FillInputs(hash, mapInputs);
+    BOOST_CHECK_EQUAL(pool.mapTx[hash].nFee, 20000);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_spendable)
+{
+    // block templates leave out entries whose inputs aren't known yet
+    CTxMemPoolEntry entry = MakeEntry(uint256(1), 1*COIN, 50);
+    BOOST_CHECK(entry.IsSpendableAt(51));
+    entry.nFee = -1;
+    BOOST_CHECK(!entry.IsSpendableAt(51));
+
+    // and coinbase spends until they have matured at the block's height,
+    // the same rule ConnectInputs applies
+    entry.nFee = 10000;
+    entry.nCoinbaseHeight = 50;
+    BOOST_CHECK(!entry.IsSpendableAt(50 + COINBASE_MATURITY));
+    BOOST_CHECK(entry.IsSpendableAt(50 + COINBASE_MATURITY + 1));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,15 +1,32 @@
 #define BOOST_TEST_MODULE Bitcoin Test Suite
 #include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
 
 #include "main.h"
 #include "wallet.h"
+#include "strlcpy.h"
 
 CWallet* pwalletMain;
 
 extern bool fPrintToConsole;
 struct TestingSetup {
+    boost::filesystem::path pathTemp;
+
     TestingSetup() {
         fPrintToConsole = true; // don't want to write to debug.log file
+
+        // Databases go in a data directory of their own, with an empty
+        // block index for wallet code that reads it
+#if defined(BOOST_FILESYSTEM_VERSION) && BOOST_FILESYSTEM_VERSION >= 3
+        pathTemp = boost::filesystem::temp_directory_path();
+#else
+        pathTemp = ".";
+#endif
+        pathTemp /= strprintf("test_litecoin_%"PRI64d"_%d", GetTime(), GetRandInt(100000));
+        boost::filesystem::create_directories(pathTemp);
+        strlcpy(pszSetDataDir, pathTemp.string().c_str(), sizeof(pszSetDataDir));
+        CTxDB("cr+").Close();
+
         pwalletMain = new CWallet();
         RegisterWallet(pwalletMain);
     }
@@ -17,6 +34,8 @@ struct TestingSetup {
     {
         delete pwalletMain;
         pwalletMain = NULL;
+        DBFlush(true);
+        boost::filesystem::remove_all(pathTemp);
     }
 };
 
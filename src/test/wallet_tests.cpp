@@ -0,0 +1,1079 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "wallet.h"
+#include "init.h"
+#include "json/json_spirit_utils.h"
+
+using namespace std;
+
+typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
+extern map<string, rpcfn_type> mapCallTable;
+extern CBlockIndex* GetRescanStart(int64 nBirth);
+
+BOOST_AUTO_TEST_SUITE(wallet_tests)
+
+// Block index entries for wallet transactions to be confirmed in, put back
+// the way they were when it goes out of scope
+class CFakeChain
+{
+public:
+    vector<CBlockIndex*> vpindex;
+    CBlockIndex* pindexBestOld;
+    int nBestHeightOld;
+
+    CFakeChain()
+    {
+        pindexBestOld = pindexBest;
+        nBestHeightOld = nBestHeight;
+    }
+
+    ~CFakeChain()
+    {
+        BOOST_FOREACH(CBlockIndex* pindex, vpindex)
+        {
+            mapBlockIndex.erase(pindex->GetBlockHash());
+            delete pindex;
+        }
+        pindexBest = pindexBestOld;
+        nBestHeight = nBestHeightOld;
+    }
+
+    CBlockIndex* Extend(CBlockIndex* pprev, int nBlocks)
+    {
+        for (int i = 0; i < nBlocks; i++)
+        {
+            CBlockIndex* pindex = new CBlockIndex();
+            pindex->pprev = pprev;
+            pindex->nHeight = pprev ? pprev->nHeight + 1 : 0;
+            unsigned int n = vpindex.size();
+            uint256 hash = Hash(BEGIN(n), END(n));
+            pindex->phashBlock = &((*mapBlockIndex.insert(make_pair(hash, pindex)).first).first);
+            vpindex.push_back(pindex);
+            pprev = pindex;
+        }
+        return pprev;
+    }
+
+    // Indexes a block the test built, which isn't written anywhere
+    CBlockIndex* AddBlock(CBlockIndex* pprev, const CBlock& block)
+    {
+        CBlockIndex* pindex = new CBlockIndex();
+        pindex->pprev = pprev;
+        pindex->nHeight = pprev ? pprev->nHeight + 1 : 0;
+        pindex->nTime = block.nTime;
+        pindex->phashBlock = &((*mapBlockIndex.insert(make_pair(block.GetHash(), pindex)).first).first);
+        vpindex.push_back(pindex);
+        return pindex;
+    }
+
+    void SetBest(CBlockIndex* pindexTip)
+    {
+        BOOST_FOREACH(CBlockIndex* pindex, vpindex)
+            pindex->pnext = NULL;
+        for (CBlockIndex* pindex = pindexTip; pindex->pprev; pindex = pindex->pprev)
+            pindex->pprev->pnext = pindex;
+        pindexBest = pindexTip;
+        nBestHeight = pindexTip->nHeight;
+    }
+};
+
+static CWalletTx MakeTx(const COutPoint& prevout, const CScript& scriptPubKey, int64 nValue, CBlockIndex* pindex)
+{
+    CWalletTx wtx;
+    wtx.vin.push_back(CTxIn(prevout));
+    wtx.vout.push_back(CTxOut(nValue, scriptPubKey));
+    if (pindex)
+    {
+        wtx.hashBlock = pindex->GetBlockHash();
+        wtx.nIndex = 0;
+        wtx.fMerkleVerified = true;
+    }
+    return wtx;
+}
+
+// A payment from someone else, its input unknown to the wallet
+static CWalletTx MakeIncomingTx(const CScript& scriptPubKey, int64 nValue, CBlockIndex* pindex)
+{
+    static unsigned int nCounter;
+    nCounter++;
+    return MakeTx(COutPoint(Hash(BEGIN(nCounter), END(nCounter)), 0), scriptPubKey, nValue, pindex);
+}
+
+static CScript MakeKey(CWallet& wallet)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(wallet.AddKey(key));
+    CScript scriptPubKey;
+    scriptPubKey.SetBitcoinAddress(key.GetPubKey());
+    return scriptPubKey;
+}
+
+static bool CanSelect(const CWallet& wallet, int64 nValue, int nConfMine, int nConfTheirs)
+{
+    set<pair<const CWalletTx*,unsigned int> > setCoins;
+    int64 nValueIn = 0;
+    return wallet.SelectCoinsMinConf(nValue, nConfMine, nConfTheirs, setCoins, nValueIn);
+}
+
+static void SetLabel(CWallet& wallet, const CScript& scriptPubKey, const string& strAccount)
+{
+    CBitcoinAddress address;
+    BOOST_CHECK(ExtractAddress(scriptPubKey, address));
+    wallet.SetAddressBookName(address, strAccount);
+}
+
+// Account balance added up from every wallet transaction, the way getbalance
+// does past the depth the account tally keeps
+static int64 RecomputeAccountBalance(const CWallet& wallet, const string& strAccount, int nMinDepth)
+{
+    int64 nBalance = 0;
+    for (map<uint256, CWalletTx>::const_iterator it = wallet.mapWallet.begin(); it != wallet.mapWallet.end(); ++it)
+    {
+        const CWalletTx& wtx = (*it).second;
+        if (!wtx.IsFinal())
+            continue;
+        int64 nGenerated, nReceived, nSent, nFee;
+        wtx.GetAccountAmounts(strAccount, nGenerated, nReceived, nSent, nFee);
+        if (nReceived != 0 && wtx.GetDepthInMainChain() >= nMinDepth)
+            nBalance += nReceived;
+        nBalance += nGenerated - nSent - nFee;
+    }
+    map<string, int64>::const_iterator mi = wallet.mapAccountCreditDebit.find(strAccount);
+    if (mi != wallet.mapAccountCreditDebit.end())
+        nBalance += (*mi).second;
+    return nBalance;
+}
+
+// Compares the tally with a full recomputation at every minconf it answers
+static void CheckAccountTally(const CWallet& wallet, const vector<string>& vAccounts)
+{
+    for (int nMinDepth = 0; nMinDepth <= ACCOUNT_TALLY_DEPTH; nMinDepth++)
+    {
+        map<string, int64> mapBalances;
+        BOOST_CHECK(wallet.GetAccountBalances(nMinDepth, mapBalances));
+        BOOST_FOREACH(const string& strAccount, vAccounts)
+        {
+            int64 nExpected = RecomputeAccountBalance(wallet, strAccount, nMinDepth);
+            int64 nBalance = 0;
+            BOOST_CHECK(wallet.GetAccountBalance(strAccount, nMinDepth, nBalance));
+            BOOST_CHECK_EQUAL(nBalance, nExpected);
+            BOOST_CHECK_EQUAL(mapBalances[strAccount], nExpected);
+        }
+    }
+
+    // deeper than that the caller adds it up itself
+    int64 nBalance = 0;
+    BOOST_CHECK(!wallet.GetAccountBalance("", ACCOUNT_TALLY_DEPTH + 1, nBalance));
+}
+
+BOOST_AUTO_TEST_CASE(wallet_coinbase_maturity)
+{
+    CFakeChain chain;
+    CWallet wallet;
+    CScript scriptPubKey = MakeKey(wallet);
+
+    CBlockIndex* pindexCoinBase = chain.Extend(NULL, 11);
+    CWalletTx wtx;
+    wtx.vin.resize(1);
+    wtx.vin[0].scriptSig = CScript() << 1;
+    wtx.vout.push_back(CTxOut(50 * COIN, scriptPubKey));
+    wtx.hashBlock = pindexCoinBase->GetBlockHash();
+    wtx.nIndex = 0;
+    wtx.fMerkleVerified = true;
+    BOOST_CHECK(wtx.IsCoinBase());
+
+    // one block short of maturity
+    chain.SetBest(chain.Extend(pindexCoinBase, COINBASE_MATURITY + 20 - 2));
+    BOOST_CHECK(wallet.AddToWallet(wtx));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 0);
+    BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), 0);
+    BOOST_CHECK(!CanSelect(wallet, COIN, 1, 1));
+
+    chain.SetBest(chain.Extend(pindexBest, 1));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 50 * COIN);
+    BOOST_CHECK(CanSelect(wallet, COIN, 1, 1));
+}
+
+BOOST_AUTO_TEST_CASE(wallet_unconfirmed)
+{
+    CFakeChain chain;
+    CWallet wallet;
+    CScript scriptPubKey = MakeKey(wallet);
+
+    CBlockIndex* pindex = chain.Extend(NULL, 6);
+    chain.SetBest(chain.Extend(pindex, 5));
+    CWalletTx wtxIn = MakeIncomingTx(scriptPubKey, 10 * COIN, pindex);
+    BOOST_CHECK(wallet.AddToWallet(wtxIn));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 10 * COIN);
+
+    // unconfirmed payments from others only show as unconfirmed
+    BOOST_CHECK(wallet.AddToWallet(MakeIncomingTx(scriptPubKey, 5 * COIN, NULL)));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 10 * COIN);
+    BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), 5 * COIN);
+
+    // sending to ourselves spends the confirmed coin, and the unconfirmed
+    // change counts right away
+    CWalletTx wtxSelf = MakeTx(COutPoint(wtxIn.GetHash(), 0), scriptPubKey, 10 * COIN - CENT, NULL);
+    wtxSelf.vtxPrev.push_back(boost::shared_ptr<const CMerkleTx>(new CMerkleTx(wtxIn)));
+    BOOST_CHECK(wallet.AddToWallet(wtxSelf));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 10 * COIN - CENT);
+    BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), 5 * COIN);
+    BOOST_CHECK(CanSelect(wallet, 6 * COIN, 0, 1));
+    BOOST_CHECK(!CanSelect(wallet, 6 * COIN, 1, 1));
+    BOOST_CHECK(!CanSelect(wallet, 11 * COIN, 0, 1));
+}
+
+BOOST_AUTO_TEST_CASE(wallet_update_spent)
+{
+    CFakeChain chain;
+    CWallet wallet;
+    CScript scriptPubKey = MakeKey(wallet);
+
+    CBlockIndex* pindex = chain.Extend(NULL, 6);
+    chain.SetBest(chain.Extend(pindex, 5));
+    CWalletTx wtx = MakeIncomingTx(scriptPubKey, 10 * COIN, pindex);
+    BOOST_CHECK(wallet.AddToWallet(wtx));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 10 * COIN);
+
+    // spent by a copy of the wallet elsewhere
+    CTransaction tx = MakeTx(COutPoint(wtx.GetHash(), 0), CScript() << OP_TRUE, 10 * COIN, NULL);
+    wallet.WalletUpdateSpent(tx);
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 0);
+    BOOST_CHECK(!CanSelect(wallet, COIN, 1, 1));
+}
+
+BOOST_AUTO_TEST_CASE(wallet_reorg)
+{
+    CFakeChain chain;
+    CWallet wallet;
+    CScript scriptPubKey = MakeKey(wallet);
+
+    // confirmed at height 6, with a competing chain forking off at 4
+    CBlockIndex* pindexFork = chain.Extend(NULL, 5);
+    CBlockIndex* pindex = chain.Extend(pindexFork, 2);
+    CBlockIndex* pindexTipA = chain.Extend(pindex, 4);
+    CBlockIndex* pindexTipB = chain.Extend(pindexFork, 8);
+    chain.SetBest(pindexTipA);
+
+    CWalletTx wtx = MakeIncomingTx(scriptPubKey, 10 * COIN, pindex);
+    BOOST_CHECK(wallet.AddToWallet(wtx));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 10 * COIN);
+    BOOST_CHECK(CanSelect(wallet, COIN, 1, 1));
+
+    // reorganized out of the main chain
+    chain.SetBest(pindexTipB);
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 0);
+    BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), 10 * COIN);
+    BOOST_CHECK(!CanSelect(wallet, COIN, 1, 1));
+
+    // and back in
+    chain.SetBest(chain.Extend(pindexTipA, 5));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 10 * COIN);
+    BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), 0);
+    BOOST_CHECK(CanSelect(wallet, COIN, 1, 1));
+}
+
+BOOST_AUTO_TEST_CASE(wallet_erase)
+{
+    CFakeChain chain;
+    CWallet wallet;
+    CScript scriptPubKey = MakeKey(wallet);
+
+    CBlockIndex* pindex = chain.Extend(NULL, 6);
+    chain.SetBest(chain.Extend(pindex, 5));
+    CWalletTx wtx1 = MakeIncomingTx(scriptPubKey, 10 * COIN, pindex);
+    CWalletTx wtx2 = MakeIncomingTx(scriptPubKey, 3 * COIN, pindex);
+    BOOST_CHECK(wallet.AddToWallet(wtx1));
+    BOOST_CHECK(wallet.AddToWallet(wtx2));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 13 * COIN);
+
+    BOOST_CHECK(wallet.EraseFromWallet(wtx1.GetHash()));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 3 * COIN);
+    BOOST_CHECK(CanSelect(wallet, 2 * COIN, 1, 1));
+    BOOST_CHECK(!CanSelect(wallet, 4 * COIN, 1, 1));
+}
+
+BOOST_AUTO_TEST_CASE(wallet_account_tally_minconf)
+{
+    CFakeChain chain;
+    CWallet wallet;
+    CScript scriptA = MakeKey(wallet);
+    CScript scriptNone = MakeKey(wallet);
+    SetLabel(wallet, scriptA, "a");
+    vector<string> vAccounts;
+    vAccounts.push_back("");
+    vAccounts.push_back("a");
+
+    // credits at depths 10, 6, 3 and 1, and one not confirmed yet
+    CBlockIndex* pindex1 = chain.Extend(NULL, 5);
+    CBlockIndex* pindex2 = chain.Extend(pindex1, 4);
+    CBlockIndex* pindex3 = chain.Extend(pindex2, 3);
+    CBlockIndex* pindex4 = chain.Extend(pindex3, 2);
+    chain.SetBest(pindex4);
+    CWalletTx wtxA = MakeIncomingTx(scriptA, 10 * COIN, pindex1);
+    BOOST_CHECK(wallet.AddToWallet(wtxA));
+    BOOST_CHECK(wallet.AddToWallet(MakeIncomingTx(scriptA, 4 * COIN, pindex2)));
+    BOOST_CHECK(wallet.AddToWallet(MakeIncomingTx(scriptNone, 2 * COIN, pindex3)));
+    BOOST_CHECK(wallet.AddToWallet(MakeIncomingTx(scriptA, 1 * COIN, pindex4)));
+    BOOST_CHECK(wallet.AddToWallet(MakeIncomingTx(scriptNone, 3 * COIN, NULL)));
+    CheckAccountTally(wallet, vAccounts);
+
+    // a payment out of "a" counts at any depth, fee included
+    CWalletTx wtxSend = MakeTx(COutPoint(wtxA.GetHash(), 0), CScript() << OP_TRUE, 10 * COIN - CENT, NULL);
+    wtxSend.strFromAccount = "a";
+    BOOST_CHECK(wallet.AddToWallet(wtxSend));
+    CheckAccountTally(wallet, vAccounts);
+
+    // credits move up the buckets as the chain grows, and past the tally's
+    // depth they get folded in
+    chain.SetBest(chain.Extend(pindex4, 5));
+    CheckAccountTally(wallet, vAccounts);
+    chain.SetBest(chain.Extend(pindexBest, ACCOUNT_TALLY_DEPTH));
+    CheckAccountTally(wallet, vAccounts);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_account_tally_coinbase)
+{
+    CFakeChain chain;
+    CWallet wallet;
+    CScript scriptPubKey = MakeKey(wallet);
+    vector<string> vAccounts(1, "");
+
+    CBlockIndex* pindexCoinBase = chain.Extend(NULL, 11);
+    CWalletTx wtx;
+    wtx.vin.resize(1);
+    wtx.vin[0].scriptSig = CScript() << 1;
+    wtx.vout.push_back(CTxOut(50 * COIN, scriptPubKey));
+    wtx.hashBlock = pindexCoinBase->GetBlockHash();
+    wtx.nIndex = 0;
+    wtx.fMerkleVerified = true;
+
+    // one block short of maturity
+    chain.SetBest(chain.Extend(pindexCoinBase, COINBASE_MATURITY + 20 - 2));
+    BOOST_CHECK(wallet.AddToWallet(wtx));
+    CheckAccountTally(wallet, vAccounts);
+    int64 nBalance = -1;
+    BOOST_CHECK(wallet.GetAccountBalance("", 0, nBalance));
+    BOOST_CHECK_EQUAL(nBalance, 0);
+
+    chain.SetBest(chain.Extend(pindexBest, 1));
+    CheckAccountTally(wallet, vAccounts);
+    BOOST_CHECK(wallet.GetAccountBalance("", 1, nBalance));
+    BOOST_CHECK_EQUAL(nBalance, 50 * COIN);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_account_tally_reorg)
+{
+    CFakeChain chain;
+    CWallet wallet;
+    CScript scriptPubKey = MakeKey(wallet);
+    SetLabel(wallet, scriptPubKey, "a");
+    vector<string> vAccounts(1, "a");
+
+    // confirmed at height 6, with a competing chain forking off at 4
+    CBlockIndex* pindexFork = chain.Extend(NULL, 5);
+    CBlockIndex* pindex = chain.Extend(pindexFork, 2);
+    CBlockIndex* pindexTipA = chain.Extend(pindex, 4);
+    CBlockIndex* pindexTipB = chain.Extend(pindexFork, 8);
+    chain.SetBest(pindexTipA);
+    BOOST_CHECK(wallet.AddToWallet(MakeIncomingTx(scriptPubKey, 10 * COIN, pindex)));
+    BOOST_CHECK(wallet.AddToWallet(MakeIncomingTx(scriptPubKey, 2 * COIN, pindexFork)));
+    CheckAccountTally(wallet, vAccounts);
+
+    // the block it was credited in is disconnected
+    chain.SetBest(pindexTipB);
+    CheckAccountTally(wallet, vAccounts);
+    int64 nBalance = 0;
+    BOOST_CHECK(wallet.GetAccountBalance("a", 1, nBalance));
+    BOOST_CHECK_EQUAL(nBalance, 2 * COIN);
+
+    // and connected again
+    chain.SetBest(chain.Extend(pindexTipA, 5));
+    CheckAccountTally(wallet, vAccounts);
+    BOOST_CHECK(wallet.GetAccountBalance("a", 1, nBalance));
+    BOOST_CHECK_EQUAL(nBalance, 12 * COIN);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_account_tally_relabel)
+{
+    CFakeChain chain;
+    CWallet wallet;
+    CScript scriptPubKey = MakeKey(wallet);
+    SetLabel(wallet, scriptPubKey, "a");
+    vector<string> vAccounts;
+    vAccounts.push_back("");
+    vAccounts.push_back("a");
+    vAccounts.push_back("b");
+
+    CBlockIndex* pindex = chain.Extend(NULL, 6);
+    chain.SetBest(chain.Extend(pindex, 5));
+    BOOST_CHECK(wallet.AddToWallet(MakeIncomingTx(scriptPubKey, 10 * COIN, pindex)));
+    BOOST_CHECK(wallet.AddToWallet(MakeIncomingTx(scriptPubKey, 1 * COIN, NULL)));
+    CheckAccountTally(wallet, vAccounts);
+
+    // past credits follow the address to its new account
+    SetLabel(wallet, scriptPubKey, "b");
+    CheckAccountTally(wallet, vAccounts);
+    int64 nBalance = -1;
+    BOOST_CHECK(wallet.GetAccountBalance("a", 0, nBalance));
+    BOOST_CHECK_EQUAL(nBalance, 0);
+    BOOST_CHECK(wallet.GetAccountBalance("b", 0, nBalance));
+    BOOST_CHECK_EQUAL(nBalance, 11 * COIN);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_account_tally_move)
+{
+    CFakeChain chain;
+    CWallet wallet;
+    CScript scriptPubKey = MakeKey(wallet);
+    SetLabel(wallet, scriptPubKey, "a");
+    vector<string> vAccounts;
+    vAccounts.push_back("a");
+    vAccounts.push_back("b");
+
+    CBlockIndex* pindex = chain.Extend(NULL, 6);
+    chain.SetBest(chain.Extend(pindex, 5));
+    BOOST_CHECK(wallet.AddToWallet(MakeIncomingTx(scriptPubKey, 10 * COIN, pindex)));
+    CheckAccountTally(wallet, vAccounts);
+
+    // move 3 from "a" to "b", as the move RPC records it
+    CAccountingEntry debit;
+    debit.strAccount = "a";
+    debit.nCreditDebit = -3 * COIN;
+    debit.nTime = GetAdjustedTime();
+    debit.strOtherAccount = "b";
+    wallet.AddAccountingEntry(debit);
+    CAccountingEntry credit;
+    credit.strAccount = "b";
+    credit.nCreditDebit = 3 * COIN;
+    credit.nTime = debit.nTime;
+    credit.strOtherAccount = "a";
+    wallet.AddAccountingEntry(credit);
+    CheckAccountTally(wallet, vAccounts);
+
+    // moves count at any depth
+    int64 nBalance = 0;
+    BOOST_CHECK(wallet.GetAccountBalance("b", ACCOUNT_TALLY_DEPTH, nBalance));
+    BOOST_CHECK_EQUAL(nBalance, 3 * COIN);
+    BOOST_CHECK(wallet.GetAccountBalance("a", 1, nBalance));
+    BOOST_CHECK_EQUAL(nBalance, 7 * COIN);
+}
+
+// A wallet in its own file in the test data directory, for code that takes
+// keys from the key pool or opens the block index
+static void LoadFileWallet(CWallet& wallet)
+{
+    bool fFirstRun = false;
+    BOOST_CHECK_EQUAL(wallet.LoadWallet(fFirstRun), (int)DB_LOAD_OK);
+    BOOST_CHECK(fFirstRun);
+}
+
+// Payments of a little over a coin each to addresses that aren't ours
+static vector<pair<CScript, int64> > MakeRecipients(unsigned int nCount)
+{
+    vector<pair<CScript, int64> > vecSend;
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        CScript scriptPubKey;
+        scriptPubKey.SetBitcoinAddress(CBitcoinAddress(uint160(i + 1)));
+        vecSend.push_back(make_pair(scriptPubKey, COIN + i));
+    }
+    return vecSend;
+}
+
+// Checks a batch pays every recipient once and in order, that each
+// transaction's inputs are signed and cover its payments and a fee enough
+// to relay, and that the fees add up to what CreateTransactions reported
+static void CheckBatch(const CWallet& wallet, const vector<pair<CScript, int64> >& vecSend, const vector<CWalletTx>& vwtx, int64 nFeeRet)
+{
+    unsigned int nSend = 0;
+    int64 nFeeTotal = 0;
+    for (unsigned int k = 0; k < vwtx.size(); k++)
+    {
+        const CWalletTx& wtx = vwtx[k];
+        int64 nValueIn = 0;
+        for (unsigned int nIn = 0; nIn < wtx.vin.size(); nIn++)
+        {
+            const COutPoint& prevout = wtx.vin[nIn].prevout;
+            const CTransaction* ptxPrev = NULL;
+            map<uint256, CWalletTx>::const_iterator mi = wallet.mapWallet.find(prevout.hash);
+            if (mi != wallet.mapWallet.end())
+                ptxPrev = &(*mi).second;
+            for (unsigned int j = 0; j < k; j++)
+                if (vwtx[j].GetHash() == prevout.hash)
+                    ptxPrev = &vwtx[j];
+            BOOST_REQUIRE(ptxPrev != NULL);
+            BOOST_REQUIRE(prevout.n < ptxPrev->vout.size());
+            nValueIn += ptxPrev->vout[prevout.n].nValue;
+            BOOST_CHECK(VerifySignature(*ptxPrev, wtx, nIn, true, 0));
+        }
+
+        unsigned int nPayments = 0;
+        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+        {
+            if (wallet.IsMine(txout))
+                continue;
+            BOOST_REQUIRE(nSend < vecSend.size());
+            BOOST_CHECK(txout.scriptPubKey == vecSend[nSend].first);
+            BOOST_CHECK_EQUAL(txout.nValue, vecSend[nSend].second);
+            nSend++;
+            nPayments++;
+        }
+        BOOST_CHECK(nPayments > 0 && nPayments <= BATCH_MAX_TX_OUTPUTS);
+
+        int64 nFee = nValueIn - wtx.GetValueOut();
+        unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtx, SER_NETWORK);
+        BOOST_CHECK(nBytes < MAX_BLOCK_SIZE_GEN/5);
+        BOOST_CHECK(nFee >= wtx.GetMinFee(1, false, GMF_SEND));
+        BOOST_CHECK(nFee >= MIN_TX_FEE * (1 + (int64)nBytes / 1000));
+        nFeeTotal += nFee;
+    }
+    BOOST_CHECK_EQUAL(nSend, vecSend.size());
+    BOOST_CHECK_EQUAL(nFeeTotal, nFeeRet);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_batch_split)
+{
+    CFakeChain chain;
+    CWallet wallet("wallet_batch_split.dat");
+    LoadFileWallet(wallet);
+    CScript scriptPubKey = MakeKey(wallet);
+
+    CBlockIndex* pindex = chain.Extend(NULL, 6);
+    chain.SetBest(chain.Extend(pindex, 5));
+    for (int i = 0; i < 20; i++)
+        BOOST_CHECK(wallet.AddToWallet(MakeIncomingTx(scriptPubKey, 100 * COIN, pindex)));
+
+    vector<pair<CScript, int64> > vecSend = MakeRecipients(2 * BATCH_MAX_TX_OUTPUTS + 10);
+    vector<CWalletTx> vwtx;
+    CReserveKey reservekey(&wallet);
+    int64 nFeeRet = 0;
+    BOOST_CHECK(wallet.CreateTransactions(vecSend, vwtx, reservekey, nFeeRet));
+    BOOST_CHECK_EQUAL(vwtx.size(), 3);
+    CheckBatch(wallet, vecSend, vwtx, nFeeRet);
+    reservekey.ReturnKey();
+}
+
+BOOST_AUTO_TEST_CASE(wallet_batch_chain)
+{
+    CFakeChain chain;
+    CWallet wallet("wallet_batch_chain.dat");
+    LoadFileWallet(wallet);
+    CScript scriptPubKey = MakeKey(wallet);
+
+    // a single coin can only go to one transaction, the others have to
+    // spend the change of the one before
+    CBlockIndex* pindex = chain.Extend(NULL, 6);
+    chain.SetBest(chain.Extend(pindex, 5));
+    BOOST_CHECK(wallet.AddToWallet(MakeIncomingTx(scriptPubKey, 2000 * COIN, pindex)));
+
+    vector<pair<CScript, int64> > vecSend = MakeRecipients(2 * BATCH_MAX_TX_OUTPUTS + 10);
+    vector<CWalletTx> vwtx;
+    CReserveKey reservekey(&wallet);
+    int64 nFeeRet = 0;
+    BOOST_CHECK(wallet.CreateTransactions(vecSend, vwtx, reservekey, nFeeRet));
+    BOOST_REQUIRE_EQUAL(vwtx.size(), 3);
+    CheckBatch(wallet, vecSend, vwtx, nFeeRet);
+    for (unsigned int k = 1; k < vwtx.size(); k++)
+    {
+        const COutPoint& prevout = vwtx[k].vin[0].prevout;
+        BOOST_CHECK(prevout.hash == vwtx[k-1].GetHash());
+        BOOST_REQUIRE(prevout.n < vwtx[k-1].vout.size());
+        BOOST_CHECK(wallet.IsMine(vwtx[k-1].vout[prevout.n]));
+
+        // the transaction it spends goes along with it
+        bool fSupported = false;
+        BOOST_FOREACH(const boost::shared_ptr<const CMerkleTx>& ptxPrev, vwtx[k].vtxPrev)
+            if (ptxPrev->GetHash() == prevout.hash)
+                fSupported = true;
+        BOOST_CHECK(fSupported);
+    }
+    reservekey.ReturnKey();
+}
+
+BOOST_AUTO_TEST_CASE(wallet_batch_insufficient)
+{
+    CFakeChain chain;
+    CWallet wallet("wallet_batch_insufficient.dat");
+    LoadFileWallet(wallet);
+    CScript scriptPubKey = MakeKey(wallet);
+
+    CBlockIndex* pindex = chain.Extend(NULL, 6);
+    chain.SetBest(chain.Extend(pindex, 5));
+    BOOST_CHECK(wallet.AddToWallet(MakeIncomingTx(scriptPubKey, 100 * COIN, pindex)));
+
+    vector<CWalletTx> vwtx;
+    CReserveKey reservekey(&wallet);
+    int64 nFeeRet = 0;
+    BOOST_CHECK(!wallet.CreateTransactions(MakeRecipients(BATCH_MAX_TX_OUTPUTS + 1), vwtx, reservekey, nFeeRet));
+    BOOST_CHECK(nFeeRet > 0);
+
+    vector<pair<CScript, int64> > vecSend;
+    BOOST_CHECK(!wallet.CreateTransactions(vecSend, vwtx, reservekey, nFeeRet));
+    vecSend = MakeRecipients(2);
+    vecSend[1].second = 0;
+    BOOST_CHECK(!wallet.CreateTransactions(vecSend, vwtx, reservekey, nFeeRet));
+    reservekey.ReturnKey();
+}
+
+BOOST_AUTO_TEST_CASE(wallet_sendmanybatch_unpaid)
+{
+    CFakeChain chain;
+    CWallet wallet("wallet_sendmanybatch.dat");
+    LoadFileWallet(wallet);
+    CScript scriptPubKey = MakeKey(wallet);
+
+    // the coin isn't in the block index, so the first transaction is
+    // signed and recorded but can't get into the memory pool
+    CBlockIndex* pindex = chain.Extend(NULL, 6);
+    chain.SetBest(chain.Extend(pindex, 5));
+    BOOST_CHECK(wallet.AddToWallet(MakeIncomingTx(scriptPubKey, 1000 * COIN, pindex)));
+
+    json_spirit::Object sendTo;
+    vector<string> vAddress;
+    for (unsigned int i = 0; i < BATCH_MAX_TX_OUTPUTS + 10; i++)
+    {
+        vAddress.push_back(CBitcoinAddress(uint160(i + 1)).ToString());
+        sendTo.push_back(json_spirit::Pair(vAddress.back(), 1.0));
+    }
+    json_spirit::Array params;
+    params.push_back("");
+    params.push_back(sendTo);
+
+    CWallet* pwalletMainOld = pwalletMain;
+    pwalletMain = &wallet;
+    bool fThrown = false;
+    try
+    {
+        mapCallTable["sendmanybatch"](params, false);
+    }
+    catch (json_spirit::Object& error)
+    {
+        fThrown = true;
+        BOOST_CHECK_EQUAL(json_spirit::find_value(error, "code").get_int(), -4);
+        BOOST_CHECK(json_spirit::find_value(error, "txids").get_array().empty());
+        const json_spirit::Array& unpaid = json_spirit::find_value(error, "unpaid").get_array();
+        BOOST_REQUIRE_EQUAL(unpaid.size(), vAddress.size());
+        for (unsigned int i = 0; i < unpaid.size(); i++)
+            BOOST_CHECK_EQUAL(unpaid[i].get_str(), vAddress[i]);
+    }
+    pwalletMain = pwalletMainOld;
+    BOOST_CHECK(fThrown);
+}
+
+// Waits for a background key pool refill to finish, as StopNode does
+static bool WaitForKeyPoolRefill(CWallet& wallet)
+{
+    for (int i = 0; i < 6000; i++)
+    {
+        CRITICAL_BLOCK(wallet.cs_wallet)
+            if (vnThreadsRunning[THREAD_KEYPOOL] == 0)
+                return true;
+        Sleep(10);
+    }
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_keypool_refill)
+{
+    string strKeyPoolOld = mapArgs.count("-keypool") ? mapArgs["-keypool"] : "";
+    mapArgs["-keypool"] = "20";
+    CWallet wallet("wallet_keypool.dat");
+    LoadFileWallet(wallet);
+    BOOST_CHECK_EQUAL(wallet.GetKeyPoolSize(), 20);
+    set<vector<unsigned char> > setKeys;
+
+    // taking the pool down to half its size starts a refill
+    for (int i = 0; i < 11; i++)
+    {
+        vector<unsigned char> vchPubKey;
+        BOOST_CHECK(wallet.GetKeyFromPool(vchPubKey, false));
+        BOOST_CHECK(setKeys.insert(vchPubKey).second);
+    }
+    BOOST_REQUIRE(WaitForKeyPoolRefill(wallet));
+    BOOST_CHECK(!wallet.fKeyPoolRefilling);
+    BOOST_CHECK_EQUAL(wallet.GetKeyPoolSize(), 21);
+
+    // keys keep coming while a refill is waiting to add its keys, and it
+    // makes up for them once it gets the lock
+    CRITICAL_BLOCK(wallet.cs_wallet)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            vector<unsigned char> vchPubKey;
+            BOOST_CHECK(wallet.GetKeyFromPool(vchPubKey, false));
+            BOOST_CHECK(setKeys.insert(vchPubKey).second);
+        }
+        BOOST_CHECK(wallet.fKeyPoolRefilling);
+        BOOST_CHECK_EQUAL(wallet.GetKeyPoolSize(), 5);
+    }
+    BOOST_REQUIRE(WaitForKeyPoolRefill(wallet));
+    BOOST_CHECK_EQUAL(wallet.GetKeyPoolSize(), 21);
+
+    BOOST_FOREACH(const vector<unsigned char>& vchPubKey, setKeys)
+        BOOST_CHECK(wallet.HaveKey(Hash160(vchPubKey)));
+
+    if (strKeyPoolOld.empty())
+        mapArgs.erase("-keypool");
+    else
+        mapArgs["-keypool"] = strKeyPoolOld;
+}
+
+static CAccountingEntry MakeMove(const string& strAccount, int64 nCreditDebit, int64 nTime)
+{
+    CAccountingEntry acentry;
+    acentry.strAccount = strAccount;
+    acentry.nCreditDebit = nCreditDebit;
+    acentry.nTime = nTime;
+    acentry.strOtherAccount = "other";
+    return acentry;
+}
+
+// The wallet's time ordered history, transactions by hash and moves by
+// account, checking the times never go backwards
+static vector<string> DescribeTxItems(const CWallet& wallet)
+{
+    vector<string> vItems;
+    for (unsigned int i = 0; i < wallet.vOrderedTxItems.size(); i++)
+    {
+        const CWallet::TxItems::value_type& item = wallet.vOrderedTxItems[i];
+        if (i > 0)
+            BOOST_CHECK(wallet.vOrderedTxItems[i-1].first <= item.first);
+        if (item.second.first)
+        {
+            BOOST_CHECK_EQUAL(item.first, item.second.first->GetTxTime());
+            vItems.push_back(item.second.first->GetHash().ToString());
+        }
+        else
+        {
+            BOOST_CHECK_EQUAL(item.first, item.second.second->nTime);
+            vItems.push_back("move " + item.second.second->strAccount);
+        }
+    }
+    return vItems;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_ordered_tx_items)
+{
+    CFakeChain chain;
+    CWallet wallet;
+    CScript scriptPubKey = MakeKey(wallet);
+    CBlockIndex* pindex = chain.Extend(NULL, 6);
+    chain.SetBest(chain.Extend(pindex, 5));
+    int64 nTime = 1300000000;
+    vector<string> vExpected;
+
+    // received in the same second, they stay in the order they came in
+    SetMockTime(nTime);
+    CWalletTx wtx1 = MakeIncomingTx(scriptPubKey, 1 * COIN, pindex);
+    CWalletTx wtx2 = MakeIncomingTx(scriptPubKey, 2 * COIN, pindex);
+    CWalletTx wtx3 = MakeIncomingTx(scriptPubKey, 3 * COIN, pindex);
+    BOOST_CHECK(wallet.AddToWallet(wtx1));
+    BOOST_CHECK(wallet.AddToWallet(wtx2));
+    BOOST_CHECK(wallet.AddToWallet(wtx3));
+
+    // moves go in among them by time, after anything with the same time
+    wallet.AddAccountingEntry(MakeMove("a", COIN, nTime));
+    wallet.AddAccountingEntry(MakeMove("b", COIN, nTime - 10));
+    SetMockTime(nTime + 20);
+    CWalletTx wtx4 = MakeIncomingTx(scriptPubKey, 4 * COIN, pindex);
+    BOOST_CHECK(wallet.AddToWallet(wtx4));
+    wallet.AddAccountingEntry(MakeMove("c", COIN, nTime + 10));
+    SetMockTime(0);
+
+    vExpected.push_back("move b");
+    vExpected.push_back(wtx1.GetHash().ToString());
+    vExpected.push_back(wtx2.GetHash().ToString());
+    vExpected.push_back(wtx3.GetHash().ToString());
+    vExpected.push_back("move a");
+    vExpected.push_back("move c");
+    vExpected.push_back(wtx4.GetHash().ToString());
+    BOOST_CHECK(DescribeTxItems(wallet) == vExpected);
+
+    // adding a transaction again doesn't move it
+    BOOST_CHECK(wallet.AddToWallet(wtx1));
+    BOOST_CHECK(DescribeTxItems(wallet) == vExpected);
+
+    BOOST_CHECK(wallet.EraseFromWallet(wtx2.GetHash()));
+    vExpected.erase(vExpected.begin() + 2);
+    BOOST_CHECK(DescribeTxItems(wallet) == vExpected);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_ordered_tx_items_reload)
+{
+    CFakeChain chain;
+    CBlockIndex* pindex = chain.Extend(NULL, 6);
+    chain.SetBest(chain.Extend(pindex, 5));
+    int64 nTime = 1300000000;
+    CWalletTx wtx1, wtx2, wtx3;
+    {
+        CWallet wallet("wallet_ordered.dat");
+        LoadFileWallet(wallet);
+        CScript scriptPubKey = MakeKey(wallet);
+
+        SetMockTime(nTime + 10);
+        wtx3 = MakeIncomingTx(scriptPubKey, 3 * COIN, pindex);
+        BOOST_CHECK(wallet.AddToWallet(wtx3));
+        SetMockTime(nTime);
+        wtx1 = MakeIncomingTx(scriptPubKey, 1 * COIN, pindex);
+        wtx2 = MakeIncomingTx(scriptPubKey, 2 * COIN, pindex);
+        BOOST_CHECK(wallet.AddToWallet(wtx1));
+        BOOST_CHECK(wallet.AddToWallet(wtx2));
+        SetMockTime(0);
+
+        CWalletDB walletdb(wallet.strWalletFile);
+        CAccountingEntry acentry = MakeMove("a", COIN, nTime);
+        BOOST_CHECK(walletdb.WriteAccountingEntry(acentry));
+        wallet.AddAccountingEntry(acentry);
+        acentry = MakeMove("b", COIN, nTime - 10);
+        BOOST_CHECK(walletdb.WriteAccountingEntry(acentry));
+        wallet.AddAccountingEntry(acentry);
+    }
+
+    // rebuilt with a stable sort of the transactions, in wallet order,
+    // followed by the moves
+    CWallet wallet("wallet_ordered.dat");
+    bool fFirstRun = true;
+    BOOST_CHECK_EQUAL(wallet.LoadWallet(fFirstRun), (int)DB_LOAD_OK);
+    BOOST_CHECK(!fFirstRun);
+    vector<string> vExpected;
+    vExpected.push_back("move b");
+    if (wtx1.GetHash() < wtx2.GetHash())
+    {
+        vExpected.push_back(wtx1.GetHash().ToString());
+        vExpected.push_back(wtx2.GetHash().ToString());
+    }
+    else
+    {
+        vExpected.push_back(wtx2.GetHash().ToString());
+        vExpected.push_back(wtx1.GetHash().ToString());
+    }
+    vExpected.push_back("move a");
+    vExpected.push_back(wtx3.GetHash().ToString());
+    BOOST_CHECK(DescribeTxItems(wallet) == vExpected);
+}
+
+// Amounts listtransactions returns, oldest first
+static vector<double> ListTransactionAmounts(const string& strAccount, int nCount, int nFrom)
+{
+    json_spirit::Array params;
+    params.push_back(strAccount);
+    params.push_back(nCount);
+    params.push_back(nFrom);
+    json_spirit::Array ret = mapCallTable["listtransactions"](params, false).get_array();
+    vector<double> vAmounts;
+    BOOST_FOREACH(const json_spirit::Value& entry, ret)
+        vAmounts.push_back(json_spirit::find_value(entry.get_obj(), "amount").get_real());
+    return vAmounts;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_listtransactions_paging)
+{
+    CFakeChain chain;
+    CWallet wallet;
+    CScript scriptPubKey = MakeKey(wallet);
+    CBlockIndex* pindex = chain.Extend(NULL, 6);
+    chain.SetBest(chain.Extend(pindex, 5));
+
+    // six payments ten seconds apart, with a move to "a" after the second
+    // and one out of "b" after the fourth
+    int64 nTime = 1300000000;
+    for (int i = 0; i < 6; i++)
+    {
+        SetMockTime(nTime + 10 * i);
+        BOOST_CHECK(wallet.AddToWallet(MakeIncomingTx(scriptPubKey, (i + 1) * COIN, pindex)));
+    }
+    SetMockTime(0);
+    wallet.AddAccountingEntry(MakeMove("a", COIN / 2, nTime + 15));
+    wallet.AddAccountingEntry(MakeMove("b", -COIN / 4, nTime + 35));
+
+    double pAll[] = { 1, 2, 0.5, 3, 4, -0.25, 5, 6 };
+    vector<double> vAll(pAll, pAll + 8);
+
+    CWallet* pwalletMainOld = pwalletMain;
+    pwalletMain = &wallet;
+    BOOST_CHECK(ListTransactionAmounts("*", 100, 0) == vAll);
+    BOOST_CHECK(ListTransactionAmounts("*", 3, 0) == vector<double>(vAll.end() - 3, vAll.end()));
+    BOOST_CHECK(ListTransactionAmounts("*", 3, 2) == vector<double>(vAll.end() - 5, vAll.end() - 2));
+    BOOST_CHECK(ListTransactionAmounts("*", 3, 6) == vector<double>(vAll.begin(), vAll.begin() + 2));
+    BOOST_CHECK(ListTransactionAmounts("*", 3, 8).empty());
+    BOOST_CHECK(ListTransactionAmounts("*", 3, 100).empty());
+
+    // an account only sees its own moves, and other accounts' moves don't
+    // count towards [from]
+    BOOST_CHECK(ListTransactionAmounts("a", 10, 0) == vector<double>(1, 0.5));
+    BOOST_CHECK(ListTransactionAmounts("b", 10, 0) == vector<double>(1, -0.25));
+    double pReceived[] = { 1, 2, 3, 4 };
+    BOOST_CHECK(ListTransactionAmounts("", 10, 2) == vector<double>(pReceived, pReceived + 4));
+    BOOST_CHECK(ListTransactionAmounts("", 10, 6).empty());
+    pwalletMain = pwalletMainOld;
+}
+
+static set<uint160> GetKeyHashes(const CWallet& wallet)
+{
+    set<uint160> setKeyHashes;
+    set<CBitcoinAddress> setAddress;
+    wallet.GetKeys(setAddress);
+    BOOST_FOREACH(const CBitcoinAddress& address, setAddress)
+        setKeyHashes.insert(address.GetHash160());
+    return setKeyHashes;
+}
+
+static CTransaction MakeSpend(const COutPoint& prevout, const CScript& scriptPubKey, int64 nValue)
+{
+    CTransaction tx;
+    tx.vin.push_back(CTxIn(prevout));
+    tx.vout.push_back(CTxOut(nValue, scriptPubKey));
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_rescan_candidates)
+{
+    CWallet wallet;
+    CKey key, keyUncompressed, keyOther;
+    key.MakeNewKey(true);
+    keyUncompressed.MakeNewKey(false);
+    keyOther.MakeNewKey(true);
+    BOOST_CHECK(wallet.AddKey(key));
+    BOOST_CHECK(wallet.AddKey(keyUncompressed));
+    vector<CKey> vMultisig;
+    vMultisig.push_back(key);
+    vMultisig.push_back(keyOther);
+
+    vector<CScript> vScript(7);
+    vScript[0].SetBitcoinAddress(key.GetPubKey());
+    vScript[1].SetBitcoinAddress(keyOther.GetPubKey());
+    vScript[2] << key.GetPubKey() << OP_CHECKSIG;
+    vScript[3] << keyOther.GetPubKey() << OP_CHECKSIG;
+    vScript[4] << keyUncompressed.GetPubKey() << OP_CHECKSIG;
+    vScript[5].SetMultisig(1, vMultisig);
+    vScript[6] = vScript[1];
+    BOOST_CHECK_EQUAL(vScript[2].size(), 35);
+    BOOST_CHECK_EQUAL(vScript[4].size(), 67);
+
+    CRescanBlock rescan;
+    for (unsigned int i = 0; i < vScript.size(); i++)
+        rescan.block.vtx.push_back(MakeSpend(COutPoint(Hash(BEGIN(i), END(i)), 0), vScript[i], COIN));
+
+    // the last pays someone else but is already ours
+    BOOST_CHECK(wallet.AddToWallet(CWalletTx(&wallet, rescan.block.vtx[6])));
+
+    MarkRescanCandidates(&wallet, rescan, GetKeyHashes(wallet));
+    char pfExpected[] = { true, false, true, false, true, true, true };
+    BOOST_CHECK(rescan.vfCandidate == vector<char>(pfExpected, pfExpected + 7));
+}
+
+// Reads ahead the way ScanForWalletTransactions does, blocks are built in
+// memory instead
+static void MarkRescanBlocks(const CWallet* pwallet, vector<CRescanBlock>* pvBlocks, const set<uint160>* psetKeyHashes, unsigned int nBegin, unsigned int nStep)
+{
+    for (unsigned int i = nBegin; i < pvBlocks->size(); i += nStep)
+        MarkRescanCandidates(pwallet, (*pvBlocks)[i], *psetKeyHashes);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_rescan_parallel)
+{
+    CFakeChain chain;
+    CWallet walletParallel, walletSequential;
+    CKey key, keyUncompressed, keyOther;
+    key.MakeNewKey(true);
+    keyUncompressed.MakeNewKey(false);
+    keyOther.MakeNewKey(true);
+    BOOST_CHECK(walletParallel.AddKey(key));
+    BOOST_CHECK(walletParallel.AddKey(keyUncompressed));
+    BOOST_CHECK(walletSequential.AddKey(key));
+    BOOST_CHECK(walletSequential.AddKey(keyUncompressed));
+    vector<CKey> vMultisig;
+    vMultisig.push_back(key);
+    vMultisig.push_back(keyOther);
+
+    vector<CScript> vScript(6);
+    vScript[0].SetBitcoinAddress(key.GetPubKey());
+    vScript[1].SetBitcoinAddress(keyOther.GetPubKey());
+    vScript[2] << key.GetPubKey() << OP_CHECKSIG;
+    vScript[3] << keyOther.GetPubKey() << OP_CHECKSIG;
+    vScript[4] << keyUncompressed.GetPubKey() << OP_CHECKSIG;
+    vScript[5].SetMultisig(1, vMultisig);
+
+    // Coinbases paying us and others in turn, and in every block after the
+    // first a transaction spending the coinbase before it, which is often in
+    // the same batch
+    vector<CBlock> vBlocks;
+    CBlockIndex* pindex = NULL;
+    int nFoundSequential = 0;
+    for (int nHeight = 0; nHeight < 40; nHeight++)
+    {
+        CBlock block;
+        block.nTime = 1300000000 + 600 * nHeight;
+        if (pindex)
+            block.hashPrevBlock = pindex->GetBlockHash();
+        CTransaction txCoinBase;
+        txCoinBase.vin.resize(1);
+        txCoinBase.vin[0].prevout.SetNull();
+        txCoinBase.vin[0].scriptSig = CScript() << nHeight;
+        txCoinBase.vout.push_back(CTxOut(50 * COIN, vScript[nHeight % 5]));
+        block.vtx.push_back(txCoinBase);
+        if (!vBlocks.empty())
+            block.vtx.push_back(MakeSpend(COutPoint(vBlocks.back().vtx[0].GetHash(), 0), vScript[(nHeight + 2) % 6], 49 * COIN));
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        pindex = chain.AddBlock(pindex, block);
+        vBlocks.push_back(block);
+
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            if (walletSequential.AddToWalletIfInvolvingMe(tx, &block, true))
+                nFoundSequential++;
+    }
+    chain.SetBest(pindex);
+
+    set<uint160> setKeyHashes = GetKeyHashes(walletParallel);
+    int nFoundParallel = 0;
+    for (unsigned int i = 0; i < vBlocks.size(); i += 8)
+    {
+        vector<CRescanBlock> vRescan;
+        for (unsigned int j = i; j < vBlocks.size() && j < i + 8; j++)
+        {
+            vRescan.push_back(CRescanBlock());
+            vRescan.back().block = vBlocks[j];
+            vRescan.back().pindex = mapBlockIndex[vBlocks[j].GetHash()];
+        }
+        boost::thread_group threads;
+        for (int n = 0; n < 3; n++)
+            threads.create_thread(boost::bind(&MarkRescanBlocks, &walletParallel, &vRescan, &setKeyHashes, n, 3));
+        threads.join_all();
+        nFoundParallel += walletParallel.AddRescanCandidates(vRescan, true);
+    }
+
+    BOOST_CHECK(nFoundSequential > 0);
+    BOOST_CHECK_EQUAL(nFoundParallel, nFoundSequential);
+    BOOST_CHECK_EQUAL(walletParallel.mapWallet.size(), walletSequential.mapWallet.size());
+    for (map<uint256, CWalletTx>::const_iterator it = walletSequential.mapWallet.begin(); it != walletSequential.mapWallet.end(); ++it)
+        BOOST_CHECK(walletParallel.mapWallet.count((*it).first));
+    BOOST_CHECK_EQUAL(walletParallel.GetBalance(), walletSequential.GetBalance());
+}
+
+BOOST_AUTO_TEST_CASE(wallet_rescan_start)
+{
+    CFakeChain chain;
+    CBlockIndex* pindexTip = chain.Extend(NULL, 20);
+    chain.SetBest(pindexTip);
+    int64 nTime = 1300000000;
+    for (CBlockIndex* pindex = pindexTip; pindex; pindex = pindex->pprev)
+        pindex->nTime = nTime + 600 * pindex->nHeight;
+
+    // a birth height starts the scan at that block
+    BOOST_CHECK_EQUAL(GetRescanStart(0)->nHeight, 0);
+    BOOST_CHECK_EQUAL(GetRescanStart(5)->nHeight, 5);
+    BOOST_CHECK(GetRescanStart(100) == pindexTip);
+
+    // a birth time starts two hours early, before the first block at or
+    // after that
+    BOOST_CHECK_EQUAL(GetRescanStart(nTime + 600 * 3 + 2 * 60 * 60)->nHeight, 2);
+    BOOST_CHECK_EQUAL(GetRescanStart(nTime + 600 * 3 + 2 * 60 * 60 + 1)->nHeight, 3);
+    BOOST_CHECK_EQUAL(GetRescanStart(nTime + 2 * 60 * 60)->nHeight, 0);
+    BOOST_CHECK_EQUAL(GetRescanStart(nTime - 24 * 60 * 60)->nHeight, 0);
+    BOOST_CHECK(GetRescanStart(nTime + 600 * 100) == pindexTip);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1006,63 +1006,72 @@ void SetMockTime(int64 nMockTimeIn)
     nMockTime = nMockTimeIn;
 }
 
+// Median offset of our peers' clocks.  cs_nTimeOffset guards it along with
+// the samples, as message handlers that run without cs_main read it too.
+static CCriticalSection cs_nTimeOffset;
 static int64 nTimeOffset = 0;
 
 int64 GetAdjustedTime()
 {
-    return GetTime() + nTimeOffset;
+    int64 nOffset;
+    CRITICAL_BLOCK(cs_nTimeOffset)
+        nOffset = nTimeOffset;
+    return GetTime() + nOffset;
 }
 
 void AddTimeData(const CNetAddr& ip, int64 nTime)
 {
     int64 nOffsetSample = nTime - GetTime();
 
-    // Ignore duplicates
-    static set<CNetAddr> setKnown;
-    if (!setKnown.insert(ip).second)
-        return;
-
-    // Add data
-    vTimeOffsets.input(nOffsetSample);
-    printf("Added time data, samples %d, offset %+"PRI64d" (%+"PRI64d" minutes)\n", vTimeOffsets.size(), nOffsetSample, nOffsetSample/60);
-    if (vTimeOffsets.size() >= 5 && vTimeOffsets.size() % 2 == 1)
+    CRITICAL_BLOCK(cs_nTimeOffset)
     {
-        int64 nMedian = vTimeOffsets.median();
-        std::vector<int64> vSorted = vTimeOffsets.sorted();
-        // Only let other nodes change our time by so much
-        if (abs64(nMedian) < 35 * 60) // Litecoin: changed maximum adjust to 35 mins to avoid letting peers change our time too much in case of an attack.
-        {
-            nTimeOffset = nMedian;
-        }
-        else
-        {
-            nTimeOffset = 0;
+        // Ignore duplicates
+        static set<CNetAddr> setKnown;
+        if (!setKnown.insert(ip).second)
+            return;
 
-            static bool fDone;
-            if (!fDone)
+        // Add data
+        vTimeOffsets.input(nOffsetSample);
+        printf("Added time data, samples %d, offset %+"PRI64d" (%+"PRI64d" minutes)\n", vTimeOffsets.size(), nOffsetSample, nOffsetSample/60);
+        if (vTimeOffsets.size() >= 5 && vTimeOffsets.size() % 2 == 1)
+        {
+            int64 nMedian = vTimeOffsets.median();
+            std::vector<int64> vSorted = vTimeOffsets.sorted();
+            // Only let other nodes change our time by so much
+            if (abs64(nMedian) < 35 * 60) // Litecoin: changed maximum adjust to 35 mins to avoid letting peers change our time too much in case of an attack.
+            {
+                nTimeOffset = nMedian;
+            }
+            else
             {
-                // If nobody has a time different than ours but within 5 minutes of ours, give a warning
-                bool fMatch = false;
-                BOOST_FOREACH(int64 nOffset, vSorted)
-                    if (nOffset != 0 && abs64(nOffset) < 5 * 60)
-                        fMatch = true;
+                nTimeOffset = 0;
 
-                if (!fMatch)
+                static bool fDone;
+                if (!fDone)
                 {
-                    fDone = true;
-                    string strMessage = _("Warning: Please check that your computer's date and time are correct.  If your clock is wrong Litecoin will not work properly.");
-                    strMiscWarning = strMessage;
-                    printf("*** %s\n", strMessage.c_str());
-                    boost::thread(boost::bind(ThreadSafeMessageBox, strMessage+" ", string("Litecoin"), wxOK | wxICON_EXCLAMATION, (wxWindow*)NULL, -1, -1));
+                    // If nobody has a time different than ours but within 5 minutes of ours, give a warning
+                    bool fMatch = false;
+                    BOOST_FOREACH(int64 nOffset, vSorted)
+                        if (nOffset != 0 && abs64(nOffset) < 5 * 60)
+                            fMatch = true;
+
+                    if (!fMatch)
+                    {
+                        fDone = true;
+                        string strMessage = _("Warning: Please check that your computer's date and time are correct.  If your clock is wrong Litecoin will not work properly.");
+                        strMiscWarning = strMessage;
+                        printf("*** %s\n", strMessage.c_str());
+                        boost::thread(boost::bind(ThreadSafeMessageBox, strMessage+" ", string("Litecoin"), wxOK | wxICON_EXCLAMATION, (wxWindow*)NULL, -1, -1));
+                    }
                 }
             }
+            if (fDebug) {
+                BOOST_FOREACH(int64 n, vSorted)
+                    printf("%+"PRI64d"  ", n);
+                printf("|  ");
+            }
+            printf("nTimeOffset = %+"PRI64d"  (%+"PRI64d" minutes)\n", nTimeOffset, nTimeOffset/60);
         }
-        if (fDebug) {
-            BOOST_FOREACH(int64 n, vSorted)
-                printf("%+"PRI64d"  ", n);
-            printf("|  ");
-        }
-        printf("nTimeOffset = %+"PRI64d"  (%+"PRI64d" minutes)\n", nTimeOffset, nTimeOffset/60);
     }
 }
 
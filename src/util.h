@@ -55,6 +55,15 @@ typedef unsigned long long  uint64;
 #endif
 #endif
 
+// Format characters for size_t
+#ifndef PRIszu
+#if defined(_MSC_VER) || defined(__MSVCRT__)
+#define PRIszu  "Iu"
+#else
+#define PRIszu  "zu"
+#endif
+#endif
+
 // This is needed because the foreach macro can't get over the comma in pair<t1, t2>
 #define PAIRTYPE(t1, t2)    std::pair<t1, t2>
 
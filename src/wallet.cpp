@@ -271,6 +271,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                     printf("WalletUpdateSpent found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    UpdateCoins(wtx);
                     vWalletUpdated.push_back(txin.prevout.hash);
                 }
             }
@@ -284,9 +285,150 @@ void CWallet::MarkDirty()
     {
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        RebuildCoinIndex();
+        fAccountTallyDirty = true;
     }
 }
 
+// Height of the block a wallet transaction claims to be in, or -1.
+// If fMainChain is set the block must also be on the best chain.
+int static GetCoinHeight(const CWalletTx& wtx, bool fMainChain)
+{
+    if (wtx.hashBlock == 0)
+        return -1;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+    if (mi == mapBlockIndex.end())
+        return -1;
+    CBlockIndex* pindex = (*mi).second;
+    if (fMainChain && !pindex->IsInMainChain())
+        return -1;
+    return pindex->nHeight;
+}
+
+void CWallet::AddCoin(const CWalletTx& wtx, unsigned int i, int nHeight) const
+{
+    COutPoint outpoint(wtx.GetHash(), i);
+    CWalletCoin& coin = mapCoins[outpoint];
+    coin.pcoin = &wtx;
+    coin.i = i;
+    coin.nValue = wtx.vout[i].nValue;
+    coin.nHeight = nHeight;
+    coin.fCoinBase = wtx.IsCoinBase();
+
+    setCoinsByHeight.insert(make_pair(nHeight, outpoint));
+    setCoinsByValue.insert(make_pair(coin.nValue, outpoint));
+    if (coin.fCoinBase)
+        setCoinBaseByHeight.insert(make_pair(nHeight, outpoint));
+    if (nHeight >= 0)
+    {
+        nCoinsConfirmed += coin.nValue;
+        nCoinsCheckHeight = min(nCoinsCheckHeight, nHeight);
+    }
+}
+
+void CWallet::EraseCoin(const COutPoint& outpoint) const
+{
+    map<COutPoint, CWalletCoin>::iterator mi = mapCoins.find(outpoint);
+    if (mi == mapCoins.end())
+        return;
+    const CWalletCoin& coin = (*mi).second;
+    setCoinsByHeight.erase(make_pair(coin.nHeight, outpoint));
+    setCoinsByValue.erase(make_pair(coin.nValue, outpoint));
+    if (coin.fCoinBase)
+        setCoinBaseByHeight.erase(make_pair(coin.nHeight, outpoint));
+    if (coin.nHeight >= 0)
+        nCoinsConfirmed -= coin.nValue;
+    mapCoins.erase(mi);
+}
+
+// Re-index the outputs of one of our transactions, e.g. after it got
+// confirmed or some of its outputs were spent
+void CWallet::UpdateCoins(const CWalletTx& wtx, int nHeight) const
+{
+    uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        EraseCoin(COutPoint(hash, i));
+        if (wtx.IsSpent(i) || wtx.vout[i].nValue <= 0 || !IsMine(wtx.vout[i]))
+            continue;
+        AddCoin(wtx, i, nHeight);
+    }
+}
+
+void CWallet::UpdateCoins(const CWalletTx& wtx) const
+{
+    // The block may only be getting connected right now, SyncCoinIndex
+    // checks it made it into the main chain
+    UpdateCoins(wtx, GetCoinHeight(wtx, false));
+}
+
+void CWallet::RebuildCoinIndex() const
+{
+    mapCoins.clear();
+    setCoinsByHeight.clear();
+    setCoinsByValue.clear();
+    setCoinBaseByHeight.clear();
+    nCoinsConfirmed = 0;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateCoins((*it).second, GetCoinHeight((*it).second, true));
+    pindexCoins = pindexBest;
+    nCoinsCheckHeight = std::numeric_limits<int>::max();
+}
+
+// Bring the height buckets in line with the best chain.  New blocks report
+// our transactions through AddToWallet as they are connected, so only coins
+// recorded since the last sync, coins above the fork with the chain we saw
+// then, and unconfirmed coins can be out of date.
+void CWallet::SyncCoinIndex() const
+{
+    if (pindexCoins == pindexBest && nCoinsCheckHeight == std::numeric_limits<int>::max())
+        return;
+
+    int nCheckHeight = nCoinsCheckHeight;
+    if (pindexCoins != pindexBest)
+    {
+        CBlockIndex* pfork = pindexCoins;
+        while (pfork && !pfork->IsInMainChain())
+            pfork = pfork->pprev;
+        nCheckHeight = min(nCheckHeight, pfork ? pfork->nHeight + 1 : 0);
+    }
+
+    vector<const CWalletTx*> vStale;
+    const COutPoint outpointMin(0, 0);
+    for (set<pair<int, COutPoint> >::const_iterator it = setCoinsByHeight.begin();
+         it != setCoinsByHeight.end() && (*it).first < 0; ++it)
+    {
+        const CWalletCoin& coin = mapCoins[(*it).second];
+        if (GetCoinHeight(*coin.pcoin, true) != -1)
+            vStale.push_back(coin.pcoin);
+    }
+    for (set<pair<int, COutPoint> >::const_iterator it = setCoinsByHeight.lower_bound(make_pair(max(nCheckHeight, 0), outpointMin));
+         it != setCoinsByHeight.end(); ++it)
+    {
+        const CWalletCoin& coin = mapCoins[(*it).second];
+        if (GetCoinHeight(*coin.pcoin, true) != coin.nHeight)
+            vStale.push_back(coin.pcoin);
+    }
+    BOOST_FOREACH(const CWalletTx* pcoin, vStale)
+        UpdateCoins(*pcoin, GetCoinHeight(*pcoin, true));
+
+    pindexCoins = pindexBest;
+    nCoinsCheckHeight = std::numeric_limits<int>::max();
+}
+
+bool CWallet::IsSpendableCoin(const CWalletCoin& coin, int nConfMine, int nConfTheirs) const
+{
+    const CWalletTx* pcoin = coin.pcoin;
+    int nDepth = (coin.nHeight >= 0 ? nBestHeight - coin.nHeight + 1 : 0);
+    if (coin.fCoinBase && nDepth < COINBASE_MATURITY+20)
+        return false;
+    if (nDepth < (pcoin->IsFromMe() ? nConfMine : nConfTheirs))
+        return false;
+    if (nDepth < 1 && (!pcoin->IsFinal() || !pcoin->IsConfirmed()))
+        return false;
+    return true;
+}
+
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 {
     uint256 hash = wtxIn.GetHash();
@@ -298,7 +440,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         wtx.BindWallet(this);
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
+        {
             wtx.nTimeReceived = GetAdjustedTime();
+            AddToOrderedTxItems(wtx.GetTxTime(), &wtx, NULL);
+        }
 
         bool fUpdated = false;
         if (!fInsertedNew)
@@ -347,6 +492,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
         }
 #endif
+        UpdateCoins(wtx);
+        if (!fAccountTallyDirty)
+            TallyAccountTx(wtx, GetCoinHeight(wtx, false));
+
         // Notify UI
         vWalletUpdated.push_back(hash);
 
@@ -385,12 +534,19 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
 
 bool CWallet::EraseFromWallet(uint256 hash)
 {
-    if (!fFileBacked)
-        return false;
     CRITICAL_BLOCK(cs_wallet)
     {
-        if (mapWallet.erase(hash))
-            CWalletDB(strWalletFile).EraseTx(hash);
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            for (unsigned int i = 0; i < (*mi).second.vout.size(); i++)
+                EraseCoin(COutPoint(hash, i));
+            UntallyAccountTx(hash);
+            EraseFromOrderedTxItems((*mi).second.GetTxTime(), &(*mi).second);
+            mapWallet.erase(mi);
+            if (fFileBacked)
+                CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return true;
 }
@@ -582,8 +738,7 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
 {
     vtxPrev.clear();
 
-    const int COPY_DEPTH = 3;
-    if (SetMerkleBranch() < COPY_DEPTH)
+    if (SetMerkleBranch() < SUPPORTING_TX_DEPTH)
     {
         vector<uint256> vWorkQueue;
         BOOST_FOREACH(const CTxIn& txin, vin)
@@ -592,7 +747,7 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
         // This critsect is OK because txdb is already open
         CRITICAL_BLOCK(pwallet->cs_wallet)
         {
-            map<uint256, const CMerkleTx*> mapWalletPrev;
+            map<uint256, boost::shared_ptr<const CMerkleTx> > mapWalletPrev;
             set<uint256> setAlreadyDone;
             for (int i = 0; i < vWorkQueue.size(); i++)
             {
@@ -601,13 +756,15 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
                     continue;
                 setAlreadyDone.insert(hash);
 
-                CMerkleTx tx;
+                CMerkleTx* ptx = new CMerkleTx();
+                boost::shared_ptr<const CMerkleTx> ptxShared(ptx);
+                CMerkleTx& tx = *ptx;
                 map<uint256, CWalletTx>::const_iterator mi = pwallet->mapWallet.find(hash);
                 if (mi != pwallet->mapWallet.end())
                 {
                     tx = (*mi).second;
-                    BOOST_FOREACH(const CMerkleTx& txWalletPrev, (*mi).second.vtxPrev)
-                        mapWalletPrev[txWalletPrev.GetHash()] = &txWalletPrev;
+                    BOOST_FOREACH(const boost::shared_ptr<const CMerkleTx>& ptxWalletPrev, (*mi).second.vtxPrev)
+                        mapWalletPrev[ptxWalletPrev->GetHash()] = ptxWalletPrev;
                 }
                 else if (mapWalletPrev.count(hash))
                 {
@@ -624,9 +781,9 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
                 }
 
                 int nDepth = tx.SetMerkleBranch();
-                vtxPrev.push_back(tx);
+                vtxPrev.push_back(ptxShared);
 
-                if (nDepth < COPY_DEPTH)
+                if (nDepth < SUPPORTING_TX_DEPTH)
                     BOOST_FOREACH(const CTxIn& txin, tx.vin)
                         vWorkQueue.push_back(txin.prevout.hash);
             }
@@ -638,31 +795,135 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
 
 bool CWalletTx::WriteToDisk()
 {
+    if (!pwallet->fFileBacked)
+        return true;
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+// Whether an output could be paying us, judged from our key hashes alone
+// so it can be done off the main thread.  Anything but plain pay-to-pubkey
+// and pay-to-pubkey-hash is left for IsMine to decide.
+bool static IsRescanCandidate(const CScript& script, const set<uint160>& setKeyHashes)
+{
+    // OP_DUP OP_HASH160 <hash160> OP_EQUALVERIFY OP_CHECKSIG
+    if (script.size() == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+        script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG)
+        return setKeyHashes.count(uint160(vector<unsigned char>(script.begin() + 3, script.begin() + 23)));
+
+    // <pubkey> OP_CHECKSIG
+    if ((script.size() == 35 || script.size() == 67) && script[0] == script.size() - 2 &&
+        script[script.size() - 1] == OP_CHECKSIG)
+        return setKeyHashes.count(Hash160(vector<unsigned char>(script.begin() + 1, script.end() - 1)));
+
+    return true;
+}
+
+// Marks the transactions in a block read for a rescan that may pay us, or
+// that are already in the wallet.  Spends of our coins are left for
+// AddRescanCandidates, as the coins may only be found earlier in the batch.
+void MarkRescanCandidates(const CWallet* pwallet, CRescanBlock& rescan, const set<uint160>& setKeyHashes)
+{
+    rescan.vfCandidate.assign(rescan.block.vtx.size(), false);
+    for (unsigned int j = 0; j < rescan.block.vtx.size(); j++)
+    {
+        const CTransaction& tx = rescan.block.vtx[j];
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        {
+            if (IsRescanCandidate(txout.scriptPubKey, setKeyHashes))
+            {
+                rescan.vfCandidate[j] = true;
+                break;
+            }
+        }
+        if (!rescan.vfCandidate[j] && pwallet->mapWallet.count(tx.GetHash()))
+            rescan.vfCandidate[j] = true;
+    }
+}
+
+void static ReadRescanBlocks(const CWallet* pwallet, vector<CRescanBlock>* pvBlocks, const set<uint160>* psetKeyHashes, unsigned int nBegin, unsigned int nStep)
+{
+    for (unsigned int i = nBegin; i < pvBlocks->size() && !fShutdown; i += nStep)
+    {
+        CRescanBlock& rescan = (*pvBlocks)[i];
+        if (!rescan.block.ReadFromDisk(rescan.pindex, true))
+            continue;
+        MarkRescanCandidates(pwallet, rescan, *psetKeyHashes);
+    }
+}
+
+// Goes through the candidates of a batch of rescan blocks in chain order,
+// along with anything spending a coin of ours, and returns how many
+// transactions were added or updated
+int CWallet::AddRescanCandidates(const vector<CRescanBlock>& vBlocks, bool fUpdate)
+{
+    int ret = 0;
+    CRITICAL_BLOCK(cs_wallet)
+    {
+        BOOST_FOREACH(const CRescanBlock& rescan, vBlocks)
+        {
+            for (unsigned int j = 0; j < rescan.vfCandidate.size(); j++)
+            {
+                const CTransaction& tx = rescan.block.vtx[j];
+                bool fCandidate = rescan.vfCandidate[j];
+                for (unsigned int n = 0; n < tx.vin.size() && !fCandidate; n++)
+                    if (mapWallet.count(tx.vin[n].prevout.hash))
+                        fCandidate = true;
+                if (fCandidate && AddToWalletIfInvolvingMe(tx, &rescan.block, fUpdate))
+                    ret++;
+            }
+        }
+    }
+    return ret;
+}
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+// Blocks are read ahead in batches, and their outputs matched against our
+// key hashes, on several threads; only transactions that may pay us or
+// spend our coins go through AddToWalletIfInvolvingMe, in chain order.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
 
+    set<uint160> setKeyHashes;
+    set<CBitcoinAddress> setAddress;
+    GetKeys(setAddress);
+    BOOST_FOREACH(const CBitcoinAddress& address, setAddress)
+        setKeyHashes.insert(address.GetHash160());
+
+    int nThreads = boost::thread::hardware_concurrency();
+    if (nThreads < 1)
+        nThreads = 1;
+    if (nThreads > 8)
+        nThreads = 8;
+
+    int64 nStart = GetTimeMillis();
     CBlockIndex* pindex = pindexStart;
     CRITICAL_BLOCK(cs_wallet)
     {
-        while (pindex)
+        while (pindex && !fShutdown)
         {
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            vector<CRescanBlock> vBlocks;
+            for (; pindex && vBlocks.size() < nThreads * RESCAN_BLOCKS_PER_THREAD; pindex = pindex->pnext)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                vBlocks.push_back(CRescanBlock());
+                vBlocks.back().pindex = pindex;
             }
-            pindex = pindex->pnext;
+
+            // Nothing touches mapWallet while the readers run
+            boost::thread_group threads;
+            for (int i = 0; i < nThreads; i++)
+                threads.create_thread(boost::bind(&ReadRescanBlocks, this, &vBlocks, &setKeyHashes, i, nThreads));
+            threads.join_all();
+
+            ret += AddRescanCandidates(vBlocks, fUpdate);
+
+            if (pindex && vBlocks.back().pindex->nHeight / 10000 != pindex->nHeight / 10000)
+                printf("ScanForWalletTransactions() : at height %d, %d found\n", pindex->nHeight, ret);
         }
     }
+    printf("ScanForWalletTransactions() : %d transactions found in %"PRI64d"ms\n", ret, GetTimeMillis() - nStart);
     return ret;
 }
 
@@ -715,6 +976,7 @@ void CWallet::ReacceptWalletTransactions()
                     printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    UpdateCoins(wtx);
                 }
             }
             else
@@ -735,8 +997,9 @@ void CWallet::ReacceptWalletTransactions()
 
 void CWalletTx::RelayWalletTransaction(CTxDB& txdb)
 {
-    BOOST_FOREACH(const CMerkleTx& tx, vtxPrev)
+    BOOST_FOREACH(const boost::shared_ptr<const CMerkleTx>& ptx, vtxPrev)
     {
+        const CMerkleTx& tx = *ptx;
         if (!tx.IsCoinBase())
         {
             uint256 hash = tx.GetHash();
@@ -818,12 +1081,23 @@ int64 CWallet::GetBalance() const
     int64 nTotal = 0;
     CRITICAL_BLOCK(cs_wallet)
     {
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        SyncCoinIndex();
+        nTotal = nCoinsConfirmed;
+
+        // Generated coins don't count until they mature
+        const COutPoint outpointMin(0, 0);
+        int nImmatureHeight = nBestHeight + 2 - (COINBASE_MATURITY+20);
+        for (set<pair<int, COutPoint> >::const_iterator it = setCoinBaseByHeight.lower_bound(make_pair(max(nImmatureHeight, 0), outpointMin));
+             it != setCoinBaseByHeight.end(); ++it)
+            nTotal -= mapCoins[(*it).second].nValue;
+
+        // Unconfirmed coins count if we sent them to ourselves
+        for (set<pair<int, COutPoint> >::const_iterator it = setCoinsByHeight.begin();
+             it != setCoinsByHeight.end() && (*it).first < 0; ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                continue;
-            nTotal += pcoin->GetAvailableCredit();
+            const CWalletCoin& coin = mapCoins[(*it).second];
+            if (!coin.fCoinBase && coin.pcoin->IsFinal() && coin.pcoin->IsConfirmed())
+                nTotal += coin.nValue;
         }
     }
 
@@ -835,111 +1109,390 @@ int64 CWallet::GetUnconfirmedBalance() const
     int64 nTotal = 0;
     CRITICAL_BLOCK(cs_wallet)
     {
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        SyncCoinIndex();
+        for (set<pair<int, COutPoint> >::const_iterator it = setCoinsByHeight.begin();
+             it != setCoinsByHeight.end() && (*it).first < 0; ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsFinal() && pcoin->IsConfirmed())
+            const CWalletCoin& coin = mapCoins[(*it).second];
+            if (coin.fCoinBase || (coin.pcoin->IsFinal() && coin.pcoin->IsConfirmed()))
                 continue;
-            nTotal += pcoin->GetAvailableCredit();
+            nTotal += coin.nValue;
         }
     }
     return nTotal;
 }
 
-bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
+void CWallet::ApplyAccountTxTally(const CAccountTxTally& txtally, int64 nSign) const
 {
-    setCoinsRet.clear();
-    nValueRet = 0;
+    if (!txtally.fFinal)
+        return;
+    for (unsigned int i = 0; i < txtally.vDebit.size(); i++)
+        mapAccountTally[txtally.vDebit[i].first].nSettled += nSign * txtally.vDebit[i].second;
 
-    // List of values less than target
-    pair<int64, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
-    coinLowestLarger.first = std::numeric_limits<int64>::max();
-    coinLowestLarger.second.first = NULL;
-    vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
-    int64 nTotalLower = 0;
+    bool fSettled = (txtally.nHeight >= 0 && txtally.nHeight <= nAccountTallyFoldHeight);
+    for (unsigned int i = 0; i < txtally.vCredit.size(); i++)
+    {
+        CAccountTally& tally = mapAccountTally[txtally.vCredit[i].first];
+        int64 nCredit = nSign * txtally.vCredit[i].second;
+        if (fSettled)
+        {
+            tally.nSettled += nCredit;
+            continue;
+        }
+        map<int, int64>& mapBucket = (txtally.fCoinBase ? tally.mapImmature : tally.mapPending);
+        if ((mapBucket[txtally.nHeight] += nCredit) == 0)
+            mapBucket.erase(txtally.nHeight);
+    }
+}
 
-    CRITICAL_BLOCK(cs_wallet)
+void CWallet::UntallyAccountTx(const uint256& hash) const
+{
+    map<uint256, CAccountTxTally>::iterator mi = mapAccountTxTally.find(hash);
+    if (mi == mapAccountTxTally.end())
+        return;
+    ApplyAccountTxTally((*mi).second, -1);
+    setAccountTxByHeight.erase(make_pair((*mi).second.nHeight, hash));
+    setAccountTxNonFinal.erase(hash);
+    mapAccountTxTally.erase(mi);
+}
+
+// Split one of our transactions between the accounts the same way
+// CWalletTx::GetAccountAmounts does
+void CWallet::TallyAccountTx(const CWalletTx& wtx, int nHeight) const
+{
+    uint256 hash = wtx.GetHash();
+    UntallyAccountTx(hash);
+
+    CAccountTxTally& txtally = mapAccountTxTally[hash];
+    txtally.nHeight = nHeight;
+    txtally.fFinal = wtx.IsFinal();
+    txtally.fCoinBase = wtx.IsCoinBase();
+    setAccountTxByHeight.insert(make_pair(nHeight, hash));
+    if (nHeight >= 0)
+        nAccountCheckHeight = min(nAccountCheckHeight, nHeight);
+    if (!txtally.fFinal)
     {
-       vector<const CWalletTx*> vCoins;
-       vCoins.reserve(mapWallet.size());
-       for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-           vCoins.push_back(&(*it).second);
-       random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+        setAccountTxNonFinal.insert(hash);
+        return;
+    }
 
-       BOOST_FOREACH(const CWalletTx* pcoin, vCoins)
-       {
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                continue;
+    int64 nGeneratedImmature, nGeneratedMature, nFee;
+    string strSentAccount;
+    list<pair<CBitcoinAddress, int64> > listReceived;
+    list<pair<CBitcoinAddress, int64> > listSent;
+    wtx.GetAmounts(nGeneratedImmature, nGeneratedMature, listReceived, listSent, nFee, strSentAccount);
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+    int64 nDebit = nFee;
+    BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, int64)& s, listSent)
+        nDebit += s.second;
+    txtally.vDebit.push_back(make_pair(strSentAccount, -nDebit));
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < (pcoin->IsFromMe() ? nConfMine : nConfTheirs))
-                continue;
+    if (txtally.fCoinBase)
+        txtally.vCredit.push_back(make_pair(string(""), nGeneratedImmature + nGeneratedMature));
+    BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, int64)& r, listReceived)
+    {
+        map<CBitcoinAddress, string>::const_iterator mi = mapAddressBook.find(r.first);
+        txtally.vCredit.push_back(make_pair(mi != mapAddressBook.end() ? (*mi).second : string(""), r.second));
+    }
 
-            for (int i = 0; i < pcoin->vout.size(); i++)
-            {
-                if (pcoin->IsSpent(i) || !IsMine(pcoin->vout[i]))
-                    continue;
+    ApplyAccountTxTally(txtally, 1);
+}
 
-                int64 n = pcoin->vout[i].nValue;
+void CWallet::RebuildAccountTally() const
+{
+    mapAccountTally.clear();
+    mapAccountTxTally.clear();
+    setAccountTxByHeight.clear();
+    setAccountTxNonFinal.clear();
+    nAccountTallyFoldHeight = nBestHeight + 1 - ACCOUNT_TALLY_DEPTH;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        TallyAccountTx((*it).second, GetCoinHeight((*it).second, true));
+    pindexAccounts = pindexBest;
+    nAccountCheckHeight = std::numeric_limits<int>::max();
+    fAccountTallyDirty = false;
+}
 
-                // If output is less than minimum value, then don't include transaction.
-                // This is to help deal with dust spam clogging up create transactions.
-                if (n <= 0 || n < nMinimumInputValue)
-                    continue;
+// Bring the tally in line with the best chain, the same way SyncCoinIndex
+// does for the coin index, then fold credits that are now deep enough into
+// the settled totals.
+void CWallet::SyncAccountTally() const
+{
+    int nFoldHeight = nBestHeight + 1 - ACCOUNT_TALLY_DEPTH;
 
-                pair<int64,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin,i));
+    // Folded credits can't be told apart again, so start over if the
+    // chain got shorter
+    if (fAccountTallyDirty || nFoldHeight < nAccountTallyFoldHeight)
+    {
+        RebuildAccountTally();
+        return;
+    }
+    if (pindexAccounts == pindexBest && nAccountCheckHeight == std::numeric_limits<int>::max() && setAccountTxNonFinal.empty())
+        return;
 
-                if (n == nTargetValue)
-                {
-                    setCoinsRet.insert(coin.second);
-                    nValueRet += coin.first;
-                    return true;
-                }
-                else if (n < nTargetValue + CENT)
-                {
-                    vValue.push_back(coin);
-                    nTotalLower += n;
-                }
-                else if (n < coinLowestLarger.first)
+    int nCheckHeight = nAccountCheckHeight;
+    if (pindexAccounts != pindexBest)
+    {
+        CBlockIndex* pfork = pindexAccounts;
+        while (pfork && !pfork->IsInMainChain())
+            pfork = pfork->pprev;
+        nCheckHeight = min(nCheckHeight, pfork ? pfork->nHeight + 1 : 0);
+    }
+
+    vector<uint256> vStale(setAccountTxNonFinal.begin(), setAccountTxNonFinal.end());
+    for (set<pair<int, uint256> >::const_iterator it = setAccountTxByHeight.begin();
+         it != setAccountTxByHeight.end() && (*it).first < 0; ++it)
+    {
+        const CWalletTx& wtx = mapWallet.find((*it).second)->second;
+        if (GetCoinHeight(wtx, true) != -1)
+            vStale.push_back((*it).second);
+    }
+    for (set<pair<int, uint256> >::const_iterator it = setAccountTxByHeight.lower_bound(make_pair(max(nCheckHeight, 0), uint256(0)));
+         it != setAccountTxByHeight.end(); ++it)
+    {
+        const CWalletTx& wtx = mapWallet.find((*it).second)->second;
+        if (GetCoinHeight(wtx, true) != (*it).first)
+            vStale.push_back((*it).second);
+    }
+    BOOST_FOREACH(const uint256& hash, vStale)
+    {
+        const CWalletTx& wtx = mapWallet.find(hash)->second;
+        TallyAccountTx(wtx, GetCoinHeight(wtx, true));
+    }
+
+    if (nFoldHeight > nAccountTallyFoldHeight)
+    {
+        for (map<string, CAccountTally>::iterator it = mapAccountTally.begin(); it != mapAccountTally.end(); ++it)
+        {
+            CAccountTally& tally = (*it).second;
+            map<int, int64>* pmapBuckets[] = { &tally.mapPending, &tally.mapImmature };
+            for (int i = 0; i < ARRAYLEN(pmapBuckets); i++)
+            {
+                map<int, int64>& mapBucket = *pmapBuckets[i];
+                map<int, int64>::iterator mi = mapBucket.lower_bound(0);
+                while (mi != mapBucket.end() && (*mi).first <= nFoldHeight)
                 {
-                    coinLowestLarger = coin;
+                    tally.nSettled += (*mi).second;
+                    mapBucket.erase(mi++);
                 }
             }
         }
+        nAccountTallyFoldHeight = nFoldHeight;
     }
 
-    if (nTotalLower == nTargetValue || nTotalLower == nTargetValue + CENT)
+    pindexAccounts = pindexBest;
+    nAccountCheckHeight = std::numeric_limits<int>::max();
+}
+
+int64 CWallet::GetTallyBalance(const CAccountTally& tally, int nMinDepth) const
+{
+    int64 nBalance = tally.nSettled;
+    for (map<int, int64>::const_iterator it = tally.mapPending.begin(); it != tally.mapPending.end(); ++it)
     {
-        for (int i = 0; i < vValue.size(); ++i)
+        int nDepth = ((*it).first >= 0 ? nBestHeight - (*it).first + 1 : 0);
+        if (nDepth >= nMinDepth)
+            nBalance += (*it).second;
+    }
+    return nBalance;
+}
+
+// Balance of one account counting credits at least nMinDepth deep.  Returns
+// false if nMinDepth is deeper than the tally keeps track of, the caller
+// has to add it up from mapWallet then.
+bool CWallet::GetAccountBalance(const string& strAccount, int nMinDepth, int64& nBalanceRet) const
+{
+    if (nMinDepth > ACCOUNT_TALLY_DEPTH)
+        return false;
+    CRITICAL_BLOCK(cs_wallet)
+    {
+        SyncAccountTally();
+        nBalanceRet = 0;
+        map<string, CAccountTally>::const_iterator mi = mapAccountTally.find(strAccount);
+        if (mi != mapAccountTally.end())
+            nBalanceRet += GetTallyBalance((*mi).second, nMinDepth);
+        map<string, int64>::const_iterator mc = mapAccountCreditDebit.find(strAccount);
+        if (mc != mapAccountCreditDebit.end())
+            nBalanceRet += (*mc).second;
+    }
+    return true;
+}
+
+// Adds the balance of every account with any activity to mapBalances
+bool CWallet::GetAccountBalances(int nMinDepth, map<string, int64>& mapBalances) const
+{
+    if (nMinDepth > ACCOUNT_TALLY_DEPTH)
+        return false;
+    CRITICAL_BLOCK(cs_wallet)
+    {
+        SyncAccountTally();
+        for (map<string, CAccountTally>::const_iterator it = mapAccountTally.begin(); it != mapAccountTally.end(); ++it)
+            mapBalances[(*it).first] += GetTallyBalance((*it).second, nMinDepth);
+        for (map<string, int64>::const_iterator it = mapAccountCreditDebit.begin(); it != mapAccountCreditDebit.end(); ++it)
+            mapBalances[(*it).first] += (*it).second;
+    }
+    return true;
+}
+
+// Record an internal transfer once its acentry has been written
+void CWallet::AddAccountingEntry(const CAccountingEntry& acentry)
+{
+    CRITICAL_BLOCK(cs_wallet)
+    {
+        laccentries.push_back(acentry);
+        mapAccountCreditDebit[acentry.strAccount] += acentry.nCreditDebit;
+        AddToOrderedTxItems(acentry.nTime, NULL, &laccentries.back());
+    }
+}
+
+// Our transactions confirmed above nHeight on the main chain, and the ones
+// that aren't confirmed at all
+void CWallet::GetTransactionsSince(int nHeight, vector<const CWalletTx*>& vwtxRet) const
+{
+    vwtxRet.clear();
+    CRITICAL_BLOCK(cs_wallet)
+    {
+        // The account tally keeps our transactions ordered by height
+        SyncAccountTally();
+        set<pair<int, uint256> >::const_iterator it = setAccountTxByHeight.begin();
+        for (; it != setAccountTxByHeight.end() && (*it).first < 0; ++it)
+            vwtxRet.push_back(&mapWallet.find((*it).second)->second);
+        for (it = setAccountTxByHeight.lower_bound(make_pair(max(nHeight + 1, 0), uint256(0))); it != setAccountTxByHeight.end(); ++it)
+            vwtxRet.push_back(&mapWallet.find((*it).second)->second);
+    }
+}
+
+struct CompareTxItemTime
+{
+    bool operator()(const CWallet::TxItems::value_type& a, const CWallet::TxItems::value_type& b) const
+    {
+        return a.first < b.first;
+    }
+    bool operator()(int64 nTime, const CWallet::TxItems::value_type& b) const
+    {
+        return nTime < b.first;
+    }
+    bool operator()(const CWallet::TxItems::value_type& a, int64 nTime) const
+    {
+        return a.first < nTime;
+    }
+};
+
+void CWallet::AddToOrderedTxItems(int64 nTime, CWalletTx* pwtx, CAccountingEntry* pacentry)
+{
+    // Nearly everything arrives in time order and goes on the end
+    TxItems::iterator it = vOrderedTxItems.end();
+    if (!vOrderedTxItems.empty() && vOrderedTxItems.back().first > nTime)
+        it = upper_bound(vOrderedTxItems.begin(), vOrderedTxItems.end(), nTime, CompareTxItemTime());
+    vOrderedTxItems.insert(it, make_pair(nTime, TxPair(pwtx, pacentry)));
+}
+
+void CWallet::EraseFromOrderedTxItems(int64 nTime, CWalletTx* pwtx)
+{
+    TxItems::iterator it = lower_bound(vOrderedTxItems.begin(), vOrderedTxItems.end(), nTime, CompareTxItemTime());
+    for (; it != vOrderedTxItems.end() && (*it).first == nTime; ++it)
+    {
+        if ((*it).second.first == pwtx)
         {
-            setCoinsRet.insert(vValue[i].second);
-            nValueRet += vValue[i].first;
+            vOrderedTxItems.erase(it);
+            break;
         }
-        return true;
     }
+}
 
-    if (nTotalLower < nTargetValue + (coinLowestLarger.second.first ? CENT : 0))
+void CWallet::RebuildOrderedTxItems()
+{
+    vOrderedTxItems.clear();
+    vOrderedTxItems.reserve(mapWallet.size() + laccentries.size());
+    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        vOrderedTxItems.push_back(make_pair((*it).second.GetTxTime(), TxPair(&(*it).second, (CAccountingEntry*)NULL)));
+    BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+        vOrderedTxItems.push_back(make_pair(entry.nTime, TxPair((CWalletTx*)NULL, &entry)));
+    stable_sort(vOrderedTxItems.begin(), vOrderedTxItems.end(), CompareTxItemTime());
+}
+
+// Depth-first search for a subset of vValue (sorted largest first) that
+// covers nTargetValue with less than a cent left over, which
+// CreateTransaction adds to the fee instead of making change.  Including
+// a coin is tried before leaving it out, branches that can no longer
+// reach the target or already overshoot it are cut, and a coin equal in
+// value to one just left out is skipped as well.  Gives up after
+// BNB_MAX_TRIES steps.
+bool SelectCoinsBranchAndBound(const vector<int64>& vValue, int64 nTargetValue, vector<char>& vfBest, int64& nBest)
+{
+    // Value of everything from each position on
+    vector<int64> vRemaining(vValue.size() + 1, 0);
+    for (int i = vValue.size() - 1; i >= 0; i--)
+        vRemaining[i] = vRemaining[i+1] + vValue[i];
+    if (vRemaining[0] < nTargetValue)
+        return false;
+
+    vector<char> vfIncluded(vValue.size(), false);
+    vector<unsigned int> vIncluded;
+    bool fFound = false;
+    int64 nTotal = 0;
+    unsigned int i = 0;
+    for (int nTries = 0; nTries < BNB_MAX_TRIES; nTries++)
     {
-        if (coinLowestLarger.second.first == NULL)
-            return false;
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-        return true;
+        bool fBacktrack = false;
+        if (nTotal + vRemaining[i] < nTargetValue || nTotal >= nTargetValue + CENT)
+        {
+            fBacktrack = true;
+        }
+        else if (nTotal >= nTargetValue)
+        {
+            if (!fFound || nTotal < nBest)
+            {
+                fFound = true;
+                nBest = nTotal;
+                vfBest = vfIncluded;
+                if (nTotal == nTargetValue)
+                    break;
+            }
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            // Leave out the last coin we included and carry on after it
+            if (vIncluded.empty())
+                break;
+            i = vIncluded.back();
+            vIncluded.pop_back();
+            vfIncluded[i] = false;
+            nTotal -= vValue[i];
+            int64 nOmitted = vValue[i++];
+            while (i < vValue.size() && vValue[i] == nOmitted)
+            {
+                i++;
+                nTries++;
+            }
+        }
+        else
+        {
+            vIncluded.push_back(i);
+            vfIncluded[i] = true;
+            nTotal += vValue[i++];
+        }
     }
+    return fFound;
+}
 
+// Solve subset sum by stochastic approximation, aiming for at least a cent
+// of change if the coins allow it.  The number of rounds shrinks with the
+// number of coins so large wallets stay within a fixed amount of work.
+bool SelectCoinsKnapsack(const vector<int64>& vValue, int64 nTargetValue, vector<char>& vfBest, int64& nBest)
+{
+    int64 nTotalLower = 0;
+    BOOST_FOREACH(int64 n, vValue)
+        nTotalLower += n;
     if (nTotalLower >= nTargetValue + CENT)
         nTargetValue += CENT;
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend());
     vector<char> vfIncluded;
-    vector<char> vfBest(vValue.size(), true);
-    int64 nBest = nTotalLower;
+    vfBest.assign(vValue.size(), true);
+    nBest = nTotalLower;
 
-    for (int nRep = 0; nRep < 1000 && nBest != nTargetValue; nRep++)
+    int nReps = max((int64)10, min((int64)1000, KNAPSACK_MAX_WORK / ((int64)vValue.size() + 1)));
+    for (int nRep = 0; nRep < nReps && nBest != nTargetValue; nRep++)
     {
         vfIncluded.assign(vValue.size(), false);
         int64 nTotal = 0;
@@ -950,7 +1503,7 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
             {
                 if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
                 {
-                    nTotal += vValue[i].first;
+                    nTotal += vValue[i];
                     vfIncluded[i] = true;
                     if (nTotal >= nTargetValue)
                     {
@@ -960,16 +1513,122 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
                             nBest = nTotal;
                             vfBest = vfIncluded;
                         }
-                        nTotal -= vValue[i].first;
+                        nTotal -= vValue[i];
                         vfIncluded[i] = false;
                     }
                 }
             }
         }
     }
+    return (nBest >= nTargetValue);
+}
+
+static const struct
+{
+    const char* pszName;
+    coinselectfn_type pfn;
+}
+vCoinSelection[] =
+{
+    { "bnb",      &SelectCoinsBranchAndBound },
+    { "knapsack", &SelectCoinsKnapsack },
+};
+
+coinselectfn_type GetCoinSelection(const string& strName)
+{
+    for (int i = 0; i < ARRAYLEN(vCoinSelection); i++)
+        if (strName == vCoinSelection[i].pszName)
+            return vCoinSelection[i].pfn;
+    return NULL;
+}
+
+// The strategy -coinselection picked, set once at startup
+coinselectfn_type pfnCoinSelection = &SelectCoinsBranchAndBound;
+
+bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
+{
+    setCoinsRet.clear();
+    nValueRet = 0;
+
+    // List of values less than target
+    pair<int64, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
+    coinLowestLarger.first = std::numeric_limits<int64>::max();
+    coinLowestLarger.second.first = NULL;
+    vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
+    int64 nTotalLower = 0;
+
+    CRITICAL_BLOCK(cs_wallet)
+    {
+        SyncCoinIndex();
+
+        // Walk our coins in order of value: everything below the target
+        // is a candidate for the subset sum, and the first one above it
+        // is the lowest larger coin.
+        // If output is less than minimum value, then don't include transaction.
+        // This is to help deal with dust spam clogging up create transactions.
+        int64 nMinValue = max(nMinimumInputValue, (int64)1);
+        for (set<pair<int64, COutPoint> >::const_iterator it = setCoinsByValue.lower_bound(make_pair(nMinValue, COutPoint(0, 0)));
+             it != setCoinsByValue.end(); ++it)
+        {
+            const CWalletCoin& wcoin = mapCoins[(*it).second];
+            if (!IsSpendableCoin(wcoin, nConfMine, nConfTheirs))
+                continue;
+
+            int64 n = wcoin.nValue;
+            pair<int64,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(wcoin.pcoin,wcoin.i));
+
+            if (n == nTargetValue)
+            {
+                setCoinsRet.insert(coin.second);
+                nValueRet += coin.first;
+                return true;
+            }
+            else if (n < nTargetValue + CENT)
+            {
+                vValue.push_back(coin);
+                nTotalLower += n;
+            }
+            else
+            {
+                coinLowestLarger = coin;
+                break;
+            }
+        }
+    }
+
+    if (nTotalLower == nTargetValue || nTotalLower == nTargetValue + CENT)
+    {
+        for (int i = 0; i < vValue.size(); ++i)
+        {
+            setCoinsRet.insert(vValue[i].second);
+            nValueRet += vValue[i].first;
+        }
+        return true;
+    }
+
+    if (nTotalLower < nTargetValue + (coinLowestLarger.second.first ? CENT : 0))
+    {
+        if (coinLowestLarger.second.first == NULL)
+            return false;
+        setCoinsRet.insert(coinLowestLarger.second);
+        nValueRet += coinLowestLarger.first;
+        return true;
+    }
+
+    // Sort the candidates by decreasing value and hand them to the
+    // configured strategy, falling back to the stochastic approximation
+    sort(vValue.rbegin(), vValue.rend());
+    vector<int64> vAmount(vValue.size());
+    for (int i = 0; i < vValue.size(); i++)
+        vAmount[i] = vValue[i].first;
+
+    vector<char> vfBest;
+    int64 nBest = 0;
+    if (!pfnCoinSelection || !pfnCoinSelection(vAmount, nTargetValue, vfBest, nBest))
+        SelectCoinsKnapsack(vAmount, nTargetValue, vfBest, nBest);
 
     // If the next larger is still closer, return it
-    if (coinLowestLarger.second.first && coinLowestLarger.first - nTargetValue <= nBest - nTargetValue)
+    if (coinLowestLarger.second.first && coinLowestLarger.first <= nBest)
     {
         setCoinsRet.insert(coinLowestLarger.second);
         nValueRet += coinLowestLarger.first;
@@ -1048,14 +1707,13 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend, CW
                 }
 
                 int64 nChange = nValueIn - nValue - nFeeRet;
-                // if sub-cent change is required, the fee must be raised to at least MIN_TX_FEE
-                // or until nChange becomes zero
+                // Sub-cent change goes to the fee: as an output it would
+                // raise the minimum fee by MIN_TX_FEE, more than it is worth
                 // NOTE: this depends on the exact behaviour of GetMinFee
-                if (nFeeRet < MIN_TX_FEE && nChange > 0 && nChange < CENT)
+                if (nChange > 0 && nChange < CENT)
                 {
-                    int64 nMoveToFee = min(nChange, MIN_TX_FEE - nFeeRet);
-                    nChange -= nMoveToFee;
-                    nFeeRet += nMoveToFee;
+                    nFeeRet += nChange;
+                    nChange = 0;
                 }
 
                 if (nChange > 0)
@@ -1128,6 +1786,259 @@ bool CWallet::CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& w
     return CreateTransaction(vecSend, wtxNew, reservekey, nFeeRet);
 }
 
+// Fee for a batch transaction of nBytes, never counting on it going free
+int64 static GetBatchFee(unsigned int nBytes, const vector<CTxOut>& vout)
+{
+    int64 nFee = max(nTransactionFee, MIN_TX_FEE) * (1 + (int64)nBytes / 1000);
+    BOOST_FOREACH(const CTxOut& txout, vout)
+        if (txout.nValue < CENT)
+            nFee += MIN_TX_FEE;
+    return nFee;
+}
+
+void static SignBatchTransactions(const CWallet* pwallet, vector<CWalletTx>* pvwtx, const vector<vector<const CWalletTx*> >* pvCoins, vector<char>* pvfSigned, unsigned int nBegin, unsigned int nStep)
+{
+    for (unsigned int i = nBegin; i < pvwtx->size(); i += nStep)
+    {
+        CWalletTx& wtx = (*pvwtx)[i];
+        const vector<const CWalletTx*>& vCoins = (*pvCoins)[i];
+        (*pvfSigned)[i] = true;
+        for (unsigned int nIn = 0; nIn < wtx.vin.size(); nIn++)
+        {
+            if (!SignSignature(*pwallet, *vCoins[nIn], wtx, nIn))
+            {
+                (*pvfSigned)[i] = false;
+                break;
+            }
+        }
+    }
+}
+
+// Pay a large number of recipients at once.  The recipients are split into
+// transactions of at most BATCH_MAX_TX_OUTPUTS outputs, coins for the whole
+// batch are selected in one go and dealt out to the transactions largest
+// first, each taking no more inputs than keep it under the size limit, and
+// the transactions are signed on several threads.  If a few large coins hold
+// the funds, dealing them out leaves later transactions short; the coins are
+// then dealt again with every transaction spending the change of the one
+// before it, and that chain is signed in order.  Change from every
+// transaction goes to the same reserved key.
+bool CWallet::CreateTransactions(const vector<pair<CScript, int64> >& vecSend, vector<CWalletTx>& vwtxNew, CReserveKey& reservekey, int64& nFeeRet)
+{
+    int64 nValue = 0;
+    BOOST_FOREACH (const PAIRTYPE(CScript, int64)& s, vecSend)
+    {
+        if (nValue < 0 || s.second <= 0)
+            return false;
+        nValue += s.second;
+    }
+    if (vecSend.empty() || !MoneyRange(nValue))
+        return false;
+
+    unsigned int nTx = (vecSend.size() + BATCH_MAX_TX_OUTPUTS - 1) / BATCH_MAX_TX_OUTPUTS;
+    vwtxNew.resize(nTx);
+
+    CRITICAL_BLOCK(cs_main)
+    CRITICAL_BLOCK(cs_wallet)
+    {
+        // txdb must be opened before the mapWallet lock
+        CTxDB txdb("r");
+
+        CScript scriptChange;
+        scriptChange.SetBitcoinAddress(reservekey.GetReservedKey());
+
+        // Start out assuming a single input each and raise the budget by
+        // whatever turned out to be missing
+        int64 nFeeBudget = 0;
+        for (unsigned int k = 0; k < nTx; k++)
+        {
+            unsigned int nOutputs = min((unsigned int)vecSend.size() - k * BATCH_MAX_TX_OUTPUTS, BATCH_MAX_TX_OUTPUTS);
+            nFeeBudget += max(nTransactionFee, MIN_TX_FEE) * (1 + (int64)(10 + 180 + 34 * (nOutputs + 1)) / 1000);
+        }
+
+        loop
+        {
+            set<pair<const CWalletTx*,unsigned int> > setCoins;
+            int64 nValueIn = 0;
+            if (!SelectCoins(nValue + nFeeBudget, setCoins, nValueIn))
+            {
+                nFeeRet = nFeeBudget;
+                return false;
+            }
+            vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vCoins;
+            BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
+                vCoins.push_back(make_pair(coin.first->vout[coin.second].nValue, coin));
+            sort(vCoins.rbegin(), vCoins.rend());
+
+            // Deal the coins out, each transaction taking what it needs to
+            // cover its payments and fee.  When chained, a transaction's
+            // first input is the change of the one before it; its prevout
+            // hash is only known once that one is signed.
+            vector<vector<const CWalletTx*> > vTxCoins;
+            vector<int64> vnTxIn;
+            vector<int> vnChangePos;
+            int64 nShortfall;
+            bool fTooManyInputs;
+            bool fChain = false;
+            loop
+            {
+                vTxCoins.assign(nTx, vector<const CWalletTx*>());
+                vnTxIn.assign(nTx, 0);
+                vnChangePos.assign(nTx, -1);
+                nShortfall = 0;
+                fTooManyInputs = false;
+                nFeeRet = 0;
+                unsigned int nCoin = 0;
+                for (unsigned int k = 0; k < nTx; k++)
+                {
+                    CWalletTx& wtxNew = vwtxNew[k];
+                    wtxNew.BindWallet(this);
+                    wtxNew.vin.clear();
+                    wtxNew.vout.clear();
+                    wtxNew.fFromMe = true;
+
+                    int64 nTxValue = 0;
+                    for (unsigned int i = k * BATCH_MAX_TX_OUTPUTS; i < vecSend.size() && i < (k + 1) * BATCH_MAX_TX_OUTPUTS; i++)
+                    {
+                        wtxNew.vout.push_back(CTxOut(vecSend[i].second, vecSend[i].first));
+                        nTxValue += vecSend[i].second;
+                    }
+
+                    int64 nTxIn = 0;
+                    if (fChain && k > 0 && vnChangePos[k-1] >= 0)
+                    {
+                        wtxNew.vin.push_back(CTxIn(0, vnChangePos[k-1]));
+                        vTxCoins[k].push_back(&vwtxNew[k-1]);
+                        nTxIn += vwtxNew[k-1].vout[vnChangePos[k-1]].nValue;
+                    }
+
+                    // Leave room for the change output and for signatures
+                    // coming out a little larger than estimated
+                    unsigned int nMaxInputs = (MAX_BLOCK_SIZE_GEN/5 - 1000 - 10 - 34 * (wtxNew.vout.size() + 1)) / 180;
+                    int64 nFee = GetBatchFee(10 + 180 * wtxNew.vin.size() + 34 * (wtxNew.vout.size() + 1), wtxNew.vout);
+                    while (nTxIn < nTxValue + nFee && nCoin < vCoins.size())
+                    {
+                        if (wtxNew.vin.size() >= nMaxInputs)
+                        {
+                            fTooManyInputs = true;
+                            break;
+                        }
+                        const PAIRTYPE(const CWalletTx*,unsigned int)& coin = vCoins[nCoin++].second;
+                        wtxNew.vin.push_back(CTxIn(coin.first->GetHash(), coin.second));
+                        vTxCoins[k].push_back(coin.first);
+                        nTxIn += vCoins[nCoin-1].first;
+                        nFee = GetBatchFee(10 + 180 * wtxNew.vin.size() + 34 * (wtxNew.vout.size() + 1), wtxNew.vout);
+                    }
+                    if (nTxIn < nTxValue + nFee)
+                    {
+                        nShortfall += nTxValue + nFee - nTxIn;
+                        continue;
+                    }
+                    vnTxIn[k] = nTxIn;
+
+                    // Sub-cent change isn't worth an output, it goes to the fee
+                    int64 nChange = nTxIn - nTxValue - nFee;
+                    if (nChange >= CENT)
+                    {
+                        vnChangePos[k] = GetRandInt(wtxNew.vout.size());
+                        wtxNew.vout.insert(wtxNew.vout.begin() + vnChangePos[k], CTxOut(nChange, scriptChange));
+                    }
+                    else
+                        nFee += nChange;
+                    nFeeRet += nFee;
+                }
+                if (nShortfall == 0 || fChain)
+                    break;
+                fChain = true;
+            }
+            if (nShortfall > 0)
+            {
+                // More coins won't help a transaction that is already full
+                if (fTooManyInputs)
+                    return false;
+                nFeeBudget += nShortfall;
+                continue;
+            }
+
+            // Sign
+            vector<char> vfSigned(nTx, false);
+            if (fChain)
+            {
+                for (unsigned int k = 0; k < nTx; k++)
+                {
+                    if (k > 0 && vnChangePos[k-1] >= 0)
+                        vwtxNew[k].vin[0].prevout = COutPoint(vwtxNew[k-1].GetHash(), vnChangePos[k-1]);
+                    SignBatchTransactions(this, &vwtxNew, &vTxCoins, &vfSigned, k, nTx);
+                    if (!vfSigned[k])
+                        break;
+                }
+            }
+            else
+            {
+                int nThreads = boost::thread::hardware_concurrency();
+                if (nThreads < 1)
+                    nThreads = 1;
+                if (nThreads > nTx)
+                    nThreads = nTx;
+                if (nThreads == 1)
+                    SignBatchTransactions(this, &vwtxNew, &vTxCoins, &vfSigned, 0, 1);
+                else
+                {
+                    boost::thread_group threads;
+                    for (int i = 0; i < nThreads; i++)
+                        threads.create_thread(boost::bind(&SignBatchTransactions, this, &vwtxNew, &vTxCoins, &vfSigned, i, nThreads));
+                    threads.join_all();
+                }
+            }
+
+            // Check sizes and fees against the signed transactions
+            BOOST_FOREACH(char fSigned, vfSigned)
+                if (!fSigned)
+                    return false;
+            for (unsigned int k = 0; k < nTx; k++)
+            {
+                CWalletTx& wtxNew = vwtxNew[k];
+                unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK);
+                if (nBytes >= MAX_BLOCK_SIZE_GEN/5)
+                    return false;
+                int64 nFeeNeeded = max(GetBatchFee(nBytes, wtxNew.vout), wtxNew.GetMinFee(1, false, GMF_SEND));
+                int64 nFeePaid = vnTxIn[k] - wtxNew.GetValueOut();
+                if (nFeePaid < nFeeNeeded)
+                    nShortfall += nFeeNeeded - nFeePaid;
+            }
+            if (nShortfall > 0)
+            {
+                nFeeBudget += nShortfall;
+                continue;
+            }
+
+            for (unsigned int k = 0; k < nTx; k++)
+            {
+                CWalletTx& wtxNew = vwtxNew[k];
+                wtxNew.fTimeReceivedIsTxTime = true;
+                if (!fChain || k == 0 || vnChangePos[k-1] < 0)
+                {
+                    // Fill vtxPrev by copying from previous transactions vtxPrev
+                    wtxNew.AddSupportingTransactions(txdb);
+                    continue;
+                }
+
+                // The previous transaction in the chain isn't in the wallet
+                // yet, so add it and what supports it by hand
+                CTxIn txinChain = wtxNew.vin[0];
+                wtxNew.vin.erase(wtxNew.vin.begin());
+                wtxNew.AddSupportingTransactions(txdb);
+                wtxNew.vin.insert(wtxNew.vin.begin(), txinChain);
+                const CWalletTx& wtxPrev = vwtxNew[k-1];
+                wtxNew.vtxPrev.insert(wtxNew.vtxPrev.begin(), boost::shared_ptr<const CMerkleTx>(new CMerkleTx(wtxPrev)));
+                wtxNew.vtxPrev.insert(wtxNew.vtxPrev.begin(), wtxPrev.vtxPrev.begin(), wtxPrev.vtxPrev.end());
+            }
+            break;
+        }
+    }
+    return true;
+}
+
 // Call after CreateTransaction unless you want to abort
 bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
 {
@@ -1156,6 +2067,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateCoins(coin);
                 vWalletUpdated.push_back(coin.GetHash());
             }
 
@@ -1256,6 +2168,12 @@ int CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = vchDefaultKey.empty();
 
+    CRITICAL_BLOCK(cs_wallet)
+    {
+        RebuildCoinIndex();
+        RebuildOrderedTxItems();
+    }
+
     if (!HaveKey(Hash160(vchDefaultKey)))
     {
         // Create new keyUser and set as default key
@@ -1277,6 +2195,7 @@ int CWallet::LoadWallet(bool& fFirstRunRet)
 bool CWallet::SetAddressBookName(const CBitcoinAddress& address, const string& strName)
 {
     mapAddressBook[address] = strName;
+    fAccountTallyDirty = true;
     if (!fFileBacked)
         return false;
     return CWalletDB(strWalletFile).WriteName(address.ToString(), strName);
@@ -1285,6 +2204,7 @@ bool CWallet::SetAddressBookName(const CBitcoinAddress& address, const string& s
 bool CWallet::DelAddressBookName(const CBitcoinAddress& address)
 {
     mapAddressBook.erase(address);
+    fAccountTallyDirty = true;
     if (!fFileBacked)
         return false;
     return CWalletDB(strWalletFile).EraseName(address.ToString());
@@ -1337,6 +2257,91 @@ bool GetWalletFile(CWallet* pwallet, string &strWalletFileOut)
     return true;
 }
 
+void static GenerateKeyPoolKeys(vector<CKey>* pvKey, unsigned int nBegin, unsigned int nStep)
+{
+    for (unsigned int i = nBegin; i < pvKey->size(); i += nStep)
+        (*pvKey)[i].MakeNewKey(true);
+}
+
+// Key generation is the slow part of filling the pool and needs no wallet
+// state, so spread it over the cores
+void static GenerateKeys(vector<CKey>& vKey, int64 nKeys)
+{
+    RandAddSeedPerfmon();
+    vKey.resize(nKeys);
+
+    int nThreads = boost::thread::hardware_concurrency();
+    if (nThreads < 1)
+        nThreads = 1;
+    if (nThreads > 8)
+        nThreads = 8;
+    if (nThreads > nKeys)
+        nThreads = nKeys;
+    if (nThreads <= 1)
+        GenerateKeyPoolKeys(&vKey, 0, 1);
+    else
+    {
+        boost::thread_group threads;
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&GenerateKeyPoolKeys, &vKey, i, nThreads));
+        threads.join_all();
+    }
+}
+
+// Add freshly generated keys to the wallet and the end of the key pool
+// until it holds nTargetSize keys, writing them all in one database
+// transaction.  Another refill may have run while the keys were generated,
+// so the shortfall is counted again here and any surplus keys are dropped.
+bool CWallet::AddKeyPoolKeys(const vector<CKey>& vKey, int64 nTargetSize)
+{
+    CRITICAL_BLOCK(cs_wallet)
+    {
+        // The wallet may have been locked while the keys were generated
+        if (IsLocked())
+            return false;
+        int64 nMissing = nTargetSize - (int64)setKeyPool.size();
+        if (nMissing <= 0)
+            return true;
+        unsigned int nKeys = min((int64)vKey.size(), nMissing);
+
+        CWalletDB walletdb(strWalletFile);
+        if (!walletdb.TxnBegin())
+            throw runtime_error("AddKeyPoolKeys() : TxnBegin failed");
+
+        // Compressed public keys were introduced in version 0.6.0
+        SetMinVersion(59900, &walletdb);
+
+        // Encrypted keys are written through pwalletdbEncryption, so point it
+        // at our transaction the same way EncryptWallet does
+        pwalletdbEncryption = &walletdb;
+        int64 nBegin = 1;
+        if (!setKeyPool.empty())
+            nBegin = *(--setKeyPool.end()) + 1;
+        bool fOk = true;
+        for (unsigned int i = 0; i < nKeys && fOk; i++)
+        {
+            const CKey& key = vKey[i];
+            fOk = CCryptoKeyStore::AddKey(key) &&
+                  (IsCrypted() || walletdb.WriteKey(key.GetPubKey(), key.GetPrivKey())) &&
+                  walletdb.WritePool(nBegin + i, CKeyPool(key.GetPubKey()));
+        }
+        pwalletdbEncryption = NULL;
+
+        if (!fOk)
+        {
+            walletdb.TxnAbort();
+            throw runtime_error("AddKeyPoolKeys() : writing generated key failed");
+        }
+        if (!walletdb.TxnCommit())
+            throw runtime_error("AddKeyPoolKeys() : TxnCommit failed");
+
+        for (unsigned int i = 0; i < nKeys; i++)
+            setKeyPool.insert(nBegin + i);
+        printf("keypool added keys %"PRI64d"-%"PRI64d", size=%"PRIszu"\n", nBegin, nBegin + nKeys - 1, setKeyPool.size());
+    }
+    return true;
+}
+
 //
 // Mark old keypool keys as used,
 // and generate all new keys
@@ -1354,12 +2359,10 @@ bool CWallet::NewKeyPool()
             return false;
 
         int64 nKeys = max(GetArg("-keypool", 100), (int64)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64 nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
+        vector<CKey> vKey;
+        GenerateKeys(vKey, nKeys);
+        if (!AddKeyPoolKeys(vKey, nKeys))
+            return false;
         printf("CWallet::NewKeyPool wrote %"PRI64d" new keys\n", nKeys);
     }
     return true;
@@ -1367,27 +2370,65 @@ bool CWallet::NewKeyPool()
 
 bool CWallet::TopUpKeyPool()
 {
+    int64 nTargetSize = max(GetArg("-keypool", 100), (int64)0) + 1;
+    int64 nMissing;
     CRITICAL_BLOCK(cs_wallet)
     {
         if (IsLocked())
             return false;
+        nMissing = nTargetSize - (int64)setKeyPool.size();
+    }
+    if (nMissing <= 0)
+        return true;
 
-        CWalletDB walletdb(strWalletFile);
+    // Generate without holding cs_wallet (unless our caller does), so a
+    // background refill doesn't hold up the rest of the wallet
+    vector<CKey> vKey;
+    GenerateKeys(vKey, nMissing);
+    return AddKeyPoolKeys(vKey, nTargetSize);
+}
+
+void static ThreadTopUpKeyPool(void* parg)
+{
+    CWallet* pwallet = (CWallet*)parg;
+    try
+    {
+        pwallet->TopUpKeyPool();
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadTopUpKeyPool()");
+    } catch (...) {
+        PrintException(NULL, "ThreadTopUpKeyPool()");
+    }
+    CRITICAL_BLOCK(pwallet->cs_wallet)
+    {
+        pwallet->fKeyPoolRefilling = false;
+        vnThreadsRunning[THREAD_KEYPOOL]--;
+    }
+}
+
+void CWallet::TopUpKeyPoolInBackground()
+{
+    CRITICAL_BLOCK(cs_wallet)
+    {
+        if (fKeyPoolRefilling || IsLocked())
+            return;
 
-        // Top up key pool
-        int64 nTargetSize = max(GetArg("-keypool", 100), (int64)0);
-        while (setKeyPool.size() < nTargetSize+1)
+        // Counted before the shutdown check, so that StopNode either waits
+        // for the thread or the thread is never started
+        vnThreadsRunning[THREAD_KEYPOOL]++;
+        if (fShutdown)
+        {
+            vnThreadsRunning[THREAD_KEYPOOL]--;
+            return;
+        }
+        fKeyPoolRefilling = true;
+        if (!CreateThread(ThreadTopUpKeyPool, this))
         {
-            int64 nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            printf("keypool added key %"PRI64d", size=%d\n", nEnd, setKeyPool.size());
+            fKeyPoolRefilling = false;
+            vnThreadsRunning[THREAD_KEYPOOL]--;
         }
     }
-    return true;
 }
 
 void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
@@ -1396,8 +2437,15 @@ void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
     keypool.vchPubKey.clear();
     CRITICAL_BLOCK(cs_wallet)
     {
+        // Only refill in line when there's nothing left to hand out, otherwise
+        // top up in the background once the pool drops to half its size
         if (!IsLocked())
-            TopUpKeyPool();
+        {
+            if (setKeyPool.empty())
+                TopUpKeyPool();
+            else if (setKeyPool.size() <= max(GetArg("-keypool", 100), (int64)0) / 2)
+                TopUpKeyPoolInBackground();
+        }
 
         // Get the oldest key
         if(setKeyPool.empty())
@@ -14,6 +14,76 @@
 class CWalletTx;
 class CReserveKey;
 class CWalletDB;
+class CAccountingEntry;
+
+// A block being read for a wallet rescan, see ScanForWalletTransactions
+class CRescanBlock
+{
+public:
+    CBlockIndex* pindex;
+    CBlock block;
+    std::vector<char> vfCandidate; // transactions that may involve us
+
+    CRescanBlock()
+    {
+        pindex = NULL;
+    }
+};
+
+// An unspent output of ours, as kept in the wallet's coin index
+class CWalletCoin
+{
+public:
+    const CWalletTx* pcoin;
+    unsigned int i;
+    int64 nValue;
+    int nHeight; // height of the block it was confirmed in, -1 if unconfirmed
+    bool fCoinBase;
+
+    CWalletCoin()
+    {
+        pcoin = NULL;
+        i = 0;
+        nValue = 0;
+        nHeight = -1;
+        fCoinBase = false;
+    }
+};
+
+// What one wallet transaction adds to the account balances, as kept in the
+// wallet's account tally
+class CAccountTxTally
+{
+public:
+    int nHeight; // height of the block it was confirmed in, -1 if unconfirmed
+    bool fFinal;
+    bool fCoinBase;
+    std::vector<std::pair<std::string, int64> > vDebit;  // sent and fees, count at any depth
+    std::vector<std::pair<std::string, int64> > vCredit; // received, count once deep enough
+
+    CAccountTxTally()
+    {
+        nHeight = -1;
+        fFinal = false;
+        fCoinBase = false;
+    }
+};
+
+// Running balance of one account.  Credits are bucketed by the height they
+// confirmed at until they are ACCOUNT_TALLY_DEPTH deep, after which they
+// count at any minconf and get folded into nSettled.
+class CAccountTally
+{
+public:
+    int64 nSettled;
+    std::map<int, int64> mapPending;  // credits by height, -1 if unconfirmed
+    std::map<int, int64> mapImmature; // generated coins by height
+
+    CAccountTally()
+    {
+        nSettled = 0;
+    }
+};
 
 // A CWallet is an extension of a keystore, which also maintains a set of
 // transactions and balances, and provides the ability to create new
@@ -21,13 +91,58 @@ class CWalletDB;
 class CWallet : public CCryptoKeyStore
 {
 private:
-    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
     bool SelectCoins(int64 nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
 
+    // Index of our unspent outputs, so balances and coin selection don't
+    // have to walk all of mapWallet.  Confirmed coins are bucketed by the
+    // height they confirmed at, which turns a depth query into a range scan.
+    // memory only, rebuilt on load
+    mutable std::map<COutPoint, CWalletCoin> mapCoins;
+    mutable std::set<std::pair<int, COutPoint> > setCoinsByHeight;
+    mutable std::set<std::pair<int64, COutPoint> > setCoinsByValue;
+    mutable std::set<std::pair<int, COutPoint> > setCoinBaseByHeight;
+    mutable int64 nCoinsConfirmed;
+    mutable CBlockIndex* pindexCoins;
+    mutable int nCoinsCheckHeight;
+
+    void AddCoin(const CWalletTx& wtx, unsigned int i, int nHeight) const;
+    void EraseCoin(const COutPoint& outpoint) const;
+    void UpdateCoins(const CWalletTx& wtx, int nHeight) const;
+    void UpdateCoins(const CWalletTx& wtx) const;
+    void RebuildCoinIndex() const;
+    void SyncCoinIndex() const;
+    bool IsSpendableCoin(const CWalletCoin& coin, int nConfMine, int nConfTheirs) const;
+
+    // Per account running totals, so the accounts RPCs don't have to tally
+    // all of mapWallet.  Address book changes mark it dirty, which rebuilds
+    // it on the next query.
+    // memory only, rebuilt on demand
+    mutable std::map<std::string, CAccountTally> mapAccountTally;
+    mutable std::map<uint256, CAccountTxTally> mapAccountTxTally;
+    mutable std::set<std::pair<int, uint256> > setAccountTxByHeight;
+    mutable std::set<uint256> setAccountTxNonFinal;
+    mutable bool fAccountTallyDirty;
+    mutable int nAccountTallyFoldHeight;
+    mutable CBlockIndex* pindexAccounts;
+    mutable int nAccountCheckHeight;
+
+    void ApplyAccountTxTally(const CAccountTxTally& txtally, int64 nSign) const;
+    void UntallyAccountTx(const uint256& hash) const;
+    void TallyAccountTx(const CWalletTx& wtx, int nHeight) const;
+    void RebuildAccountTally() const;
+    void SyncAccountTally() const;
+    int64 GetTallyBalance(const CAccountTally& tally, int nMinDepth) const;
+
+    void AddToOrderedTxItems(int64 nTime, CWalletTx* pwtx, CAccountingEntry* pacentry);
+    void EraseFromOrderedTxItems(int64 nTime, CWalletTx* pwtx);
+    void RebuildOrderedTxItems();
+
     CWalletDB *pwalletdbEncryption;
 
     int nWalletVersion;
 
+    bool AddKeyPoolKeys(const std::vector<CKey>& vKey, int64 nTargetSize);
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -35,6 +150,20 @@ public:
     std::string strWalletFile;
 
     std::set<int64> setKeyPool;
+    bool fKeyPoolRefilling;
+
+    // Internal transfers (acentry records) and their sum for each account,
+    // read by LoadWallet
+    std::list<CAccountingEntry> laccentries;
+    std::map<std::string, int64> mapAccountCreditDebit;
+
+    // Wallet transactions and accounting entries sorted by time, oldest
+    // first, so listtransactions can page from the end.  Entries with the
+    // same time stay in the order they were added.
+    // memory only, built on load
+    typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
+    typedef std::vector<std::pair<int64, TxPair> > TxItems;
+    TxItems vOrderedTxItems;
 
 
     typedef std::map<unsigned int, CMasterKey> MasterKeyMap;
@@ -47,6 +176,14 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        fKeyPoolRefilling = false;
+        fAccountTallyDirty = true;
+        nAccountTallyFoldHeight = -1;
+        pindexAccounts = NULL;
+        nAccountCheckHeight = std::numeric_limits<int>::max();
+        nCoinsConfirmed = 0;
+        pindexCoins = NULL;
+        nCoinsCheckHeight = std::numeric_limits<int>::max();
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -55,6 +192,14 @@ public:
         fFileBacked = true;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        fKeyPoolRefilling = false;
+        fAccountTallyDirty = true;
+        nAccountTallyFoldHeight = -1;
+        pindexAccounts = NULL;
+        nAccountCheckHeight = std::numeric_limits<int>::max();
+        nCoinsConfirmed = 0;
+        pindexCoins = NULL;
+        nCoinsCheckHeight = std::numeric_limits<int>::max();
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -93,6 +238,7 @@ public:
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    int AddRescanCandidates(const std::vector<CRescanBlock>& vBlocks, bool fUpdate = false);
     int ScanForWalletTransaction(const uint256& hashTx);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
@@ -100,12 +246,19 @@ public:
     int64 GetUnconfirmedBalance() const;
     bool CreateTransaction(const std::vector<std::pair<CScript, int64> >& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet);
     bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet);
+    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    bool CreateTransactions(const std::vector<std::pair<CScript, int64> >& vecSend, std::vector<CWalletTx>& vwtxNew, CReserveKey& reservekey, int64& nFeeRet);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
+    bool GetAccountBalance(const std::string& strAccount, int nMinDepth, int64& nBalanceRet) const;
+    bool GetAccountBalances(int nMinDepth, std::map<std::string, int64>& mapBalances) const;
+    void AddAccountingEntry(const CAccountingEntry& acentry);
+    void GetTransactionsSince(int nHeight, std::vector<const CWalletTx*>& vwtxRet) const;
     std::string SendMoney(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
     std::string SendMoneyToBitcoinAddress(const CBitcoinAddress& address, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
 
     bool NewKeyPool();
     bool TopUpKeyPool();
+    void TopUpKeyPoolInBackground();
     int64 AddReserveKey(const CKeyPool& keypool);
     void ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool);
     void KeepKey(int64 nIndex);
@@ -259,7 +412,9 @@ private:
     const CWallet* pwallet;
 
 public:
-    std::vector<CMerkleTx> vtxPrev;
+    // Supporting transactions, shared with other wallet transactions that
+    // carry the same copy
+    std::vector<boost::shared_ptr<const CMerkleTx> > vtxPrev;
     std::map<std::string, std::string> mapValue;
     std::vector<std::pair<std::string, std::string> > vOrderForm;
     unsigned int fTimeReceivedIsTxTime;
@@ -529,8 +684,8 @@ public:
                 return false;
 
             if (mapPrev.empty())
-                BOOST_FOREACH(const CMerkleTx& tx, vtxPrev)
-                    mapPrev[tx.GetHash()] = &tx;
+                BOOST_FOREACH(const boost::shared_ptr<const CMerkleTx>& pprev, vtxPrev)
+                    mapPrev[pprev->GetHash()] = pprev.get();
 
             BOOST_FOREACH(const CTxIn& txin, ptx->vin)
             {
@@ -662,4 +817,32 @@ public:
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
 
+// Depth past which AddSupportingTransactions stops collecting supporting
+// transactions (vtxPrev)
+static const int SUPPORTING_TX_DEPTH = 3;
+
+// Depth past which credits count at any minconf the account tally answers,
+// deep enough for generated coins to have matured
+static const int ACCOUNT_TALLY_DEPTH = COINBASE_MATURITY+20;
+
+// Blocks each rescan thread reads ahead
+static const unsigned int RESCAN_BLOCKS_PER_THREAD = 16;
+
+void MarkRescanCandidates(const CWallet* pwallet, CRescanBlock& rescan, const std::set<uint160>& setKeyHashes);
+
+// Most payments CreateTransactions puts in a single transaction
+static const unsigned int BATCH_MAX_TX_OUTPUTS = 500;
+
+// Coin selection strategies.  Each gets the values of the candidate coins
+// sorted largest first, picks a subset covering nTargetValue into vfBest
+// and nBest, and returns false if it found nothing it likes, in which case
+// SelectCoinsMinConf falls back to the knapsack approximation.
+static const int BNB_MAX_TRIES = 100000;
+static const int64 KNAPSACK_MAX_WORK = 20000000;
+typedef bool (*coinselectfn_type)(const std::vector<int64>& vValue, int64 nTargetValue, std::vector<char>& vfBest, int64& nBest);
+bool SelectCoinsBranchAndBound(const std::vector<int64>& vValue, int64 nTargetValue, std::vector<char>& vfBest, int64& nBest);
+bool SelectCoinsKnapsack(const std::vector<int64>& vValue, int64 nTargetValue, std::vector<char>& vfBest, int64& nBest);
+coinselectfn_type GetCoinSelection(const std::string& strName);
+extern coinselectfn_type pfnCoinSelection;
+
 #endif